@@ -0,0 +1,529 @@
+/*
+ * bench.c  End-to-end benchmark of nonlinear regression paths: automatic
+ * differentiation (dual numbers), analytical derivatives written in Lua
+ * and native C code (residuals and Jacobian as in lmtest.c) for the heat
+ * capacity model of func_cpfit.lua and for the models of funcs.lua.
+ * Synthetic data sets are generated for each size. The results are typed
+ * as JSON lines (one object per case):
+ *
+ *   model, path, n, m -- case (path is autodiff, analytic or native)
+ *   eval_us -- time of one evaluation of residuals (LuaFunc_EvalValue)
+ *   jac_us -- time of one evaluation of residuals and Jacobian
+ *     (LuaFunc_Eval + LuaFunc_GetValue)
+ *   jac_melem_s -- Jacobian throughput (millions of elements per second)
+ *   fit_ms, fit_iter, fit_sse -- LuaFunc_LevMar from perturbed parameters
+ *     (null for native path and for large cases)
+ *   lua_allocs, lua_alloc_kb -- allocations by Lua state during one
+ *     evaluation of Jacobian (see LuaFunc_SetAllocator; data of RealVectors
+ *     is allocated by malloc and is not counted)
+ *   peak_rss_kb -- peak resident set size of the process that ran the case
+ *     (each case is run in a separate process if fork succeeds, -1 if it
+ *     is not available)
+ *   skipped -- reason if the case was not run (e.g. memory limit)
+ *
+ * Full garbage collection is made between repetitions (it is not timed):
+ * the collector doesn't see memory of RealVectors.
+ *
+ * (C) 2016-2017 Alexey Voskov (alvoskov@gmail.com)
+ * License: MIT (X11) license
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define _USE_MATH_DEFINES
+#include <math.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#endif
+
+#include "lua.h"
+#include "cwrapper.h"
+#include "lmfit.h"
+
+#define CONST_R 8.3144598 /* Universal gas constant */
+#define BENCH_FITCELLS 200000 /* Maximal n*m for fits */
+#define BENCH_ITMAX 100 /* Maximal number of iterations for fits */
+#define BENCH_MAXREPS 1000 /* Maximal number of timed repetitions */
+
+/* Native residuals (res = f(x) - y) and Jacobian (n x m, row by row, or NULL) */
+typedef void (*BenchFunc)(const double *p, const double *x, const double *y,
+	double *res, double *J, int m, int n);
+
+/* Benchmark model */
+typedef struct {
+	const char *name;
+	int m; /* Number of parameters (0 - any even number) */
+	double xmin, xmax; /* Range of x */
+	double ptrue[3]; /* Parameters for synthetic data (for fixed m) */
+	BenchFunc func;
+	int luamodel[2]; /* Models of func_bench.lua: automatic and analytical derivatives (0 - absent) */
+} BenchModel;
+
+/* Settings */
+typedef struct {
+	const char *script;
+	const char *model; /* Only this model (or NULL) */
+	const char *path; /* Only this path (or NULL) */
+	int n, m; /* Only this size (or 0) */
+	int quick; /* Small sizes only */
+	int fit; /* 1 if fits must be run */
+	double maxmem; /* Limit of memory, MiB */
+	double mintime; /* Minimal time of timed repetitions, s */
+} BenchOpts;
+
+/* Statistics of allocations (see bench_alloc) */
+typedef struct {
+	long long nallocs;
+	long long bytes;
+} BenchAllocStats;
+
+static BenchAllocStats bench_stats = {0, 0};
+
+/* Counting allocator for Lua states */
+static void *bench_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+	BenchAllocStats *st = (BenchAllocStats *) ud;
+	if (nsize == 0) {
+		free(ptr);
+		return NULL;
+	}
+	if (ptr == NULL) {
+		st->nallocs++;
+		st->bytes += (long long) nsize;
+	} else if (nsize > osize) {
+		st->nallocs++;
+		st->bytes += (long long) (nsize - osize);
+	}
+	return realloc(ptr, nsize);
+}
+
+/* Monotonic time, seconds */
+static double bench_time(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER t, f;
+	QueryPerformanceCounter(&t);
+	QueryPerformanceFrequency(&f);
+	return (double) t.QuadPart / f.QuadPart;
+#else
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + 1e-9 * t.tv_nsec;
+#endif
+}
+
+/* Peak resident set size of the process, KiB (-1 if unknown) */
+static long bench_peakrss(void)
+{
+#ifdef _WIN32
+	return -1;
+#else
+	struct rusage ru;
+	return (getrusage(RUSAGE_SELF, &ru) == 0) ? ru.ru_maxrss : -1;
+#endif
+}
+
+/*========== Native models ==========*/
+
+/* Heat capacity: sum of m/2 Einstein functions (see func_cpfit.lua and lmtest.c) */
+static void native_cp(const double *p, const double *x, const double *y,
+	double *res, double *J, int m, int n)
+{
+	int nterms = m / 2;
+	for (int i = 0; i < n; i++, J = (J != NULL) ? J + m : NULL) {
+		double Cp = 0.0;
+		for (int j = 0; j < nterms; j++) {
+			double alpha = p[j], t = p[nterms + j] / x[i];
+			double exm = exp(-t), q = exm / ((1 - exm) * (1 - exm));
+			Cp += 3*alpha*q*t*t;
+			if (J != NULL) {
+				J[j] = 3*q*t*t * CONST_R;
+				J[nterms + j] = 3*alpha*q*t / x[i] * ((2 + t) - 2*t / (1 - exm)) * CONST_R;
+			}
+		}
+		res[i] = Cp * CONST_R - y[i];
+	}
+}
+
+/* funcs.lua, data set 0: b1 + b2*exp(-b3*x) */
+static void native_funcs0(const double *p, const double *x, const double *y,
+	double *res, double *J, int m, int n)
+{
+	for (int i = 0; i < n; i++) {
+		double e = exp(-p[2] * x[i]);
+		res[i] = p[0] + p[1]*e - y[i];
+		if (J != NULL) {
+			J[i*m] = 1.0;
+			J[i*m + 1] = e;
+			J[i*m + 2] = -p[1]*x[i]*e;
+		}
+	}
+}
+
+/* funcs.lua, data set 1: b1*(1 - exp(-exp(-b2 - b3*x))) */
+static void native_funcs1(const double *p, const double *x, const double *y,
+	double *res, double *J, int m, int n)
+{
+	for (int i = 0; i < n; i++) {
+		double u = exp(-p[1] - p[2]*x[i]), v = exp(-u);
+		res[i] = p[0]*(1 - v) - y[i];
+		if (J != NULL) {
+			J[i*m] = 1 - v;
+			J[i*m + 1] = -p[0]*v*u;
+			J[i*m + 2] = -p[0]*v*u*x[i];
+		}
+	}
+}
+
+/* funcs.lua, data set 2: 1 / (1 + exp(-b1 - b2*x)) */
+static void native_funcs2(const double *p, const double *x, const double *y,
+	double *res, double *J, int m, int n)
+{
+	for (int i = 0; i < n; i++) {
+		double e = exp(-p[0] - p[1]*x[i]), f = 1 / (1 + e);
+		res[i] = f - y[i];
+		if (J != NULL) {
+			J[i*m] = f*f*e;
+			J[i*m + 1] = f*f*e*x[i];
+		}
+	}
+}
+
+/* funcs.lua, data set 3: 1 / (b1 + b2*x + b3*x^2) */
+static void native_funcs3(const double *p, const double *x, const double *y,
+	double *res, double *J, int m, int n)
+{
+	for (int i = 0; i < n; i++) {
+		double f = 1 / (p[0] + p[1]*x[i] + p[2]*x[i]*x[i]);
+		res[i] = f - y[i];
+		if (J != NULL) {
+			J[i*m] = -f*f;
+			J[i*m + 1] = -f*f*x[i];
+			J[i*m + 2] = -f*f*x[i]*x[i];
+		}
+	}
+}
+
+static const BenchModel bench_models[] = {
+	{"cp", 0, 5.0, 300.0, {0.0}, native_cp, {1, 2}},
+	{"funcs0", 3, 0.0, 5.0, {0.1, 2.8, 0.9}, native_funcs0, {3, 0}},
+	{"funcs1", 3, 0.05, 0.2, {1.9483, -1.2699, 14.3631}, native_funcs1, {4, 0}},
+	{"funcs2", 2, 0.0, 0.045, {-4.0261, 171.6644}, native_funcs2, {5, 0}},
+	{"funcs3", 3, 0.5, 6.0, {0.8183, -0.6776, 0.1633}, native_funcs3, {6, 0}},
+	{NULL, 0, 0.0, 0.0, {0.0}, NULL, {0, 0}}
+};
+
+static const char *bench_paths[] = {"autodiff", "analytic", "native"};
+
+/*========== Benchmark cases ==========*/
+
+/* Results of one case */
+typedef struct {
+	double eval, jac; /* Times of evaluations, s */
+	double fit; /* Time of fit, s (negative if it was not made) */
+	double fititer, fitsse;
+	long long nallocs, allocbytes;
+	const char *error; /* Error message or NULL */
+} BenchResult;
+
+/* Synthetic data set: x is uniform in the range, y = f(x) with 0.1% noise */
+static void bench_data(const BenchModel *mod, int n, int m, double *x, double *y,
+	double *ptrue, double *p0)
+{
+	unsigned long long state = 88172645463325252ULL;
+	if (mod->m == 0) {
+		/* Heat capacity: Einstein temperatures from 50 to 500 K */
+		for (int j = 0; j < m / 2; j++) {
+			ptrue[j] = 2.0 / m;
+			ptrue[m / 2 + j] = 50.0 + 450.0 * j / (m / 2);
+		}
+	} else {
+		memcpy(ptrue, mod->ptrue, m * sizeof(double));
+	}
+	for (int j = 0; j < m; j++) {
+		p0[j] = ptrue[j] * 1.1 + 0.01;
+	}
+	for (int i = 0; i < n; i++) {
+		x[i] = mod->xmin + (mod->xmax - mod->xmin) * i / (n > 1 ? n - 1 : 1);
+	}
+	double *zero = (double *) calloc(n, sizeof(double));
+	mod->func(ptrue, x, zero, y, NULL, m, n);
+	for (int i = 0; i < n; i++) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		y[i] *= 1.0 + 1e-3 * ((state >> 11) * (1.0 / 9007199254740992.0) - 0.5);
+	}
+	free(zero);
+}
+
+/* Runs fn(arg) repeatedly (after warm-up), returns mean time of one run */
+static double bench_repeat(int (*fn)(void *), void *arg, void (*cleanup)(void *), double mintime)
+{
+	double total = 0.0;
+	int nreps = 0;
+	if (!fn(arg)) {
+		return -1.0;
+	}
+	while (nreps < BENCH_MAXREPS && (nreps == 0 || total < mintime)) {
+		if (cleanup != NULL) {
+			cleanup(arg);
+		}
+		double tic = bench_time();
+		if (!fn(arg)) {
+			return -1.0;
+		}
+		total += bench_time() - tic;
+		nreps++;
+	}
+	return total / nreps;
+}
+
+/* Arguments for timed functions */
+typedef struct {
+	const BenchModel *mod;
+	LuaFunc *F;
+	int n, m;
+	double *x, *y, *p, *res, *J;
+} BenchArg;
+
+static int bench_native_eval(void *arg)
+{
+	BenchArg *a = (BenchArg *) arg;
+	a->mod->func(a->p, a->x, a->y, a->res, NULL, a->m, a->n);
+	return 1;
+}
+
+static int bench_native_jac(void *arg)
+{
+	BenchArg *a = (BenchArg *) arg;
+	a->mod->func(a->p, a->x, a->y, a->res, a->J, a->m, a->n);
+	return 1;
+}
+
+static int bench_lua_eval(void *arg)
+{
+	BenchArg *a = (BenchArg *) arg;
+	return LuaFunc_EvalValue(a->F, a->p) && LuaFunc_GetValue(a->F, a->res, NULL);
+}
+
+static int bench_lua_jac(void *arg)
+{
+	BenchArg *a = (BenchArg *) arg;
+	return LuaFunc_Eval(a->F, a->p) && LuaFunc_GetValue(a->F, a->res, a->J);
+}
+
+/* Full garbage collection (RealVectors data is invisible for Lua collector) */
+static void bench_lua_collect(void *arg)
+{
+	BenchArg *a = (BenchArg *) arg;
+	lua_gc((lua_State *) a->F->LuaState, LUA_GCCOLLECT, 0);
+}
+
+/* Runs one case: path 0 - autodiff, 1 - analytic, 2 - native */
+static void bench_run(const BenchModel *mod, int path, int n, int m, const BenchOpts *o, BenchResult *r)
+{
+	BenchArg a = {mod, NULL, n, m, NULL, NULL, NULL, NULL, NULL};
+	double *ptrue = (double *) calloc(m, sizeof(double));
+	a.x = (double *) calloc(n, sizeof(double));
+	a.y = (double *) calloc(n, sizeof(double));
+	a.p = (double *) calloc(m, sizeof(double));
+	a.res = (double *) calloc(n, sizeof(double));
+	a.J = (double *) calloc((size_t) n * m, sizeof(double));
+	bench_data(mod, n, m, a.x, a.y, ptrue, a.p);
+	memset(r, 0, sizeof(BenchResult));
+	r->fit = -1.0;
+	if (path == 2) {
+		r->eval = bench_repeat(bench_native_eval, &a, NULL, o->mintime);
+		r->jac = bench_repeat(bench_native_jac, &a, NULL, o->mintime);
+	} else {
+		static LuaFunc F; /* Error message is kept after return */
+		double options[2] = {mod->luamodel[path], m};
+		a.F = &F;
+		memset(&F, 0, sizeof(LuaFunc));
+		if (!LuaFunc_Load(&F, o->script) || !LuaFunc_SetData(&F, "X", a.x, n) ||
+			!LuaFunc_SetData(&F, "Y", a.y, n) || !LuaFunc_SetData(&F, "options", options, 2) ||
+			!LuaFunc_SetData(&F, "beta0", a.p, m) || !LuaFunc_Setup(&F)) {
+			r->error = LuaFunc_GetErrMsg(&F);
+		} else {
+			r->eval = bench_repeat(bench_lua_eval, &a, bench_lua_collect, o->mintime);
+			r->jac = bench_repeat(bench_lua_jac, &a, bench_lua_collect, o->mintime);
+			/* Allocations during one evaluation of Jacobian */
+			bench_lua_collect(&a);
+			long long nallocs = bench_stats.nallocs, bytes = bench_stats.bytes;
+			bench_lua_jac(&a);
+			r->nallocs = bench_stats.nallocs - nallocs;
+			r->allocbytes = bench_stats.bytes - bytes;
+			/* Fit from perturbed parameters */
+			if (o->fit && (double) n * m <= BENCH_FITCELLS && r->jac >= 0.0) {
+				double info[LUAFUNC_LM_INFO_SZ];
+				bench_lua_collect(&a);
+				double tic = bench_time();
+				if (LuaFunc_LevMar(&F, a.p, NULL, m, n, BENCH_ITMAX, NULL, info, NULL, NULL) != -1) {
+					r->fit = bench_time() - tic;
+					r->fititer = info[5];
+					r->fitsse = info[1];
+				}
+			}
+			if (r->eval < 0.0 || r->jac < 0.0) {
+				r->error = LuaFunc_GetErrMsg(&F);
+			}
+		}
+		if (F.LuaState != NULL) {
+			LuaFunc_Close(&F);
+		}
+	}
+	free(ptrue); free(a.x); free(a.y); free(a.p); free(a.res); free(a.J);
+}
+
+/* Types JSON string (only printable ASCII is kept) */
+static void bench_putstr(const char *str)
+{
+	putchar('"');
+	for (; *str != '\0'; str++) {
+		if (*str == '"' || *str == '\\') {
+			putchar('\\');
+		}
+		putchar((*str >= 32 && *str < 127) ? *str : ' ');
+	}
+	putchar('"');
+}
+
+/* Runs the case (in a child process if possible) and types JSON line */
+static void bench_case(const BenchModel *mod, int path, int n, int m, const BenchOpts *o)
+{
+	/* Estimation of memory: peak RSS of Lua paths is about 250 vectors of
+	   dual numbers (m + 1 parts) because of garbage between collections */
+	double mem = (path == 2) ? (double) n * (m + 4) * 8 : 256.0 * n * (m + 1) * 8;
+	printf("{\"model\": \"%s\", \"path\": \"%s\", \"n\": %d, \"m\": %d, ", mod->name, bench_paths[path], n, m);
+	if (mem > o->maxmem * 1048576.0) {
+		printf("\"skipped\": \"memory limit\"}\n");
+		fflush(stdout);
+		return;
+	}
+	fflush(stdout);
+#ifndef _WIN32
+	pid_t pid = fork();
+	if (pid > 0) {
+		int status;
+		waitpid(pid, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			printf("\"error\": \"process was terminated\"}\n");
+			fflush(stdout);
+		}
+		return;
+	}
+	/* pid == -1: fork failed, the case is run in this process */
+#endif
+	BenchResult r;
+	bench_run(mod, path, n, m, o, &r);
+	if (r.error != NULL) {
+		printf("\"error\": ");
+		bench_putstr(r.error);
+	} else {
+		printf("\"eval_us\": %.4g, \"jac_us\": %.4g, \"jac_melem_s\": %.4g, ",
+			r.eval * 1e6, r.jac * 1e6, (double) n * m / r.jac * 1e-6);
+		if (r.fit >= 0.0) {
+			printf("\"fit_ms\": %.4g, \"fit_iter\": %g, \"fit_sse\": %.6g, ", r.fit * 1e3, r.fititer, r.fitsse);
+		} else {
+			printf("\"fit_ms\": null, \"fit_iter\": null, \"fit_sse\": null, ");
+		}
+		if (path != 2) {
+			printf("\"lua_allocs\": %lld, \"lua_alloc_kb\": %.1f, ", r.nallocs, r.allocbytes / 1024.0);
+		} else {
+			printf("\"lua_allocs\": 0, \"lua_alloc_kb\": 0, ");
+		}
+		printf("\"peak_rss_kb\": %ld", bench_peakrss());
+	}
+	printf("}\n");
+	fflush(stdout);
+#ifndef _WIN32
+	if (pid == 0) {
+		_exit(0);
+	}
+#endif
+}
+
+/* Runs all cases selected by options */
+static void bench_all(const BenchOpts *o)
+{
+	static const int msizes[] = {2, 4, 8, 16, 32, 64, 0};
+	int nmax = o->quick ? 10000 : 10000000, mmax = o->quick ? 8 : 64;
+	for (const BenchModel *mod = bench_models; mod->name != NULL; mod++) {
+		if (o->model != NULL && strcmp(o->model, mod->name)) {
+			continue;
+		}
+		for (int n = 100; n <= nmax; n *= 10) {
+			if (o->n > 0 && n != o->n) {
+				continue;
+			}
+			for (const int *pm = msizes; *pm != 0 && *pm <= mmax; pm++) {
+				int m = (mod->m > 0) ? mod->m : *pm;
+				if (o->m <= 0 || m == o->m) {
+					for (int path = 0; path < 3; path++) {
+						if ((path < 2 && mod->luamodel[path] == 0) ||
+							(o->path != NULL && strcmp(o->path, bench_paths[path]))) {
+							continue;
+						}
+						bench_case(mod, path, n, m, o);
+					}
+				}
+				if (mod->m > 0) {
+					break;
+				}
+			}
+		}
+	}
+}
+
+/* Program entry point */
+int main(int argc, const char *argv[])
+{
+	BenchOpts o = {"func_bench.lua", NULL, NULL, 0, 0, 0, 1, 2048.0, 0.2};
+	for (int i = 1; i < argc; i++) {
+		const char *arg = argv[i], *val = (i + 1 < argc) ? argv[i + 1] : NULL;
+		if (!strcmp(arg, "-quick")) {
+			o.quick = 1;
+		} else if (!strcmp(arg, "-nofit")) {
+			o.fit = 0;
+		} else if (val != NULL && !strcmp(arg, "-script")) {
+			o.script = val; i++;
+		} else if (val != NULL && !strcmp(arg, "-model")) {
+			o.model = val; i++;
+		} else if (val != NULL && !strcmp(arg, "-path")) {
+			o.path = val; i++;
+		} else if (val != NULL && !strcmp(arg, "-n")) {
+			o.n = atoi(val); i++;
+		} else if (val != NULL && !strcmp(arg, "-m")) {
+			o.m = atoi(val); i++;
+		} else if (val != NULL && !strcmp(arg, "-maxmem")) {
+			o.maxmem = atof(val); i++;
+		} else if (val != NULL && !strcmp(arg, "-mintime")) {
+			o.mintime = atof(val); i++;
+		} else {
+			printf("End-to-end benchmark of automatic differentiation, analytical and native derivatives.\n");
+			printf("(C) 2016-2017 Alexey Voskov (alvoskov@gmail.com)\n");
+			printf("Usage:\n");
+			printf("  bench [-quick] [-nofit] [-script func_bench.lua] [-model name] [-path name]\n");
+			printf("    [-n rows] [-m params] [-maxmem MiB] [-mintime s]\n");
+			printf("  -quick -- only small sizes (up to 10^4 rows and 8 parameters)\n");
+			printf("  -model -- cp, funcs0, funcs1, funcs2 or funcs3 (default - all)\n");
+			printf("  -path -- autodiff, analytic or native (default - all)\n");
+			printf("  -n, -m -- only this size (rows are 10^2..10^7, parameters are 2..64 for cp)\n");
+			printf("  -maxmem -- cases that need more memory are skipped (default 2048 MiB)\n");
+			printf("  -mintime -- minimal total time of timed repetitions (default 0.2 s)\n");
+			printf("Results are typed as JSON lines.\n");
+			return 0;
+		}
+	}
+	LuaFunc_SetAllocator(bench_alloc, &bench_stats);
+	bench_all(&o);
+	return 0;
+}
@@ -13,9 +13,13 @@
 #define _USE_MATH_DEFINES
 #include <math.h>
 #include <time.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "lua.h"
 #include "lualib.h"
 #include "lauxlib.h"
+#include "luacompat.h"
 
 #include "mlsmat.h"
 #include "cwrapper.h"
@@ -24,6 +28,8 @@
 #include "mlslib_lua.c" /* Statically linked mlslib.lua file */
 #endif
 
+#define NE_BLOCK 128 /* Rows per block for normal equations (packed block must fit L2 cache) */
+
 
 /*
  * Initializes Lua interpreter and loads Lua function from user-defined
@@ -36,6 +42,21 @@
  *     b is DualNVector class example (i.e. dual number) that allows to
  *     calculate derivatives by means of automatic differentiation.
  *
+ * Batch mode: K independent problems with the same model are fitted
+ * simultaneously if initfunc returns two values: initial approximation
+ * for all problems (K*m elements, m parameters of the first problem,
+ * then m parameters of the second one etc.) and RealVector with numbers
+ * of residuals of each problem (K elements). In this mode resfunc argument
+ * is a table of m DualNVector objects, b[j] contains j-th parameters of
+ * all problems expanded to their residuals (see c_push_batch_arg), and
+ * resfunc must return residuals of all problems concatenated. LuaFunc_Eval
+ * argument has K*m elements, the Jacobian has m columns (each row contains
+ * derivatives with respect to parameters of its own problem).
+ *
+ * LuaFunc_Init is equivalent to LuaFunc_Load followed by LuaFunc_Setup,
+ * the host application may call LuaFunc_SetData between them to pass its
+ * data arrays to initfunc.
+ *
  * The resulting Lua stack is
  * 1: mlslib module
  * 2: user-defined function module (table with initfunc and resfunc fields)
@@ -44,11 +65,273 @@
  */
 int LuaFunc_Init(LuaFunc *F, const char *filename)
 {
-	lua_State *L = luaL_newstate();
-	luaL_openlibs(L);
+	return LuaFunc_Load(F, filename) && LuaFunc_Setup(F);
+}
+
+/* Array exposed to Lua state: env.data[name] or env.datasets[name][index] */
+typedef struct {
+	char *name;
+	int index; /* 0 for env.data */
+	const void *ptr;
+	int len;
+	int single;
+} LuaFuncArray;
+
+/*
+ * Data shared by LuaFunc and its clones (see LuaFunc_Clone): precompiled
+ * user script and arrays that are not copied. It is filled by LuaFunc_Load,
+ * LuaFunc_SetData, LuaFunc_SetPrecision and LuaFunc_Setup and is immutable
+ * after LuaFunc_Setup.
+ */
+typedef struct {
+	char *chunk; /* User script bytecode */
+	size_t chunklen;
+	char chunkname[LUAFUNC_BUFSIZE];
+	int precision;
+	int narrays;
+	LuaFuncArray *arrays;
+} LuaFuncShared;
+
+/* Process-wide settings (see LuaFunc_SetBytecodeCache and LuaFunc_SetLibs) */
+static char luafunc_cachedir[LUAFUNC_BUFSIZE] = "";
+static int luafunc_libs = LUAFUNC_LIBS_ALL;
+static LuaFunc_Alloc luafunc_alloc = NULL;
+static void *luafunc_allocud = NULL;
+
+/*
+ * Sets directory for precompiled user scripts: LuaFunc_Load saves bytecode
+ * of scripts to dirname/<hash>.luac files and reuses them if contents of the
+ * script is not changed (the key is 64-bit FNV-1a hash of the source). NULL
+ * or empty string disables the cache (default). The directory must be
+ * writable only by trusted users: bytecode is not verified by Lua.
+ * It is not thread-safe and must be called before creation of LuaFuncs.
+ *
+ * Returns 1 in the case of success or 0 in the case of error
+ */
+int LuaFunc_SetBytecodeCache(const char *dirname)
+{
+	if (dirname == NULL) {
+		dirname = "";
+	}
+	if (strlen(dirname) + 32 > LUAFUNC_BUFSIZE) {
+		return 0;
+	}
+	strcpy(luafunc_cachedir, dirname);
+	return 1;
+}
+
+/*
+ * Sets libraries opened by LuaFunc_Load: LUAFUNC_LIBS_ALL (default) or
+ * LUAFUNC_LIBS_LEAN (without io, os, coroutine and utf8; debug library
+ * is available only by require; jit, ffi and bit libraries are kept
+ * for LuaJIT). It is not thread-safe and must be called
+ * before creation of LuaFuncs.
+ *
+ * Returns 1 in the case of success or 0 in the case of error
+ */
+int LuaFunc_SetLibs(int libs)
+{
+	if (libs != LUAFUNC_LIBS_ALL && libs != LUAFUNC_LIBS_LEAN) {
+		return 0;
+	}
+	luafunc_libs = libs;
+	return 1;
+}
+
+/*
+ * Sets memory allocation function for Lua states created by LuaFunc_Load
+ * and LuaFunc_Clone (see lua_Alloc in Lua manual); ud is passed to it.
+ * NULL restores the default allocator. It may be used for accounting of
+ * memory: note that data of RealVector objects is allocated by malloc
+ * and is not passed to this function. It is not thread-safe and must be
+ * called before creation of LuaFuncs.
+ *
+ * Returns 1 in the case of success or 0 in the case of error
+ */
+int LuaFunc_SetAllocator(LuaFunc_Alloc f, void *ud)
+{
+	luafunc_alloc = f;
+	luafunc_allocud = ud;
+	return 1;
+}
+
+/* Panic function for states with user-defined allocator (as in luaL_newstate) */
+static int c_luafunc_panic(lua_State *L)
+{
+	fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", lua_tostring(L, -1));
+	return 0;
+}
+
+/* 64-bit FNV-1a hash */
+static unsigned long long c_fnv1a(const char *data, size_t len, unsigned long long h)
+{
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ (unsigned char) data[i]) * 1099511628211ULL;
+	}
+	return h;
+}
+
+/* Reads the whole file into allocated buffer (NULL in the case of error) */
+static char *c_readfile(const char *filename, size_t *len)
+{
+	FILE *fp = fopen(filename, "rb");
+	if (fp == NULL) {
+		return NULL;
+	}
+	size_t cap = 4096, n = 0, nread;
+	char *buf = (char *) malloc(cap);
+	while (buf != NULL && (nread = fread(buf + n, 1, cap - n, fp)) > 0) {
+		n += nread;
+		if (n == cap) {
+			char *newbuf = (char *) realloc(buf, cap * 2);
+			if (newbuf == NULL) {
+				free(buf);
+			}
+			buf = newbuf;
+			cap *= 2;
+		}
+	}
+	fclose(fp);
+	*len = n;
+	return buf;
+}
+
+/* lua_Writer for lua_dump: appends data to LuaFuncShared chunk */
+static int c_chunk_writer(lua_State *L, const void *p, size_t sz, void *ud)
+{
+	LuaFuncShared *sh = (LuaFuncShared *) ud;
+	(void) L;
+	char *chunk = (char *) realloc(sh->chunk, sh->chunklen + sz);
+	if (chunk == NULL) {
+		return 1;
+	}
+	sh->chunk = chunk;
+	memcpy(sh->chunk + sh->chunklen, p, sz);
+	sh->chunklen += sz;
+	return 0;
+}
+
+/*
+ * Loads user script as Lua function (pushed to the stack) and keeps its
+ * bytecode in F->shared. The bytecode is taken from the cache (see
+ * LuaFunc_SetBytecodeCache) if possible. Returns LUA_OK or an error code.
+ */
+static int c_load_script(LuaFunc *F, const char *filename)
+{
+	lua_State *L = (lua_State *) F->LuaState;
+	LuaFuncShared *sh = (LuaFuncShared *) F->shared;
+	size_t len = 0;
+	char *src = c_readfile(filename, &len), cachename[LUAFUNC_BUFSIZE + 32];
+	if (src == NULL) {
+		lua_pushfstring(L, "cannot open %s", filename);
+		return LUA_ERRFILE;
+	}
+	snprintf(sh->chunkname, LUAFUNC_BUFSIZE, "@%s", filename);
+	/* Try to load bytecode from the cache: the hash also depends on chunkname
+	   (it is saved in bytecode) and bytecode format */
+	cachename[0] = '\0';
+	if (luafunc_cachedir[0] != '\0') {
+		unsigned long long h = c_fnv1a(src, len, 14695981039346656037ULL);
+		h = c_fnv1a(sh->chunkname, strlen(sh->chunkname) + 1, h);
+		char fmt[64];
+		snprintf(fmt, sizeof(fmt), "%d %d %d %d", LUA_VERSION_NUM,
+			(int) sizeof(lua_Number), (int) sizeof(lua_Integer), (int) sizeof(size_t));
+		h = c_fnv1a(fmt, strlen(fmt), h);
+		snprintf(cachename, sizeof(cachename), "%s/%016llx.luac", luafunc_cachedir, h);
+		sh->chunk = c_readfile(cachename, &sh->chunklen);
+		if (sh->chunk != NULL) {
+			if (luaL_loadbufferx(L, sh->chunk, sh->chunklen, sh->chunkname, "b") == LUA_OK) {
+				free(src);
+				return LUA_OK;
+			}
+			lua_pop(L, 1); /* Corrupted or incompatible file: recompile */
+			free(sh->chunk);
+			sh->chunk = NULL;
+		}
+		sh->chunklen = 0;
+	}
+	/* Compile the source (the first line starting with # is skipped as in luaL_loadfile) */
+	size_t skip = 0;
+	if (len > 0 && src[0] == '#') {
+		while (skip < len && src[skip] != '\n') {
+			skip++;
+		}
+	}
+	int status = luaL_loadbuffer(L, src + skip, len - skip, sh->chunkname);
+	free(src);
+	if (status != LUA_OK) {
+		return status;
+	}
+	if (lua_dump(L, c_chunk_writer, sh, 0) != 0) {
+		lua_pop(L, 1);
+		lua_pushstring(L, "not enough memory");
+		return LUA_ERRMEM;
+	}
+	/* Save bytecode to the cache (temporary file is renamed to avoid partial files) */
+	if (cachename[0] != '\0') {
+		char tmpname[LUAFUNC_BUFSIZE + 96];
+		snprintf(tmpname, sizeof(tmpname), "%s.%p.%ld.tmp", cachename, (void *) F, (long) clock());
+		FILE *fp = fopen(tmpname, "wb");
+		if (fp != NULL) {
+			int ok = fwrite(sh->chunk, 1, sh->chunklen, fp) == sh->chunklen;
+			ok = (fclose(fp) == 0) && ok;
+			if (!ok || rename(tmpname, cachename) != 0) {
+				remove(tmpname);
+			}
+		}
+	}
+	return LUA_OK;
+}
+
+/* Creates Lua state of F with libraries (see LuaFunc_SetLibs) and mlslib module at index 1 */
+static int c_luafunc_open(LuaFunc *F)
+{
+	lua_State *L = NULL;
+	if (luafunc_alloc != NULL) {
+		L = lua_newstate(luafunc_alloc, luafunc_allocud);
+		if (L != NULL) {
+			lua_atpanic(L, c_luafunc_panic);
+		}
+	} else {
+		L = luaL_newstate();
+	}
 	F->LuaState = (void *) L;
 	F->userFlags = 0;
+	F->beta0 = NULL;
+	F->active = NULL;
+	F->ncolors = 0;
+	F->color = NULL;
+	F->nrows = F->nnz = 0;
+	F->colptr = F->rowind = F->rowptr = F->colind = NULL;
+	F->nbatch = 0;
+	F->batchptr = NULL;
+	F->shared = NULL;
+	F->ownshared = 0;
 	char *errmsg = F->errMsg;
+	if (L == NULL) {
+		snprintf(errmsg, LUAFUNC_BUFSIZE, "Cannot create Lua state (not enough memory)");
+		return 0;
+	}
+	if (luafunc_libs == LUAFUNC_LIBS_LEAN) {
+		static const luaL_Reg libs[] = {{"_G", luaopen_base}, {LUA_LOADLIBNAME, luaopen_package},
+			{LUA_TABLIBNAME, luaopen_table}, {LUA_STRLIBNAME, luaopen_string},
+			{LUA_MATHLIBNAME, luaopen_math}, {NULL, NULL}};
+		for (const luaL_Reg *lib = libs; lib->func != NULL; lib++) {
+			luaL_requiref(L, lib->name, lib->func, 1);
+			lua_pop(L, 1);
+		}
+		luaL_requiref(L, LUA_DBLIBNAME, luaopen_debug, 0); /* Used by mlslib */
+		lua_pop(L, 1);
+#ifdef LUA_JITLIBNAME
+		/* LuaJIT: the compiler is enabled by jit library, ffi is used by env.view */
+		luaL_requiref(L, LUA_JITLIBNAME, luaopen_jit, 1);
+		luaL_requiref(L, LUA_FFILIBNAME, luaopen_ffi, 0);
+		luaL_requiref(L, LUA_BITLIBNAME, luaopen_bit, 1);
+		lua_pop(L, 3);
+#endif
+	} else {
+		luaL_openlibs(L);
+	}
 #ifdef STATIC_LINK
 	/* Load mlslib and mlslib libraries that are embedded into file */
 	/* It is designed for static linking with Lua */
@@ -71,8 +354,15 @@ int LuaFunc_Init(LuaFunc *F, const char *filename)
 		snprintf(errmsg, LUAFUNC_BUFSIZE, "Libraries are corrupted");
 		return 0;
 	}
-	/* Load user-defined script */
-	if (luaL_dofile(L, filename) != 0) {
+	return 1;
+}
+
+/* Runs the loaded user script (on the top of the stack) and checks its output */
+static int c_luafunc_run(LuaFunc *F, const char *filename)
+{
+	lua_State *L = (lua_State *) F->LuaState;
+	char *errmsg = F->errMsg;
+	if (lua_pcall(L, 0, LUA_MULTRET, 0) != 0) {
 		snprintf(errmsg, LUAFUNC_BUFSIZE, "Failed to load user-defined script %s (%s)", filename, lua_tostring(L, -1));
 		return 0;
 	}
@@ -95,13 +385,254 @@ int LuaFunc_Init(LuaFunc *F, const char *filename)
 		return 0;
 	}
 	lua_pop(L, 1);
+	/* Table for data arrays of the host application */
+	lua_newtable(L);
+	lua_setfield(L, 1, "data");
+	return 1;
+}
+
+/*
+ * Initializes Lua interpreter, loads libraries and user-defined script
+ * (see LuaFunc_Init) but doesn't call initfunc. Creates empty env.data
+ * table for LuaFunc_SetData. The script is compiled or taken from
+ * the bytecode cache (see LuaFunc_SetBytecodeCache). The resulting Lua
+ * stack is
+ * 1: mlslib module
+ * 2: user-defined function module (table with initfunc and resfunc fields)
+ */
+int LuaFunc_Load(LuaFunc *F, const char *filename)
+{
+	if (!c_luafunc_open(F)) {
+		return 0;
+	}
+	F->shared = calloc(1, sizeof(LuaFuncShared));
+	if (F->shared == NULL) {
+		snprintf(F->errMsg, LUAFUNC_BUFSIZE, "Not enough memory");
+		return 0;
+	}
+	F->ownshared = 1;
+	lua_State *L = (lua_State *) F->LuaState;
+	if (c_load_script(F, filename) != LUA_OK) {
+		snprintf(F->errMsg, LUAFUNC_BUFSIZE, "Failed to load user-defined script %s (%s)", filename, lua_tostring(L, -1));
+		return 0;
+	}
+	return c_luafunc_run(F, filename);
+}
+
+/* Pushes read-only RealVector that wraps external array (double or single precision) */
+static void c_push_external(lua_State *L, const void *ptr, int n, int single)
+{
+	RealVector *vec = (RealVector *) lua_newuserdata(L, sizeof(RealVector));
+	vec->len = n;
+	vec->data = single ? NULL : (double *) ptr - 1; /* data[0] is not used */
+	vec->sdata = single ? (float *) ptr - 1 : NULL;
+	vec->single = single;
+	vec->readonly = 1;
+	vec->external = 1;
+	vec->mapbase = NULL;
+	vec->mapsize = 0;
+	luaL_getmetatable(L, "MLSMat::RealVector");
+	lua_setmetatable(L, -2);
+}
+
+/*
+ * Initializes F as a clone of src that must be initialized (LuaFunc_Init
+ * or LuaFunc_Load + LuaFunc_Setup) and must not be closed before F.
+ * The script is not compiled again, arrays passed to src by LuaFunc_SetData
+ * and data sets loaded by its initfunc (see env.dataset in mlslib.lua) are
+ * shared without copying, precision is inherited. initfunc is called for
+ * the clone, but env.dataset returns shared data instead of calling loaders.
+ * src is not modified, so clones may be created in parallel threads.
+ *
+ * Returns 1 in the case of success or 0 in the case of error
+ */
+int LuaFunc_Clone(LuaFunc *F, const LuaFunc *src)
+{
+	const LuaFuncShared *sh = (const LuaFuncShared *) src->shared;
+	if (!c_luafunc_open(F)) {
+		return 0;
+	}
+	lua_State *L = (lua_State *) F->LuaState;
+	F->shared = (void *) sh;
+	if (sh == NULL || sh->chunk == NULL) {
+		snprintf(F->errMsg, LUAFUNC_BUFSIZE, "Source LuaFunc is not initialized");
+		return 0;
+	}
+	if (luaL_loadbufferx(L, sh->chunk, sh->chunklen, sh->chunkname, "b") != LUA_OK) {
+		snprintf(F->errMsg, LUAFUNC_BUFSIZE, "Failed to load user-defined script %s (%s)",
+			sh->chunkname + 1, lua_tostring(L, -1));
+		return 0;
+	}
+	if (!c_luafunc_run(F, sh->chunkname + 1)) {
+		return 0;
+	}
+	/* Shared arrays: env.data[name] and env.datasets[name][index] */
+	lua_getfield(L, 1, "datasets");
+	if (lua_type(L, -1) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, 1, "datasets");
+	}
+	lua_getfield(L, 1, "data");
+	for (int k = 0; k < sh->narrays; k++) {
+		const LuaFuncArray *a = sh->arrays + k;
+		if (a->index == 0) {
+			c_push_external(L, a->ptr, a->len, a->single);
+			lua_setfield(L, -2, a->name);
+			continue;
+		}
+		lua_getfield(L, -2, a->name);
+		if (lua_type(L, -1) != LUA_TTABLE) {
+			lua_pop(L, 1);
+			lua_newtable(L);
+			lua_pushvalue(L, -1);
+			lua_setfield(L, -4, a->name);
+		}
+		c_push_external(L, a->ptr, a->len, a->single);
+		lua_rawseti(L, -2, a->index);
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 2);
+	if (sh->precision != LUAFUNC_DOUBLE && !LuaFunc_SetPrecision(F, sh->precision)) {
+		return 0;
+	}
+	return LuaFunc_Setup(F);
+}
+
+/*
+ * Adds array to the shared data of F (only if F is not a clone).
+ * Returns 1 in the case of success or 0 in the case of error
+ */
+static int c_shared_addarray(LuaFunc *F, const char *name, int index, const void *ptr, int len, int single)
+{
+	LuaFuncShared *sh = (LuaFuncShared *) F->shared;
+	if (!F->ownshared || sh == NULL) {
+		return 1;
+	}
+	/* Arrays of env.data with the same name are replaced */
+	LuaFuncArray *a = NULL;
+	for (int k = 0; k < sh->narrays && index == 0; k++) {
+		if (sh->arrays[k].index == 0 && !strcmp(sh->arrays[k].name, name)) {
+			a = sh->arrays + k;
+		}
+	}
+	if (a == NULL) {
+		LuaFuncArray *arrays = (LuaFuncArray *) realloc(sh->arrays, (sh->narrays + 1) * sizeof(LuaFuncArray));
+		char *aname = (arrays != NULL) ? (char *) malloc(strlen(name) + 1) : NULL;
+		if (arrays != NULL) {
+			sh->arrays = arrays;
+		}
+		if (aname == NULL) {
+			snprintf(F->errMsg, LUAFUNC_BUFSIZE, "Not enough memory");
+			return 0;
+		}
+		strcpy(aname, name);
+		a = sh->arrays + sh->narrays++;
+		a->name = aname;
+	}
+	a->index = index;
+	a->ptr = ptr;
+	a->len = len;
+	a->single = single;
+	return 1;
+}
+
+/* Removes array of env.data from the shared data of F (only if F is not a clone) */
+static void c_shared_removearray(LuaFunc *F, const char *name)
+{
+	LuaFuncShared *sh = (LuaFuncShared *) F->shared;
+	if (!F->ownshared || sh == NULL) {
+		return;
+	}
+	for (int k = 0; k < sh->narrays; k++) {
+		if (sh->arrays[k].index == 0 && !strcmp(sh->arrays[k].name, name)) {
+			free(sh->arrays[k].name);
+			sh->arrays[k] = sh->arrays[--sh->narrays];
+			return;
+		}
+	}
+}
+
+/*
+ * Adds data sets loaded by initfunc (env.datasets table) to the shared
+ * data of F. Vectors become read-only because clones use their memory.
+ * Returns 1 in the case of success or 0 in the case of error
+ */
+static int c_shared_adddatasets(LuaFunc *F)
+{
+	lua_State *L = (lua_State *) F->LuaState;
+	if (!F->ownshared) {
+		return 1;
+	}
+	lua_getfield(L, 1, "datasets");
+	if (lua_type(L, -1) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		return 1;
+	}
+	lua_pushnil(L);
+	while (lua_next(L, -2) != 0) {
+		if (lua_type(L, -2) == LUA_TSTRING && lua_type(L, -1) == LUA_TTABLE) {
+			int n = (int) lua_rawlen(L, -1);
+			for (int i = 1; i <= n; i++) {
+				lua_rawgeti(L, -1, i);
+				RealVector *vec = (RealVector *) luaL_testudata(L, -1, "MLSMat::RealVector");
+				if (vec != NULL) {
+					vec->readonly = 1;
+					if (!c_shared_addarray(F, lua_tostring(L, -3), i,
+						vec->single ? (void *) (vec->sdata + 1) : (void *) (vec->data + 1),
+						vec->len, vec->single)) {
+						lua_pop(L, 4);
+						return 0;
+					}
+				}
+				lua_pop(L, 1);
+			}
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	return 1;
+}
+
+/*
+ * Calls initfunc of the script loaded by LuaFunc_Load, processes initial
+ * approximation and sizes of problems (see LuaFunc_Init).
+ */
+int LuaFunc_Setup(LuaFunc *F)
+{
+	lua_State *L = (lua_State *) F->LuaState;
+	char *errmsg = F->errMsg;
 	/* Initialize user script */
 	lua_getfield(L, -1, "initfunc");
 	lua_pushvalue(L, 1); /* Module with dual numbers */
-	if (lua_pcall(L, 1, 1, 0) != 0) {
+	if (lua_pcall(L, 1, 2, 0) != 0) {
 		snprintf(errmsg, LUAFUNC_BUFSIZE, "User script initialization failed (%s)", lua_tostring(L, -1));
 		return 0;
 	}
+	/* Process sizes of problems (batch mode) */
+	if (!lua_isnil(L, -1)) {
+		RealVector *sizes = (RealVector *) luaL_testudata(L, -1, "MLSMat::RealVector");
+		if (sizes == NULL || sizes->len == 0) {
+			snprintf(errmsg, LUAFUNC_BUFSIZE, "Sizes of problems must be a non-empty RealVector");
+			return 0;
+		}
+		F->batchptr = (int *) calloc(sizes->len + 1, sizeof(int));
+		if (F->batchptr == NULL) {
+			snprintf(errmsg, LUAFUNC_BUFSIZE, "Not enough memory");
+			return 0;
+		}
+		F->nbatch = sizes->len;
+		for (int k = 0; k < F->nbatch; k++) {
+			int len = (int) REALVECTOR_GET(sizes, k + 1);
+			if (len < 1 || len != REALVECTOR_GET(sizes, k + 1)) {
+				snprintf(errmsg, LUAFUNC_BUFSIZE, "Invalid size of problem %d", k + 1);
+				return 0;
+			}
+			F->batchptr[k + 1] = F->batchptr[k] + len;
+		}
+	}
+	lua_pop(L, 1);
 	/* Process initial approximation obtained from the user */
 	RealVector *initApprox = (RealVector *) luaL_testudata(L, -1, "MLSMat::RealVector");
 	if (initApprox == NULL) {
@@ -112,12 +643,21 @@ int LuaFunc_Init(LuaFunc *F, const char *filename)
 		snprintf(errmsg, LUAFUNC_BUFSIZE, "Initial approximation mustn't be empty");
 		return 0;
 	}
+	if (F->nbatch > 0 && initApprox->len % F->nbatch != 0) {
+		snprintf(errmsg, LUAFUNC_BUFSIZE, "Initial approximation must contain %d equal parts", F->nbatch);
+		return 0;
+	}
 	F->beta0 = calloc(initApprox->len, sizeof(double));
 	F->nparams = initApprox->len;
+	F->nactive = (F->nbatch > 0) ? initApprox->len / F->nbatch : initApprox->len;
 	for (int i = 0; i < F->nparams; i++) {
-		F->beta0[i] = initApprox->data[i + 1];
+		F->beta0[i] = REALVECTOR_GET(initApprox, i + 1);
 	}
 	lua_pop(L, 1);
+	/* Data sets loaded by initfunc are shared with clones */
+	if (!c_shared_adddatasets(F)) {
+		return 0;
+	}
 	/* Get constructor for dual numbers */
 	lua_getfield(L, 1, "DualNVector");
 	if (lua_isnil(L, -1)) {
@@ -140,84 +680,380 @@ int LuaFunc_Init(LuaFunc *F, const char *filename)
 }
 
 /*
- * Evaluates Lua function. The resulting Lua stack is:
- * 1-4: initLuaFunc output
- * 5: DualNVector result
- * 
+ * Exposes the array of the host application as env.data[name] read-only
+ * RealVector with n elements. The data is not copied and is not freed
+ * by Lua, so ptr must remain valid until LuaFunc_Close (or until the next
+ * LuaFunc_SetData or LuaFunc_RemoveData call with the same name). Usually
+ * it is called between LuaFunc_Load and LuaFunc_Setup to make data visible
+ * to initfunc.
+ *
  * Returns 1 in the case of success or 0 in the case of error
  */
-int LuaFunc_Eval(LuaFunc *F, double *b)
+int LuaFunc_SetData(LuaFunc *F, const char *name, const double *ptr, int n)
 {
 	lua_State *L = (lua_State *) F->LuaState;
-	char *errmsg = F->errMsg;
-	int m = F->nparams;
-	/* Get lua residuals function from the table */
-	lua_getfield(L, 2, "resfunc");
-	/* Construct beta vector */
-	lua_pushvalue(L, 3); /* DualVectorN.new copy */
-	/* a) real part */
-	lua_pushvalue(L, 4); /* Vec copy */
-	lua_newtable(L);
-	for (int i = 0; i < m; i++) {
-		lua_pushinteger(L, i + 1); /* Key */
-		lua_pushnumber(L, b[i]); /* Value */
-		lua_settable(L, -3);
-	}
-	if (lua_pcall(L, 1, 1, 0) != 0) {
-		snprintf(errmsg, LUAFUNC_BUFSIZE, "real construction/%s", lua_tostring(L, -1));
+	if (n < 0 || ptr == NULL) {
+		snprintf(F->errMsg, LUAFUNC_BUFSIZE, "Invalid data array %s", name);
 		return 0;
 	}
-	/* b) imaginary parts */
-	for (int i = 1; i <= m; i++) {
-		lua_pushvalue(L, 4); /* Vec copy */
-		lua_newtable(L);
-		for (int j = 1; j <= m; j++) {
-			lua_pushinteger(L, j); /* Key */
-			lua_pushnumber(L, (i == j) ? 1.0 : 0.0); /* Value */
-			lua_settable(L, -3);
-		}
-		if (lua_pcall(L, 1, 1, 0) != 0) {
-			snprintf(errmsg, LUAFUNC_BUFSIZE, "imag construction/%s", lua_tostring(L, -1));
-			return 0;
-		}
+	lua_getfield(L, 1, "data");
+	if (lua_type(L, -1) != LUA_TTABLE) {
+		snprintf(F->errMsg, LUAFUNC_BUFSIZE, "env.data table is absent");
+		lua_pop(L, 1);
+		return 0;
 	}
-	/* c) DualVector.new constructor call */
-	if (lua_pcall(L, m + 1, 1, 0) != 0) {
-		snprintf(errmsg, LUAFUNC_BUFSIZE, "DualVector.new/%s", lua_tostring(L, -1));
+	if (!c_shared_addarray(F, name, 0, ptr, n, 0)) {
+		lua_pop(L, 1);
 		return 0;
 	}
-	/* Call resfunc */
-	if (lua_pcall(L, 1, 1, 0) != 0) {
-		snprintf(errmsg, LUAFUNC_BUFSIZE, "resfunc/%s", lua_tostring(L, -1));
+	c_push_external(L, ptr, n, 0);
+	lua_setfield(L, -2, name);
+	lua_pop(L, 1);
+	return LuaFunc_Invalidate(F);
+}
+
+/*
+ * Exposes a copy of the array as env.data[name] read-only RealVector with
+ * n elements. Unlike LuaFunc_SetData the copy is owned by the Lua state:
+ * ptr may be freed after the call, and the vector remains valid while the
+ * script keeps references to it (e.g. after LuaFunc_RemoveData). The copy
+ * is not shared with clones.
+ *
+ * Returns 1 in the case of success or 0 in the case of error
+ */
+int LuaFunc_SetDataCopy(LuaFunc *F, const char *name, const double *ptr, int n)
+{
+	lua_State *L = (lua_State *) F->LuaState;
+	if (n < 0 || ptr == NULL) {
+		snprintf(F->errMsg, LUAFUNC_BUFSIZE, "Invalid data array %s", name);
 		return 0;
 	}
-	/* Check the type */
+	lua_getfield(L, 1, "data");
 	if (lua_type(L, -1) != LUA_TTABLE) {
-		snprintf(errmsg, LUAFUNC_BUFSIZE, "resfunc must return a table\n");
+		snprintf(F->errMsg, LUAFUNC_BUFSIZE, "env.data table is absent");
+		lua_pop(L, 1);
 		return 0;
 	}
-	lua_getfield(L, -1, "__len");
-	if (lua_isnil(L, -1)) {
-		snprintf(errmsg, LUAFUNC_BUFSIZE, "__len method not found\n");
+	RealVector *vec = (RealVector *) lua_newuserdata(L, sizeof(RealVector));
+	vec->data = (double *) malloc((n + 1) * sizeof(double));
+	if (vec->data == NULL) {
+		snprintf(F->errMsg, LUAFUNC_BUFSIZE, "Not enough memory");
+		lua_pop(L, 2);
 		return 0;
 	}
+	memcpy(vec->data + 1, ptr, n * sizeof(double));
+	vec->len = n;
+	vec->sdata = NULL;
+	vec->single = 0;
+	vec->readonly = 1;
+	vec->external = 0;
+	vec->mapbase = NULL;
+	vec->mapsize = 0;
+	luaL_getmetatable(L, "MLSMat::RealVector");
+	lua_setmetatable(L, -2);
+	lua_setfield(L, -2, name);
 	lua_pop(L, 1);
-	return 1;
+	return LuaFunc_Invalidate(F);
 }
 
-int LuaFunc_GetValueLength(LuaFunc *F)
-{
-	lua_State *L = (lua_State *) F->LuaState;
-	char *errmsg = F->errMsg;
+/*
+ * Removes env.data[name] added by LuaFunc_SetData or LuaFunc_SetDataCopy,
+ * so the array of the host application may be freed (user script mustn't
+ * keep references to the vector added by LuaFunc_SetData, e.g. in upvalues).
+ *
+ * Returns 1 in the case of success or 0 in the case of error
+ */
+int LuaFunc_RemoveData(LuaFunc *F, const char *name)
+{
+	lua_State *L = (lua_State *) F->LuaState;
+	lua_getfield(L, 1, "data");
+	if (lua_type(L, -1) != LUA_TTABLE) {
+		snprintf(F->errMsg, LUAFUNC_BUFSIZE, "env.data table is absent");
+		lua_pop(L, 1);
+		return 0;
+	}
+	lua_pushnil(L);
+	lua_setfield(L, -2, name);
+	lua_pop(L, 1);
+	c_shared_removearray(F, name);
+	return LuaFunc_Invalidate(F);
+}
+
+/*
+ * Drops values of parameter-independent subexpressions cached by
+ * env.invariant (see mlslib.lua). It must be called if the host
+ * application changes contents of arrays passed by LuaFunc_SetData
+ * (LuaFunc_SetData itself calls it).
+ *
+ * Returns 1 in the case of success or 0 in the case of error
+ */
+int LuaFunc_Invalidate(LuaFunc *F)
+{
+	lua_State *L = (lua_State *) F->LuaState;
+	lua_getfield(L, 1, "invalidate");
+	if (!lua_isfunction(L, -1)) {
+		lua_pop(L, 1);
+		return 1;
+	}
+	if (lua_pcall(L, 0, 0, 0) != 0) {
+		snprintf(F->errMsg, LUAFUNC_BUFSIZE, "invalidate/%s", lua_tostring(L, -1));
+		lua_pop(L, 1);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Sets precision (LUAFUNC_DOUBLE or LUAFUNC_SINGLE) of vectors created by
+ * RealVector constructors in the Lua state (see RealVector.setprecision).
+ * Single precision halves memory traffic of vectorized operations; values
+ * returned by resfunc are converted to double by the C interface and all
+ * reductions (e.g. normal equations) are accumulated in double precision.
+ * It should be called between LuaFunc_Load and LuaFunc_Setup to affect
+ * data loaded by initfunc. Data passed by LuaFunc_SetData is always double.
+ *
+ * Returns 1 in the case of success or 0 in the case of error
+ */
+int LuaFunc_SetPrecision(LuaFunc *F, int precision)
+{
+	lua_State *L = (lua_State *) F->LuaState;
+	if (precision != LUAFUNC_DOUBLE && precision != LUAFUNC_SINGLE) {
+		snprintf(F->errMsg, LUAFUNC_BUFSIZE, "Invalid precision %d", precision);
+		return 0;
+	}
+	lua_getfield(L, 1, "RealVector");
+	lua_getfield(L, -1, "setprecision");
+	lua_remove(L, -2);
+	lua_pushstring(L, (precision == LUAFUNC_SINGLE) ? "single" : "double");
+	if (lua_pcall(L, 1, 0, 0) != 0) {
+		snprintf(F->errMsg, LUAFUNC_BUFSIZE, "RealVector.setprecision/%s", lua_tostring(L, -1));
+		lua_pop(L, 1);
+		return 0;
+	}
+	if (F->ownshared) {
+		((LuaFuncShared *) F->shared)->precision = precision;
+	}
+	return 1;
+}
+
+/*
+ * Pushes resfunc argument (DualNVector or HyperDualNVector) with nvars
+ * imaginary parts on the stack (see c_luafunc_eval).
+ *
+ * Returns 1 in the case of success or 0 in the case of error
+ */
+static int c_push_arg(LuaFunc *F, double *b, int nvars, int hyper, const double *v)
+{
+	lua_State *L = (lua_State *) F->LuaState;
+	char *errmsg = F->errMsg;
+	int m = F->nparams;
+	if (hyper) {
+		lua_getfield(L, 1, "HyperDualNVector");
+		if (lua_type(L, -1) != LUA_TTABLE) {
+			snprintf(errmsg, LUAFUNC_BUFSIZE, "HyperDualNVector class is absent");
+			return 0;
+		}
+		lua_getfield(L, -1, "new");
+		lua_remove(L, -2);
+	} else {
+		lua_pushvalue(L, 3); /* DualVectorN.new copy */
+	}
+	/* a) real part */
+	lua_pushvalue(L, 4); /* Vec copy */
+	lua_newtable(L);
+	for (int i = 0; i < m; i++) {
+		lua_pushinteger(L, i + 1); /* Key */
+		lua_pushnumber(L, b[i]); /* Value */
+		lua_settable(L, -3);
+	}
+	if (lua_pcall(L, 1, 1, 0) != 0) {
+		snprintf(errmsg, LUAFUNC_BUFSIZE, "real construction/%s", lua_tostring(L, -1));
+		return 0;
+	}
+	/* b) imaginary parts */
+	for (int i = 1; i <= nvars; i++) {
+		lua_pushvalue(L, 4); /* Vec copy */
+		int ind = (F->active != NULL) ? F->active[i - 1] + 1 : i;
+		lua_newtable(L);
+		for (int j = 1; j <= m; j++) {
+			int seed = (F->ncolors > 0 && !hyper) ? (F->color[j - 1] == i - 1) : (ind == j);
+			lua_pushinteger(L, j); /* Key */
+			lua_pushnumber(L, seed ? 1.0 : 0.0); /* Value */
+			lua_settable(L, -3);
+		}
+		if (v != NULL) { /* Tangent direction */
+			for (int j = 0; j < F->nactive; j++) {
+				lua_pushnumber(L, v[j]);
+				lua_rawseti(L, -2, (F->active != NULL) ? F->active[j] + 1 : j + 1);
+			}
+		}
+		if (lua_pcall(L, 1, 1, 0) != 0) {
+			snprintf(errmsg, LUAFUNC_BUFSIZE, "imag construction/%s", lua_tostring(L, -1));
+			return 0;
+		}
+	}
+	/* c) DualVector.new constructor call */
+	if (lua_pcall(L, nvars + 1, 1, 0) != 0) {
+		snprintf(errmsg, LUAFUNC_BUFSIZE, "DualVector.new/%s", lua_tostring(L, -1));
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Pushes resfunc argument for batch mode (see LuaFunc_Init): a table of
+ * m DualNVector objects where m is the number of parameters of one problem.
+ * The j-th object contains j-th parameters of all problems expanded to
+ * residuals of these problems, i.e. it has the same length as resfunc
+ * output. Problems are independent, so only nvars = 0 or nvars = m
+ * imaginary parts are required: the j-th one is filled by ones for the
+ * j-th parameter and by zeros for other ones.
+ *
+ * Returns 1 in the case of success or 0 in the case of error
+ */
+static int c_push_batch_arg(LuaFunc *F, double *b, int nvars)
+{
+	lua_State *L = (lua_State *) F->LuaState;
+	char *errmsg = F->errMsg;
+	int m = F->nactive, K = F->nbatch, N = F->batchptr[K];
+	lua_createtable(L, m, 0);
+	for (int j = 0; j < m; j++) {
+		lua_createtable(L, 0, 2); /* DualNVector object */
+		lua_createtable(L, nvars, 0); /* imag table */
+		for (int d = -1; d < nvars; d++) {
+			lua_pushvalue(L, 4); /* Vec copy */
+			lua_pushinteger(L, N);
+			if (lua_pcall(L, 1, 1, 0) != 0) {
+				snprintf(errmsg, LUAFUNC_BUFSIZE, "batch construction/%s", lua_tostring(L, -1));
+				return 0;
+			}
+			RealVector *rv = (RealVector *) luaL_testudata(L, -1, "MLSMat::RealVector");
+			if (rv == NULL || rv->readonly) {
+				snprintf(errmsg, LUAFUNC_BUFSIZE, "Writable MLSMat::RealVector expected");
+				return 0;
+			}
+			if (d == -1) { /* Real part */
+				for (int k = 0; k < K; k++) {
+					for (int i = F->batchptr[k]; i < F->batchptr[k + 1]; i++) {
+						REALVECTOR_SET(rv, i + 1, b[k*m + j]);
+					}
+				}
+				lua_setfield(L, -3, "real");
+			} else {
+				if (d == j) {
+					for (int i = 1; i <= N; i++) {
+						REALVECTOR_SET(rv, i, 1.0);
+					}
+				}
+				lua_rawseti(L, -2, d + 1);
+			}
+		}
+		lua_setfield(L, -2, "imag");
+		luaL_getmetatable(L, "MLSMat::DualNVector");
+		lua_setmetatable(L, -2);
+		lua_rawseti(L, -2, j + 1);
+	}
+	return 1;
+}
+
+/*
+ * Evaluates Lua function with nvars imaginary parts in its argument
+ * (nvars = 0 or nvars = number of seed directions). The k-th imaginary
+ * part corresponds to the k-th active parameter (see LuaFunc_SetActiveParams)
+ * or to the k-th color of active parameters if compressed seeding is enabled
+ * (see LuaFunc_DetectSparsity). Other parameters are passed as constants.
+ * If hyper is nonzero the argument is HyperDualNVector (i.e. second
+ * derivatives are also calculated) and compressed seeding is not used.
+ * If v is not NULL (nvars must be 1) the only imaginary part contains
+ * the tangent direction v (nactive elements) scattered to active parameters.
+ * The resulting Lua stack is:
+ * 1-4: initLuaFunc output
+ * 5: DualNVector (or HyperDualNVector) result
+ *
+ * The result of the previous evaluation is removed from the stack
+ * (and may be collected by Lua garbage collector).
+ * 
+ * Returns 1 in the case of success or 0 in the case of error
+ */
+static int c_luafunc_eval(LuaFunc *F, double *b, int nvars, int hyper, const double *v)
+{
+	lua_State *L = (lua_State *) F->LuaState;
+	char *errmsg = F->errMsg;
+	/* Remove the previous result */
+	lua_settop(L, 4);
+	/* Get lua residuals function from the table */
+	lua_getfield(L, 2, "resfunc");
+	/* Construct beta vector */
+	if (F->nbatch > 0) {
+		if (hyper || v != NULL) {
+			snprintf(errmsg, LUAFUNC_BUFSIZE, "Only first derivatives are supported in batch mode");
+			return 0;
+		}
+		if (!c_push_batch_arg(F, b, nvars)) {
+			return 0;
+		}
+	} else if (!c_push_arg(F, b, nvars, hyper, v)) {
+		return 0;
+	}
+	/* Call resfunc */
+	if (lua_pcall(L, 1, 1, 0) != 0) {
+		snprintf(errmsg, LUAFUNC_BUFSIZE, "resfunc/%s", lua_tostring(L, -1));
+		return 0;
+	}
+	/* Check the type */
+	if (lua_type(L, -1) != LUA_TTABLE) {
+		snprintf(errmsg, LUAFUNC_BUFSIZE, "resfunc must return a table\n");
+		return 0;
+	}
+	lua_getfield(L, -1, "__len");
+	if (lua_isnil(L, -1)) {
+		snprintf(errmsg, LUAFUNC_BUFSIZE, "__len method not found\n");
+		return 0;
+	}
+	lua_pop(L, 1);
+	/* Double precision copies of the result (see c_realvector_todouble) */
+	lua_newtable(L);
+	lua_insert(L, -2);
+	return 1;
+}
+
+/*
+ * Evaluates Lua function and its derivatives (see c_luafunc_eval).
+ * Returns 1 in the case of success or 0 in the case of error
+ */
+int LuaFunc_Eval(LuaFunc *F, double *b)
+{
+	return c_luafunc_eval(F, b, (F->ncolors > 0) ? F->ncolors : F->nactive, 0, NULL);
+}
+
+/*
+ * Evaluates Lua function without derivatives: the argument is passed
+ * as DualNVector without imaginary parts, so the cost is approximately
+ * equal to one evaluation with RealVector. Only residuals can be obtained
+ * from such result by LuaFunc_GetValue.
+ *
+ * Returns 1 in the case of success or 0 in the case of error
+ */
+int LuaFunc_EvalValue(LuaFunc *F, double *b)
+{
+	return c_luafunc_eval(F, b, 0, 0, NULL);
+}
+
+int LuaFunc_GetValueLength(LuaFunc *F)
+{
+	lua_State *L = (lua_State *) F->LuaState;
+	char *errmsg = F->errMsg;
 	/* Call __len method */
 	lua_getfield(L, -1, "__len");
 	if (lua_isnil(L, -1)) {
 		snprintf(errmsg, LUAFUNC_BUFSIZE, "__len method not found\n");
+		lua_pop(L, 1);
 		return -1;
 	}
 	lua_pushvalue(L, -2); /* self */
 	if (lua_pcall(L, 1, 1, 0) != 0) {
 		snprintf(errmsg, LUAFUNC_BUFSIZE, "%s", lua_tostring(L, -1));
+		lua_pop(L, 1);
 		return -1;
 	}
 	/* And convert it to number */
@@ -226,6 +1062,191 @@ int LuaFunc_GetValueLength(LuaFunc *F)
 	return len;
 }
 
+/*
+ * Converts single precision vector (see RealVector:single) returned by
+ * resfunc to double precision: the C interface always works with doubles,
+ * so pointers to the data may be returned to the user. The vector itself
+ * is not changed (the script may keep it or its env.view): its double
+ * precision copy replaces the vector on the top of the stack. Copies are
+ * kept in the table under the result (stack index 5) until the next
+ * c_luafunc_eval call, so repeated calls return the same copy.
+ *
+ * Returns the vector (if it is double) or its copy or NULL in the case of error
+ */
+static RealVector *c_realvector_todouble(LuaFunc *F, RealVector *vec)
+{
+	lua_State *L = (lua_State *) F->LuaState;
+	if (!vec->single) {
+		return vec;
+	}
+	lua_pushvalue(L, -1);
+	lua_rawget(L, 5);
+	RealVector *copy = (RealVector *) luaL_testudata(L, -1, "MLSMat::RealVector");
+	if (copy != NULL) {
+		lua_replace(L, -2);
+		return copy;
+	}
+	lua_pop(L, 1);
+	copy = (RealVector *) lua_newuserdata(L, sizeof(RealVector));
+	copy->data = malloc((vec->len + 1) * sizeof(double));
+	if (copy->data == NULL) {
+		lua_pop(L, 1);
+		snprintf(F->errMsg, LUAFUNC_BUFSIZE, "Not enough memory");
+		return NULL;
+	}
+	for (int i = 1; i <= vec->len; i++) {
+		copy->data[i] = vec->sdata[i];
+	}
+	copy->len = vec->len;
+	copy->sdata = NULL;
+	copy->single = 0;
+	copy->readonly = 0;
+	copy->external = 0;
+	copy->mapbase = NULL;
+	copy->mapsize = 0;
+	luaL_getmetatable(L, "MLSMat::RealVector");
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, -2);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, 5);
+	lua_replace(L, -2);
+	return copy;
+}
+
+/*
+ * LuaFunc_GetValuePtr implementation: nvars is the expected number of
+ * imaginary parts (i.e. Jacobian columns or compressed columns).
+ */
+static int c_getvalueptr(LuaFunc *F, const double **res, const double **J, int nvars)
+{
+	lua_State *L = (lua_State *) F->LuaState;
+	char *errmsg = F->errMsg;
+	int top = lua_gettop(L); /* The stack is restored in the case of error */
+	/* Get length (number of elements) */
+	int n = LuaFunc_GetValueLength(F);
+	if (n == -1) { /* Error message is generated by LuaFunc_GetValueLength */
+		return 0;
+	}
+	/* Real part (values) */
+	if (res != NULL) {
+		lua_getfield(L, -1, "real");
+		RealVector *rv = (RealVector *) luaL_testudata(L, -1, "MLSMat::RealVector");
+		if (rv == NULL || rv->len != n) {
+			snprintf(errmsg, LUAFUNC_BUFSIZE, "MLSMat::RealVector with %d elements expected", n);
+			lua_settop(L, top);
+			return 0;
+		}
+		RealVector *dv = c_realvector_todouble(F, rv);
+		if (dv == NULL) {
+			lua_settop(L, top);
+			return 0;
+		}
+		*res = dv->data + 1;
+		lua_pop(L, 1);
+	}
+	/* Imaginary part (derivatives) */
+	if (J != NULL) {
+		lua_getfield(L, -1, "imag");
+		if (lua_type(L, -1) != LUA_TTABLE) {
+			snprintf(errmsg, LUAFUNC_BUFSIZE, "imag part is corrupted");
+			lua_settop(L, top);
+			return 0;
+		}
+		int m = lua_rawlen(L, -1);
+		if (m != nvars) {
+			snprintf(errmsg, LUAFUNC_BUFSIZE, "%d derivatives expected (%d found)", nvars, m);
+			lua_settop(L, top);
+			return 0;
+		}
+		for (int j = 0; j < m; j++) {
+			lua_pushinteger(L, j + 1);
+			lua_gettable(L, -2);
+			RealVector *iv = (RealVector *) luaL_testudata(L, -1, "MLSMat::RealVector");
+			if (iv == NULL || iv->len != n) {
+				snprintf(errmsg, LUAFUNC_BUFSIZE, "MLSMat::RealVector with %d elements expected", n);
+				lua_settop(L, top);
+				return 0;
+			}
+			RealVector *dv = c_realvector_todouble(F, iv);
+			if (dv == NULL) {
+				lua_settop(L, top);
+				return 0;
+			}
+			J[j] = dv->data + 1;
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+	return 1;
+}
+
+/*
+ * Decompresses the Jacobian obtained with compressed seeding (see
+ * LuaFunc_DetectSparsity) into dense n x nactive matrix J (the same
+ * format as in LuaFunc_GetValue).
+ *
+ * Returns 1 in the case of success, 0 in the case of error.
+ */
+static int c_getvalue_compressed(LuaFunc *F, int n, double *J)
+{
+	int m = F->nactive;
+	const double **cols = (const double **) calloc(F->ncolors, sizeof(double *));
+	if (cols == NULL) {
+		snprintf(F->errMsg, LUAFUNC_BUFSIZE, "Not enough memory");
+		return 0;
+	}
+	if (!c_getvalueptr(F, NULL, cols, F->ncolors)) {
+		free(cols);
+		return 0;
+	}
+	if (n != F->nrows) {
+		snprintf(F->errMsg, LUAFUNC_BUFSIZE, "%d residuals expected by sparsity pattern (%d found)", F->nrows, n);
+		free(cols);
+		return 0;
+	}
+	memset(J, 0, n * m * sizeof(double));
+	for (int j = 0; j < m; j++) {
+		const double *cj = cols[F->color[(F->active != NULL) ? F->active[j] : j]];
+		for (int p = F->colptr[j]; p < F->colptr[j + 1]; p++) {
+			int i = F->rowind[p];
+			J[m*i + j] = cj[i];
+		}
+	}
+	free(cols);
+	return 1;
+}
+
+/*
+ * Evaluates Lua function and its directional derivative (Jacobian-vector
+ * product) Jv = J*v. Only one imaginary part is seeded, so the cost is
+ * approximately equal to two evaluations of residuals and doesn't depend
+ * on the number of parameters. It is suitable for matrix-free methods.
+ *
+ * b -- parameters (nparams elements)
+ * v -- tangent direction (m elements)
+ * res -- buffer for residuals (n elements) or NULL
+ * Jv -- buffer for J*v product (n elements) or NULL
+ * where m is the number of active parameters (see LuaFunc_SetActiveParams).
+ *
+ * Returns 1 in the case of success or 0 in the case of error
+ */
+int LuaFunc_EvalJVP(LuaFunc *F, double *b, const double *v, double *res, double *Jv)
+{
+	const double *r, *jv;
+	if (!c_luafunc_eval(F, b, 1, 0, v) ||
+		!c_getvalueptr(F, (res != NULL) ? &r : NULL, (Jv != NULL) ? &jv : NULL, 1)) {
+		return 0;
+	}
+	int n = LuaFunc_GetValueLength(F);
+	if (res != NULL) {
+		memcpy(res, r, n * sizeof(double));
+	}
+	if (Jv != NULL) {
+		memcpy(Jv, jv, n * sizeof(double));
+	}
+	return 1;
+}
+
 /*
  * Returns precalculated function value and its derivatives
  * (in the form of Jacobian). Note that the value must be
@@ -235,6 +1256,9 @@ int LuaFunc_GetValueLength(LuaFunc *F)
  * J -- pointer to the buffer for Jacobian (or NULL). Jacobian will be
  *   written in the next format:
  *   [dF(x1)/dB1...dF(x1)/dBm, ..., dF(xn)/dB1...dF(xn)/dBm]
+ *   where m is the number of active parameters (see LuaFunc_SetActiveParams)
+ *   If compressed seeding is enabled (see LuaFunc_DetectSparsity) the
+ *   Jacobian is decompressed, elements outside the pattern are zeros.
  * 
  * Use NULL pointer for res and J if you don't need a variable.
  *
@@ -258,11 +1282,14 @@ int LuaFunc_GetValue(LuaFunc *F, double *res, double *J)
 			return 0;
 		}
 		for (int i = 0; i < n; i++) {
-			res[i] = rv->data[i + 1];
+			res[i] = REALVECTOR_GET(rv, i + 1);
 		}
 		lua_pop(L, 1);
 	}
 	/* Prepare imaginary part (derivatives) */
+	if (J != NULL && F->ncolors > 0) {
+		return c_getvalue_compressed(F, n, J);
+	}
 	if (J != NULL) {
 		lua_getfield(L, -1, "imag");
 		if (lua_type(L, -1) != LUA_TTABLE) {
@@ -281,20 +1308,324 @@ int LuaFunc_GetValue(LuaFunc *F, double *res, double *J)
 			}
 			/* Copy the vector */
 			for (int i = 0; i < n; i++) {
-				J[m*i + j] = iv->data[i + 1];
+				J[m*i + j] = REALVECTOR_GET(iv, i + 1);
 			}
 			/* Restore the stack */
 			lua_pop(L, 1);
 		}
+		lua_pop(L, 1); /* Remove imag table */
 	}
 	return 1;
 }
 
+/*
+ * Returns pointers to precalculated function value and to the columns
+ * of its Jacobian without copying them. Note that the value must be
+ * calculated by LuaFunc_Eval before its call. The pointers remain valid
+ * until the next LuaFunc_Eval or LuaFunc_Close call.
+ *
+ * res -- pointer to the variable for residuals pointer (or NULL)
+ * J -- array of m pointers (or NULL) where m is the number of active
+ *   parameters. J[j] will point to the vector [dF(x1)/dBj, ..., dF(xn)/dBj]
+ *   (i.e. j-th Jacobian column)
+ *
+ * Returns 1 in the case of success, 0 in the case of error.
+ */
+int LuaFunc_GetValuePtr(LuaFunc *F, const double **res, const double **J)
+{
+	if (J != NULL && F->ncolors > 0) {
+		snprintf(F->errMsg, LUAFUNC_BUFSIZE,
+			"Jacobian is compressed (use LuaFunc_GetValue or LuaFunc_GetValueSparse)");
+		return 0;
+	}
+	return c_getvalueptr(F, res, J, F->nactive);
+}
+
+/*
+ * SYRK-style kernel: G += P^T P (only 2x4 tiles that cover the upper
+ * triangle of G are updated). P contains mp packed columns (mp is
+ * a multiple of 4), each column has NE_BLOCK elements and only the
+ * first len (even) elements are used. G is mp x mp matrix.
+ */
+static void c_syrk_block(const double *P, int mp, int len, double *G)
+{
+	for (int j = 0; j < mp; j += 2) {
+		const double *a0 = P + j*NE_BLOCK, *a1 = a0 + NE_BLOCK;
+		for (int k = j & ~3; k < mp; k += 4) {
+			const double *b0 = P + k*NE_BLOCK, *b1 = b0 + NE_BLOCK;
+			const double *b2 = b1 + NE_BLOCK, *b3 = b2 + NE_BLOCK;
+			double s[8];
+#if defined(__SSE2__)
+			__m128d s00 = _mm_setzero_pd(), s01 = _mm_setzero_pd();
+			__m128d s02 = _mm_setzero_pd(), s03 = _mm_setzero_pd();
+			__m128d s10 = _mm_setzero_pd(), s11 = _mm_setzero_pd();
+			__m128d s12 = _mm_setzero_pd(), s13 = _mm_setzero_pd();
+			for (int i = 0; i < len; i += 2) {
+				__m128d x0 = _mm_loadu_pd(a0 + i), x1 = _mm_loadu_pd(a1 + i), y;
+				y = _mm_loadu_pd(b0 + i);
+				s00 = _mm_add_pd(s00, _mm_mul_pd(x0, y)); s10 = _mm_add_pd(s10, _mm_mul_pd(x1, y));
+				y = _mm_loadu_pd(b1 + i);
+				s01 = _mm_add_pd(s01, _mm_mul_pd(x0, y)); s11 = _mm_add_pd(s11, _mm_mul_pd(x1, y));
+				y = _mm_loadu_pd(b2 + i);
+				s02 = _mm_add_pd(s02, _mm_mul_pd(x0, y)); s12 = _mm_add_pd(s12, _mm_mul_pd(x1, y));
+				y = _mm_loadu_pd(b3 + i);
+				s03 = _mm_add_pd(s03, _mm_mul_pd(x0, y)); s13 = _mm_add_pd(s13, _mm_mul_pd(x1, y));
+			}
+			/* Horizontal sums */
+			__m128d t;
+			t = _mm_add_pd(s00, _mm_unpackhi_pd(s00, s00)); _mm_store_sd(s + 0, t);
+			t = _mm_add_pd(s01, _mm_unpackhi_pd(s01, s01)); _mm_store_sd(s + 1, t);
+			t = _mm_add_pd(s02, _mm_unpackhi_pd(s02, s02)); _mm_store_sd(s + 2, t);
+			t = _mm_add_pd(s03, _mm_unpackhi_pd(s03, s03)); _mm_store_sd(s + 3, t);
+			t = _mm_add_pd(s10, _mm_unpackhi_pd(s10, s10)); _mm_store_sd(s + 4, t);
+			t = _mm_add_pd(s11, _mm_unpackhi_pd(s11, s11)); _mm_store_sd(s + 5, t);
+			t = _mm_add_pd(s12, _mm_unpackhi_pd(s12, s12)); _mm_store_sd(s + 6, t);
+			t = _mm_add_pd(s13, _mm_unpackhi_pd(s13, s13)); _mm_store_sd(s + 7, t);
+#else
+			for (int q = 0; q < 8; q++) s[q] = 0.0;
+			for (int i = 0; i < len; i++) {
+				double x0 = a0[i], x1 = a1[i];
+				s[0] += x0 * b0[i]; s[1] += x0 * b1[i]; s[2] += x0 * b2[i]; s[3] += x0 * b3[i];
+				s[4] += x1 * b0[i]; s[5] += x1 * b1[i]; s[6] += x1 * b2[i]; s[7] += x1 * b3[i];
+			}
+#endif
+			double *g0 = G + j*mp + k, *g1 = g0 + mp;
+			g0[0] += s[0]; g0[1] += s[1]; g0[2] += s[2]; g0[3] += s[3];
+			g1[0] += s[4]; g1[1] += s[5]; g1[2] += s[6]; g1[3] += s[7];
+		}
+	}
+}
+
+/*
+ * Sparse variant of LuaFunc_GetNormalEquations for compressed seeding:
+ * the cost is proportional to the sum of squared numbers of nonzero
+ * elements in Jacobian rows.
+ */
+static int c_normaleq_sparse(LuaFunc *F, int n, double *JtJ, double *Jtr, double *sse)
+{
+	int m = F->nactive;
+	const double *r;
+	const double **cols = (const double **) calloc(F->ncolors + m, sizeof(double *));
+	const double **jcol = cols + F->ncolors; /* Compressed column for each Jacobian column */
+	double *v = (double *) calloc(m, sizeof(double));
+	if (cols == NULL || v == NULL) {
+		snprintf(F->errMsg, LUAFUNC_BUFSIZE, "Not enough memory");
+		free(cols); free(v);
+		return 0;
+	}
+	if (!c_getvalueptr(F, &r, cols, F->ncolors)) {
+		free(cols); free(v);
+		return 0;
+	}
+	if (n != F->nrows) {
+		snprintf(F->errMsg, LUAFUNC_BUFSIZE, "%d residuals expected by sparsity pattern (%d found)", F->nrows, n);
+		free(cols); free(v);
+		return 0;
+	}
+	for (int j = 0; j < m; j++) {
+		jcol[j] = cols[F->color[(F->active != NULL) ? F->active[j] : j]];
+	}
+	if (JtJ != NULL) memset(JtJ, 0, m * m * sizeof(double));
+	if (Jtr != NULL) memset(Jtr, 0, m * sizeof(double));
+	double s = 0.0;
+	for (int i = 0; i < n; i++) {
+		int p0 = F->rowptr[i], p1 = F->rowptr[i + 1];
+		for (int p = p0; p < p1; p++) {
+			v[p - p0] = jcol[F->colind[p]][i];
+		}
+		/* Column indexes are sorted, so only upper triangle is updated */
+		for (int p = p0; p < p1; p++) {
+			int j = F->colind[p];
+			double vj = v[p - p0];
+			if (JtJ != NULL) {
+				for (int q = p; q < p1; q++) {
+					JtJ[j*m + F->colind[q]] += vj * v[q - p0];
+				}
+			}
+			if (Jtr != NULL) {
+				Jtr[j] += vj * r[i];
+			}
+		}
+		s += r[i] * r[i];
+	}
+	if (JtJ != NULL) {
+		for (int j = 0; j < m; j++) {
+			for (int k = j + 1; k < m; k++) {
+				JtJ[k*m + j] = JtJ[j*m + k];
+			}
+		}
+	}
+	if (sse != NULL) {
+		*sse = s;
+	}
+	free(cols); free(v);
+	return 1;
+}
+
+/*
+ * Calculates normal equations for the precalculated function value
+ * (see LuaFunc_Eval) without copying of the Jacobian:
+ *   JtJ = J^T J (m*m elements), Jtr = J^T r (m elements), sse = r^T r
+ * (m is the number of active parameters)
+ * where r is the vector of residuals and J is the Jacobian. The rows are
+ * processed by blocks of NE_BLOCK elements: each block of Jacobian columns
+ * and residuals is packed into a contiguous buffer and multiplied by
+ * cache-friendly (SIMD if possible) kernel. If compressed seeding is enabled
+ * (see LuaFunc_DetectSparsity) only nonzero elements of each row are used.
+ *
+ * Use NULL pointer for JtJ, Jtr or sse if you don't need a variable.
+ *
+ * Returns 1 in the case of success, 0 in the case of error.
+ */
+int LuaFunc_GetNormalEquations(LuaFunc *F, double *JtJ, double *Jtr, double *sse)
+{
+	char *errmsg = F->errMsg;
+	int m = F->nactive, n = LuaFunc_GetValueLength(F);
+	if (n == -1) {
+		return 0;
+	}
+	if (F->ncolors > 0) {
+		return c_normaleq_sparse(F, n, JtJ, Jtr, sse);
+	}
+	int mp = (m + 1 + 3) & ~3; /* Columns of J, residuals and zero padding */
+	const double **cols = (const double **) calloc(m + 1, sizeof(double *));
+	double *P = (double *) calloc(mp * NE_BLOCK, sizeof(double));
+	double *G = (double *) calloc(mp * mp, sizeof(double));
+	if (cols == NULL || P == NULL || G == NULL) {
+		snprintf(errmsg, LUAFUNC_BUFSIZE, "Not enough memory");
+		free(cols); free(P); free(G);
+		return 0;
+	}
+	if (!LuaFunc_GetValuePtr(F, &cols[m], cols)) {
+		free(cols); free(P); free(G);
+		return 0;
+	}
+	for (int i0 = 0; i0 < n; i0 += NE_BLOCK) {
+		int len = (n - i0 < NE_BLOCK) ? (n - i0) : NE_BLOCK;
+		/* Pack the block (odd length is padded by zero) */
+		for (int j = 0; j <= m; j++) {
+			memcpy(P + j*NE_BLOCK, cols[j] + i0, len * sizeof(double));
+			if (len & 1) P[j*NE_BLOCK + len] = 0.0;
+		}
+		c_syrk_block(P, mp, (len + 1) & ~1, G);
+	}
+	/* Copy the results (only upper triangle of G is valid) */
+	for (int j = 0; j < m; j++) {
+		if (JtJ != NULL) {
+			for (int k = j; k < m; k++) {
+				JtJ[j*m + k] = JtJ[k*m + j] = G[j*mp + k];
+			}
+		}
+		if (Jtr != NULL) {
+			Jtr[j] = G[j*mp + m];
+		}
+	}
+	if (sse != NULL) {
+		*sse = G[m*mp + m];
+	}
+	free(cols); free(P); free(G);
+	return 1;
+}
+
+/*
+ * Calculates normal equations for each problem in batch mode (see
+ * LuaFunc_Init) for the precalculated function value:
+ *   JtJ_k = J_k^T J_k, Jtr_k = J_k^T r_k, sse_k = r_k^T r_k
+ * where J_k and r_k are rows of the Jacobian and residuals of the k-th
+ * problem. Results are written problem by problem: JtJ has K*m*m elements,
+ * Jtr has K*m elements and sse has K elements (K is the number of problems,
+ * m is the number of parameters of one problem).
+ *
+ * Use NULL pointer for JtJ, Jtr or sse if you don't need a variable.
+ *
+ * Returns 1 in the case of success, 0 in the case of error.
+ */
+int LuaFunc_GetNormalEquationsBatch(LuaFunc *F, double *JtJ, double *Jtr, double *sse)
+{
+	char *errmsg = F->errMsg;
+	int m = F->nactive, K = F->nbatch;
+	const double *r;
+	if (K == 0) {
+		snprintf(errmsg, LUAFUNC_BUFSIZE, "Batch mode is not enabled");
+		return 0;
+	}
+	const double **cols = (const double **) calloc(m, sizeof(double *));
+	if (cols == NULL) {
+		snprintf(errmsg, LUAFUNC_BUFSIZE, "Not enough memory");
+		return 0;
+	}
+	if (!c_getvalueptr(F, &r, cols, m)) {
+		free(cols);
+		return 0;
+	}
+	if (LuaFunc_GetValueLength(F) != F->batchptr[K]) {
+		snprintf(errmsg, LUAFUNC_BUFSIZE, "%d residuals expected in batch mode", F->batchptr[K]);
+		free(cols);
+		return 0;
+	}
+	for (int k = 0; k < K; k++) {
+		int i0 = F->batchptr[k], i1 = F->batchptr[k + 1];
+		for (int j = 0; j < m; j++) {
+			const double *cj = cols[j];
+			if (JtJ != NULL) {
+				double *G = JtJ + (size_t) k*m*m;
+				for (int l = 0; l <= j; l++) {
+					const double *cl = cols[l];
+					double s = 0.0;
+					for (int i = i0; i < i1; i++) {
+						s += cj[i] * cl[i];
+					}
+					G[j*m + l] = G[l*m + j] = s;
+				}
+			}
+			if (Jtr != NULL) {
+				double s = 0.0;
+				for (int i = i0; i < i1; i++) {
+					s += cj[i] * r[i];
+				}
+				Jtr[k*m + j] = s;
+			}
+		}
+		if (sse != NULL) {
+			double s = 0.0;
+			for (int i = i0; i < i1; i++) {
+				s += r[i] * r[i];
+			}
+			sse[k] = s;
+		}
+	}
+	free(cols);
+	return 1;
+}
+
+/* Removes sparsity pattern and disables compressed seeding */
+static void c_sparsity_free(LuaFunc *F)
+{
+	free(F->color); free(F->colptr); free(F->rowind);
+	free(F->rowptr); free(F->colind);
+	F->color = F->colptr = F->rowind = F->rowptr = F->colind = NULL;
+	F->ncolors = F->nrows = F->nnz = 0;
+}
+
 /* Closes Lua interpreter states and all buffers */
 void LuaFunc_Close(LuaFunc *F)
 {
-	lua_close((lua_State *) F->LuaState);
+	if (F->LuaState != NULL) {
+		lua_close((lua_State *) F->LuaState);
+	}
 	free(F->beta0);
+	free(F->active);
+	free(F->batchptr);
+	c_sparsity_free(F);
+	if (F->ownshared) {
+		LuaFuncShared *sh = (LuaFuncShared *) F->shared;
+		for (int k = 0; k < sh->narrays; k++) {
+			free(sh->arrays[k].name);
+		}
+		free(sh->arrays);
+		free(sh->chunk);
+		free(sh);
+	}
 }
 
 /* Returns pointer to the latest error message */
@@ -314,3 +1645,368 @@ int LuaFunc_GetNParams(LuaFunc *F)
 {
 	return F->nparams;
 }
+
+/*
+ * Sets the parameters that are free (active) during the next evaluations:
+ * only active parameters receive imaginary parts, i.e. derivatives are
+ * calculated only for them and the cost of dual numbers operations is
+ * reduced. Frozen parameters are passed to resfunc as constants.
+ *
+ * mask -- nparams elements: nonzero for free parameters and zero for
+ *   fixed ones. Use NULL to make all parameters active.
+ *
+ * After this call LuaFunc_Eval argument still contains all nparams values,
+ * but the Jacobian (see LuaFunc_GetValue) has only LuaFunc_GetNActive(F)
+ * columns ordered as the active parameters. Sparsity pattern (see
+ * LuaFunc_DetectSparsity) is removed, i.e. dense seeding is restored.
+ *
+ * Returns 1 in the case of success, 0 in the case of error.
+ */
+int LuaFunc_SetActiveParams(LuaFunc *F, const int *mask)
+{
+	int m = F->nparams;
+	if (F->nbatch > 0) {
+		snprintf(F->errMsg, LUAFUNC_BUFSIZE, "Active parameters cannot be changed in batch mode");
+		return 0;
+	}
+	c_sparsity_free(F);
+	free(F->active);
+	F->active = NULL;
+	F->nactive = m;
+	if (mask == NULL) {
+		return 1;
+	}
+	F->active = (int *) calloc(m, sizeof(int));
+	if (F->active == NULL) {
+		snprintf(F->errMsg, LUAFUNC_BUFSIZE, "Not enough memory");
+		return 0;
+	}
+	F->nactive = 0;
+	for (int i = 0; i < m; i++) {
+		if (mask[i]) {
+			F->active[F->nactive++] = i;
+		}
+	}
+	return 1;
+}
+
+/* Returns number of active (free) parameters */
+int LuaFunc_GetNActive(LuaFunc *F)
+{
+	return F->nactive;
+}
+
+/* Returns number of problems in batch mode (0 if it is disabled) */
+int LuaFunc_GetNBatch(LuaFunc *F)
+{
+	return F->nbatch;
+}
+
+
+/* Comparison function for qsort: (nnz, index) pairs by decreasing nnz */
+static int c_cmp_degree(const void *a, const void *b)
+{
+	const int *x = (const int *) a, *y = (const int *) b;
+	if (x[0] != y[0]) {
+		return (x[0] > y[0]) ? -1 : 1;
+	}
+	return x[1] - y[1];
+}
+
+/*
+ * Detects Jacobian sparsity pattern and enables compressed seeding.
+ * The function is evaluated at b with all active parameters seeded
+ * (the pattern is a set of nonzero derivatives), then Jacobian columns
+ * are colored by greedy largest-first algorithm: columns that have
+ * nonzero elements in the same row get different colors. The next
+ * LuaFunc_Eval calls seed one imaginary part per color (i.e. the sum of
+ * structurally orthogonal columns), so the cost of derivatives is
+ * proportional to the number of colors instead of number of active
+ * parameters. Use LuaFunc_GetValue (dense) or LuaFunc_GetValueSparse
+ * to obtain the decompressed Jacobian.
+ *
+ * The pattern is valid only if derivatives that are zero at b are
+ * structural zeros: don't use points where some derivatives vanish
+ * accidentally (e.g. zero parameters in products). The number of
+ * residuals must not change. Note that the probe result is not
+ * available through LuaFunc_GetValue, call LuaFunc_Eval again.
+ * Call LuaFunc_SetActiveParams to return to dense seeding.
+ *
+ * Returns number of colors or 0 in the case of error.
+ */
+int LuaFunc_DetectSparsity(LuaFunc *F, double *b)
+{
+	char *errmsg = F->errMsg;
+	int m = F->nactive;
+	c_sparsity_free(F);
+	if (F->nbatch > 0) {
+		snprintf(errmsg, LUAFUNC_BUFSIZE, "Sparsity detection is not supported in batch mode");
+		return 0;
+	}
+	if (m == 0) {
+		snprintf(errmsg, LUAFUNC_BUFSIZE, "No active parameters");
+		return 0;
+	}
+	if (!c_luafunc_eval(F, b, m, 0, NULL)) {
+		return 0;
+	}
+	int n = LuaFunc_GetValueLength(F);
+	if (n == -1) {
+		return 0;
+	}
+	const double **cols = (const double **) calloc(m, sizeof(double *));
+	int *work = (int *) calloc(4 * m + n + 1, sizeof(int));
+	if (cols == NULL || work == NULL) {
+		snprintf(errmsg, LUAFUNC_BUFSIZE, "Not enough memory");
+		free(cols); free(work);
+		return 0;
+	}
+	if (!c_getvalueptr(F, NULL, cols, m)) {
+		free(cols); free(work);
+		return 0;
+	}
+	/* a) Pattern in CSC format */
+	int nnz = 0;
+	for (int j = 0; j < m; j++) {
+		for (int i = 0; i < n; i++) {
+			nnz += (cols[j][i] != 0.0);
+		}
+	}
+	F->colptr = (int *) calloc(m + 1, sizeof(int));
+	F->rowind = (int *) calloc(nnz + 1, sizeof(int));
+	F->rowptr = (int *) calloc(n + 1, sizeof(int));
+	F->colind = (int *) calloc(nnz + 1, sizeof(int));
+	F->color = (int *) calloc(F->nparams, sizeof(int));
+	if (F->colptr == NULL || F->rowind == NULL || F->rowptr == NULL ||
+		F->colind == NULL || F->color == NULL) {
+		snprintf(errmsg, LUAFUNC_BUFSIZE, "Not enough memory");
+		c_sparsity_free(F);
+		free(cols); free(work);
+		return 0;
+	}
+	for (int j = 0, p = 0; j < m; j++) {
+		F->colptr[j] = p;
+		for (int i = 0; i < n; i++) {
+			if (cols[j][i] != 0.0) {
+				F->rowind[p++] = i;
+				F->rowptr[i + 1]++;
+			}
+		}
+	}
+	F->colptr[m] = nnz;
+	/* b) Pattern in CSR format (column indexes are sorted in each row) */
+	int *next = work + 4 * m;
+	for (int i = 0; i < n; i++) {
+		F->rowptr[i + 1] += F->rowptr[i];
+		next[i] = F->rowptr[i];
+	}
+	for (int j = 0; j < m; j++) {
+		for (int p = F->colptr[j]; p < F->colptr[j + 1]; p++) {
+			F->colind[next[F->rowind[p]]++] = j;
+		}
+	}
+	/* c) Greedy coloring of columns (largest first) */
+	int *order = work, *acolor = work + 2 * m, *forbidden = work + 3 * m;
+	for (int j = 0; j < m; j++) {
+		order[2*j] = F->colptr[j + 1] - F->colptr[j];
+		order[2*j + 1] = j;
+		acolor[j] = forbidden[j] = -1;
+	}
+	qsort(order, m, 2 * sizeof(int), c_cmp_degree);
+	int ncolors = 0;
+	for (int q = 0; q < m; q++) {
+		int j = order[2*q + 1], c = 0;
+		for (int p = F->colptr[j]; p < F->colptr[j + 1]; p++) {
+			int i = F->rowind[p];
+			for (int r = F->rowptr[i]; r < F->rowptr[i + 1]; r++) {
+				int k = F->colind[r];
+				if (acolor[k] >= 0) {
+					forbidden[acolor[k]] = j;
+				}
+			}
+		}
+		while (forbidden[c] == j) {
+			c++;
+		}
+		acolor[j] = c;
+		if (c >= ncolors) {
+			ncolors = c + 1;
+		}
+	}
+	for (int i = 0; i < F->nparams; i++) {
+		F->color[i] = -1;
+	}
+	for (int j = 0; j < m; j++) {
+		F->color[(F->active != NULL) ? F->active[j] : j] = acolor[j];
+	}
+	F->nrows = n;
+	F->nnz = nnz;
+	F->ncolors = ncolors;
+	free(cols); free(work);
+	return ncolors;
+}
+
+/* Returns number of nonzero Jacobian elements (0 if sparsity is not detected) */
+int LuaFunc_GetNNZ(LuaFunc *F)
+{
+	return F->nnz;
+}
+
+/*
+ * Returns precalculated function value and its sparse Jacobian
+ * (see LuaFunc_DetectSparsity and LuaFunc_Eval).
+ *
+ * format -- LUAFUNC_CSR (compressed rows) or LUAFUNC_CSC (compressed columns)
+ * res -- buffer for residuals (n elements) or NULL
+ * ptr -- row pointers (n+1 elements) for CSR or column pointers (m+1 elements)
+ *   for CSC where m is the number of active parameters; or NULL
+ * ind -- column (CSR) or row (CSC) 0-based indexes (nnz elements) or NULL
+ * val -- nonzero elements of Jacobian (nnz elements) or NULL
+ * where nnz = LuaFunc_GetNNZ(F). Indexes are sorted inside each row/column.
+ *
+ * Returns 1 in the case of success, 0 in the case of error.
+ */
+int LuaFunc_GetValueSparse(LuaFunc *F, int format, double *res,
+	int *ptr, int *ind, double *val)
+{
+	char *errmsg = F->errMsg;
+	int m = F->nactive, n = F->nrows;
+	const double *r;
+	if (F->ncolors == 0) {
+		snprintf(errmsg, LUAFUNC_BUFSIZE, "Sparsity pattern is not detected (see LuaFunc_DetectSparsity)");
+		return 0;
+	}
+	if (format != LUAFUNC_CSR && format != LUAFUNC_CSC) {
+		snprintf(errmsg, LUAFUNC_BUFSIZE, "Unknown sparse matrix format %d", format);
+		return 0;
+	}
+	const double **cols = (const double **) calloc(F->ncolors, sizeof(double *));
+	if (cols == NULL) {
+		snprintf(errmsg, LUAFUNC_BUFSIZE, "Not enough memory");
+		return 0;
+	}
+	if (!c_getvalueptr(F, &r, cols, F->ncolors)) {
+		free(cols);
+		return 0;
+	}
+	if (LuaFunc_GetValueLength(F) != n) {
+		snprintf(errmsg, LUAFUNC_BUFSIZE, "%d residuals expected by sparsity pattern", n);
+		free(cols);
+		return 0;
+	}
+	if (res != NULL) {
+		memcpy(res, r, n * sizeof(double));
+	}
+	const int *sptr = (format == LUAFUNC_CSR) ? F->rowptr : F->colptr;
+	const int *sind = (format == LUAFUNC_CSR) ? F->colind : F->rowind;
+	int nptr = (format == LUAFUNC_CSR) ? n : m;
+	if (ptr != NULL) {
+		memcpy(ptr, sptr, (nptr + 1) * sizeof(int));
+	}
+	if (ind != NULL) {
+		memcpy(ind, sind, F->nnz * sizeof(int));
+	}
+	if (val != NULL) {
+		for (int a = 0; a < nptr; a++) {
+			for (int p = sptr[a]; p < sptr[a + 1]; p++) {
+				int i = (format == LUAFUNC_CSR) ? a : sind[p];
+				int j = (format == LUAFUNC_CSR) ? sind[p] : a;
+				val[p] = cols[F->color[(F->active != NULL) ? F->active[j] : j]][i];
+			}
+		}
+	}
+	free(cols);
+	return 1;
+}
+
+/*
+ * Evaluates Lua function with second derivatives (resfunc argument is
+ * HyperDualNVector) and calculates the sum of squares of its elements
+ *   S = r^T r
+ * with its gradient and Hessian with respect to active parameters
+ *   grad = 2 J^T r, H = 2 (J^T J + sum(r_i * d2r_i/dB2))
+ * (m is the number of active parameters, see LuaFunc_SetActiveParams).
+ * Only the lower triangle of each d2r_i/dB2 is calculated by Lua
+ * (m(m+1)/2 elements instead of m^2).
+ *
+ * sse -- pointer to S or NULL
+ * grad -- buffer for the gradient (m elements) or NULL
+ * H -- buffer for the Hessian (m*m elements) or NULL
+ *
+ * Residuals and Jacobian of the evaluated function may be obtained
+ * by LuaFunc_GetValue (if compressed seeding is not enabled).
+ *
+ * Returns 1 in the case of success, 0 in the case of error.
+ */
+int LuaFunc_EvalHessian(LuaFunc *F, double *b, double *sse, double *grad, double *H)
+{
+	lua_State *L = (lua_State *) F->LuaState;
+	char *errmsg = F->errMsg;
+	int m = F->nactive;
+	const double *r;
+	if (!c_luafunc_eval(F, b, m, 1, NULL)) {
+		return 0;
+	}
+	int n = LuaFunc_GetValueLength(F);
+	if (n == -1) {
+		return 0;
+	}
+	const double **cols = (const double **) calloc(m + 1, sizeof(double *));
+	if (cols == NULL) {
+		snprintf(errmsg, LUAFUNC_BUFSIZE, "Not enough memory");
+		return 0;
+	}
+	if (!c_getvalueptr(F, &r, cols, m)) {
+		free(cols);
+		return 0;
+	}
+	/* Sum of squares and gradient */
+	double s = 0.0;
+	for (int i = 0; i < n; i++) {
+		s += r[i] * r[i];
+	}
+	if (sse != NULL) {
+		*sse = s;
+	}
+	for (int j = 0; grad != NULL && j < m; j++) {
+		s = 0.0;
+		for (int i = 0; i < n; i++) {
+			s += cols[j][i] * r[i];
+		}
+		grad[j] = 2.0 * s;
+	}
+	if (H == NULL) {
+		free(cols);
+		return 1;
+	}
+	/* Hessian: lower triangle is packed by rows in hess table */
+	lua_getfield(L, -1, "hess");
+	if (lua_type(L, -1) != LUA_TTABLE || lua_rawlen(L, -1) != (size_t) (m * (m + 1) / 2)) {
+		snprintf(errmsg, LUAFUNC_BUFSIZE, "hess part is corrupted");
+		lua_pop(L, 1);
+		free(cols);
+		return 0;
+	}
+	for (int j = 0, k = 1; j < m; j++) {
+		for (int l = 0; l <= j; l++, k++) {
+			lua_rawgeti(L, -1, k);
+			RealVector *hv = (RealVector *) luaL_testudata(L, -1, "MLSMat::RealVector");
+			if (hv == NULL || hv->len != n) {
+				snprintf(errmsg, LUAFUNC_BUFSIZE, "MLSMat::RealVector with %d elements expected", n);
+				lua_pop(L, 2);
+				free(cols);
+				return 0;
+			}
+			const double *cj = cols[j], *cl = cols[l];
+			s = 0.0;
+			for (int i = 0; i < n; i++) {
+				s += cj[i] * cl[i] + r[i] * REALVECTOR_GET(hv, i + 1);
+			}
+			H[j*m + l] = H[l*m + j] = 2.0 * s;
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
+	free(cols);
+	return 1;
+}
@@ -8,7 +8,14 @@
  */
 #ifndef __CWRAPPER_H
 #define __CWRAPPER_H
+#include <stddef.h>
 #define LUAFUNC_BUFSIZE 512
+#define LUAFUNC_CSR 0 /* Compressed sparse rows format */
+#define LUAFUNC_CSC 1 /* Compressed sparse columns format */
+#define LUAFUNC_DOUBLE 0 /* Double precision RealVector storage */
+#define LUAFUNC_SINGLE 1 /* Single precision RealVector storage */
+#define LUAFUNC_LIBS_ALL 0 /* All standard Lua libraries */
+#define LUAFUNC_LIBS_LEAN 1 /* Only base, package, table, string and math libraries */
 
 /* Structure for saving Lua state, error messages, initial approximations etc.*/
 typedef struct {
@@ -17,8 +24,23 @@ typedef struct {
 	char errMsg[LUAFUNC_BUFSIZE]; /* Buffer */
 	double *beta0; /* Initial approximation */
 	double nparams; /* Number of parameters*/
+	int nactive; /* Number of active (free) parameters */
+	int *active; /* Indexes of active parameters (NULL if all are active) */
+	int ncolors; /* Number of seed directions for sparse Jacobian (0 if dense) */
+	int *color; /* Seed direction of each parameter (-1 for frozen ones) */
+	int nrows; /* Number of rows in Jacobian sparsity pattern */
+	int nnz; /* Number of nonzero elements in Jacobian sparsity pattern */
+	int *colptr, *rowind; /* Sparsity pattern in CSC format */
+	int *rowptr, *colind; /* Sparsity pattern in CSR format */
+	int nbatch; /* Number of problems in batch mode (0 if disabled) */
+	int *batchptr; /* Offsets of problems residuals (nbatch + 1 elements) */
+	void *shared; /* Script bytecode and data shared with clones (see LuaFunc_Clone) */
+	int ownshared; /* 1 if shared data is owned by this structure */
 } LuaFunc;
 
+/* Memory allocation function for Lua states (the same as lua_Alloc) */
+typedef void *(*LuaFunc_Alloc)(void *ud, void *ptr, size_t osize, size_t nsize);
+
 #ifdef __cplusplus
 #define FEXTERN extern "C"
 #else
@@ -27,12 +49,36 @@ typedef struct {
 
 /* API for user */
 int FEXTERN LuaFunc_Init(LuaFunc *F, const char *filename);
+int FEXTERN LuaFunc_Load(LuaFunc *F, const char *filename);
+int FEXTERN LuaFunc_Setup(LuaFunc *F);
+int FEXTERN LuaFunc_Clone(LuaFunc *F, const LuaFunc *src);
+int FEXTERN LuaFunc_SetBytecodeCache(const char *dirname);
+int FEXTERN LuaFunc_SetLibs(int libs);
+int FEXTERN LuaFunc_SetAllocator(LuaFunc_Alloc f, void *ud);
+int FEXTERN LuaFunc_SetData(LuaFunc *F, const char *name, const double *ptr, int n);
+int FEXTERN LuaFunc_SetDataCopy(LuaFunc *F, const char *name, const double *ptr, int n);
+int FEXTERN LuaFunc_RemoveData(LuaFunc *F, const char *name);
+int FEXTERN LuaFunc_Invalidate(LuaFunc *F);
+int FEXTERN LuaFunc_SetPrecision(LuaFunc *F, int precision);
 int FEXTERN LuaFunc_Eval(LuaFunc *F, double *b);
+int FEXTERN LuaFunc_EvalValue(LuaFunc *F, double *b);
+int FEXTERN LuaFunc_EvalJVP(LuaFunc *F, double *b, const double *v, double *res, double *Jv);
+int FEXTERN LuaFunc_EvalHessian(LuaFunc *F, double *b, double *sse, double *grad, double *H);
 int FEXTERN LuaFunc_GetValueLength(LuaFunc *F);
 int FEXTERN LuaFunc_GetValue(LuaFunc *F, double *res, double *J);
+int FEXTERN LuaFunc_GetValuePtr(LuaFunc *F, const double **res, const double **J);
+int FEXTERN LuaFunc_GetNormalEquations(LuaFunc *F, double *JtJ, double *Jtr, double *sse);
+int FEXTERN LuaFunc_GetNormalEquationsBatch(LuaFunc *F, double *JtJ, double *Jtr, double *sse);
 void FEXTERN LuaFunc_Close(LuaFunc *F);
 const char FEXTERN *LuaFunc_GetErrMsg(LuaFunc *F);
 double FEXTERN *LuaFunc_GetBeta0(LuaFunc *F);
 int FEXTERN LuaFunc_GetNParams(LuaFunc *F);
+int FEXTERN LuaFunc_SetActiveParams(LuaFunc *F, const int *mask);
+int FEXTERN LuaFunc_GetNActive(LuaFunc *F);
+int FEXTERN LuaFunc_GetNBatch(LuaFunc *F);
+int FEXTERN LuaFunc_DetectSparsity(LuaFunc *F, double *b);
+int FEXTERN LuaFunc_GetNNZ(LuaFunc *F);
+int FEXTERN LuaFunc_GetValueSparse(LuaFunc *F, int format, double *res,
+	int *ptr, int *ind, double *val);
 #endif
 
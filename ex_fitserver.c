@@ -0,0 +1,584 @@
+/*
+ * ex_fitserver.c Persistent fitting server for nonlinear regression with
+ * dual numbers library (mlsmat.c and mlslib.lua) and built-in
+ * Levenberg-Marquardt method (lmfit.c). It listens on Unix domain socket
+ * and keeps a pool of warm Lua states (LuaFunc structures) for each
+ * script, so start-up costs (process, Lua state, libraries, script
+ * compilation and data sets loaded by env.dataset) are paid only once.
+ * States are cloned from the first one (see LuaFunc_Clone) and are
+ * reloaded if the script is changed. POSIX only.
+ *
+ * Protocol: every message is a 32-bit length (native byte order) followed
+ * by the payload; integers are 32-bit, doubles are 64-bit, strings are
+ * terminated by zero. A client may send several jobs through one
+ * connection.
+ *
+ * Job (request):
+ *   script       -- path to Lua script (as for ex_lmfit)
+ *   m            -- number of parameters (0 - use initial approximation)
+ *   itmax        -- maximal number of iterations (0 - default)
+ *   ndata        -- number of data arrays
+ *   p[m]         -- initial approximation
+ *   ndata times: name, n, x[n] -- arrays passed to env.data[name]
+ *                   (see LuaFunc_SetDataCopy, they are visible to resfunc)
+ *
+ * Result (response):
+ *   status       -- 0 - success, 1 - error
+ *   if error:    message
+ *   if success:  m, n (number of residuals), info[LUAFUNC_LM_INFO_SZ]
+ *                (see LuaFunc_LevMar), p[m] (solution), covar[m*m]
+ *
+ * (C) 2016-2017 Alexey Voskov (alvoskov@gmail.com)
+ * License: MIT (X11) license
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "cwrapper.h"
+#include "lmfit.h"
+
+#define FS_MAXTHREADS 256 /* Maximal number of worker threads */
+#define FS_MAXMSG (1U << 30) /* Maximal size of message */
+#define FS_ITMAX 500 /* Default maximal number of iterations */
+
+/* Script with its pool of warm states */
+typedef struct FitScript {
+	char path[LUAFUNC_BUFSIZE];
+	struct stat st; /* File status of the loaded version */
+	int loading; /* 1 while the master is being loaded (without the lock) */
+	LuaFunc master; /* Source for clones (never used for fits) */
+	LuaFunc **idle; /* Warm states ready for jobs */
+	int nidle;
+	int nbusy; /* Number of states used by jobs now */
+	int retired; /* 1 if the script was changed (freed after the last job) */
+	struct FitScript *next;
+} FitScript;
+
+/* Shared state of the server */
+typedef struct {
+	int fd; /* Listening socket */
+	FitScript *scripts;
+	pthread_mutex_t lock;
+	pthread_cond_t loaded; /* Signalled when a script is loaded */
+} FitServer;
+
+/* Buffer for parsing of requests and building of responses */
+typedef struct {
+	char *data;
+	size_t len;
+	size_t pos;
+	int nomem; /* 1 if fs_put failed (the message is incomplete) */
+} FitBuffer;
+
+static const char *fs_sockpath = NULL;
+
+/* Removes socket file on termination */
+static void fs_onsignal(int sig)
+{
+	if (fs_sockpath != NULL) {
+		unlink(fs_sockpath);
+	}
+	_exit(128 + sig);
+}
+
+/* Reads/writes exactly len bytes, returns 0 in the case of error or EOF */
+static int fs_readall(int fd, void *buf, size_t len)
+{
+	char *p = (char *) buf;
+	while (len > 0) {
+		ssize_t k = read(fd, p, len);
+		if (k < 0 && errno == EINTR) {
+			continue;
+		}
+		if (k <= 0) {
+			return 0;
+		}
+		p += k;
+		len -= (size_t) k;
+	}
+	return 1;
+}
+
+static int fs_writeall(int fd, const void *buf, size_t len)
+{
+	const char *p = (const char *) buf;
+	while (len > 0) {
+		ssize_t k = write(fd, p, len);
+		if (k < 0 && errno == EINTR) {
+			continue;
+		}
+		if (k <= 0) {
+			return 0;
+		}
+		p += k;
+		len -= (size_t) k;
+	}
+	return 1;
+}
+
+/* Sends message: length prefix and payload */
+static int fs_sendmsg(int fd, const FitBuffer *b)
+{
+	uint32_t len = (uint32_t) b->len;
+	return fs_writeall(fd, &len, sizeof(len)) && fs_writeall(fd, b->data, b->len);
+}
+
+/* Receives message (b->data must be freed), returns 0 in the case of error or EOF */
+static int fs_recvmsg(int fd, FitBuffer *b)
+{
+	uint32_t len;
+	b->data = NULL;
+	b->len = b->pos = 0;
+	b->nomem = 0;
+	if (!fs_readall(fd, &len, sizeof(len)) || len > FS_MAXMSG) {
+		return 0;
+	}
+	b->data = (char *) malloc(len > 0 ? len : 1);
+	b->len = len;
+	return b->data != NULL && fs_readall(fd, b->data, len);
+}
+
+/* Appends data to the buffer (sets nomem flag in the case of error) */
+static void fs_put(FitBuffer *b, const void *src, size_t len)
+{
+	char *data = b->nomem ? NULL : (char *) realloc(b->data, b->len + len);
+	if (data == NULL) {
+		b->nomem = 1;
+		return;
+	}
+	b->data = data;
+	memcpy(b->data + b->len, src, len);
+	b->len += len;
+}
+
+static void fs_putint(FitBuffer *b, int32_t val)
+{
+	fs_put(b, &val, sizeof(val));
+}
+
+static void fs_putstr(FitBuffer *b, const char *str)
+{
+	fs_put(b, str, strlen(str) + 1);
+}
+
+/* Extracts data from the buffer, returns 0 if the buffer is too short */
+static int fs_get(FitBuffer *b, void *dst, size_t len)
+{
+	if (len > b->len - b->pos) {
+		return 0;
+	}
+	memcpy(dst, b->data + b->pos, len);
+	b->pos += len;
+	return 1;
+}
+
+static int fs_getint(FitBuffer *b, int32_t *val)
+{
+	return fs_get(b, val, sizeof(*val));
+}
+
+/* Returns pointer to zero-terminated string inside the buffer (or NULL) */
+static const char *fs_getstr(FitBuffer *b)
+{
+	const char *str = b->data + b->pos, *end = memchr(str, '\0', b->len - b->pos);
+	if (end == NULL) {
+		return NULL;
+	}
+	b->pos += (size_t) (end - str) + 1;
+	return str;
+}
+
+/* Frees the script with all its states (they must not be used) */
+static void fs_script_free(FitScript *s)
+{
+	for (int i = 0; i < s->nidle; i++) {
+		LuaFunc_Close(s->idle[i]);
+		free(s->idle[i]);
+	}
+	free(s->idle);
+	if (s->master.LuaState != NULL) {
+		LuaFunc_Close(&s->master);
+	}
+	free(s);
+}
+
+/* Returns state to the pool (ok = 0 if it may be broken by error) */
+static void fs_release(FitServer *srv, FitScript *s, LuaFunc *F, int ok)
+{
+	pthread_mutex_lock(&srv->lock);
+	s->nbusy--;
+	if (ok && F != NULL && !s->retired) {
+		LuaFunc **idle = (LuaFunc **) realloc(s->idle, (s->nidle + 1) * sizeof(LuaFunc *));
+		if (idle != NULL) {
+			s->idle = idle;
+			s->idle[s->nidle++] = F;
+			F = NULL;
+		}
+	}
+	if (F != NULL) {
+		if (F->LuaState != NULL) {
+			LuaFunc_Close(F);
+		}
+		free(F);
+	}
+	if (s->retired && s->nbusy == 0) {
+		fs_script_free(s);
+	}
+	pthread_mutex_unlock(&srv->lock);
+}
+
+/* Returns 1 if the file is not changed since the script was loaded */
+static int fs_samefile(const FitScript *s, const struct stat *st)
+{
+	return s->st.st_dev == st->st_dev && s->st.st_ino == st->st_ino &&
+		s->st.st_size == st->st_size && s->st.st_mtim.tv_sec == st->st_mtim.tv_sec &&
+		s->st.st_mtim.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/*
+ * Takes warm state for the script from the pool (the script is loaded
+ * or reloaded if necessary). Returns NULL in the case of error (message
+ * is copied to errmsg).
+ */
+static LuaFunc *fs_acquire(FitServer *srv, const char *path, FitScript **sptr, char *errmsg)
+{
+	struct stat st;
+	if (stat(path, &st) != 0 || strlen(path) >= LUAFUNC_BUFSIZE) {
+		snprintf(errmsg, LUAFUNC_BUFSIZE, "Cannot open script %s", path);
+		return NULL;
+	}
+	pthread_mutex_lock(&srv->lock);
+	FitScript **link, *s;
+	while (1) {
+		link = &srv->scripts;
+		while ((s = *link) != NULL && strcmp(s->path, path)) {
+			link = &s->next;
+		}
+		if (s == NULL || !s->loading) {
+			break;
+		}
+		pthread_cond_wait(&srv->loaded, &srv->lock); /* Other worker loads it */
+	}
+	if (s != NULL && !fs_samefile(s, &st)) {
+		/* Script is changed: retire the old version */
+		*link = s->next;
+		s->retired = 1;
+		if (s->nbusy == 0) {
+			fs_script_free(s);
+		}
+		s = NULL;
+	}
+	if (s == NULL) {
+		/* Load the script: the slot is published at once, so other jobs
+		   for it wait, and the lock is released during loading */
+		s = (FitScript *) calloc(1, sizeof(FitScript));
+		if (s == NULL) {
+			pthread_mutex_unlock(&srv->lock);
+			snprintf(errmsg, LUAFUNC_BUFSIZE, "Not enough memory");
+			return NULL;
+		}
+		strcpy(s->path, path);
+		s->st = st;
+		s->loading = 1;
+		s->next = srv->scripts;
+		srv->scripts = s;
+		pthread_mutex_unlock(&srv->lock);
+		int loaded = LuaFunc_Init(&s->master, path);
+		pthread_mutex_lock(&srv->lock);
+		s->loading = 0;
+		pthread_cond_broadcast(&srv->loaded);
+		if (!loaded) {
+			for (link = &srv->scripts; *link != s; link = &(*link)->next) {
+			}
+			*link = s->next;
+			pthread_mutex_unlock(&srv->lock);
+			snprintf(errmsg, LUAFUNC_BUFSIZE, "%s", LuaFunc_GetErrMsg(&s->master));
+			if (s->master.LuaState != NULL) {
+				LuaFunc_Close(&s->master);
+			}
+			free(s);
+			return NULL;
+		}
+	}
+	s->nbusy++;
+	LuaFunc *F = (s->nidle > 0) ? s->idle[--s->nidle] : NULL;
+	pthread_mutex_unlock(&srv->lock);
+	*sptr = s;
+	if (F != NULL) {
+		return F;
+	}
+	/* New state: the master is not modified by cloning */
+	F = (LuaFunc *) calloc(1, sizeof(LuaFunc));
+	if (F == NULL || LuaFunc_Clone(F, &s->master) == 0) {
+		snprintf(errmsg, LUAFUNC_BUFSIZE, "%s", (F != NULL) ? LuaFunc_GetErrMsg(F) : "Not enough memory");
+		fs_release(srv, s, F, 0);
+		return NULL;
+	}
+	return F;
+}
+
+/* Processes one job: parses request and builds response */
+static void fs_job(FitServer *srv, FitBuffer *req, FitBuffer *res)
+{
+	char errmsg[LUAFUNC_BUFSIZE];
+	int32_t m, itmax, ndata;
+	const char *path = fs_getstr(req);
+	if (path == NULL || !fs_getint(req, &m) || !fs_getint(req, &itmax) ||
+		!fs_getint(req, &ndata) || m < 0 || ndata < 0 ||
+		(size_t) m > req->len / sizeof(double) || (size_t) ndata > req->len) {
+		fs_putint(res, 1);
+		fs_putstr(res, "Invalid request");
+		return;
+	}
+	/* Arrays are copied because doubles in the message are not aligned */
+	double *p = (double *) calloc(m > 0 ? m : 1, sizeof(double));
+	double **data = (double **) calloc(ndata > 0 ? ndata : 1, sizeof(double *));
+	const char **names = (const char **) calloc(ndata > 0 ? ndata : 1, sizeof(char *));
+	int32_t *lens = (int32_t *) calloc(ndata > 0 ? ndata : 1, sizeof(int32_t));
+	int nomem = (p == NULL || data == NULL || names == NULL || lens == NULL), nread = 0;
+	int valid = !nomem && fs_get(req, p, m * sizeof(double));
+	for (; valid && nread < ndata; nread++) {
+		valid = (names[nread] = fs_getstr(req)) != NULL && fs_getint(req, &lens[nread]) &&
+			lens[nread] >= 0 && (size_t) lens[nread] <= (req->len - req->pos) / sizeof(double);
+		if (valid) {
+			data[nread] = (double *) malloc((lens[nread] > 0 ? lens[nread] : 1) * sizeof(double));
+			valid = data[nread] != NULL && fs_get(req, data[nread], lens[nread] * sizeof(double));
+		}
+	}
+	FitScript *s = NULL;
+	LuaFunc *F = NULL;
+	int ok = 0;
+	if (nomem) {
+		snprintf(errmsg, LUAFUNC_BUFSIZE, "Not enough memory");
+	} else if (!valid) {
+		snprintf(errmsg, LUAFUNC_BUFSIZE, "Invalid request");
+	} else if ((F = fs_acquire(srv, path, &s, errmsg)) != NULL) {
+		/* Run the fit */
+		int nparams = LuaFunc_GetNParams(F), n = -1, nset = 0, clean = 1;
+		double info[LUAFUNC_LM_INFO_SZ], *covar = NULL;
+		/* The state is reused by the next jobs: the script may keep
+		   references to the arrays, so they are owned by the state */
+		for (; nset < ndata; nset++) {
+			if (!LuaFunc_SetDataCopy(F, names[nset], data[nset], lens[nset])) {
+				break;
+			}
+		}
+		if (m == 0 && nparams > 0) {
+			double *p0 = (double *) realloc(p, nparams * sizeof(double));
+			if (p0 != NULL) {
+				m = nparams;
+				p = p0;
+				memcpy(p, LuaFunc_GetBeta0(F), m * sizeof(double));
+			} else {
+				nomem = 1;
+			}
+		}
+		if (nset < ndata) {
+			snprintf(errmsg, LUAFUNC_BUFSIZE, "%s", LuaFunc_GetErrMsg(F));
+		} else if (nomem) {
+			snprintf(errmsg, LUAFUNC_BUFSIZE, "Not enough memory");
+		} else if (m != nparams || m == 0 || LuaFunc_GetNBatch(F) > 0) {
+			snprintf(errmsg, LUAFUNC_BUFSIZE, "Script requires %d parameters (batch mode is not supported)", nparams);
+		} else if ((covar = (double *) calloc((size_t) m * m, sizeof(double))) == NULL) {
+			snprintf(errmsg, LUAFUNC_BUFSIZE, "Not enough memory");
+		} else if (!LuaFunc_Eval(F, p) || (n = LuaFunc_GetValueLength(F)) == -1 ||
+			LuaFunc_LevMar(F, p, NULL, m, n, itmax > 0 ? itmax : FS_ITMAX, NULL, info, NULL, covar) == -1) {
+			snprintf(errmsg, LUAFUNC_BUFSIZE, "%s", LuaFunc_GetErrMsg(F));
+		} else {
+			ok = 1;
+			fs_putint(res, 0);
+			fs_putint(res, m);
+			fs_putint(res, n);
+			fs_put(res, info, sizeof(info));
+			fs_put(res, p, m * sizeof(double));
+			fs_put(res, covar, (size_t) m * m * sizeof(double));
+		}
+		free(covar);
+		/* Data of the job must not be visible to the next one */
+		for (int k = 0; k < nset; k++) {
+			clean &= LuaFunc_RemoveData(F, names[k]);
+		}
+		fs_release(srv, s, F, ok && clean);
+	}
+	if (!ok) {
+		fs_putint(res, 1);
+		fs_putstr(res, errmsg);
+	}
+	for (int k = 0; k < nread; k++) {
+		free(data[k]);
+	}
+	free(p); free(data); free(names); free(lens);
+}
+
+/* Worker thread: accepts connections and processes their jobs */
+static void *fs_worker(void *arg)
+{
+	FitServer *srv = (FitServer *) arg;
+	while (1) {
+		int fd = accept(srv->fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			perror("accept");
+			return NULL;
+		}
+		FitBuffer req, res;
+		while (fs_recvmsg(fd, &req)) {
+			res.data = NULL;
+			res.len = res.pos = 0;
+			res.nomem = 0;
+			fs_job(srv, &req, &res);
+			if (res.nomem) {
+				/* Incomplete response is replaced by error message */
+				res.len = 0;
+				res.nomem = 0;
+				fs_putint(&res, 1);
+				fs_putstr(&res, "Not enough memory");
+			}
+			int sent = !res.nomem && fs_sendmsg(fd, &res);
+			free(req.data);
+			free(res.data);
+			req.data = NULL;
+			if (!sent) {
+				break;
+			}
+		}
+		free(req.data);
+		close(fd);
+	}
+	return NULL;
+}
+
+/* Opens connection to the server (-1 in the case of error) */
+static int fs_connect(const char *sockpath, int server)
+{
+	struct sockaddr_un addr;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || strlen(sockpath) >= sizeof(addr.sun_path)) {
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, sockpath);
+	if (server) {
+		unlink(sockpath);
+		if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+			close(fd);
+			return -1;
+		}
+	} else if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Server mode */
+static int fs_serve(const char *sockpath, int nthreads)
+{
+	FitServer srv;
+	pthread_t threads[FS_MAXTHREADS];
+	if ((srv.fd = fs_connect(sockpath, 1)) < 0) {
+		perror(sockpath);
+		return 1;
+	}
+	srv.scripts = NULL;
+	pthread_mutex_init(&srv.lock, NULL);
+	pthread_cond_init(&srv.loaded, NULL);
+	fs_sockpath = sockpath;
+	signal(SIGINT, fs_onsignal);
+	signal(SIGTERM, fs_onsignal);
+	signal(SIGPIPE, SIG_IGN);
+	printf("Listening on %s, threads: %d\n", sockpath, nthreads);
+	fflush(stdout);
+	for (int t = 0; t < nthreads; t++) {
+		pthread_create(&threads[t], NULL, fs_worker, &srv);
+	}
+	for (int t = 0; t < nthreads; t++) {
+		pthread_join(threads[t], NULL);
+	}
+	unlink(sockpath);
+	pthread_cond_destroy(&srv.loaded);
+	pthread_mutex_destroy(&srv.lock);
+	return 0;
+}
+
+/* Client mode: sends one job without data arrays and types the result */
+static int fs_fit(const char *sockpath, const char *script, int m, const char *argv[])
+{
+	FitBuffer req = {NULL, 0, 0, 0}, res = {NULL, 0, 0, 0};
+	int fd = fs_connect(sockpath, 0);
+	if (fd < 0) {
+		perror(sockpath);
+		return 1;
+	}
+	fs_putstr(&req, script);
+	fs_putint(&req, m);
+	fs_putint(&req, 0);
+	fs_putint(&req, 0);
+	for (int i = 0; i < m; i++) {
+		double val = atof(argv[i]);
+		fs_put(&req, &val, sizeof(val));
+	}
+	int32_t status = 1, n = 0;
+	if (req.nomem || !fs_sendmsg(fd, &req) || !fs_recvmsg(fd, &res) || !fs_getint(&res, &status)) {
+		printf("Connection error\n");
+	} else if (status != 0) {
+		const char *msg = fs_getstr(&res);
+		printf("Error: %s\n", msg != NULL ? msg : "unknown");
+	} else if (fs_getint(&res, &m) && fs_getint(&res, &n)) {
+		double info[LUAFUNC_LM_INFO_SZ], *p = (double *) calloc(m + (size_t) m * m, sizeof(double));
+		fs_get(&res, info, sizeof(info));
+		fs_get(&res, p, (m + (size_t) m * m) * sizeof(double));
+		printf("Points: %d, iterations: %g, reason for terminating: %g, sum of squares: %g\n",
+			n, info[5], info[6], info[1]);
+		printf("%10s %10s\n", "beta", "s(beta)");
+		for (int i = 0; i < m; i++) {
+			printf("%10g %10g\n", p[i], sqrt(p[m + i*m + i]));
+		}
+		free(p);
+	}
+	close(fd);
+	free(req.data);
+	free(res.data);
+	return status != 0;
+}
+
+/* Program entry point */
+int main(int argc, const char *argv[])
+{
+	if (argc >= 3 && !strcmp(argv[1], "serve")) {
+		int nthreads = (argc > 3) ? atoi(argv[3]) : 4;
+		if (nthreads < 1 || nthreads > FS_MAXTHREADS) {
+			printf("nthreads must be in [1; %d]\n", FS_MAXTHREADS);
+			return 1;
+		}
+		return fs_serve(argv[2], nthreads);
+	}
+	if (argc >= 4 && !strcmp(argv[1], "fit")) {
+		return fs_fit(argv[2], argv[3], argc - 4, argv + 4);
+	}
+	printf("Persistent fitting server for user-defined functions written in Lua.\n");
+	printf("(C) 2016-2017 Alexey Voskov (alvoskov@gmail.com)\n");
+	printf("Usage:\n");
+	printf("  ex_fitserver serve socket [nthreads]\n");
+	printf("  ex_fitserver fit socket func.lua [p1 p2 ...]\n");
+	printf("  socket -- path to Unix domain socket\n");
+	printf("  nthreads -- number of worker threads (default 4), each one serves one connection\n");
+	printf("  p1 p2 ... -- initial approximation (default is taken from initfunc)\n");
+	return 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * ex_lmfit.c An example of usage of built-in Levenberg-Marquardt method
+ * (lmfit.c) with dual numbers library (mlsmat.c and mlslib.lua) for
+ * nonlinear regression. Unlike ex_levmar.c it doesn't require levmar
+ * library and never copies the full Jacobian.
+ *
+ * (C) 2016-2017 Alexey Voskov (alvoskov@gmail.com)
+ * License: MIT (X11) license
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define _USE_MATH_DEFINES
+#include <math.h>
+#include <time.h>
+
+#include "cwrapper.h"
+#include "lmfit.h"
+
+/* Fits all problems of the function in batch mode */
+static int run_batch(LuaFunc *LF)
+{
+	int K = LuaFunc_GetNBatch(LF), m = LuaFunc_GetNActive(LF);
+	int nstop[8] = {0};
+	double *beta = (double *) calloc(K * m, sizeof(double));
+	double *covar = (double *) calloc(K * m * m, sizeof(double));
+	double *info = (double *) calloc(K * LUAFUNC_LM_INFO_SZ, sizeof(double));
+	double opts[LUAFUNC_LM_OPTS_SZ] = {LUAFUNC_LM_INIT_MU, 1e-15, 1e-15, 1e-20};
+	memcpy(beta, LF->beta0, K * m * sizeof(double));
+	clock_t tic = clock();
+	int it = LuaFunc_LevMarBatch(LF, beta, 500, opts, info, covar);
+	clock_t toc = clock();
+	if (it == -1) {
+		printf("Error during optimization: %s\n", LuaFunc_GetErrMsg(LF));
+		return 1;
+	}
+	for (int k = 0; k < K; k++) {
+		nstop[(int) info[k*LUAFUNC_LM_INFO_SZ + 6]]++;
+	}
+	printf("Problems: %d, iterations: %d, function evaluations: %g, time: %g s\n",
+		K, it, info[7], (double) (toc - tic) / CLOCKS_PER_SEC);
+	printf("Reasons for terminating:");
+	for (int i = 1; i < 8; i++) {
+		printf(" %d:%d", i, nstop[i]);
+	}
+	printf("\n");
+	/* Type the result for several problems */
+	for (int k = 0; k < K && k < 5; k++) {
+		printf("Problem %d (%g iterations):\n", k + 1, info[k*LUAFUNC_LM_INFO_SZ + 5]);
+		printf("%10s %10s\n", "beta", "s(beta)");
+		for (int i = 0; i < m; i++) {
+			printf("%10g %10g\n", beta[k*m + i], sqrt(covar[k*m*m + i*m + i]));
+		}
+	}
+	free(beta);
+	free(covar);
+	free(info);
+	return 0;
+}
+
+/* Program entry point */
+int main(int argc, const char *argv[])
+{
+	double *beta, *covar;
+	LuaFunc LF;
+	if (argc != 2 && argc != 3) {
+		printf("Levenberg-Marquardt method for user-defined functions written in Lua.\n");
+		printf("(C) 2016-2017 Alexey Voskov (alvoskov@gmail.com)\n");
+		printf("Usage:\n");
+		printf("  ex_lmfit func.lua [nbroyden]\n");
+		printf("  nbroyden -- maximal number of Broyden updates of the Jacobian (default 0)");
+		return 0;
+	}
+	/* Load user-defined function */
+	const char *filename = argv[1];
+	if (LuaFunc_Init(&LF, filename) == 0) {
+		printf("Error during initialization: %s\n", LuaFunc_GetErrMsg(&LF));
+		return 1;
+	}
+	if (LuaFunc_GetNBatch(&LF) > 0) {
+		int ret = run_batch(&LF);
+		LuaFunc_Close(&LF);
+		return ret;
+	}
+	/* Type initial approximation */
+	printf("Initial approxmiation: ");
+	for (int i = 0; i < LF.nparams; i++) {
+		printf("%10g", LF.beta0[i]);
+	}
+	printf("\n");
+	int m = LF.nparams;
+	beta = (double *) calloc(m, sizeof(double));
+	covar = (double *) calloc(m * m, sizeof(double));
+	/* Try to evaluate it */
+	if (LuaFunc_Eval(&LF, LF.beta0) == 0) {
+		printf("Error during function evaluation: %s\n", LuaFunc_GetErrMsg(&LF));
+		return 1;
+	}
+	int n = LuaFunc_GetValueLength(&LF);
+	if (n == -1) {
+		printf("Error during getting number of points: %s\n", LuaFunc_GetErrMsg(&LF));
+		return 1;		
+	}
+	/* Run optimizer */
+	memcpy(beta, LF.beta0, LF.nparams * sizeof(double));
+	double opts[LUAFUNC_LM_OPTS_SZ] = {LUAFUNC_LM_INIT_MU, 1e-15, 1e-15, 1e-20};
+	int nbroyden = (argc == 3) ? atoi(argv[2]) : 0;
+	double info[LUAFUNC_LM_INFO_SZ];
+	if (LuaFunc_LevMarBroyden(&LF, beta, NULL, m, n, 500, opts, nbroyden, info, NULL, covar) == -1) {
+		printf("Error during optimization: %s\n", LuaFunc_GetErrMsg(&LF));
+	}
+	printf("Iterations: %g, reason for terminating: %g, function evaluations: %g, Jacobian evaluations: %g\n",
+		info[5], info[6], info[7], info[8]);
+	/* Type the result */
+	printf("Result:\n");
+	printf("%10s %10s\n", "beta", "s(beta)");
+	for (int i = 0; i < LF.nparams; i++) {
+		printf("%10g %10g\n", beta[i], sqrt((covar[i*m + i])));
+	}
+	
+	/* Close all structs and exit */
+	LuaFunc_Close(&LF);
+	free(beta);
+	free(covar);
+	return 0;
+}
@@ -0,0 +1,278 @@
+/*
+ * ex_multistart.c Multi-start driver for nonlinear regression with
+ * dual numbers library (mlsmat.c and mlslib.lua) and built-in
+ * Levenberg-Marquardt method (lmfit.c). Many start points are generated
+ * (Latin hypercube or uniform random sampling around initial approximation
+ * or user-defined list) and the fits are run concurrently by a pool of
+ * threads. Each thread has its own Lua state (LuaFunc structure cloned
+ * from the main one, so the script is compiled only once). Fits are
+ * made by chunks of iterations; runs that are dominated by the best result
+ * found so far are cancelled between chunks.
+ *
+ * (C) 2016-2017 Alexey Voskov (alvoskov@gmail.com)
+ * License: MIT (X11) license
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define _USE_MATH_DEFINES
+#include <math.h>
+#include <float.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "cwrapper.h"
+#include "lmfit.h"
+
+#define MS_MAXTHREADS 256 /* Maximal number of threads */
+#define MS_CHUNK 20 /* Number of LM iterations between checks for domination */
+#define MS_MAXCHUNKS 25 /* Maximal number of chunks for one run */
+#define MS_DOMINATED 10.0 /* Run is cancelled if its sse > MS_DOMINATED * best sse */
+
+/* Run status */
+enum {MS_WAITING = 0, MS_CONVERGED, MS_CANCELLED, MS_FAILED};
+
+/* Shared state of the driver */
+typedef struct {
+	const LuaFunc *src; /* User-defined function (source for clones) */
+	int m; /* Number of parameters */
+	int nstarts; /* Number of start points */
+	double *starts; /* Start points (nstarts*m elements), solutions on output */
+	double *sse; /* Sum of squares for each run */
+	int *status; /* Status of each run */
+	int *niter; /* Number of iterations of each run */
+	int next; /* Index of the next start point to process */
+	double best; /* The best sum of squares among finished runs */
+	pthread_mutex_t lock;
+} MultiStart;
+
+/* Simple thread-safe (local) pseudorandom number generator: U[0;1) */
+static double ms_rand(unsigned long long *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return (*state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * Generates start points in the box beta0*(1 +/- scale) (+/- scale for
+ * zero components of beta0) by Latin hypercube (lhs != 0) or uniform
+ * random sampling. The first point is always beta0.
+ */
+static void ms_genstarts(double *starts, const double *beta0, int m, int nstarts,
+	double scale, int lhs)
+{
+	unsigned long long state = 88172645463325252ULL;
+	int *perm = (int *) calloc(nstarts, sizeof(int));
+	for (int j = 0; j < m; j++) {
+		double w = (beta0[j] != 0.0) ? fabs(beta0[j]) * scale : scale;
+		double lo = beta0[j] - w;
+		/* Random permutation of strata (Fisher-Yates) */
+		for (int i = 0; i < nstarts; i++) {
+			perm[i] = i;
+		}
+		for (int i = nstarts - 1; i > 0; i--) {
+			int k = (int) (ms_rand(&state) * (i + 1)), t = perm[i];
+			perm[i] = perm[k]; perm[k] = t;
+		}
+		for (int i = 0; i < nstarts; i++) {
+			double u = lhs ? (perm[i] + ms_rand(&state)) / nstarts : ms_rand(&state);
+			starts[i*m + j] = lo + 2.0 * w * u;
+		}
+	}
+	memcpy(starts, beta0, m * sizeof(double));
+	free(perm);
+}
+
+/*
+ * Reads start points from the text file (m numbers in each line).
+ * Returns number of points or -1 in the case of error.
+ */
+static int ms_readstarts(const char *filename, double **starts, int m)
+{
+	FILE *fp = fopen(filename, "r");
+	int n = 0, cap = 16;
+	double val;
+	if (fp == NULL) {
+		return -1;
+	}
+	*starts = (double *) calloc(cap * m, sizeof(double));
+	while (fscanf(fp, "%lf", &val) == 1) {
+		if (n == cap * m) {
+			cap *= 2;
+			*starts = (double *) realloc(*starts, cap * m * sizeof(double));
+		}
+		(*starts)[n++] = val;
+	}
+	fclose(fp);
+	return (n % m == 0) ? n / m : -1;
+}
+
+/* Worker thread: processes start points until the queue is empty */
+static void *ms_worker(void *arg)
+{
+	MultiStart *ms = (MultiStart *) arg;
+	int m = ms->m;
+	LuaFunc F;
+	if (LuaFunc_Clone(&F, ms->src) == 0) {
+		printf("Error during initialization: %s\n", LuaFunc_GetErrMsg(&F));
+		if (F.LuaState != NULL) {
+			LuaFunc_Close(&F);
+		}
+		return NULL;
+	}
+	double *work = (double *) calloc(LUAFUNC_LM_WORKSZ(m), sizeof(double));
+	while (1) {
+		/* Get the next start point */
+		pthread_mutex_lock(&ms->lock);
+		int i = ms->next++;
+		pthread_mutex_unlock(&ms->lock);
+		if (i >= ms->nstarts) {
+			break;
+		}
+		double *p = ms->starts + i*m;
+		double info[LUAFUNC_LM_INFO_SZ], opts[LUAFUNC_LM_OPTS_SZ] = {LUAFUNC_LM_INIT_MU, 1e-15, 1e-15, 1e-20};
+		int status = MS_FAILED, niter = 0, n;
+		if (!LuaFunc_Eval(&F, p) || (n = LuaFunc_GetValueLength(&F)) == -1) {
+			ms->status[i] = MS_FAILED;
+			continue;
+		}
+		/* Run LM by chunks, damping parameter is kept between chunks */
+		info[1] = NAN; /* Start is failed if the first chunk is failed */
+		for (int c = 0; c < MS_MAXCHUNKS; c++) {
+			if (LuaFunc_LevMar(&F, p, NULL, m, n, MS_CHUNK, opts, info, work, NULL) == -1) {
+				status = MS_FAILED;
+				break;
+			}
+			niter += (int) info[5];
+			status = (info[6] == 3) ? MS_WAITING : MS_CONVERGED;
+			if (status == MS_CONVERGED || !isfinite(info[1])) {
+				break;
+			}
+			opts[0] = info[4];
+			/* Check for domination */
+			pthread_mutex_lock(&ms->lock);
+			int dominated = info[1] > MS_DOMINATED * ms->best;
+			pthread_mutex_unlock(&ms->lock);
+			if (dominated) {
+				status = MS_CANCELLED;
+				break;
+			}
+		}
+		if (!isfinite(info[1])) {
+			status = MS_FAILED;
+		}
+		pthread_mutex_lock(&ms->lock);
+		ms->sse[i] = info[1];
+		ms->niter[i] = niter;
+		ms->status[i] = status;
+		if (status == MS_CONVERGED && info[1] < ms->best) {
+			ms->best = info[1];
+		}
+		pthread_mutex_unlock(&ms->lock);
+	}
+	free(work);
+	LuaFunc_Close(&F);
+	return NULL;
+}
+
+/* Program entry point */
+int main(int argc, const char *argv[])
+{
+	MultiStart ms;
+	LuaFunc LF;
+	pthread_t threads[MS_MAXTHREADS];
+	if (argc < 2 || argc > 6) {
+		printf("Multi-start Levenberg-Marquardt method for user-defined functions written in Lua.\n");
+		printf("(C) 2016-2017 Alexey Voskov (alvoskov@gmail.com)\n");
+		printf("Usage:\n");
+		printf("  ex_multistart func.lua [nstarts] [nthreads] [method] [scale]\n");
+		printf("  nstarts -- number of start points (default 64)\n");
+		printf("  nthreads -- number of threads (default 4)\n");
+		printf("  method -- lhs (Latin hypercube, default), rand (uniform random)\n");
+		printf("    or name of text file with start points (one point per line)\n");
+		printf("  scale -- relative half-width of the box around initial approximation (default 1)\n");
+		return 0;
+	}
+	int nstarts = (argc > 2) ? atoi(argv[2]) : 64;
+	int nthreads = (argc > 3) ? atoi(argv[3]) : 4;
+	const char *method = (argc > 4) ? argv[4] : "lhs";
+	double scale = (argc > 5) ? atof(argv[5]) : 1.0;
+	if (nthreads < 1 || nthreads > MS_MAXTHREADS) {
+		printf("nthreads must be in [1; %d]\n", MS_MAXTHREADS);
+		return 1;
+	}
+	/* Load user-defined function (it is used for start points and covariance) */
+	if (LuaFunc_Init(&LF, argv[1]) == 0) {
+		printf("Error during initialization: %s\n", LuaFunc_GetErrMsg(&LF));
+		return 1;
+	}
+	int m = LuaFunc_GetNParams(&LF);
+	/* Generate start points */
+	if (!strcmp(method, "lhs") || !strcmp(method, "rand")) {
+		if (nstarts < 1) {
+			printf("nstarts must be positive\n");
+			return 1;
+		}
+		ms.starts = (double *) calloc(nstarts * m, sizeof(double));
+		ms_genstarts(ms.starts, LuaFunc_GetBeta0(&LF), m, nstarts, scale, !strcmp(method, "lhs"));
+	} else if ((nstarts = ms_readstarts(method, &ms.starts, m)) <= 0) {
+		printf("Cannot read start points from %s (%d numbers per line expected)\n", method, m);
+		return 1;
+	}
+	ms.src = &LF;
+	ms.m = m;
+	ms.nstarts = nstarts;
+	ms.sse = (double *) calloc(nstarts, sizeof(double));
+	ms.status = (int *) calloc(nstarts, sizeof(int));
+	ms.niter = (int *) calloc(nstarts, sizeof(int));
+	ms.next = 0;
+	ms.best = DBL_MAX;
+	pthread_mutex_init(&ms.lock, NULL);
+	/* Run the thread pool */
+	printf("Start points: %d, threads: %d\n", nstarts, nthreads);
+	time_t tic = time(NULL);
+	for (int t = 0; t < nthreads; t++) {
+		pthread_create(&threads[t], NULL, ms_worker, &ms);
+	}
+	for (int t = 0; t < nthreads; t++) {
+		pthread_join(threads[t], NULL);
+	}
+	time_t toc = time(NULL);
+	pthread_mutex_destroy(&ms.lock);
+	/* Statistics and the best fit */
+	int nstat[4] = {0, 0, 0, 0}, ibest = -1;
+	for (int i = 0; i < nstarts; i++) {
+		nstat[ms.status[i]]++;
+		if (ms.status[i] == MS_CONVERGED && (ibest == -1 || ms.sse[i] < ms.sse[ibest])) {
+			ibest = i;
+		}
+	}
+	printf("Converged: %d, unfinished: %d, cancelled: %d, failed: %d, time: %g s\n",
+		nstat[MS_CONVERGED], nstat[MS_WAITING], nstat[MS_CANCELLED], nstat[MS_FAILED],
+		difftime(toc, tic));
+	if (ibest == -1) {
+		printf("No converged runs\n");
+		return 1;
+	}
+	/* Covariance matrix for the best fit */
+	double *beta = ms.starts + ibest*m, info[LUAFUNC_LM_INFO_SZ];
+	double *covar = (double *) calloc(m * m, sizeof(double));
+	if (!LuaFunc_Eval(&LF, beta) || LuaFunc_LevMar(&LF, beta, NULL, m,
+		LuaFunc_GetValueLength(&LF), 0, NULL, info, NULL, covar) == -1) {
+		printf("Error during covariance estimation: %s\n", LuaFunc_GetErrMsg(&LF));
+	}
+	printf("Best fit: start point %d, sum of squares %g, iterations %d\n",
+		ibest + 1, ms.sse[ibest], ms.niter[ibest]);
+	printf("%10s %10s\n", "beta", "s(beta)");
+	for (int i = 0; i < m; i++) {
+		printf("%10g %10g\n", beta[i], sqrt(covar[i*m + i]));
+	}
+	/* Close all structs and exit */
+	LuaFunc_Close(&LF);
+	free(ms.starts); free(ms.sse); free(ms.status); free(ms.niter);
+	free(covar);
+	return 0;
+}
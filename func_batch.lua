@@ -0,0 +1,36 @@
+--
+-- func_batch.lua  An example of input file for ex_lmfit.exe in batch mode:
+-- many independent curves are fitted by the same model simultaneously
+-- (one evaluation of resfunc per iteration for all curves). Curves are
+-- generated from the model of func.lua with different parameters and
+-- a small deterministic noise.
+--
+-- (C) 2016-2017 Alexey Voskov (alvoskov@gmail.com)
+-- License: MIT (X11) license
+
+local X, Y = nil, nil -- Concatenated data sets for curve fitting
+local K, N = 500, 12 -- Number of curves and number of points in each curve
+return {
+	-- Initialization function: returns initial approximations for all
+	-- curves (3 parameters per curve) and numbers of points in curves
+	initfunc = function(env)
+		local x, y, beta0, sizes = {}, {}, {}, {}
+		for k = 1, K do
+			local b1, b2, b3 = 0.1 + 0.001*k, 2 + math.sin(k), 0.5 + 0.5*math.cos(k)^2
+			for i = 1, N do
+				local xi = 5 * (i - 1) / (N - 1)
+				x[#x + 1] = xi
+				y[#y + 1] = b1 + b2*math.exp(-b3*xi) + 0.02*math.sin(7*i + k)
+			end
+			beta0[3*k - 2], beta0[3*k - 1], beta0[3*k] = 0.2, 2, 0.5
+			sizes[k] = N
+		end
+		X, Y = env.Vec(x), env.Vec(y)
+		return env.Vec(beta0), env.Vec(sizes)
+	end,
+	-- Residuals calculation function: b[j] contains j-th parameters
+	-- of all curves expanded to their points
+	resfunc = function(b)
+		return b[1] + b[2]*(-b[3]*X):exp() - Y -- Residuals
+	end
+}
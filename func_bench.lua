@@ -0,0 +1,79 @@
+--
+-- func_bench.lua  Models for benchmark (bench.c): heat capacity (sum of
+-- Einstein functions as in func_cpfit.lua) with automatic and analytical
+-- derivatives and models from funcs.lua. Data and settings are passed
+-- by the host through env.data (see LuaFunc_SetData):
+--   X, Y -- data set
+--   options -- {model, nparams}, model is an index in the models table
+--   beta0 -- initial approximation
+--
+-- (C) 2016-2017 Alexey Voskov (alvoskov@gmail.com)
+-- License: MIT (X11) license
+
+local env, X, Y, model = nil, nil, nil, nil
+local CONST_R = 8.3144598 -- Universal gas constant
+local unpack = table.unpack or unpack -- Lua 5.3 or LuaJIT
+
+-- Heat capacity with automatic differentiation (see resAutoDiff in func_cpfit.lua);
+-- derivatives are not checked for NaN because synthetic data starts at 5 K
+local function cpAutoDiff(b)
+	local nterms = math.floor(#(b.real) / 2)
+	local Cp = 0
+	for i = 1, nterms do
+		local alpha, theta = b[i], b[nterms + i]
+		local x = theta / X
+		local exm = (-x):exp()
+		local Cpterm = 3*alpha*exm*x^2 / (1 - exm) ^ 2
+		Cp = Cp + Cpterm
+	end
+	return Cp * CONST_R - Y
+end
+
+-- Heat capacity with analytical derivatives (see resAnalytDiff in func_cpfit.lua)
+local function cpAnalytDiff(bDual)
+	local b = bDual.real
+	local nparams = #b
+	local nterms = math.floor(nparams / 2)
+	local Cp = 0
+	for i = 1, nterms do
+		local alpha, theta = b[i], b[nterms + i]
+		local x = theta / X
+		local exm = (-x):exp()
+		local q = exm / (1 - exm) ^ 2
+		local Cpterm_imag = {}
+		for j = 1, nparams do
+			Cpterm_imag[j] = env.Vec(#X)
+		end
+		Cpterm_imag[i] = 3*q*x^2
+		Cpterm_imag[nterms + i] = 3*alpha*q*x / X * ((2 + x) - 2*x / (1 - exm))
+		Cp = Cp + env.DualNVector.new(3*alpha*q*x^2, unpack(Cpterm_imag))
+	end
+	return Cp * CONST_R - Y
+end
+
+-- Models from funcs.lua (data sets 0-3)
+local models = {
+	cpAutoDiff,
+	cpAnalytDiff,
+	function(b) return b[1] + b[2]*(-b[3]*X):exp() - Y end,
+	function(b) return b[1]*(1 - (-(-b[2]-b[3]*X):exp()):exp()) - Y end,
+	function(b) return 1 / (1 + (-b[1] - b[2]*X):exp()) - Y end,
+	function(b)
+		local X2 = env.invariant(function() return X^2 end)
+		return 1 / (b[1] + b[2]*X + b[3]*X2) - Y
+	end
+}
+
+return {
+	initfunc = function(newEnv)
+		env = newEnv
+		local options = env.data.options
+		X, Y, model = env.data.X, env.data.Y, models[options[1]]
+		if model == nil or #(env.data.beta0) ~= options[2] then
+			error('Invalid benchmark options')
+		end
+		return env.data.beta0
+	end,
+
+	resfunc = function(b) return model(b) end
+}
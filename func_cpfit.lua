@@ -9,37 +9,45 @@
 
 local env, Texp, Cpexp = nil, nil, nil -- Data set for curve fitting
 local CONST_R = 8.3144598 -- Universal gas constant
+local unpack = table.unpack or unpack -- Lua 5.3 or LuaJIT
 
 
 local function TypeDerivatives(dn)
-for i = 1, #(dn.real) do
+	local imag = {} -- Views for fast access to elements (see env.view)
 	for j = 1, #(dn.imag) do
-		io.write(string.format("%10.4g ", dn.imag[j][i]))
+		imag[j] = env.view(dn.imag[j])
+	end
+	for i = 1, #(dn.real) do
+		for j = 1, #imag do
+			io.write(string.format("%10.4g ", imag[j][i]))
+		end
+		io.write("\n");
 	end
-	io.write("\n");
-end
 end
 
 -- This function uses automatic differentiation (dual numbers)
 -- Note that there are some issues with rounding errors and the
 -- not evident workaround (see processing of NaNs in the function)
 local function resAutoDiff(b)
-	local nparams = #b
+	local nparams = #(b.real)
+	local nterms = math.floor(nparams / 2)
 	local Cp = 0
 	print(b.real)
- 	for i = 1, nparams // 2 do
-		local alpha, theta = b[i], b[nparams // 2 + i]
+ 	for i = 1, nterms do
+		local alpha, theta = b[i], b[nterms + i]
 		local x = theta / Texp
-		local ex = x:exp()
-		local Cpterm = 3*alpha*ex*x^2 / (ex - 1) ^ 2
-		local ii = x:gt(300)
-		Cpterm[ii] = 3*alpha*x[ii]^2 / ex[ii]
+		-- exp(-x) doesn't overflow at low T (x --> Inf)
+		local exm = (-x):exp()
+		local Cpterm = 3*alpha*exm*x^2 / (1 - exm) ^ 2
 		-- Prevents situations like "0*Inf gives NaN"
-		-- (the occur at low T due to e(x)-->Inf)
+		-- (they occur if theta --> 0)
 		-- NOTE: Removing this code will break the optimization!
-		for i = 1, #(Cpterm.imag) do
-			local jj = Cpterm.imag[i]:isnan()
-			Cpterm.imag[i][jj] = 0
+		-- The loop over elements is compiled by LuaJIT
+		for k = 1, #(Cpterm.imag) do
+			local dk = env.view(Cpterm.imag[k])
+			for j = 1, #(Cpterm.imag[k]) do -- Views are not checked for bounds
+				if dk[j] ~= dk[j] then dk[j] = 0 end
+			end
 		end
 		-- Add term to the sum
 		Cp = Cp + Cpterm
@@ -51,19 +59,18 @@ end
 -- This function uses analytical differentiation (i.e. derivatives
 -- that are written in explicit form inside the code)
 local function resAnalytDiff(bDual)
-	local nparams = #bDual
 	local Cp = 0 -- Heat capacity (sum of terms)
 	local b = bDual.real -- No dual numbers are required for analytical derivatives
- 	for i = 1, nparams // 2 do
-		-- Prepare intermediate part
-		local alpha, theta = b[i], b[nparams // 2 + i]
+	local nparams = #b
+	local nterms = math.floor(nparams / 2)
+ 	for i = 1, nterms do
+		-- Prepare intermediate part: q = exp(x) / (exp(x) - 1)^2
+		local alpha, theta = b[i], b[nterms + i]
 		local x = theta / Texp
-		local ex = x:exp()
-		local Cpterm_real, ii = env.Vec(#Texp), x:gt(300)
-		local x_ii, ex_ii, x_nii, ex_nii = x[ii], ex[ii], x[~ii], ex[~ii]
+		local exm = (-x):exp()
+		local q = exm / (1 - exm) ^ 2
 		-- Calculate function value
-		Cpterm_real[~ii] = 3*alpha*ex_nii*x_nii^2 / (ex_nii - 1) ^ 2
-		Cpterm_real[ii] = 3*alpha*x_ii^2 / ex_ii
+		local Cpterm_real = 3*alpha*q*x^2
 		-- Initialize arrays for derivatives
 		local Cpterm_imag = {}
 		for j = 1, nparams do
@@ -71,16 +78,11 @@ local function resAnalytDiff(bDual)
 		end
 		-- Calculate derivatives
 		-- a) alpha
-		Cpterm_imag[i][~ii] = 3*ex_nii*x_nii^2 / (ex_nii - 1) ^ 2
-		Cpterm_imag[i][ii] = 3*x_ii^2 / ex_ii
+		Cpterm_imag[i] = 3*q*x^2
 		-- b) theta
-		Cpterm_imag[i + nparams // 2][~ii] =
-			3*alpha / (Texp[~ii] * (ex_nii - 1) ^ 2) * x_nii * ex_nii * ( 
-			(2 + x_nii) - 2*x_nii*ex_nii / (ex_nii - 1) )
-		Cpterm_imag[i + nparams // 2][ii] =
-			3*alpha*x_ii / (Texp[ii] * ex_ii) * (2 - x_ii)
+		Cpterm_imag[nterms + i] = 3*alpha*q*x / Texp * ((2 + x) - 2*x / (1 - exm))
 		-- Create dual number used calculated derivatives
-		local Cpterm = env.DualNVector.new(Cpterm_real, table.unpack(Cpterm_imag))
+		local Cpterm = env.DualNVector.new(Cpterm_real, unpack(Cpterm_imag))
 		-- Add term
 		Cp = Cp + Cpterm
 	end
@@ -90,19 +92,15 @@ end
 
 -- Heat capacity function without any derivatives
 local function Cpfunc(b)
-	local nparams = #b
+	local nterms = math.floor(#b / 2)
 	local Cp = 0 -- Heat capacity (sum of terms)
- 	for i = 1, nparams // 2 do
+ 	for i = 1, nterms do
 		-- Prepare intermediate part
-		local alpha, theta = b[i], b[nparams // 2 + i]
+		local alpha, theta = b[i], b[nterms + i]
 		local x = theta / Texp
-		local ex = x:exp()
-		local Cpterm, ii = env.Vec(#Texp), x:gt(300)
-		-- Calculate function value
-		Cpterm[~ii] = 3*alpha*ex[~ii]*x[~ii] / (ex[~ii] - 1) ^ 2
-		Cpterm[ii] = 3*alpha*x[ii]^2 / ex[ii]
-		-- Add term
-		Cp = Cp + Cpterm		
+		local exm = (-x):exp()
+		-- Calculate function value and add term
+		Cp = Cp + 3*alpha*exm*x / (1 - exm) ^ 2
 	end
 	Cp = Cp * CONST_R
 	return Cp - Cpexp
@@ -113,14 +111,11 @@ end
 return {
 	-- Initialization function
 	initfunc = function(newEnv)
-		local Xary, Yary = {}, {}
 		env = newEnv
-		for line in io.lines('ScF3.dat') do
-			local T, Cp = line:match("([^%s]+)%s([^%s]+)")
-			Xary[#Xary + 1] = tonumber(T)
-			Yary[#Yary + 1] = tonumber(Cp)
-		end
-		Texp, Cpexp = env.Vec(Xary), env.Vec(Yary)
+		-- Data set is loaded once and shared by LuaFunc clones
+		Texp, Cpexp = env.dataset('ScF3', function()
+			return env.RealVector.loadtxt('ScF3.dat', {columns = {1, 2}})
+		end)
 --
 --		for i = 1, #Texp do print(Texp[i], ',', Cpexp[i], ',') end
 		return env.Vec{0.1, 0.1, 1.0, 1.0} -- Init.approx: {alphav, thetav};
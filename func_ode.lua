@@ -0,0 +1,30 @@
+--
+-- func_ode.lua  An example of input file for ex_levmar.exe and ex_lmfit.exe:
+-- the model is defined by ordinary differential equation that is solved
+-- by built-in ode45 function (derivatives by parameters are integrated
+-- together with the solution). The data set and the model are the same
+-- as in func.lua: dy/dt = -b3*(y - b1), y(0) = b1 + b2, so the results
+-- must coincide. Repeated measurements are fitted as two lanes (independent
+-- initial value problems solved simultaneously).
+--
+-- (C) 2016-2017 Alexey Voskov (alvoskov@gmail.com)
+-- License: MIT (X11) license
+
+local T, Y, ones, ode45 = nil, nil, nil, nil -- Data set for curve fitting
+return {
+	-- Initialization function
+	initfunc = function(env)
+		-- Values for lane 1 and lane 2 at times T
+		Y = env.Vec{2.86, 1.57, 0.45, 0.65, 0.15, 0.04,
+		            2.64, 1.24, 1.02, 0.18, 0.01, 0.36}
+		T = env.Vec{0.0,  1.0,  2.0,  3.0,  4.0,  5.0}
+		ones, ode45 = env.Vec{1, 1}, env.ode45
+		return env.Vec{0.2, 0.21, 0.22} -- Initial approximation
+	end,
+	-- Residuals calculation function
+	resfunc = function(b)
+		local y = ode45(function(t, y) return {-b[3] * (y[1] - b[1])} end,
+			T, {(b[1] + b[2]) * ones}, {rtol = 1e-10, atol = 1e-12})
+		return y[1] - Y -- Residuals
+	end
+}
@@ -68,8 +68,10 @@ elseif dataSet == 3 then
 		return env.Vec{2, -2, 2} -- Initial approximation
 	end
 	-- Residuals calculation function (not that b is DualNVector, i.e. dual number vector)
+	-- X^2 doesn't depend on parameters: it is computed only once (see env.invariant)
 	function m.resfunc(b)
-		local F = 1 / (b[1] + b[2]*X + b[3]*X^2) - Y -- Residuals
+		local X2 = env.invariant(function() return X^2 end)
+		local F = 1 / (b[1] + b[2]*X + b[3]*X2) - Y -- Residuals
 		return F
 	end
 	-- Results:
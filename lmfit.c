@@ -0,0 +1,774 @@
+/*
+ * lmfit.c  Levenberg-Marquardt method for Lua functions with automatic
+ * differentiation. It is a replacement for dlevmar_der function from
+ * levmar library that is adapted for DualNVector results:
+ *   - J^T J, J^T e and e^T e are accumulated block by block directly from
+ *     the imaginary parts of the result, i.e. the full n x m Jacobian is
+ *     never copied and the solver requires only O(m^2) of memory;
+ *   - the function value and its derivatives are calculated by the same
+ *     call of LuaFunc_Eval, so the derivatives in the accepted point are
+ *     never recalculated.
+ * The algorithm itself (damping parameter update, stopping criteria,
+ * info output) follows levmar 2.6 by M. Lourakis.
+ *
+ * (C) 2016-2017 Alexey Voskov (alvoskov@gmail.com)
+ * License: MIT (X11) license
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#define _USE_MATH_DEFINES
+#include <math.h>
+
+#include "cwrapper.h"
+#include "lmfit.h"
+
+#define LM_BLOCK 256 /* Number of rows processed at once (must fit L1 cache) */
+/* i-th active parameter in p and pdp vectors */
+#define PA(i) p[(act != NULL) ? act[i] : (i)]
+#define PDPA(i) pdp[(act != NULL) ? act[i] : (i)]
+
+/*
+ * Accumulates normal equations for the latest result of LuaFunc_Eval:
+ *   JtJ = J^T J, Jte = J^T e, sse = e^T e
+ * where e = x - hx (or e = -hx if x is NULL). If x is NULL the blocked
+ * kernel from LuaFunc_GetNormalEquations is used. Otherwise the Jacobian
+ * columns are read block by block (LM_BLOCK rows) to keep them in the cache.
+ *
+ * Returns 1 in the case of success or 0 in the case of error
+ */
+static int lm_normaleq(LuaFunc *F, const double *x, int n, int m,
+	const double **cols, double *JtJ, double *Jte, double *sse)
+{
+	const double *hx;
+	double e[LM_BLOCK];
+	if (x == NULL) {
+		if (!LuaFunc_GetNormalEquations(F, JtJ, Jte, sse)) {
+			return 0;
+		}
+		for (int j = 0; j < m; j++) {
+			Jte[j] = -Jte[j];
+		}
+		return 1;
+	}
+	if (!LuaFunc_GetValuePtr(F, &hx, cols)) {
+		return 0;
+	}
+	memset(JtJ, 0, m * m * sizeof(double));
+	memset(Jte, 0, m * sizeof(double));
+	*sse = 0.0;
+	for (int i0 = 0; i0 < n; i0 += LM_BLOCK) {
+		int len = (n - i0 < LM_BLOCK) ? (n - i0) : LM_BLOCK;
+		/* a) residuals */
+		for (int i = 0; i < len; i++) {
+			e[i] = x[i0 + i] - hx[i0 + i];
+			*sse += e[i] * e[i];
+		}
+		/* b) lower triangle of J^T J and J^T e */
+		for (int j = 0; j < m; j++) {
+			const double *cj = cols[j] + i0;
+			double s = 0.0;
+			for (int i = 0; i < len; i++) {
+				s += cj[i] * e[i];
+			}
+			Jte[j] += s;
+			for (int k = 0; k <= j; k++) {
+				const double *ck = cols[k] + i0;
+				s = 0.0;
+				for (int i = 0; i < len; i++) {
+					s += cj[i] * ck[i];
+				}
+				JtJ[j*m + k] += s;
+			}
+		}
+	}
+	/* Upper triangle */
+	for (int j = 0; j < m; j++) {
+		for (int k = j + 1; k < m; k++) {
+			JtJ[j*m + k] = JtJ[k*m + j];
+		}
+	}
+	return 1;
+}
+
+/*
+ * Solves A*x = b system by means of Cholesky decomposition. A must be
+ * symmetric; it is overwritten by the lower triangular factor.
+ *
+ * Returns 1 in the case of success or 0 if A is not positive definite
+ */
+static int lm_cholsolve(double *A, int m, const double *b, double *x)
+{
+	/* A = L*L^T */
+	for (int j = 0; j < m; j++) {
+		double d = A[j*m + j];
+		for (int k = 0; k < j; k++) {
+			d -= A[j*m + k] * A[j*m + k];
+		}
+		if (!(d > 0.0)) {
+			return 0;
+		}
+		d = sqrt(d);
+		A[j*m + j] = d;
+		for (int i = j + 1; i < m; i++) {
+			double s = A[i*m + j];
+			for (int k = 0; k < j; k++) {
+				s -= A[i*m + k] * A[j*m + k];
+			}
+			A[i*m + j] = s / d;
+		}
+	}
+	/* L*y = b */
+	for (int i = 0; i < m; i++) {
+		double s = b[i];
+		for (int k = 0; k < i; k++) {
+			s -= A[i*m + k] * x[k];
+		}
+		x[i] = s / A[i*m + i];
+	}
+	/* L^T*x = y */
+	for (int i = m - 1; i >= 0; i--) {
+		double s = x[i];
+		for (int k = i + 1; k < m; k++) {
+			s -= A[k*m + i] * x[k];
+		}
+		x[i] = s / A[i*m + i];
+	}
+	return 1;
+}
+
+/*
+ * Calculates covariance matrix covar = (J^T J)^-1 * sse / (n - rank).
+ * Directions with (almost) zero pivots of Cholesky decomposition are
+ * excluded, i.e. the corresponding rows and columns of covar are zeros.
+ * A and y are buffers for m*m and m elements respectively.
+ *
+ * Returns rank of J^T J
+ */
+static int lm_covar(const double *JtJ, int m, double sse, int n,
+	double *covar, double *A, double *y)
+{
+	int rank = 0;
+	double maxdiag = 0.0;
+	memcpy(A, JtJ, m * m * sizeof(double));
+	for (int j = 0; j < m; j++) {
+		if (JtJ[j*m + j] > maxdiag) maxdiag = JtJ[j*m + j];
+	}
+	/* Cholesky decomposition that skips singular directions */
+	for (int j = 0; j < m; j++) {
+		double d = A[j*m + j];
+		for (int k = 0; k < j; k++) {
+			d -= A[j*m + k] * A[j*m + k];
+		}
+		if (d <= m * DBL_EPSILON * maxdiag) {
+			for (int i = j; i < m; i++) A[i*m + j] = 0.0;
+			continue;
+		}
+		rank++;
+		d = sqrt(d);
+		A[j*m + j] = d;
+		for (int i = j + 1; i < m; i++) {
+			double s = A[i*m + j];
+			for (int k = 0; k < j; k++) {
+				s -= A[i*m + k] * A[j*m + k];
+			}
+			A[i*m + j] = s / d;
+		}
+	}
+	/* Invert column by column: covar = L^-T L^-1 */
+	double scale = (n > rank) ? sse / (n - rank) : 0.0;
+	for (int c = 0; c < m; c++) {
+		for (int i = 0; i < m; i++) {
+			double s = (i == c) ? 1.0 : 0.0;
+			for (int k = 0; k < i; k++) {
+				s -= A[i*m + k] * y[k];
+			}
+			y[i] = (A[i*m + i] != 0.0) ? s / A[i*m + i] : 0.0;
+		}
+		for (int i = m - 1; i >= 0; i--) {
+			double s = y[i];
+			for (int k = i + 1; k < m; k++) {
+				s -= A[k*m + i] * y[k];
+			}
+			y[i] = (A[i*m + i] != 0.0) ? s / A[i*m + i] : 0.0;
+		}
+		for (int i = 0; i < m; i++) {
+			covar[i*m + c] = y[i] * scale;
+		}
+	}
+	return rank;
+}
+
+/*
+ * Calculates function value and Jacobian in the point p by means of
+ * automatic differentiation and prepares normal equations. If J is not
+ * NULL the Jacobian (n x m, row-major) and hx are also copied into J
+ * and hx buffers (they are required for Broyden updates).
+ *
+ * Returns 1 in the case of success or 0 in the case of error
+ */
+static int lm_evaljac(LuaFunc *F, double *p, const double *x, int n, int m,
+	const double **cols, double *J, double *hx, double *JtJ, double *Jte, double *sse)
+{
+	if (!LuaFunc_Eval(F, p) || !lm_normaleq(F, x, n, m, cols, JtJ, Jte, sse)) {
+		return 0;
+	}
+	if (J != NULL && !LuaFunc_GetValue(F, hx, J)) {
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Broyden rank-one update of the Jacobian J (n x m, row-major) after
+ * the step dp that changed function value from hx to hx_new:
+ *   J+ = J + w v^T, w = (hx_new - hx) - J dp, v = dp / (dp^T dp)
+ * J^T J is updated without recalculation from J:
+ *   J+^T J+ = J^T J + g v^T + v g^T + (w^T w) v v^T, g = J^T w
+ * and J^T e is recalculated for e = x - hx_new. w, g and v are buffers
+ * for n, m and m elements respectively.
+ */
+static void lm_broyden(double *J, const double *hx, const double *hx_new,
+	const double *x, const double *dp, int n, int m, double *JtJ, double *Jte,
+	double *w, double *g, double *v)
+{
+	double dp_L2 = 0.0, w_L2 = 0.0;
+	for (int j = 0; j < m; j++) {
+		dp_L2 += dp[j] * dp[j];
+		g[j] = 0.0;
+	}
+	for (int j = 0; j < m; j++) {
+		v[j] = dp[j] / dp_L2;
+	}
+	/* w and g = J^T w (for the old J) */
+	for (int i = 0; i < n; i++) {
+		const double *Ji = J + (size_t) i * m;
+		double s = hx_new[i] - hx[i];
+		for (int j = 0; j < m; j++) {
+			s -= Ji[j] * dp[j];
+		}
+		w[i] = s;
+		w_L2 += s * s;
+		for (int j = 0; j < m; j++) {
+			g[j] += Ji[j] * s;
+		}
+	}
+	/* J^T J update */
+	for (int j = 0; j < m; j++) {
+		for (int k = 0; k < m; k++) {
+			JtJ[j*m + k] += g[j] * v[k] + v[j] * g[k] + w_L2 * v[j] * v[k];
+		}
+	}
+	/* J update and J^T e recalculation */
+	for (int j = 0; j < m; j++) {
+		Jte[j] = 0.0;
+	}
+	for (int i = 0; i < n; i++) {
+		double *Ji = J + (size_t) i * m;
+		double e = ((x != NULL) ? x[i] : 0.0) - hx_new[i];
+		for (int j = 0; j < m; j++) {
+			Ji[j] += w[i] * v[j];
+			Jte[j] += Ji[j] * e;
+		}
+	}
+}
+
+/*
+ * Levenberg-Marquardt method with Jacobian calculated by means of automatic
+ * differentiation. The inputs are the same as for dlevmar_der function from
+ * levmar library except func, jacf and adata (they are replaced by F).
+ *
+ * F -- Lua function initialized by LuaFunc_Init
+ * p -- initial parameters estimates (m elements); on output the estimated
+ *   solution is written here. Only active parameters are optimized (see
+ *   LuaFunc_SetActiveParams), frozen ones keep their values.
+ * x -- measurement vector (n elements) or NULL (zero vector). Must be NULL
+ *   if compressed seeding is enabled (see LuaFunc_DetectSparsity)
+ * m -- number of parameters (must be equal to LuaFunc_GetNParams(F))
+ * n -- number of measurements (must be equal to LuaFunc_GetValueLength(F))
+ * itmax -- maximal number of iterations
+ * opts -- LUAFUNC_LM_OPTS_SZ elements: [mu, eps1, eps2, eps3]:
+ *   scale factor for initial mu, stopping thresholds for ||J^T e||_inf,
+ *   ||Dp||_2 and ||e||_2. Set it to NULL for default values.
+ * info -- LUAFUNC_LM_INFO_SZ elements (or NULL):
+ *   info[0] = ||e||_2 at initial p
+ *   info[1-4] = [ ||e||_2, ||J^T e||_inf, ||Dp||_2, mu/max[J^T J]_ii ] at estimated p
+ *   info[5] = number of iterations
+ *   info[6] = reason for terminating: 1 - small gradient J^T e; 2 - small Dp;
+ *     3 - itmax; 4 - singular matrix; 5 - no further error reduction is
+ *     possible; 6 - small ||e||_2; 7 - invalid (i.e. NaN or Inf) function values
+ *   info[7] = number of function evaluations
+ *   info[8] = number of Jacobian evaluations
+ *   info[9] = number of linear systems solved
+ * work -- working memory of LUAFUNC_LM_WORKSZ(m) elements (or NULL)
+ * covar -- covariance matrix (m*m elements) or NULL; rows and columns
+ *   of frozen parameters are filled by zeros
+ *
+ * Returns number of iterations or -1 in the case of error. Note that
+ * ||e||_2 values in info are squared (as in levmar).
+ */
+int LuaFunc_LevMar(LuaFunc *F, double *p, const double *x, int m, int n,
+	int itmax, const double *opts, double *info, double *work, double *covar)
+{
+	return LuaFunc_LevMarBroyden(F, p, x, m, n, itmax, opts, 0, info, work, covar);
+}
+
+/*
+ * The same as LuaFunc_LevMar but in quasi-Newton (Broyden) mode: trial
+ * points are evaluated without derivatives (see LuaFunc_EvalValue) and
+ * the Jacobian is corrected by rank-one updates after each accepted step.
+ * Automatic differentiation is used again after maxbroyden successive
+ * updates or when the updated Jacobian doesn't predict the decrease of
+ * the sum of squares (the step is rejected). This mode requires
+ * additional n*m elements of memory for the Jacobian.
+ *
+ * maxbroyden -- maximal number of successive Broyden updates of the
+ *   Jacobian (0 - always use automatic differentiation)
+ */
+int LuaFunc_LevMarBroyden(LuaFunc *F, double *p, const double *x, int m, int n,
+	int itmax, const double *opts, int maxbroyden, double *info, double *work, double *covar)
+{
+	char *errmsg = F->errMsg;
+	double tau = LUAFUNC_LM_INIT_MU, eps1 = LUAFUNC_LM_STOP_THRESH;
+	double eps2 = LUAFUNC_LM_STOP_THRESH, eps3 = LUAFUNC_LM_STOP_THRESH;
+	double mu = 0.0, nu = 2.0, sse, sse_new, init_sse;
+	double jte_inf = 0.0, dp_L2 = DBL_MAX;
+	int k, stop = 0, nfev = 0, njev = 0, nlss = 0, ret = -1;
+	int nbroyden = 0, refresh = 0;
+	/* Check inputs */
+	if (m != LuaFunc_GetNParams(F)) {
+		snprintf(errmsg, LUAFUNC_BUFSIZE, "LuaFunc_LevMar: m must be equal to %d", LuaFunc_GetNParams(F));
+		return -1;
+	}
+	if (LuaFunc_GetNBatch(F) > 0) {
+		snprintf(errmsg, LUAFUNC_BUFSIZE, "LuaFunc_LevMar: use LuaFunc_LevMarBatch in batch mode");
+		return -1;
+	}
+	int ma = LuaFunc_GetNActive(F); /* Only active parameters are optimized */
+	const int *act = F->active;
+	if (ma == 0) {
+		snprintf(errmsg, LUAFUNC_BUFSIZE, "LuaFunc_LevMar: there are no active parameters");
+		return -1;
+	}
+	if (n < ma) {
+		snprintf(errmsg, LUAFUNC_BUFSIZE, "LuaFunc_LevMar: cannot solve a problem with fewer measurements (%d) than unknowns (%d)", n, ma);
+		return -1;
+	}
+	if (opts != NULL) {
+		tau = opts[0]; eps1 = opts[1]; eps2 = opts[2]; eps3 = opts[3];
+	}
+	double eps2_sq = eps2 * eps2;
+	/* Prepare buffers */
+	double *buf = work, *J = NULL, *hx = NULL, *hx_new = NULL, *bw = NULL;
+	if (buf == NULL) {
+		buf = (double *) calloc(LUAFUNC_LM_WORKSZ(m), sizeof(double));
+	}
+	const double **cols = (const double **) calloc(ma, sizeof(double *));
+	if (maxbroyden > 0) {
+		J = (double *) calloc((size_t) n * ma + 3 * n + 2 * ma, sizeof(double));
+		if (J != NULL) {
+			hx = J + (size_t) n * ma; hx_new = hx + n; bw = hx_new + n;
+		}
+	}
+	if (buf == NULL || cols == NULL || (maxbroyden > 0 && J == NULL)) {
+		snprintf(errmsg, LUAFUNC_BUFSIZE, "LuaFunc_LevMar: not enough memory");
+		goto cleanup;
+	}
+	double *JtJ = buf, *JtJ_new = JtJ + ma*ma, *A = JtJ_new + ma*ma;
+	double *Jte = A + ma*ma, *Jte_new = Jte + ma, *dp = Jte_new + ma;
+	double *diag = dp + ma, *pdp = diag + ma; /* pdp has m elements */
+	/* Initial approximation */
+	nfev++; njev++;
+	if (!lm_evaljac(F, p, x, n, ma, cols, J, hx, JtJ, Jte, &sse)) {
+		goto cleanup;
+	}
+	init_sse = sse;
+	if (!isfinite(sse)) {
+		stop = 7;
+	}
+	for (k = 0; k < itmax && !stop; k++) {
+		/* Return to automatic differentiation (Broyden mode) */
+		if (refresh) {
+			nfev++; njev++;
+			if (!lm_evaljac(F, p, x, n, ma, cols, J, hx, JtJ, Jte, &sse)) {
+				goto cleanup;
+			}
+			nbroyden = 0;
+			refresh = 0;
+		}
+		/* Check the gradient */
+		double p_L2 = 0.0;
+		jte_inf = 0.0;
+		for (int i = 0; i < ma; i++) {
+			if (fabs(Jte[i]) > jte_inf) jte_inf = fabs(Jte[i]);
+			diag[i] = JtJ[i*ma + i];
+			p_L2 += PA(i) * PA(i);
+		}
+		if (jte_inf <= eps1) {
+			dp_L2 = 0.0;
+			stop = 1;
+			break;
+		}
+		/* Initial damping parameter */
+		if (k == 0) {
+			double tmp = -DBL_MAX;
+			for (int i = 0; i < ma; i++) {
+				if (diag[i] > tmp) tmp = diag[i];
+			}
+			mu = tau * tmp;
+		}
+		/* Try to find a step that reduces the sum of squares */
+		while (1) {
+			memcpy(A, JtJ, ma * ma * sizeof(double));
+			for (int i = 0; i < ma; i++) {
+				A[i*ma + i] += mu;
+			}
+			nlss++;
+			if (lm_cholsolve(A, ma, Jte, dp)) {
+				dp_L2 = 0.0;
+				memcpy(pdp, p, m * sizeof(double));
+				for (int i = 0; i < ma; i++) {
+					PDPA(i) += dp[i];
+					dp_L2 += dp[i] * dp[i];
+				}
+				if (dp_L2 <= eps2_sq * p_L2) { /* Relative change in p is small */
+					stop = 2;
+					break;
+				}
+				if (dp_L2 >= (p_L2 + eps2) / (DBL_EPSILON * DBL_EPSILON)) { /* Almost singular */
+					stop = 4;
+					break;
+				}
+				/* Function (and derivatives) in the new point */
+				nfev++;
+				if (J == NULL) {
+					njev++;
+					if (!lm_evaljac(F, pdp, x, n, ma, cols, NULL, NULL, JtJ_new, Jte_new, &sse_new)) {
+						goto cleanup;
+					}
+				} else {
+					if (!LuaFunc_EvalValue(F, pdp) || !LuaFunc_GetValue(F, hx_new, NULL)) {
+						goto cleanup;
+					}
+					sse_new = 0.0;
+					for (int i = 0; i < n; i++) {
+						double e = ((x != NULL) ? x[i] : 0.0) - hx_new[i];
+						sse_new += e * e;
+					}
+				}
+				if (!isfinite(sse_new)) {
+					stop = 7;
+					break;
+				}
+				double dL = 0.0, dF = sse - sse_new;
+				for (int i = 0; i < ma; i++) {
+					dL += dp[i] * (mu * dp[i] + Jte[i]);
+				}
+				if (dL > 0.0 && dF > 0.0) { /* Reduction in error, increment is accepted */
+					double tmp = 2.0 * dF / dL - 1.0;
+					tmp = 1.0 - tmp * tmp * tmp;
+					mu = mu * ((tmp >= 1.0 / 3.0) ? tmp : 1.0 / 3.0);
+					nu = 2.0;
+					if (J == NULL) {
+						double *t;
+						t = JtJ; JtJ = JtJ_new; JtJ_new = t;
+						t = Jte; Jte = Jte_new; Jte_new = t;
+					} else {
+						double *t;
+						lm_broyden(J, hx, hx_new, x, dp, n, ma, JtJ, Jte, bw, JtJ_new, Jte_new);
+						t = hx; hx = hx_new; hx_new = t;
+						if (++nbroyden >= maxbroyden) {
+							refresh = 1;
+						}
+					}
+					memcpy(p, pdp, m * sizeof(double));
+					sse = sse_new;
+					if (sse <= eps3) {
+						stop = 6;
+					}
+					break;
+				}
+				if (J != NULL && nbroyden > 0) {
+					/* Updated Jacobian is inaccurate: recalculate it */
+					refresh = 1;
+					break;
+				}
+			}
+			/* The matrix is not positive definite or the error is not reduced */
+			mu *= nu;
+			nu *= 2.0;
+			if (!isfinite(mu)) {
+				stop = 5;
+				break;
+			}
+		}
+	}
+	if (k >= itmax && !stop) {
+		stop = 3;
+	}
+	/* Exact J^T J for the covariance matrix (Broyden mode) */
+	if (J != NULL && nbroyden > 0 && stop != 7) {
+		nfev++; njev++;
+		if (!lm_evaljac(F, p, x, n, ma, cols, J, hx, JtJ, Jte, &sse)) {
+			goto cleanup;
+		}
+	}
+	/* Save information about the solution */
+	if (info != NULL) {
+		double tmp = -DBL_MAX;
+		for (int i = 0; i < ma; i++) {
+			if (JtJ[i*ma + i] > tmp) tmp = JtJ[i*ma + i];
+		}
+		info[0] = init_sse;
+		info[1] = sse;
+		info[2] = jte_inf;
+		info[3] = dp_L2;
+		info[4] = mu / tmp;
+		info[5] = (double) k;
+		info[6] = (double) stop;
+		info[7] = (double) nfev;
+		info[8] = (double) njev;
+		info[9] = (double) nlss;
+	}
+	if (covar != NULL) {
+		/* Covariance matrix for active parameters (frozen ones have zeros) */
+		(void) lm_covar(JtJ, ma, sse, n, JtJ_new, A, dp);
+		memset(covar, 0, m * m * sizeof(double));
+		for (int i = 0; i < ma; i++) {
+			for (int j = 0; j < ma; j++) {
+				int ii = (act != NULL) ? act[i] : i, jj = (act != NULL) ? act[j] : j;
+				covar[ii*m + jj] = JtJ_new[i*ma + j];
+			}
+		}
+	}
+	ret = (stop != 4 && stop != 7) ? k : -1;
+cleanup:
+	if (work == NULL) free(buf);
+	free(cols);
+	free(J);
+	return ret;
+}
+
+/*
+ * Levenberg-Marquardt method for K independent problems in batch mode
+ * (see LuaFunc_Init). All problems are evaluated by one LuaFunc_Eval call
+ * per iteration, but each problem has its own damping parameter, step
+ * acceptance and stopping criteria, i.e. the block-diagonal system is
+ * solved block by block. Converged problems keep their parameters and
+ * are excluded from the next steps.
+ *
+ * F -- Lua function initialized by LuaFunc_Init in batch mode
+ * p -- initial parameters estimates (K*m elements, problem by problem);
+ *   on output the estimated solutions are written here
+ * itmax -- maximal number of iterations (one iteration is one evaluation
+ *   of all problems)
+ * opts -- LUAFUNC_LM_OPTS_SZ elements (see LuaFunc_LevMar) or NULL
+ *   for default values
+ * info -- K*LUAFUNC_LM_INFO_SZ elements (or NULL): information about
+ *   each problem in the same format as in LuaFunc_LevMar (function and
+ *   Jacobian evaluations are common for all problems)
+ * covar -- covariance matrices (K*m*m elements) or NULL
+ *
+ * Returns number of iterations or -1 in the case of error.
+ */
+int LuaFunc_LevMarBatch(LuaFunc *F, double *p, int itmax, const double *opts,
+	double *info, double *covar)
+{
+	char *errmsg = F->errMsg;
+	double tau = LUAFUNC_LM_INIT_MU, eps1 = LUAFUNC_LM_STOP_THRESH;
+	double eps2 = LUAFUNC_LM_STOP_THRESH, eps3 = LUAFUNC_LM_STOP_THRESH;
+	int K = LuaFunc_GetNBatch(F), m = LuaFunc_GetNActive(F), M = LuaFunc_GetNParams(F);
+	int it = 0, nfev = 0, nleft = K, ret = -1;
+	if (K == 0) {
+		snprintf(errmsg, LUAFUNC_BUFSIZE, "LuaFunc_LevMarBatch: batch mode is not enabled");
+		return -1;
+	}
+	for (int k = 0; k < K; k++) {
+		int n = F->batchptr[k + 1] - F->batchptr[k];
+		if (n < m) {
+			snprintf(errmsg, LUAFUNC_BUFSIZE, "LuaFunc_LevMarBatch: problem %d has fewer measurements (%d) than unknowns (%d)", k + 1, n, m);
+			return -1;
+		}
+	}
+	if (opts != NULL) {
+		tau = opts[0]; eps1 = opts[1]; eps2 = opts[2]; eps3 = opts[3];
+	}
+	double eps2_sq = eps2 * eps2;
+	/* Buffers: per-problem normal equations and state */
+	double *buf = (double *) calloc(2 * (size_t) K * m * m + 4 * (size_t) M
+		+ 9 * (size_t) K + m * m + m, sizeof(double));
+	int *stop = (int *) calloc(2 * K, sizeof(int));
+	if (buf == NULL || stop == NULL) {
+		snprintf(errmsg, LUAFUNC_BUFSIZE, "LuaFunc_LevMarBatch: not enough memory");
+		goto cleanup;
+	}
+	int *trial = stop + K;
+	double *JtJ = buf, *JtJ_new = JtJ + (size_t) K*m*m;
+	double *Jte = JtJ_new + (size_t) K*m*m, *Jte_new = Jte + M, *dp = Jte_new + M, *pdp = dp + M;
+	double *sse = pdp + M, *sse_new = sse + K, *init_sse = sse_new + K;
+	double *mu = init_sse + K, *nu = mu + K, *jte_inf = nu + K, *dp_L2 = jte_inf + K;
+	double *nlss = dp_L2 + K, *niter = nlss + K, *A = niter + K, *y = A + m*m;
+	/* Initial approximation */
+	nfev++;
+	if (!LuaFunc_Eval(F, p) || !LuaFunc_GetNormalEquationsBatch(F, JtJ, Jte, sse)) {
+		goto cleanup;
+	}
+	for (int k = 0; k < K; k++) {
+		double tmp = -DBL_MAX;
+		for (int i = 0; i < m; i++) {
+			Jte[k*m + i] = -Jte[k*m + i];
+			if (JtJ[(size_t) k*m*m + i*m + i] > tmp) tmp = JtJ[(size_t) k*m*m + i*m + i];
+		}
+		init_sse[k] = sse[k];
+		mu[k] = tau * tmp;
+		nu[k] = 2.0;
+		dp_L2[k] = DBL_MAX;
+		if (!isfinite(sse[k])) {
+			stop[k] = 7;
+			nleft--;
+		}
+	}
+	for (it = 0; it < itmax && nleft > 0; it++) {
+		/* a) Steps for all active problems */
+		int ntrials = 0;
+		memcpy(pdp, p, M * sizeof(double));
+		for (int k = 0; k < K; k++) {
+			double *G = JtJ + (size_t) k*m*m, *g = Jte + k*m, *d = dp + k*m;
+			double p_L2 = 0.0;
+			trial[k] = 0;
+			if (stop[k]) {
+				continue;
+			}
+			niter[k]++;
+			jte_inf[k] = 0.0;
+			for (int i = 0; i < m; i++) {
+				if (fabs(g[i]) > jte_inf[k]) jte_inf[k] = fabs(g[i]);
+				p_L2 += p[k*m + i] * p[k*m + i];
+			}
+			if (jte_inf[k] <= eps1) {
+				dp_L2[k] = 0.0;
+				stop[k] = 1;
+				nleft--;
+				continue;
+			}
+			while (!stop[k]) {
+				memcpy(A, G, m * m * sizeof(double));
+				for (int i = 0; i < m; i++) {
+					A[i*m + i] += mu[k];
+				}
+				nlss[k]++;
+				if (lm_cholsolve(A, m, g, d)) {
+					break;
+				}
+				mu[k] *= nu[k];
+				nu[k] *= 2.0;
+				if (!isfinite(mu[k])) {
+					stop[k] = 5;
+				}
+			}
+			if (stop[k]) {
+				nleft--;
+				continue;
+			}
+			dp_L2[k] = 0.0;
+			for (int i = 0; i < m; i++) {
+				pdp[k*m + i] += d[i];
+				dp_L2[k] += d[i] * d[i];
+			}
+			if (dp_L2[k] <= eps2_sq * p_L2) { /* Relative change in p is small */
+				stop[k] = 2;
+			} else if (dp_L2[k] >= (p_L2 + eps2) / (DBL_EPSILON * DBL_EPSILON)) { /* Almost singular */
+				stop[k] = 4;
+			}
+			if (stop[k]) {
+				memcpy(pdp + k*m, p + k*m, m * sizeof(double));
+				nleft--;
+				continue;
+			}
+			trial[k] = 1;
+			ntrials++;
+		}
+		if (ntrials == 0) {
+			break;
+		}
+		/* b) Function and derivatives for all problems in new points */
+		nfev++;
+		if (!LuaFunc_Eval(F, pdp) || !LuaFunc_GetNormalEquationsBatch(F, JtJ_new, Jte_new, sse_new)) {
+			goto cleanup;
+		}
+		/* c) Acceptance of steps */
+		for (int k = 0; k < K; k++) {
+			if (!trial[k]) {
+				continue;
+			}
+			if (!isfinite(sse_new[k])) {
+				stop[k] = 7;
+				nleft--;
+				continue;
+			}
+			double dL = 0.0, dF = sse[k] - sse_new[k];
+			for (int i = 0; i < m; i++) {
+				dL += dp[k*m + i] * (mu[k] * dp[k*m + i] + Jte[k*m + i]);
+			}
+			if (dL > 0.0 && dF > 0.0) { /* Reduction in error, increment is accepted */
+				double tmp = 2.0 * dF / dL - 1.0;
+				tmp = 1.0 - tmp * tmp * tmp;
+				mu[k] = mu[k] * ((tmp >= 1.0 / 3.0) ? tmp : 1.0 / 3.0);
+				nu[k] = 2.0;
+				memcpy(JtJ + (size_t) k*m*m, JtJ_new + (size_t) k*m*m, m * m * sizeof(double));
+				for (int i = 0; i < m; i++) {
+					Jte[k*m + i] = -Jte_new[k*m + i];
+				}
+				memcpy(p + k*m, pdp + k*m, m * sizeof(double));
+				sse[k] = sse_new[k];
+				if (sse[k] <= eps3) {
+					stop[k] = 6;
+					nleft--;
+				}
+			} else {
+				mu[k] *= nu[k];
+				nu[k] *= 2.0;
+				if (!isfinite(mu[k])) {
+					stop[k] = 5;
+					nleft--;
+				}
+			}
+		}
+	}
+	for (int k = 0; k < K; k++) {
+		if (!stop[k]) {
+			stop[k] = 3;
+		}
+	}
+	/* Save information about the solutions */
+	for (int k = 0; k < K; k++) {
+		double *G = JtJ + (size_t) k*m*m;
+		if (info != NULL) {
+			double *inf = info + k*LUAFUNC_LM_INFO_SZ, tmp = -DBL_MAX;
+			for (int i = 0; i < m; i++) {
+				if (G[i*m + i] > tmp) tmp = G[i*m + i];
+			}
+			inf[0] = init_sse[k];
+			inf[1] = sse[k];
+			inf[2] = jte_inf[k];
+			inf[3] = dp_L2[k];
+			inf[4] = mu[k] / tmp;
+			inf[5] = niter[k];
+			inf[6] = (double) stop[k];
+			inf[7] = (double) nfev;
+			inf[8] = (double) nfev;
+			inf[9] = nlss[k];
+		}
+		if (covar != NULL) {
+			int n = F->batchptr[k + 1] - F->batchptr[k];
+			(void) lm_covar(G, m, sse[k], n, covar + (size_t) k*m*m, A, y);
+		}
+	}
+	ret = it;
+cleanup:
+	free(buf);
+	free(stop);
+	return ret;
+}
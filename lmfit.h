@@ -0,0 +1,24 @@
+/*
+ * lmfit.h  Levenberg-Marquardt method for Lua functions with automatic
+ * differentiation (see cwrapper.h). It doesn't require levmar library.
+ *
+ * (C) 2016-2017 Alexey Voskov (alvoskov@gmail.com)
+ * License: MIT (X11) license
+ */
+#ifndef __LMFIT_H
+#define __LMFIT_H
+#include "cwrapper.h"
+
+#define LUAFUNC_LM_OPTS_SZ 4 /* Size of opts array */
+#define LUAFUNC_LM_INFO_SZ 10 /* Size of info array */
+#define LUAFUNC_LM_INIT_MU 1e-3 /* Default scale factor for initial mu */
+#define LUAFUNC_LM_STOP_THRESH 1e-17 /* Default thresholds for stopping criteria */
+#define LUAFUNC_LM_WORKSZ(m) (3*(m)*(m) + 5*(m)) /* Size of work buffer */
+
+int FEXTERN LuaFunc_LevMar(LuaFunc *F, double *p, const double *x, int m, int n,
+	int itmax, const double *opts, double *info, double *work, double *covar);
+int FEXTERN LuaFunc_LevMarBroyden(LuaFunc *F, double *p, const double *x, int m, int n,
+	int itmax, const double *opts, int maxbroyden, double *info, double *work, double *covar);
+int FEXTERN LuaFunc_LevMarBatch(LuaFunc *F, double *p, int itmax, const double *opts,
+	double *info, double *covar);
+#endif
@@ -0,0 +1,84 @@
+/*
+ * luacompat.h  Compatibility layer that allows to build mlsmat.c and
+ * cwrapper.c with LuaJIT 2.1 (Lua 5.1 API with some Lua 5.2 extensions).
+ * It must be included after lua.h, lualib.h and lauxlib.h and does nothing
+ * for Lua 5.3.
+ *
+ * (C) 2016-2017 Alexey Voskov (alvoskov@gmail.com)
+ * License: MIT (X11) license
+ */
+#ifndef __LUACOMPAT_H
+#define __LUACOMPAT_H
+
+#if LUA_VERSION_NUM == 501
+#include <math.h>
+
+#ifndef LUA_OK
+#define LUA_OK 0
+#endif
+
+#define lua_rawlen(L, idx) lua_objlen(L, idx)
+#define lua_dump(L, writer, data, strip) lua_dump(L, writer, data)
+#define lua_isinteger(L, idx) luacompat_isinteger(L, idx)
+#define lua_setuservalue(L, idx) luacompat_setuservalue(L, idx)
+#define luaL_requiref(L, modname, openf, glb) luacompat_requiref(L, modname, openf, glb)
+#define luaL_buffinitsize(L, B, sz) luacompat_buffinitsize(L, B, sz)
+#define luaL_pushresultsize(B, sz) luacompat_pushresultsize(B, sz)
+
+/* All numbers are doubles: integer is a number with integral value */
+static inline int luacompat_isinteger(lua_State *L, int idx)
+{
+	if (lua_type(L, idx) != LUA_TNUMBER) {
+		return 0;
+	}
+	lua_Number x = lua_tonumber(L, idx);
+	return floor(x) == x && fabs(x) < 9007199254740992.0;
+}
+
+/*
+ * Sets the value on the top of the stack as user value of userdata at idx
+ * (it is kept in the environment table, the value is popped)
+ */
+static inline void luacompat_setuservalue(lua_State *L, int idx)
+{
+	if (idx < 0 && idx > LUA_REGISTRYINDEX) {
+		idx = lua_gettop(L) + idx + 1;
+	}
+	lua_createtable(L, 1, 0);
+	lua_insert(L, -2);
+	lua_rawseti(L, -2, 1);
+	lua_setfenv(L, idx);
+}
+
+/* Calls openf(modname), saves result to package.loaded and leaves it on the stack */
+static inline void luacompat_requiref(lua_State *L, const char *modname, lua_CFunction openf, int glb)
+{
+	lua_pushcfunction(L, openf);
+	lua_pushstring(L, modname);
+	lua_call(L, 1, 1);
+	lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+	lua_pushvalue(L, -2);
+	lua_setfield(L, -2, modname);
+	lua_pop(L, 1);
+	if (glb) {
+		lua_pushvalue(L, -1);
+		lua_setglobal(L, modname);
+	}
+}
+
+/* Buffer of known size: temporary userdata is converted to string */
+static inline char *luacompat_buffinitsize(lua_State *L, luaL_Buffer *B, size_t sz)
+{
+	B->L = L;
+	return (char *) lua_newuserdata(L, sz);
+}
+
+static inline void luacompat_pushresultsize(luaL_Buffer *B, size_t sz)
+{
+	lua_pushlstring(B->L, (const char *) lua_touserdata(B->L, -1), sz);
+	lua_remove(B->L, -2);
+}
+
+#endif
+
+#endif
@@ -1,5 +1,6 @@
 --
 -- Implementation of DualNVector class: n-dimensional dual number vector for Lua 5.3
+-- (or LuaJIT 2.1, see view function for fast element access)
 -- It actively uses RealVector class implemented as C library
 --
 -- (C) 2016-2017 Alexey Voskov (alvoskov@gmail.com)
@@ -17,8 +18,10 @@ if __MLSMat == nil then -- Dynamic linking
 else -- Static linking (preloaded module)
 	m = __MLSMat
 end
--- Load math library (built-in in Lua)
+-- Load math and debug libraries (built-in in Lua)
 local math = require("math")
+local debug = require("debug")
+local unpack = table.unpack or unpack -- Lua 5.1 (LuaJIT)
 
 -- Prohibit creation of global variables
 -- (to improve reliablity of code)
@@ -40,14 +43,16 @@ end
 -- Usage:
 --   obj = DualNVector.new(size, nvars)
 --   obj = DualNVector.new(real, imag1, imag2, ...)
+-- nvars may be 0 (and imag parts may be omitted): such a number
+-- contains only real part, i.e. derivatives are not calculated.
 function m.DualNVector.new (...)
 	local arg = {...}
-	if #arg < 2 then
+	if #arg < 1 then
 		error('Invalid number of input arguments')
 	end
 	local obj = {real = {}, imag = {}}
 	-- Different variants of vector creation
-	if #arg == 2 and m.isindex(arg[1]) and m.isindex(arg[2]) then
+	if #arg == 2 and m.isindex(arg[1]) and (arg[2] == 0 or m.isindex(arg[2])) then
 		-- Create empty vector
 		local size, nvars = arg[1], arg[2]
 		obj.real = m.Vec(size)
@@ -86,7 +91,7 @@ end
 --   obj -- DualNVector class example
 function m.DualNVector.const(value, nvars)
 	-- Check input arguments
-	if not m.isindex(nvars) then
+	if nvars ~= 0 and not m.isindex(nvars) then
 		error('Invalid nvars value')
 	end
 	-- Fill real (with value) and imaginary (with zeros) parts
@@ -142,6 +147,32 @@ function m.DualNVector:copy()
 	return obj
 end
 
+-- DualNVector.single, DualNVector.double  Create copies with single
+-- or double precision storage (see RealVector:single for mixing rules)
+-- Usage:
+--   objcopy = obj:single([imagonly]) -- imagonly = true keeps real part
+--                                    -- in double precision
+--   objcopy = obj:double()
+function m.DualNVector:single(imagonly)
+	local obj = {imag = {}}
+	obj.real = imagonly and self.real:copy() or self.real:single()
+	for i = 1, #self.imag do
+		obj.imag[i] = self.imag[i]:single()
+	end
+	setmetatable(obj, m.DualNVector)
+	return obj
+end
+
+function m.DualNVector:double()
+	local obj = {imag = {}}
+	obj.real = self.real:double()
+	for i = 1, #self.imag do
+		obj.imag[i] = self.imag[i]:double()
+	end
+	setmetatable(obj, m.DualNVector)
+	return obj
+end
+
 -- Generic implementation of binary operations
 -- with all required checks
 -- Usage:
@@ -207,11 +238,25 @@ function m.DualNVector.__mul_dfunc(o1r, o1i, o2r, o2i)
 	return o1i * o2r + o1r * o2i
 end
 function m.DualNVector.__mul(o1, o2)
+	if getmetatable(o1) == m.RealMatrix then
+		return m.DualNVector.matmul(o1, o2)
+	end
 	return m.DualNVector.binop(o1, o2,
 		m.DualNVector.__mul_func,
 		m.DualNVector.__mul_dfunc)
 end
 
+-- Product of RealMatrix and DualNVector: r = mat * u. The map is linear,
+-- so the derivatives are transformed by the same matrix
+function m.DualNVector.matmul(mat, u)
+	local r = {real = mat * u.real, imag = {}}
+	for i = 1, #(u.imag) do
+		r.imag[i] = mat * u.imag[i]
+	end
+	setmetatable(r, m.DualNVector)
+	return r
+end
+
 -- __div (/) operator implemenation
 function m.DualNVector.__div_func(o1r, o2r)
 	return o1r / o2r
@@ -225,29 +270,20 @@ function m.DualNVector.__div(o1, o2)
 		m.DualNVector.__div_dfunc)
 end
 
--- __pow (^) operator implementation
-function m.DualNVector.__pow_func(o1r, o2r)
-	return o1r ^ o2r
-end
-function m.DualNVector.__pow_dfunc(o1r, o1i, o2r, o2i)
-	local res = nil;
-	if #o2i == 1 and o2i[1] == 0 then
-		res = o1r ^ (o2r - 1) * (o2r*o1i);
-	else
-		res = o1r ^ (o2r - 1) * o2r*o1i + o1r ^ o2r * (o2i*(o1r:log()));
-		for i = 1, #o2i do
-			if o2i[i] == 0 and o1r[i] <= 0 then
-				res[i] = o1r[i] ^ (o2r[i] - 1) * (o2r[i]*o1i[i]);
-			end
-		end
-	end
-	
-	return res
-end
+-- __pow (^) operator implementation: real and imaginary parts are
+-- computed by the fused RealVector.dpow kernel (see mlsmat.c)
 function m.DualNVector.__pow(o1, o2)
-	return m.DualNVector.binop(o1, o2,
-		m.DualNVector.__pow_func,
-		m.DualNVector.__pow_dfunc)
+	local isdual1 = getmetatable(o1) == m.DualNVector
+	local isdual2 = getmetatable(o2) == m.DualNVector
+	if isdual1 and isdual2 and #(o1.imag) ~= #(o2.imag) then
+		error('Numbers of variables are not consistent')
+	end
+	local r = {}
+	r.real, r.imag = m.RealVector.dpow(
+		isdual1 and o1.real or o1, isdual2 and o2.real or o2,
+		isdual1 and o1.imag or nil, isdual2 and o2.imag or nil)
+	setmetatable(r, m.DualNVector)
+	return r
 end
 
 -- log function implementation
@@ -290,6 +326,163 @@ function m.DualNVector:__unm()
 	return r
 end
 
+-- Reductions: sum, sumsq, dot, norm2, mean, variance, argmin, argmax
+-- They use native (pairwise) RealVector reductions for both real and
+-- imaginary parts and return dual numbers with one element
+-- Usage:
+--   s = x:sum(); s = x:sumsq(); s = x:norm2(); s = x:mean()
+--   s = x:dot(y) -- y may be either DualNVector or RealVector
+--   s = x:variance([ddof]) -- RealVector:var analogue (DualNVector.var
+--                         -- is a constructor), ddof is 1 by default
+--   ind, val = x:argmin(); ind, val = x:argmax() -- index by real part
+local function scalardual(real, imag)
+	local r = {real = m.RealVector.new({real}), imag = {}}
+	for i = 1, #imag do
+		r.imag[i] = m.RealVector.new({imag[i]})
+	end
+	setmetatable(r, m.DualNVector)
+	return r
+end
+
+function m.DualNVector:sum()
+	local imag = {}
+	for i = 1, #(self.imag) do
+		imag[i] = self.imag[i]:sum()
+	end
+	return scalardual(self.real:sum(), imag)
+end
+
+function m.DualNVector:sumsq()
+	local imag = {}
+	for i = 1, #(self.imag) do
+		imag[i] = 2 * self.real:dot(self.imag[i])
+	end
+	return scalardual(self.real:sumsq(), imag)
+end
+
+function m.DualNVector:dot(v)
+	local imag = {}
+	if getmetatable(v) == m.RealVector then
+		for i = 1, #(self.imag) do
+			imag[i] = self.imag[i]:dot(v)
+		end
+		return scalardual(self.real:dot(v), imag)
+	end
+	if getmetatable(v) ~= m.DualNVector then
+		error('Argument must be either DualNVector or RealVector')
+	end
+	if #(v.imag) ~= #(self.imag) then
+		error('Numbers of variables are mismatching')
+	end
+	for i = 1, #(self.imag) do
+		imag[i] = self.imag[i]:dot(v.real) + self.real:dot(v.imag[i])
+	end
+	return scalardual(self.real:dot(v.real), imag)
+end
+
+function m.DualNVector:norm2()
+	return self:sumsq():sqrt()
+end
+
+function m.DualNVector:mean()
+	local n, imag = #(self.real), {}
+	for i = 1, #(self.imag) do
+		imag[i] = self.imag[i]:sum() / n
+	end
+	return scalardual(self.real:sum() / n, imag)
+end
+
+function m.DualNVector:variance(ddof)
+	ddof = ddof or 1
+	local n, imag = #(self.real), {}
+	local dev = self.real - self.real:mean()
+	for i = 1, #(self.imag) do
+		imag[i] = 2 * dev:dot(self.imag[i]) / (n - ddof)
+	end
+	return scalardual(self.real:var(ddof), imag)
+end
+
+function m.DualNVector:argmin()
+	local ind = self.real:argmin()
+	return ind, self[ind]
+end
+
+function m.DualNVector:argmax()
+	local ind = self.real:argmax()
+	return ind, self[ind]
+end
+
+-- Cumulative and windowed operations: cumsum, diff, movsum, movmean
+-- and conv are linear, so they are applied to real and imaginary parts
+-- by native RealVector functions; cumprod uses fused RealVector.dcumprod
+-- Usage:
+--   y = x:cumsum(); y = x:cumprod(); y = x:diff([k])
+--   y = x:movsum(k); y = x:movmean(k); y = x:movsum(kb, kf)
+--   y = x:conv(h [, shape [, method]]) -- x and h may be DualNVector
+--                                     -- or RealVector (see RealVector.conv)
+local function linearop(u, op, ...)
+	local r = {real = op(u.real, ...), imag = {}}
+	for i = 1, #(u.imag) do
+		r.imag[i] = op(u.imag[i], ...)
+	end
+	if u.hess ~= nil then
+		r.hess = {}
+		for k = 1, #(u.hess) do
+			r.hess[k] = op(u.hess[k], ...)
+		end
+	end
+	setmetatable(r, getmetatable(u))
+	return r
+end
+
+function m.DualNVector:cumsum()
+	return linearop(self, m.RealVector.cumsum)
+end
+
+function m.DualNVector:cumprod()
+	local r = {}
+	r.real, r.imag = m.RealVector.dcumprod(self.real, self.imag)
+	setmetatable(r, m.DualNVector)
+	return r
+end
+
+function m.DualNVector:diff(k)
+	return linearop(self, m.RealVector.diff, k)
+end
+
+function m.DualNVector:movsum(kb, kf)
+	return linearop(self, m.RealVector.movsum, kb, kf)
+end
+
+function m.DualNVector:movmean(kb, kf)
+	return linearop(self, m.RealVector.movmean, kb, kf)
+end
+
+-- Imaginary parts are convolved by one call (see RealVector.conv)
+function m.DualNVector.conv(x, h, shape, method)
+	local conv = m.RealVector.conv
+	local r = {}
+	if getmetatable(h) ~= m.DualNVector then
+		r.real = conv(x.real, h, shape, method)
+		r.imag = (#(x.imag) > 0) and conv(x.imag, h, shape, method) or {}
+	elseif getmetatable(x) ~= m.DualNVector then
+		r.real = conv(x, h.real, shape, method)
+		r.imag = (#(h.imag) > 0) and conv(x, h.imag, shape, method) or {}
+	else
+		if #(x.imag) ~= #(h.imag) then
+			error('Numbers of variables are mismatching')
+		end
+		r.real = conv(x.real, h.real, shape, method)
+		r.imag = (#(x.imag) > 0) and conv(x.imag, h.real, shape, method) or {}
+		local dh = (#(h.imag) > 0) and conv(x.real, h.imag, shape, method) or {}
+		for i = 1, #(r.imag) do
+			r.imag[i] = r.imag[i] + dh[i]
+		end
+	end
+	setmetatable(r, m.DualNVector)
+	return r
+end
+
 -- Returns number of elements (dual numbers) in the vector
 function m.DualNVector:__len()
 	return #self.real
@@ -335,6 +528,616 @@ function m.DualNVector:__index(ind)
 	end
 end
 
+---- HyperDualNVector class: vector of hyper-dual numbers that contain
+---- both first (imag) and second (hess) derivatives. The Hessian is symmetric,
+---- so only its lower triangle is stored (packed by rows): hess table
+---- contains nvars*(nvars+1)/2 RealVector objects
+
+-- HyperDualNVector.hessindex  Returns index of d2F/dBi/dBj in hess table
+-- Usage:
+--   k = HyperDualNVector.hessindex(i, j)
+function m.HyperDualNVector.hessindex(i, j)
+	if i < j then
+		i, j = j, i
+	end
+	return math.floor(i * (i - 1) / 2) + j
+end
+
+-- HyperDualNVector.new  Creates a hyper-dual number either from
+-- scratch or from user-defined RealVector variables. Second derivatives
+-- are filled by zeros.
+-- Usage:
+--   obj = HyperDualNVector.new(size, nvars)
+--   obj = HyperDualNVector.new(real, imag1, imag2, ...)
+function m.HyperDualNVector.new (...)
+	local arg = {...}
+	if #arg < 1 then
+		error('Invalid number of input arguments')
+	end
+	local obj = {real = {}, imag = {}, hess = {}}
+	local size, nvars = nil, nil
+	if #arg == 2 and m.isindex(arg[1]) and (arg[2] == 0 or m.isindex(arg[2])) then
+		-- Create empty vector
+		size, nvars = arg[1], arg[2]
+		obj.real = m.Vec(size)
+		for i = 1, nvars do
+			obj.imag[i] = m.Vec(size)
+		end
+	else
+		-- Create vector from RealVector vectors
+		size, nvars = #(arg[1]), #arg - 1
+		for i = 1, #arg do
+			if getmetatable(arg[i]) ~= m.RealVector then
+				error(('Argument %d must be a RealVector'):format(i))
+			end
+			if #(arg[i]) ~= size then
+				error(('Argument %d size is not consistent'):format(i))
+			end
+		end
+		obj.real = arg[1]:copy()
+		for i = 1, nvars do
+			obj.imag[i] = arg[i + 1]:copy()
+		end
+	end
+	for k = 1, m.HyperDualNVector.hessindex(nvars, nvars) do
+		obj.hess[k] = m.Vec(size)
+	end
+	setmetatable(obj, m.HyperDualNVector)
+	return obj
+end
+
+-- HyperDualNVector.const  Creates a hyper-dual number containing const
+-- Usage:
+--   obj = HyperDualNVector.const(value, nvars)
+function m.HyperDualNVector.const(value, nvars)
+	if nvars ~= 0 and not m.isindex(nvars) then
+		error('Invalid nvars value')
+	end
+	local obj = nil
+	if type(value) == "number" then
+		obj = m.HyperDualNVector.new(1, nvars)
+		obj.real[1] = value
+	elseif getmetatable(value) == m.RealVector then
+		obj = m.HyperDualNVector.new(#value, nvars)
+		obj.real = value:copy()
+	elseif getmetatable(value) == nil and type(value) == "table" then
+		obj = m.HyperDualNVector.new(#value, nvars)
+		obj.real = m.RealVector.new(value)
+	else
+		error('value must be either number or RealVector')
+	end
+	return obj
+end
+
+-- HyperDualNVector.var  Creates a hyper-dual number containing a variable
+-- Usage:
+--   obj = HyperDualNVector.var(value, varind, nvars)
+function m.HyperDualNVector.var(value, varind, nvars)
+	if not m.isindex(nvars) then
+		error('Invalid nvars value')
+	end
+	if not m.isindex(varind) or varind > nvars then
+		error('Invalid varind value')
+	end
+	local obj = m.HyperDualNVector.const(value, nvars)
+	obj.imag[varind] = obj.imag[varind] + 1
+	return obj
+end
+
+-- HyperDualNVector.copy  Creates a full copy of a class example
+function m.HyperDualNVector:copy()
+	local obj = {real = self.real:copy(), imag = {}, hess = {}}
+	for i = 1, #self.imag do
+		obj.imag[i] = self.imag[i]:copy()
+	end
+	for k = 1, #self.hess do
+		obj.hess[k] = self.hess[k]:copy()
+	end
+	setmetatable(obj, m.HyperDualNVector)
+	return obj
+end
+
+-- Checks if the value is a constant (number or RealVector)
+function m.HyperDualNVector.isconst(o)
+	return type(o) == "number" or getmetatable(o) == m.RealVector
+end
+
+-- Converts arguments of binary operation to HyperDualNVector
+-- and checks their consistency
+function m.HyperDualNVector.checkargs(o1, o2)
+	if getmetatable(o1) ~= m.HyperDualNVector then
+		o1 = m.HyperDualNVector.const(o1, #(o2.imag))
+	end
+	if getmetatable(o2) ~= m.HyperDualNVector then
+		o2 = m.HyperDualNVector.const(o2, #(o1.imag))
+	end
+	if #(o1.imag) ~= #(o2.imag) then
+		error('Numbers of variables are not consistent')
+	end
+	return o1, o2
+end
+
+-- Generic implementation of functions (chain rule): r = f(u)
+-- Usage:
+--   r = HyperDualNVector.chain(u, f0, f1, f2)
+-- Inputs:
+--   u -- function argument
+--   f0, f1, f2 -- f(u.real), f'(u.real) and f''(u.real) values
+function m.HyperDualNVector.chain(u, f0, f1, f2)
+	local r = {real = f0, imag = {}, hess = {}}
+	local k = 1
+	for i = 1, #(u.imag) do
+		r.imag[i] = f1 * u.imag[i]
+		local g = f2 * u.imag[i]
+		for j = 1, i do
+			r.hess[k] = f1 * u.hess[k] + g * u.imag[j]
+			k = k + 1
+		end
+	end
+	setmetatable(r, m.HyperDualNVector)
+	return r
+end
+
+-- Multiplies all parts of u by constant c (number or RealVector)
+function m.HyperDualNVector.scale(u, c)
+	local r = {real = u.real * c, imag = {}, hess = {}}
+	for i = 1, #(u.imag) do
+		r.imag[i] = u.imag[i] * c
+	end
+	for k = 1, #(u.hess) do
+		r.hess[k] = u.hess[k] * c
+	end
+	setmetatable(r, m.HyperDualNVector)
+	return r
+end
+
+-- __add (+) and __sub (-) operators implementation
+function m.HyperDualNVector.addsub(o1, o2, sign)
+	local r = {imag = {}, hess = {}}
+	if m.HyperDualNVector.isconst(o2) then
+		r.real = o1.real + sign * o2
+		for i = 1, #(o1.imag) do r.imag[i] = o1.imag[i]:copy() end
+		for k = 1, #(o1.hess) do r.hess[k] = o1.hess[k]:copy() end
+	elseif m.HyperDualNVector.isconst(o1) then
+		r.real = o1 + sign * o2.real
+		for i = 1, #(o2.imag) do r.imag[i] = sign * o2.imag[i] end
+		for k = 1, #(o2.hess) do r.hess[k] = sign * o2.hess[k] end
+	else
+		o1, o2 = m.HyperDualNVector.checkargs(o1, o2)
+		r.real = o1.real + sign * o2.real
+		for i = 1, #(o1.imag) do r.imag[i] = o1.imag[i] + sign * o2.imag[i] end
+		for k = 1, #(o1.hess) do r.hess[k] = o1.hess[k] + sign * o2.hess[k] end
+	end
+	setmetatable(r, m.HyperDualNVector)
+	return r
+end
+
+function m.HyperDualNVector.__add(o1, o2)
+	return m.HyperDualNVector.addsub(o1, o2, 1)
+end
+
+function m.HyperDualNVector.__sub(o1, o2)
+	return m.HyperDualNVector.addsub(o1, o2, -1)
+end
+
+-- __mul (*) operator implementation
+function m.HyperDualNVector.__mul(o1, o2)
+	if getmetatable(o1) == m.RealMatrix then
+		local r = {real = o1 * o2.real, imag = {}, hess = {}}
+		for i = 1, #(o2.imag) do r.imag[i] = o1 * o2.imag[i] end
+		for k = 1, #(o2.hess) do r.hess[k] = o1 * o2.hess[k] end
+		setmetatable(r, m.HyperDualNVector)
+		return r
+	elseif m.HyperDualNVector.isconst(o2) then
+		return m.HyperDualNVector.scale(o1, o2)
+	elseif m.HyperDualNVector.isconst(o1) then
+		return m.HyperDualNVector.scale(o2, o1)
+	end
+	o1, o2 = m.HyperDualNVector.checkargs(o1, o2)
+	local r = {real = o1.real * o2.real, imag = {}, hess = {}}
+	local k = 1
+	for i = 1, #(o1.imag) do
+		local a, b = o1.imag[i], o2.imag[i]
+		r.imag[i] = a * o2.real + o1.real * b
+		for j = 1, i do
+			r.hess[k] = o1.hess[k] * o2.real + o1.real * o2.hess[k] +
+				a * o2.imag[j] + o1.imag[j] * b
+			k = k + 1
+		end
+	end
+	setmetatable(r, m.HyperDualNVector)
+	return r
+end
+
+-- Reciprocal value 1/u
+function m.HyperDualNVector.recip(u)
+	local f0 = 1 / u.real
+	local f1 = -f0 * f0
+	return m.HyperDualNVector.chain(u, f0, f1, -2 * f1 * f0)
+end
+
+-- __div (/) operator implementation
+function m.HyperDualNVector.__div(o1, o2)
+	if m.HyperDualNVector.isconst(o2) then
+		return m.HyperDualNVector.scale(o1, 1 / o2)
+	end
+	return o1 * m.HyperDualNVector.recip(o2)
+end
+
+-- __pow (^) operator implementation
+function m.HyperDualNVector.__pow(o1, o2)
+	if m.HyperDualNVector.isconst(o2) then
+		-- a^c: derivatives of power function (zero factors are not
+		-- multiplied by powers to avoid 0*inf = NaN at a = 0)
+		local f1 = (o2 == 0) and 0 or o2 * o1.real ^ (o2 - 1)
+		local f2 = ((o2 - 1) * o2 == 0) and 0 or (o2 - 1) * o2 * o1.real ^ (o2 - 2)
+		return m.HyperDualNVector.chain(o1, o1.real ^ o2, f1, f2)
+	elseif m.HyperDualNVector.isconst(o1) then
+		-- c^b: derivatives of exponential function
+		local f0 = o1 ^ o2.real
+		local lnc = (type(o1) == "number") and math.log(o1) or o1:log()
+		return m.HyperDualNVector.chain(o2, f0, f0 * lnc, f0 * lnc * lnc)
+	else
+		-- a^b = exp(b*ln(a))
+		return (o2 * o1:log()):exp()
+	end
+end
+
+-- log function implementation
+function m.HyperDualNVector:log()
+	local f1 = 1 / self.real
+	return m.HyperDualNVector.chain(self, self.real:log(), f1, -f1 * f1)
+end
+
+-- exp function implementation
+function m.HyperDualNVector:exp()
+	local f = self.real:exp()
+	return m.HyperDualNVector.chain(self, f, f, f)
+end
+
+-- sqrt function implementation
+function m.HyperDualNVector:sqrt()
+	local f0 = self.real:sqrt()
+	local f1 = 0.5 / f0
+	return m.HyperDualNVector.chain(self, f0, f1, -0.5 * f1 / self.real)
+end
+
+-- unary minus function implementation
+function m.HyperDualNVector:__unm()
+	return m.HyperDualNVector.scale(self, -1)
+end
+
+-- Linear cumulative and windowed operations (see DualNVector.cumsum)
+function m.HyperDualNVector:cumsum()
+	return linearop(self, m.RealVector.cumsum)
+end
+
+function m.HyperDualNVector:diff(k)
+	return linearop(self, m.RealVector.diff, k)
+end
+
+function m.HyperDualNVector:movsum(kb, kf)
+	return linearop(self, m.RealVector.movsum, kb, kf)
+end
+
+function m.HyperDualNVector:movmean(kb, kf)
+	return linearop(self, m.RealVector.movmean, kb, kf)
+end
+
+-- Convolution with RealVector (either x or h)
+function m.HyperDualNVector.conv(x, h, shape, method)
+	local conv = m.RealVector.conv
+	if getmetatable(h) ~= m.HyperDualNVector then
+		return linearop(x, conv, h, shape, method)
+	elseif getmetatable(x) ~= m.HyperDualNVector then
+		return linearop(h, function(v) return conv(x, v, shape, method) end)
+	end
+	error('Convolution of two HyperDualNVectors is not supported')
+end
+
+-- Returns number of elements (hyper-dual numbers) in the vector
+function m.HyperDualNVector:__len()
+	return #self.real
+end
+
+-- HyperDualNVector:tostring  Metamethod that converts HyperDualNVector object
+-- to string containing all its values (including derivatives)
+function m.HyperDualNVector:__tostring()
+	local nvars = #(self.imag)
+	local str = ("HyperDualNVector: %d elements (%d variables)\n"):format(#(self.real), nvars)
+	str = str .. "Real part:\n" .. tostring(self.real);
+	for i = 1, nvars do
+		str = str .. ("Imaginary part (variable %d):\n"):format(i);
+		str = str .. tostring(self.imag[i])
+	end
+	for i = 1, nvars do
+		for j = 1, i do
+			str = str .. ("Second derivative (variables %d, %d):\n"):format(i, j);
+			str = str .. tostring(self.hess[m.HyperDualNVector.hessindex(i, j)])
+		end
+	end
+	return str
+end
+
+-- Returns subvector using user-defined index (see RealVector indexing modes)
+function m.HyperDualNVector:__index(ind)
+	if type(ind) == "number" or type(ind) == "table" then
+		local r = {real = self.real[ind], imag = {}, hess = {}}
+		local isnum = (type(r.real) == "number")
+		local function sub(v)
+			return isnum and m.RealVector.new({v[ind]}) or v[ind]
+		end
+		r.real = sub(self.real)
+		for i = 1, #self.imag do
+			r.imag[i] = sub(self.imag[i])
+		end
+		for k = 1, #self.hess do
+			r.hess[k] = sub(self.hess[k])
+		end
+		setmetatable(r, m.HyperDualNVector)
+		return r
+	else
+		return m.HyperDualNVector[ind]
+	end
+end
+
+---- Interp1 class (interpolation tables, see mlsmat.c): evaluation
+---- of dual numbers by the chain rule
+local interp1_call = m.Interp1.__call
+
+-- Usage:
+--   f = ip(x) -- x is number, RealVector, DualNVector or HyperDualNVector
+function m.Interp1.__call(ip, x)
+	local mt = getmetatable(x)
+	if mt == m.DualNVector then
+		local f, df = ip:eval(x.real, 1)
+		local r = {real = f, imag = {}}
+		for i = 1, #(x.imag) do
+			r.imag[i] = df * x.imag[i]
+		end
+		setmetatable(r, m.DualNVector)
+		return r
+	elseif mt == m.HyperDualNVector then
+		return m.HyperDualNVector.chain(x, ip:eval(x.real, 2))
+	else
+		return interp1_call(ip, x)
+	end
+end
+
+---- ODE solver (ode45 in mlsmat.c) with forward sensitivities: imaginary
+---- parts of dual numbers are integrated as additional state blocks
+local ode45_blocks = m.ode45
+
+-- ode45  Integrates dy/dt = f(t, y) by Dormand-Prince method
+-- Usage:
+--   y, stats = ode45(f, tout, y0, opts)
+-- Inputs:
+--   f(t, y) -- right-hand side: y is a table of components (RealVectors
+--     or DualNVectors), must return a table of components (numbers,
+--     RealVectors or DualNVectors). Elements of vectors are lanes, i.e.
+--     independent problems integrated simultaneously
+--   tout -- output times (RealVector or table), tout[1] is initial time
+--   y0 -- initial values of components (numbers, RealVectors or DualNVectors)
+--   opts -- table with options: rtol, atol, h, hmax, maxsteps, fixed
+--     (see mlsmat.c); error is controlled only by real parts
+-- Outputs:
+--   y -- table of components: y[c][(lane - 1) * #tout + k] is value
+--     of component c in tout[k]. Components are DualNVectors if y0 or
+--     f (e.g. its parameters) contain dual numbers
+--   stats -- table with nsteps, nreject and nfev fields
+function m.ode45(f, tout, y0, opts)
+	if getmetatable(tout) ~= m.RealVector then
+		tout = m.RealVector.new(tout)
+	end
+	-- Find number of variables: if y0 is real, f is called for it (e.g.
+	-- its parameters may be dual numbers) and the result is reused by the
+	-- first evaluation of the solver (so it is counted in stats.nfev)
+	local nvars, y0real, dy0 = 0, {}, nil
+	local function findnvars(u)
+		if getmetatable(u) == m.DualNVector then
+			if nvars ~= 0 and #(u.imag) ~= nvars then
+				error('Numbers of variables are not consistent')
+			end
+			nvars = #(u.imag)
+		end
+	end
+	for c = 1, #y0 do
+		findnvars(y0[c])
+		y0real[c] = (getmetatable(y0[c]) == m.DualNVector) and y0[c].real or y0[c]
+	end
+	if nvars == 0 then
+		dy0 = f(tout[1], y0real)
+		for c = 1, #dy0 do
+			findnvars(dy0[c])
+		end
+	end
+	local frhs = function(t, y)
+		local dy = dy0
+		if dy == nil then
+			return f(t, y)
+		end
+		dy0 = nil
+		return dy
+	end
+	local function solve(fsolve, y0solve, solveopts)
+		local y, stats = ode45_blocks(fsolve, tout, y0solve, solveopts)
+		if dy0 ~= nil then -- The solver hasn't made any evaluations
+			stats.nfev = stats.nfev + 1
+		end
+		return y, stats
+	end
+	if nvars == 0 then
+		return solve(frhs, y0real, opts)
+	end
+	-- Blocks of dual numbers: real part and nvars imaginary parts
+	local nc, stride, blocks0 = #y0, nvars + 1, {}
+	local function toblocks(u, blocks, c)
+		local b = (c - 1) * stride
+		if getmetatable(u) == m.DualNVector then
+			blocks[b + 1] = u.real
+			for i = 1, nvars do blocks[b + 1 + i] = u.imag[i] end
+		else
+			blocks[b + 1] = u
+			for i = 1, nvars do blocks[b + 1 + i] = 0 end
+		end
+	end
+	local function fromblocks(blocks, c)
+		local b = (c - 1) * stride
+		local u = {real = blocks[b + 1], imag = {}}
+		for i = 1, nvars do u.imag[i] = blocks[b + 1 + i] end
+		setmetatable(u, m.DualNVector)
+		return u
+	end
+	for c = 1, nc do
+		toblocks(y0[c], blocks0, c)
+	end
+	local fblocks = function(t, blocks)
+		local y, res = {}, {}
+		for c = 1, nc do
+			y[c] = fromblocks(blocks, c)
+		end
+		local dy = frhs(t, y)
+		for c = 1, nc do
+			toblocks(dy[c], res, c)
+		end
+		return res
+	end
+	local blkopts = {errstride = stride}
+	for k, v in pairs(opts or {}) do
+		blkopts[k] = v
+	end
+	blkopts.errstride = stride
+	local yblocks, stats = solve(fblocks, blocks0, blkopts)
+	local y = {}
+	for c = 1, nc do
+		y[c] = fromblocks(yblocks, c)
+	end
+	return y, stats
+end
+
+---- Cache of parameter-independent subexpressions (e.g. X^2 in polynomial
+---- models): they are computed during the first evaluation and kept for the
+---- lifetime of the Lua state (i.e. LuaFunc) until invalidate() is called.
+---- LuaFunc_SetData and LuaFunc_Invalidate call invalidate() automatically
+local INVARIANT_MAXSIZE = 1024 -- The cache is cleared if it has more values
+local invariant_cache, invariant_named, invariant_size = {}, {}, 0
+
+-- Returns the table for values of fn and the key: fn is identified by its
+-- prototype (source and lines), so closures created on each call share the
+-- cached value. Values of upvalues are ignored
+local function invariant_node(fn)
+	local info = debug.getinfo(fn, "S")
+	local node = invariant_cache[info.source]
+	if node == nil then
+		node = {}
+		invariant_cache[info.source] = node
+	end
+	return node, info.linedefined * 65536 + info.lastlinedefined
+end
+
+-- invariant  Returns the cached value of fn() that must depend only on
+-- data, not on parameters (it is computed once)
+-- Usage:
+--   v = invariant(fn) -- e.g. invariant(function() return X^2 end)
+--   v = invariant(key, fn) -- key is an arbitrary value (e.g. string)
+-- Functions without key are distinguished only by place of definition:
+-- use keys if fn depends on upvalues that change (e.g. loop variables)
+-- or if several functions are defined in one line
+function m.invariant(key, fn)
+	local named, node, k = fn ~= nil, invariant_named, key
+	if not named then
+		fn = key
+		node, k = invariant_node(fn)
+	elseif key == nil or key ~= key then -- nil and NaN cannot be keys
+		error('Invalid key of invariant expression')
+	end
+	local v = node[k]
+	if v == nil then
+		v = fn()
+		local mt = getmetatable(v)
+		if mt == m.DualNVector or mt == m.HyperDualNVector then
+			error('Invariant expression depends on parameters')
+		end
+		if invariant_size >= INVARIANT_MAXSIZE then
+			m.invalidate()
+			if named then
+				node = invariant_named
+			else
+				node = invariant_node(fn)
+			end
+		end
+		node[k] = v
+		invariant_size = invariant_size + 1
+	end
+	return v
+end
+
+-- invalidate  Removes the cached value of key (all values if key is nil),
+-- must be called if data used by invariant expressions is changed
+function m.invalidate(key)
+	if key == nil then
+		invariant_cache, invariant_named, invariant_size = {}, {}, 0
+	elseif invariant_named[key] ~= nil then
+		invariant_named[key] = nil
+		invariant_size = invariant_size - 1
+	end
+end
+
+---- Named data sets: they are loaded only once and shared by LuaFunc
+---- clones without copying (see LuaFunc_Clone in cwrapper.c)
+m.datasets = {}
+
+-- dataset  Returns data set (one or several RealVectors) with the given
+-- name; loader() is called only if the data set is not loaded yet
+-- Usage:
+--   X, Y = dataset("exp1", function() return RealVector.loadtxt("exp1.dat") end)
+function m.dataset(name, loader)
+	local v = m.datasets[name]
+	if v == nil then
+		v = {loader()}
+		for i = 1, #v do
+			if getmetatable(v[i]) ~= m.RealVector then
+				error(('Data set %s must contain only RealVectors'):format(name))
+			end
+		end
+		m.datasets[name] = v
+	end
+	return unpack(v)
+end
+
+---- Fast element access: FFI views of RealVector (LuaJIT)
+local ffi, viewtypes, viewanchors = nil, nil, nil
+if jit ~= nil then
+	local ok, lib = pcall(require, "ffi")
+	if ok then
+		ffi = lib
+		viewtypes = {[false] = {[false] = ffi.typeof("double *"), [true] = ffi.typeof("const double *")},
+			[true] = {[false] = ffi.typeof("float *"), [true] = ffi.typeof("const float *")}}
+		viewanchors = setmetatable({}, {__mode = "k"}) -- Views keep their vectors alive
+	end
+end
+
+-- view  Returns object for fast access to elements of RealVector x by
+-- 1-based indices. Under LuaJIT it is FFI pointer (double* or float*,
+-- const for read-only vectors) that allows the compiler to turn loops
+-- over elements into machine code; it has no bounds checks. Under Lua 5.3
+-- x itself is returned.
+-- Usage:
+--   local p = view(x)
+--   for i = 1, #x do if p[i] ~= p[i] then p[i] = 0 end end
+function m.view(x)
+	if getmetatable(x) ~= m.RealVector then
+		error('view: RealVector expected')
+	end
+	if ffi == nil then
+		return x
+	end
+	local ptr, single, readonly = x:dataptr()
+	local p = ffi.cast(viewtypes[single][readonly], ptr)
+	viewanchors[p] = x
+	return p
+end
+
 ---- Aliases for some methods
 function m.DConst(value, nvars)
 	return m.DualNVector.const(value, nvars)
@@ -344,5 +1147,13 @@ function m.DVar(value, varind, nvars)
 	return m.DualNVector.var(value, varind, nvars)
 end
 
+function m.HDConst(value, nvars)
+	return m.HyperDualNVector.const(value, nvars)
+end
+
+function m.HDVar(value, varind, nvars)
+	return m.HyperDualNVector.var(value, varind, nvars)
+end
+
 -- Return module table
 return m
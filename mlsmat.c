@@ -4,24 +4,47 @@
  * several classes:
  *   RealVector -- Vector of doubles
  *   IndexRange -- Index ranges for RealVector
- * It also initializes empty DualNVector table (that is reseved
- * for dual numbers implemented in mlslib.lua)
+ *   RandomStream -- Vectorized pseudorandom numbers generator
+ * It also initializes empty DualNVector and HyperDualNVector tables
+ * (that are reseved for dual and hyper-dual numbers implemented
+ * in mlslib.lua)
  * 
+ * RealVector data may be stored either in double or in single precision
+ * (see realvector_single for the rules of precision mixing).
+ * RealVector also provides fast loading of numeric text files (loadtxt)
+ * and read-only mapping of binary files of doubles (mmap), cumulative
+ * and moving-window operations and convolution (direct or FFT).
+ *
  * This module also can be linked statically
  *   
  * (C) 2016-2017 Alexey Voskov (alvoskov@gmail.com)
  * License: MIT (X11) license
  */
 
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L /* For mmap */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #define _USE_MATH_DEFINES
 #include <math.h>
 #include <time.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #include "lua.h"
 #include "lualib.h"
 #include "lauxlib.h"
+#include "luacompat.h"
 
 #include "mlsmat.h"
 
@@ -91,7 +114,11 @@ static const struct luaL_Reg indexrange_funcs[] = {
 
 
 /*========== RealVector class ==========*/
-static RealVector *c_realvector_create(lua_State *L, int len)
+/*
+ * Creates vector that owns the data array (len + 1 elements,
+ * data[0] is not used to provide 1-based indices)
+ */
+static RealVector *c_realvector_wrap(lua_State *L, int len, double *data)
 {
 	/* Create class example (initialize properties) */
 	lua_newtable(L);
@@ -99,31 +126,419 @@ static RealVector *c_realvector_create(lua_State *L, int len)
 	lua_pushstring(L, "data");
 	RealVector *vec = (RealVector *) lua_newuserdata(L, sizeof(RealVector));
 	vec->len = len;
-	vec->data = calloc(len + 1, sizeof(double)); /* +1 -- to provide 1-based indices */
+	vec->data = data;
+	vec->sdata = NULL;
+	vec->single = 0;
+	vec->readonly = 0;
+	vec->external = 0;
+	vec->mapbase = NULL;
+	vec->mapsize = 0;
 	/* b) set metatable */
 	luaL_getmetatable(L, "MLSMat::RealVector");
 	lua_setmetatable(L, -2);
 	return vec;
 }
 
+static RealVector *c_realvector_create(lua_State *L, int len)
+{
+	return c_realvector_wrap(L, len, calloc(len + 1, sizeof(double)));
+}
+
+/* Creates zero-filled vector with single (single != 0) or double precision */
+static RealVector *c_realvector_create_prec(lua_State *L, int len, int single)
+{
+	if (!single) {
+		return c_realvector_create(L, len);
+	}
+	RealVector *vec = c_realvector_wrap(L, len, NULL);
+	vec->sdata = calloc(len + 1, sizeof(float));
+	vec->single = 1;
+	return vec;
+}
+
+/* Returns 1 if constructors must create single precision vectors */
+static int c_default_single(lua_State *L)
+{
+	lua_getfield(L, LUA_REGISTRYINDEX, "MLSMat::single");
+	int single = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	return single;
+}
+
+/*
+ * Converts owned writable double precision storage of vector to single
+ * precision (the vector is kept in double precision if there is no memory)
+ */
+static void c_realvector_tosingle(RealVector *vec)
+{
+	if (vec->single || vec->readonly || vec->external || vec->mapbase != NULL) {
+		return;
+	}
+	float *sdata = malloc((vec->len + 1) * sizeof(float));
+	if (sdata == NULL) {
+		return;
+	}
+	for (int i = 1; i <= vec->len; i++) {
+		sdata[i] = (float) vec->data[i];
+	}
+	free(vec->data);
+	vec->data = NULL;
+	vec->sdata = sdata;
+	vec->single = 1;
+}
+
+/* Sets default precision (see RealVector.setprecision) for a new vector */
+static void c_realvector_setdefault(lua_State *L, RealVector *vec)
+{
+	if (c_default_single(L)) {
+		c_realvector_tosingle(vec);
+	}
+}
+
+/*
+ * Returns double precision data of the vector (0-based). Single precision
+ * data is converted to the temporary array *tmp that must be freed by caller.
+ */
+static const double *c_realvector_doubledata(const RealVector *vec, double **tmp)
+{
+	*tmp = NULL;
+	if (!vec->single) {
+		return vec->data + 1;
+	}
+	*tmp = malloc((vec->len + 1) * sizeof(double));
+	for (int i = 0; i < vec->len; i++) {
+		(*tmp)[i] = vec->sdata[i + 1];
+	}
+	return *tmp;
+}
+
+/*========== Pseudorandom numbers generator ==========*/
+/*
+ * RandomStream contains 4 interleaved xoshiro256+ generators (lanes)
+ * separated by 2^128 steps (jump function), i.e. their subsequences
+ * don't overlap. Streams for parallel workers are separated by 2^192
+ * steps (long jump function), so each worker gets independent and
+ * reproducible sequence. Lanes are processed by SSE2 (if available),
+ * uniform numbers contain 52 random bits.
+ */
+static const unsigned long long c_xoshiro_jump[4] = {0x180ec6d33cfd0abaULL,
+	0xd5a61266f0c9392cULL, 0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL};
+static const unsigned long long c_xoshiro_longjump[4] = {0x76e15d3efefdcbbfULL,
+	0xc5004e441c522fb3ULL, 0x77710069854ee241ULL, 0x39109bb02acbe635ULL};
+
+static unsigned long long c_splitmix64(unsigned long long *x)
+{
+	unsigned long long z = (*x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/* Makes one step of l-th lane and returns its output */
+static unsigned long long c_xoshiro_next(RandomStream *rs, int l)
+{
+	unsigned long long s0 = rs->s[0][l], s1 = rs->s[1][l], s2 = rs->s[2][l], s3 = rs->s[3][l];
+	unsigned long long res = s0 + s3, t = s1 << 17;
+	s2 ^= s0; s3 ^= s1; s1 ^= s2; s0 ^= s3; s2 ^= t;
+	s3 = (s3 << 45) | (s3 >> 19);
+	rs->s[0][l] = s0; rs->s[1][l] = s1; rs->s[2][l] = s2; rs->s[3][l] = s3;
+	return res;
+}
+
+/* Jumps l-th lane ahead by polynomial poly (jump or long jump) */
+static void c_xoshiro_jumplane(RandomStream *rs, int l, const unsigned long long *poly)
+{
+	unsigned long long s[4] = {0, 0, 0, 0};
+	for (int i = 0; i < 4; i++) {
+		for (int b = 0; b < 64; b++) {
+			if (poly[i] & (1ULL << b)) {
+				for (int w = 0; w < 4; w++) {
+					s[w] ^= rs->s[w][l];
+				}
+			}
+			c_xoshiro_next(rs, l);
+		}
+	}
+	for (int w = 0; w < 4; w++) {
+		rs->s[w][l] = s[w];
+	}
+}
+
+/* Initializes all lanes of the stream from 64-bit seed */
+static void c_randomstream_seed(RandomStream *rs, unsigned long long seed)
+{
+	for (int w = 0; w < 4; w++) {
+		rs->s[w][0] = c_splitmix64(&seed);
+	}
+	for (int l = 1; l < 4; l++) {
+		for (int w = 0; w < 4; w++) {
+			rs->s[w][l] = rs->s[w][l - 1];
+		}
+		c_xoshiro_jumplane(rs, l, c_xoshiro_jump);
+	}
+	rs->nbuf = 0;
+	rs->hasspare = 0;
+}
+
+/* Moves the stream to the next independent subsequence (2^192 steps) */
+static void c_randomstream_longjump(RandomStream *rs)
+{
+	for (int l = 0; l < 4; l++) {
+		c_xoshiro_jumplane(rs, l, c_xoshiro_longjump);
+	}
+	rs->nbuf = 0;
+	rs->hasspare = 0;
+}
+
+#if !defined(__SSE2__)
+/* Converts 64-bit integer to double from [0;1) (52 high bits are used) */
+static double c_u64_to_double(unsigned long long x)
+{
+	union {unsigned long long i; double d;} u;
+	u.i = (x >> 12) | 0x3FF0000000000000ULL;
+	return u.d - 1.0;
+}
+#else
+/* One step of two lanes of xoshiro256+ (res is output) */
+#define XOSHIRO_SSE2_STEP(s0, s1, s2, s3, res) { \
+	__m128i t = _mm_slli_epi64(s1, 17); \
+	res = _mm_add_epi64(s0, s3); \
+	s2 = _mm_xor_si128(s2, s0); s3 = _mm_xor_si128(s3, s1); \
+	s1 = _mm_xor_si128(s1, s2); s0 = _mm_xor_si128(s0, s3); \
+	s2 = _mm_xor_si128(s2, t); \
+	s3 = _mm_or_si128(_mm_slli_epi64(s3, 45), _mm_srli_epi64(s3, 19)); \
+}
+#endif
+
+/* Fills out with nblocks blocks of 4 uniform numbers (one from each lane) */
+static void c_randomstream_blocks(RandomStream *rs, double *out, int nblocks)
+{
+#if defined(__SSE2__)
+	__m128i a0 = _mm_loadu_si128((__m128i *) &rs->s[0][0]), b0 = _mm_loadu_si128((__m128i *) &rs->s[0][2]);
+	__m128i a1 = _mm_loadu_si128((__m128i *) &rs->s[1][0]), b1 = _mm_loadu_si128((__m128i *) &rs->s[1][2]);
+	__m128i a2 = _mm_loadu_si128((__m128i *) &rs->s[2][0]), b2 = _mm_loadu_si128((__m128i *) &rs->s[2][2]);
+	__m128i a3 = _mm_loadu_si128((__m128i *) &rs->s[3][0]), b3 = _mm_loadu_si128((__m128i *) &rs->s[3][2]);
+	const __m128i expbits = _mm_set1_epi64x(0x3FF0000000000000LL);
+	const __m128d one = _mm_set1_pd(1.0);
+	for (int k = 0; k < nblocks; k++, out += 4) {
+		__m128i ra, rb;
+		XOSHIRO_SSE2_STEP(a0, a1, a2, a3, ra);
+		XOSHIRO_SSE2_STEP(b0, b1, b2, b3, rb);
+		ra = _mm_or_si128(_mm_srli_epi64(ra, 12), expbits);
+		rb = _mm_or_si128(_mm_srli_epi64(rb, 12), expbits);
+		_mm_storeu_pd(out, _mm_sub_pd(_mm_castsi128_pd(ra), one));
+		_mm_storeu_pd(out + 2, _mm_sub_pd(_mm_castsi128_pd(rb), one));
+	}
+	_mm_storeu_si128((__m128i *) &rs->s[0][0], a0); _mm_storeu_si128((__m128i *) &rs->s[0][2], b0);
+	_mm_storeu_si128((__m128i *) &rs->s[1][0], a1); _mm_storeu_si128((__m128i *) &rs->s[1][2], b1);
+	_mm_storeu_si128((__m128i *) &rs->s[2][0], a2); _mm_storeu_si128((__m128i *) &rs->s[2][2], b2);
+	_mm_storeu_si128((__m128i *) &rs->s[3][0], a3); _mm_storeu_si128((__m128i *) &rs->s[3][2], b3);
+#else
+	for (int k = 0; k < nblocks; k++, out += 4) {
+		for (int l = 0; l < 4; l++) {
+			out[l] = c_u64_to_double(c_xoshiro_next(rs, l));
+		}
+	}
+#endif
+}
+
+/*
+ * Generates n uniform numbers from [0;1). The sequence doesn't depend
+ * on how it is divided into calls (unused numbers of the last block
+ * are saved in the stream)
+ */
+static void c_randomstream_uniform(RandomStream *rs, double *out, int n)
+{
+	int i = 0;
+	while (i < n && rs->nbuf > 0) {
+		out[i++] = rs->buf[4 - rs->nbuf--];
+	}
+	int nblocks = (n - i) / 4;
+	c_randomstream_blocks(rs, out + i, nblocks);
+	i += 4 * nblocks;
+	if (i < n) {
+		c_randomstream_blocks(rs, rs->buf, 1);
+		rs->nbuf = 4;
+		while (i < n) {
+			out[i++] = rs->buf[4 - rs->nbuf--];
+		}
+	}
+}
+
+/* Generates n N(0;1) numbers by Box-Muller method (both numbers of a pair are used) */
+static void c_randomstream_normal(RandomStream *rs, double *out, int n)
+{
+	double u[512];
+	int i = 0;
+	if (n > 0 && rs->hasspare) {
+		out[i++] = rs->spare;
+		rs->hasspare = 0;
+	}
+	while (i < n) {
+		int npairs = (n - i + 1) / 2;
+		if (npairs > 256) {
+			npairs = 256;
+		}
+		c_randomstream_uniform(rs, u, 2 * npairs);
+		for (int k = 0; k < npairs; k++) {
+			double r = sqrt(-2.0 * log(1.0 - u[2*k])), phi = 2.0 * M_PI * u[2*k + 1];
+			out[i++] = r * cos(phi);
+			if (i < n) {
+				out[i++] = r * sin(phi);
+			} else {
+				rs->spare = r * sin(phi);
+				rs->hasspare = 1;
+			}
+		}
+	}
+}
+
+/* Returns default stream of the Lua state (it is created at the first call) */
+static RandomStream *c_default_stream(lua_State *L)
+{
+	lua_getfield(L, LUA_REGISTRYINDEX, "MLSMat::DefaultStream");
+	RandomStream *rs = (RandomStream *) lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if (rs == NULL) {
+		rs = (RandomStream *) lua_newuserdata(L, sizeof(RandomStream));
+		c_randomstream_seed(rs, (unsigned long long) time(NULL) ^ (unsigned long long) (size_t) L);
+		lua_setfield(L, LUA_REGISTRYINDEX, "MLSMat::DefaultStream");
+	}
+	return rs;
+}
+
+/* Distributions for c_random_vector */
+enum {RNG_UNIFORM, RNG_NORMAL, RNG_EXP};
+
+/*
+ * Creates vector of random numbers, its size is taken from narg-th argument:
+ *   RNG_UNIFORM -- U[a;b)
+ *   RNG_NORMAL -- N(a;b^2)
+ *   RNG_EXP -- exponential distribution with rate a
+ */
+static int c_random_vector(lua_State *L, RandomStream *rs, int narg, int dist, double a, double b)
+{
+	int len = (int) luaL_checkinteger(L, narg);
+	luaL_argcheck(L, len >= 0, narg, "Invalid size");
+	RealVector *vec = c_realvector_create(L, len);
+	double *out = vec->data + 1;
+	if (dist == RNG_NORMAL) {
+		c_randomstream_normal(rs, out, len);
+		if (a != 0.0 || b != 1.0) {
+			for (int i = 0; i < len; i++) {
+				out[i] = a + b * out[i];
+			}
+		}
+	} else {
+		c_randomstream_uniform(rs, out, len);
+		if (dist == RNG_EXP) {
+			for (int i = 0; i < len; i++) {
+				out[i] = -log(1.0 - out[i]) / a;
+			}
+		} else if (a != 0.0 || b != 1.0) {
+			for (int i = 0; i < len; i++) {
+				out[i] = a + (b - a) * out[i];
+			}
+		}
+	}
+	c_realvector_setdefault(L, vec);
+	return 1;
+}
+
+/*
+ * rs = RandomStream.new([seed [, k]])
+ * Creates stream initialized by integer seed (default is based on time)
+ * and moved to k-th independent subsequence (i.e. k long jumps, default 0).
+ * Parallel workers should use the same seed and different k.
+ */
+static int randomstream_new(lua_State *L)
+{
+	unsigned long long seed = lua_isnoneornil(L, 1) ?
+		(unsigned long long) time(NULL) : (unsigned long long) luaL_checkinteger(L, 1);
+	lua_Integer k = luaL_optinteger(L, 2, 0);
+	luaL_argcheck(L, k >= 0, 2, "Invalid number of jumps");
+	RandomStream *rs = (RandomStream *) lua_newuserdata(L, sizeof(RandomStream));
+	luaL_getmetatable(L, "MLSMat::RandomStream");
+	lua_setmetatable(L, -2);
+	c_randomstream_seed(rs, seed);
+	for (lua_Integer i = 0; i < k; i++) {
+		c_randomstream_longjump(rs);
+	}
+	return 1;
+}
+
+/* rs:rand(n) -- n numbers from U[0;1) */
+static int randomstream_rand(lua_State *L)
+{
+	RandomStream *rs = (RandomStream *) luaL_checkudata(L, 1, "MLSMat::RandomStream");
+	return c_random_vector(L, rs, 2, RNG_UNIFORM, 0.0, 1.0);
+}
+
+/* rs:randn(n [, mu, sigma]) -- n numbers from N(mu;sigma^2), default N(0;1) */
+static int randomstream_randn(lua_State *L)
+{
+	RandomStream *rs = (RandomStream *) luaL_checkudata(L, 1, "MLSMat::RandomStream");
+	double mu = luaL_optnumber(L, 3, 0.0), sigma = luaL_optnumber(L, 4, 1.0);
+	return c_random_vector(L, rs, 2, RNG_NORMAL, mu, sigma);
+}
+
+/* rs:uniform(n, a, b) -- n numbers from U[a;b) */
+static int randomstream_uniform(lua_State *L)
+{
+	RandomStream *rs = (RandomStream *) luaL_checkudata(L, 1, "MLSMat::RandomStream");
+	double a = luaL_checknumber(L, 3), b = luaL_checknumber(L, 4);
+	return c_random_vector(L, rs, 2, RNG_UNIFORM, a, b);
+}
+
+/* rs:exp(n [, lambda]) -- n numbers from exponential distribution (rate lambda, default 1) */
+static int randomstream_exp(lua_State *L)
+{
+	RandomStream *rs = (RandomStream *) luaL_checkudata(L, 1, "MLSMat::RandomStream");
+	double lambda = luaL_optnumber(L, 3, 1.0);
+	luaL_argcheck(L, lambda > 0, 3, "Rate must be positive");
+	return c_random_vector(L, rs, 2, RNG_EXP, lambda, 0.0);
+}
+
+/* rs:jump([k]) -- moves the stream k subsequences ahead (default 1), returns rs */
+static int randomstream_jump(lua_State *L)
+{
+	RandomStream *rs = (RandomStream *) luaL_checkudata(L, 1, "MLSMat::RandomStream");
+	lua_Integer k = luaL_optinteger(L, 2, 1);
+	for (lua_Integer i = 0; i < k; i++) {
+		c_randomstream_longjump(rs);
+	}
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int randomstream_tostring(lua_State *L)
+{
+	luaL_checkudata(L, 1, "MLSMat::RandomStream");
+	lua_pushstring(L, "<RandomStream: xoshiro256+ x4>");
+	return 1;
+}
+
+static const struct luaL_Reg randomstream_funcs[] = {
+	{"new", randomstream_new},
+	{"rand", randomstream_rand},
+	{"randn", randomstream_randn},
+	{"uniform", randomstream_uniform},
+	{"exp", randomstream_exp},
+	{"jump", randomstream_jump},
+	{"__tostring", randomstream_tostring},
+	{NULL, NULL}
+};
+
 static int realvector_rand(lua_State *L)
 {
 	if (lua_gettop(L) != 1) {
 		luaL_error(L, "Invalid number of input arguments");
 	}
-	if (lua_isinteger(L, 1)) {
-		/* Create array of U[0;1] of required size */
-		int len = luaL_checkinteger(L, 1);
-		luaL_argcheck(L, len >= 0, 1, "Invalid size");
-		RealVector *vec = c_realvector_create(L, len);
-		double *out = vec->data + 1;
-		for (int i = 1; i <= vec->len; i++) {
-			*out++ = (double) rand() / RAND_MAX;
-		}
-	} else {
+	if (!lua_isinteger(L, 1)) {
 		luaL_error(L, "Input argument must be an integer value");
 	}
-	return 1;
+	/* Create array of U[0;1] of required size */
+	return c_random_vector(L, c_default_stream(L), 1, RNG_UNIFORM, 0.0, 1.0);
 }
 
 static int realvector_randn(lua_State *L)
@@ -131,21 +546,19 @@ static int realvector_randn(lua_State *L)
 	if (lua_gettop(L) != 1) {
 		luaL_error(L, "Invalid number of input arguments");
 	}
-	if (lua_isinteger(L, 1)) {
-		/* Create array of N(0;1) of required size */
-		int len = luaL_checkinteger(L, 1);
-		luaL_argcheck(L, len >= 0, 1, "Invalid size");
-		RealVector *vec = c_realvector_create(L, len);
-		double *out = vec->data + 1;
-		for (int i = 1; i <= vec->len; i++) {
-			double u1 = (double) rand() / RAND_MAX;
-			double u2 = (double) rand() / RAND_MAX;			
-			*out++ = sqrt(-2*log(u1)) * cos(2*M_PI*u2);
-		}
-	} else {
+	if (!lua_isinteger(L, 1)) {
 		luaL_error(L, "Input argument must be an integer value");
 	}
-	return 1;
+	/* Create array of N(0;1) of required size */
+	return c_random_vector(L, c_default_stream(L), 1, RNG_NORMAL, 0.0, 1.0);
+}
+
+/* RealVector.seed(seed) reinitializes default stream used by rand and randn */
+static int realvector_seed(lua_State *L)
+{
+	lua_Integer seed = luaL_checkinteger(L, 1);
+	c_randomstream_seed(c_default_stream(L), (unsigned long long) seed);
+	return 0;
 }
 
 
@@ -159,10 +572,36 @@ static int realvector_new(lua_State *L)
 		/* Create zero-filled array of required size */
 		int len = luaL_checkinteger(L, 1);
 		luaL_argcheck(L, len >= 0, 1, "Invalid size");
-		(void) c_realvector_create(L, len);
+		(void) c_realvector_create_prec(L, len, c_default_single(L));
 	} else if (lua_istable(L, 1)) {
+		/* Fast path for sequences: values are read by one pass over the
+		   array part, the table is accepted if it has no other keys */
+		int len = (int) lua_rawlen(L, 1), isnum = 1;
+		if (len > 0) {
+			RealVector *vec = c_realvector_create(L, len);
+			int vecpos = lua_gettop(L), nkeys = 0;
+			double *out = vec->data + 1;
+			for (int i = 1; i <= len && isnum; i++) {
+				lua_rawgeti(L, 1, i);
+				*out++ = lua_tonumberx(L, -1, &isnum);
+				lua_pop(L, 1);
+			}
+			if (isnum) {
+				lua_pushnil(L);
+				while (lua_next(L, 1) != 0 && nkeys <= len) {
+					lua_pop(L, 1);
+					nkeys++;
+				}
+				if (nkeys == len) {
+					lua_settop(L, vecpos);
+					c_realvector_setdefault(L, vec);
+					return 1;
+				}
+			}
+			lua_settop(L, 1); /* Fall back to the general case */
+		}
 		/* Create vector from an array */
-		int len = 0;
+		len = 0;
 		/* a) check all data and define vector size */
 		lua_pushnil(L);
 		while (lua_next(L, 1) != 0) {
@@ -195,6 +634,7 @@ static int realvector_new(lua_State *L)
 			vec->data[ind] = val;
 			lua_pop(L, 1); /* Remove value from stack */
 		}
+		c_realvector_setdefault(L, vec);
 	} else {
 		luaL_error(L, "Input argument must be either integer or table");
 	}
@@ -204,7 +644,18 @@ static int realvector_new(lua_State *L)
 static int realvector_gc(lua_State *L)
 {
 	RealVector *vec = luaL_checkudata(L, -1, "MLSMat::RealVector");
-	free(vec->data);
+	if (vec->mapbase == NULL) {
+		if (!vec->external) {
+			free(vec->data);
+			free(vec->sdata);
+		}
+		return 0;
+	}
+#ifdef _WIN32
+	UnmapViewOfFile(vec->mapbase);
+#else
+	munmap(vec->mapbase, vec->mapsize);
+#endif
 	return 0;
 }
 
@@ -286,85 +737,322 @@ static BinOpArgInfo realvector_binop_arginfo(lua_State *L)
 		int v1len = res.arg1.vec->len, v2len = res.arg2.vec->len;
 		if (v1len != 1 && v2len == 1) { /* V2 is scalar */
 			res.vec = res.arg1.vec;
-			res.val = res.arg2.vec->data[1];
+			res.val = REALVECTOR_GET(res.arg2.vec, 1);
 			res.flags = 2;
 		} else if (v1len == 1 && v2len != 1) { /* V1 is scalar */
-			res.val = res.arg1.vec->data[1];
+			res.val = REALVECTOR_GET(res.arg1.vec, 1);
 			res.vec = res.arg2.vec;
 			res.flags = 1;
 		} else if (v1len != v2len) { /* Both are vectors: check sizes */
 			luaL_error(L, "RealVector sizes are mismatching");
 		} 
 	}
-	/* Preallocate output vector */
+	/* Preallocate output vector: scalars (including 1-element vectors)
+	   take precision of the other argument, vectors of different
+	   precisions give single precision result */
 	if (res.flags == 3) {
-		res.resvec = c_realvector_create(L, res.arg1.vec->len);
+		res.resvec = c_realvector_create_prec(L, res.arg1.vec->len,
+			res.arg1.vec->single || res.arg2.vec->single);
 	} else {
-		res.resvec = c_realvector_create(L, res.vec->len);
+		res.resvec = c_realvector_create_prec(L, res.vec->len, res.vec->single);
 	}
 	/* Return info about arguments types */
 	return res;
 }
 
-#define REALVECTOR_BINOP_BODY(op) \
+/*
+ * Binary operations are computed in double precision, the result is
+ * rounded to float if the output vector has single precision
+ */
+#define REALVECTOR_BINOP_BODY(OPF) \
 { \
 	BinOpArgInfo ai = realvector_binop_arginfo(L); \
 	if (ai.flags > 32) { \
 		return 1; \
 	} \
-	double *in1 = ai.vec->data + 1, *in2, *out = ai.resvec->data + 1; \
-	if (ai.flags == 2) { \
-		for (int i = 1; i <= ai.vec->len; i++) \
-			*out++ = *in1++ op ai.val; \
-	} else if (ai.flags == 1) { \
-		for (int i = 1; i <= ai.vec->len; i++) \
-			*out++ = ai.val op *in1++; \
-	} else if (ai.flags == 3) { \
-		in1 = ai.arg1.vec->data + 1; in2 = ai.arg2.vec->data + 1; \
-		for (int i = 1; i <= ai.vec->len; i++) \
-			*out++ = *in1++ op *in2++; \
+	RealVector *v1 = ai.arg1.vec, *v2 = ai.arg2.vec, *rv = ai.resvec; \
+	int len = rv->len; \
+	if (ai.flags == 3 && !rv->single) { \
+		double *in1 = v1->data + 1, *in2 = v2->data + 1, *out = rv->data + 1; \
+		for (int i = 0; i < len; i++) \
+			out[i] = OPF(in1[i], in2[i]); \
+	} else if (ai.flags == 3 && v1->single && v2->single) { \
+		float *in1 = v1->sdata + 1, *in2 = v2->sdata + 1, *out = rv->sdata + 1; \
+		for (int i = 0; i < len; i++) \
+			out[i] = (float) OPF((double) in1[i], (double) in2[i]); \
+	} else if (ai.flags == 3) { /* Mixed precision */ \
+		for (int i = 1; i <= len; i++) \
+			rv->sdata[i] = (float) OPF(REALVECTOR_GET(v1, i), REALVECTOR_GET(v2, i)); \
+	} else if (!rv->single) { \
+		double *in = ai.vec->data + 1, *out = rv->data + 1; \
+		if (ai.flags == 2) { \
+			for (int i = 0; i < len; i++) \
+				out[i] = OPF(in[i], ai.val); \
+		} else { \
+			for (int i = 0; i < len; i++) \
+				out[i] = OPF(ai.val, in[i]); \
+		} \
+	} else { \
+		float *in = ai.vec->sdata + 1, *out = rv->sdata + 1; \
+		if (ai.flags == 2) { \
+			for (int i = 0; i < len; i++) \
+				out[i] = (float) OPF((double) in[i], ai.val); \
+		} else { \
+			for (int i = 0; i < len; i++) \
+				out[i] = (float) OPF(ai.val, (double) in[i]); \
+		} \
 	} \
 	return 1; \
 }
 
+#define BINOP_ADD(a, b) ((a) + (b))
+#define BINOP_SUB(a, b) ((a) - (b))
+#define BINOP_MUL(a, b) ((a) * (b))
+#define BINOP_DIV(a, b) ((a) / (b))
+
 static int realvector_add(lua_State *L)
-REALVECTOR_BINOP_BODY(+)
+REALVECTOR_BINOP_BODY(BINOP_ADD)
 
 static int realvector_sub(lua_State *L)
-REALVECTOR_BINOP_BODY(-)
+REALVECTOR_BINOP_BODY(BINOP_SUB)
 
 static int realvector_mul(lua_State *L)
-REALVECTOR_BINOP_BODY(*)
+REALVECTOR_BINOP_BODY(BINOP_MUL)
 
 static int realvector_div(lua_State *L)
-REALVECTOR_BINOP_BODY(/)
+REALVECTOR_BINOP_BODY(BINOP_DIV)
+
+/*
+ * Kernels for x^e with scalar exponent: small integer exponents use
+ * multiplication chains (binary exponentiation), half-integer exponents
+ * use sqrt, other exponents use pow
+ */
+#define POW_MAXINT 16 /* Maximal |e| for multiplication chains */
+
+/* Kinds of exponents (see c_pow_kind) */
+enum {POW_GENERIC, POW_INT, POW_SQRT, POW_RSQRT, POW_HALFINT};
+
+/* Returns kind of exponent e and its integer part n (if applicable) */
+static int c_pow_kind(double e, int *n)
+{
+	if (fabs(e) > POW_MAXINT) {
+		return POW_GENERIC;
+	} else if (e == floor(e)) {
+		*n = (int) e;
+		return POW_INT;
+	} else if (e == 0.5) {
+		return POW_SQRT;
+	} else if (e == -0.5) {
+		return POW_RSQRT;
+	} else if (e > 0 && e - 0.5 == floor(e)) {
+		*n = (int) floor(e); /* x^e = x^n * sqrt(x) */
+		return POW_HALFINT;
+	}
+	return POW_GENERIC;
+}
+
+/* x^n for integer n (binary exponentiation) */
+static double c_powi(double x, int n)
+{
+	unsigned int k = (n < 0) ? -n : n;
+	double r = 1.0;
+	while (k != 0) {
+		if (k & 1) {
+			r *= x;
+		}
+		x *= x;
+		k >>= 1;
+	}
+	return (n < 0) ? 1.0 / r : r;
+}
+
+#define POW_LOOP(EXPR) \
+	for (int i = 0; i < len; i++) { \
+		double x = (double) in[i]; \
+		out[i] = EXPR; \
+	}
+
+#define POW_ARRAY_BODY \
+{ \
+	int n = 0, kind = c_pow_kind(e, &n); \
+	if (kind == POW_INT && n == 2) { \
+		POW_LOOP(x * x) \
+	} else if (kind == POW_INT && n == -1) { \
+		POW_LOOP(1.0 / x) \
+	} else if (kind == POW_INT) { \
+		POW_LOOP(c_powi(x, n)) \
+	} else if (kind == POW_SQRT) { \
+		POW_LOOP(sqrt(x)) \
+	} else if (kind == POW_RSQRT) { \
+		POW_LOOP(1.0 / sqrt(x)) \
+	} else if (kind == POW_HALFINT) { \
+		POW_LOOP(c_powi(x, n) * sqrt(x)) \
+	} else { \
+		POW_LOOP(pow(x, e)) \
+	} \
+}
+
+/* out[i] = in[i]^e, i = 0..len-1 */
+static void c_pow_array_d(const double *in, double *out, int len, double e)
+POW_ARRAY_BODY
 
+static void c_pow_array_s(const float *in, float *out, int len, double e)
+POW_ARRAY_BODY
+
+/* vec^number and vec^(1-element vector) use kernels for scalar exponents */
 static int realvector_pow(lua_State *L)
 {
-	BinOpArgInfo ai = realvector_binop_arginfo(L);
-	if (ai.flags > 32) {
-		return 1;
+	RealVector *vec = (RealVector *) luaL_testudata(L, 1, "MLSMat::RealVector"), *evec = NULL;
+	if (vec == NULL || (lua_type(L, 2) != LUA_TNUMBER &&
+		((evec = (RealVector *) luaL_testudata(L, 2, "MLSMat::RealVector")) == NULL ||
+		evec->len != 1 || vec->len == 1))) {
+		/* Vector (or class) exponents */
+		REALVECTOR_BINOP_BODY(pow)
 	}
-	double *in1 = ai.vec->data + 1, *in2, *out = ai.resvec->data + 1;
-	if (ai.flags == 2) {
-		for (int i = 1; i <= ai.vec->len; i++)
-			*out++ = pow(*in1++, ai.val);
-	} else if (ai.flags == 1) {
-		for (int i = 1; i <= ai.vec->len; i++)
-			*out++ = pow(ai.val, *in1++);
-	} else if (ai.flags == 3) {
-		in1 = ai.arg1.vec->data + 1; in2 = ai.arg2.vec->data + 1;
-		for (int i = 1; i <= ai.vec->len; i++)
-			*out++ = pow(*in1++, *in2++);
+	double e = (evec != NULL) ? REALVECTOR_GET(evec, 1) : lua_tonumber(L, 2);
+	RealVector *rv = c_realvector_create_prec(L, vec->len, vec->single);
+	if (vec->single) {
+		c_pow_array_s(vec->sdata + 1, rv->sdata + 1, vec->len, e);
+	} else {
+		c_pow_array_d(vec->data + 1, rv->data + 1, vec->len, e);
 	}
 	return 1;
 }
 
+/* Argument of RealVector.dpow: number or RealVector (1-element vectors are broadcasted) */
+typedef struct {
+	const RealVector *vec;
+	double val;
+} PowArg;
+
+static void c_powarg_check(lua_State *L, int narg, PowArg *p)
+{
+	p->vec = (const RealVector *) luaL_testudata(L, narg, "MLSMat::RealVector");
+	if (p->vec == NULL) {
+		p->val = luaL_checknumber(L, narg);
+	} else if (p->vec->len == 1) {
+		p->val = REALVECTOR_GET(p->vec, 1);
+		p->vec = NULL;
+	}
+}
+
+/* Value of i-th element of vector (1-based) with broadcasting of 1-element vectors */
+#define POW_VECGET(v, i) REALVECTOR_GET(v, ((v)->len == 1) ? 1 : (i))
+
+/* Reads table of imaginary parts (narg) to the array (NULL for nil) */
+static const RealVector **c_dpow_imag(lua_State *L, int narg, int *nvars, int len)
+{
+	if (lua_isnoneornil(L, narg)) {
+		return NULL;
+	}
+	luaL_checktype(L, narg, LUA_TTABLE);
+	int n = (int) lua_rawlen(L, narg);
+	if (*nvars != -1 && n != *nvars) {
+		luaL_error(L, "Numbers of variables are not consistent");
+	}
+	*nvars = n;
+	const RealVector **imag = (const RealVector **) lua_newuserdata(L, (n + 1) * sizeof(RealVector *));
+	for (int k = 0; k < n; k++) {
+		lua_rawgeti(L, narg, k + 1);
+		imag[k] = (const RealVector *) luaL_testudata(L, -1, "MLSMat::RealVector");
+		lua_pop(L, 1);
+		if (imag[k] == NULL || (imag[k]->len != len && imag[k]->len != 1)) {
+			luaL_error(L, "Imaginary part %d must be a RealVector of consistent size", k + 1);
+		}
+	}
+	return imag;
+}
+
+/*
+ * f, df = RealVector.dpow(x, y, dx, dy) is a fused kernel for derivatives
+ * of f = x^y (used by DualNVector.__pow):
+ *   df[k] = y*x^(y-1)*dx[k] + x^y*log(x)*dy[k]
+ * x and y are numbers or RealVectors, dx and dy are tables of imaginary
+ * parts (RealVectors) or nil for constants. The second term is omitted
+ * for dy[k] = 0, so non-positive bases with constant exponents don't
+ * give NaN. x^y and x^(y-1) with scalar y use kernels of realvector_pow.
+ */
+static int realvector_dpow(lua_State *L)
+{
+	PowArg x, y;
+	c_powarg_check(L, 1, &x);
+	c_powarg_check(L, 2, &y);
+	int len = 1;
+	if (x.vec != NULL && y.vec != NULL && x.vec->len != y.vec->len) {
+		luaL_error(L, "RealVector sizes are mismatching");
+	} else if (x.vec != NULL || y.vec != NULL) {
+		len = (x.vec != NULL) ? x.vec->len : y.vec->len;
+	}
+	int nvars = -1;
+	const RealVector **dx = c_dpow_imag(L, 3, &nvars, len);
+	const RealVector **dy = c_dpow_imag(L, 4, &nvars, len);
+	if (nvars == -1) {
+		nvars = 0;
+	}
+	/* Values and coefficients of derivatives (a = y*x^(y-1), b = x^y*log(x)) */
+	double *xd = (double *) calloc(4 * (len + 1), sizeof(double));
+	double *f = xd + len + 1, *a = f + len + 1, *b = a + len + 1;
+	for (int i = 0; i < len; i++) {
+		xd[i] = (x.vec != NULL) ? REALVECTOR_GET(x.vec, i + 1) : x.val;
+	}
+	if (y.vec == NULL) {
+		c_pow_array_d(xd, f, len, y.val);
+		c_pow_array_d(xd, a, len, y.val - 1.0);
+		for (int i = 0; i < len; i++) {
+			a[i] *= y.val;
+		}
+	} else {
+		for (int i = 0; i < len; i++) {
+			double yi = REALVECTOR_GET(y.vec, i + 1);
+			f[i] = pow(xd[i], yi);
+			a[i] = yi * pow(xd[i], yi - 1.0);
+		}
+	}
+	if (dy != NULL) {
+		for (int i = 0; i < len; i++) {
+			b[i] = f[i] * log(xd[i]);
+		}
+	}
+	/* Real part: precision rules are the same as for binary operations */
+	int single = (x.vec != NULL && x.vec->single) || (y.vec != NULL && y.vec->single);
+	RealVector *rv = c_realvector_create_prec(L, len, single);
+	lua_insert(L, -3); /* Remove service values created by c_realvector_wrap */
+	lua_pop(L, 2);
+	for (int i = 0; i < len; i++) {
+		REALVECTOR_SET(rv, i + 1, f[i]);
+	}
+	/* Imaginary parts */
+	lua_createtable(L, nvars, 0);
+	for (int k = 0; k < nvars; k++) {
+		int isingle = single || (dx != NULL && dx[k]->single) || (dy != NULL && dy[k]->single);
+		RealVector *iv = c_realvector_create_prec(L, len, isingle);
+		for (int i = 1; i <= len; i++) {
+			double d = (dx != NULL) ? a[i - 1] * POW_VECGET(dx[k], i) : 0.0;
+			double dyi = (dy != NULL) ? POW_VECGET(dy[k], i) : 0.0;
+			if (dyi != 0.0) {
+				d += b[i - 1] * dyi;
+			}
+			REALVECTOR_SET(iv, i, d);
+		}
+		lua_rawseti(L, -4, k + 1);
+		lua_pop(L, 2);
+	}
+	free(xd);
+	return 2;
+}
+
 #define REALVECTOR_UNOP_BODY(op) \
 { \
 	RealVector *vec = (RealVector *) luaL_testudata(L, -1, "MLSMat::RealVector"); \
-	int len = vec->len; double *in = vec->data + 1, *out = (c_realvector_create(L, len))->data + 1; \
-	for (int i = 1; i <= len; i++) *out++ = op(*in++); \
+	int len = vec->len; \
+	RealVector *resvec = c_realvector_create_prec(L, len, vec->single); \
+	if (vec->single) { \
+		float *in = vec->sdata + 1, *out = resvec->sdata + 1; \
+		for (int i = 1; i <= len; i++) *out++ = (float) op((double) *in++); \
+	} else { \
+		double *in = vec->data + 1, *out = resvec->data + 1; \
+		for (int i = 1; i <= len; i++) *out++ = op(*in++); \
+	} \
 	return 1; \
 }
 
@@ -391,48 +1079,129 @@ static int realvector_totable(lua_State *L)
 		luaL_error(L, "Invalid number of arguments");
 	}
 	RealVector *vec = luaL_checkudata(L, -1, "MLSMat::RealVector");
-	lua_newtable(L);
+	lua_createtable(L, vec->len, 0);
 	for (int i = 1; i <= vec->len; i++) {
-		lua_pushinteger(L, i);
-		lua_pushnumber(L, vec->data[i]);
-		lua_settable(L, -3);
+		lua_pushnumber(L, REALVECTOR_GET(vec, i));
+		lua_rawseti(L, -2, i);
 	}
 	return 1;
 }
 
-static int realvector_tostring(lua_State *L)
+/*
+ * RealVector.frombuffer(buf [, n]) creates a vector from the binary buffer
+ * of doubles (native byte order). buf is either a Lua string (n is optional,
+ * by default all the string is used) or a light userdata (n is required).
+ */
+static int realvector_frombuffer(lua_State *L)
 {
-	char buf[64];
-	RealVector *vec = (RealVector *) luaL_checkudata(L, -1, "MLSMat::RealVector");
-	char *result = (char *) calloc(32 + vec->len * 20, sizeof(char));
-	
-	result[0] = 0;
-	sprintf(buf, "RealVector: %d elements\n  ", vec->len); strcat(result, buf);
-	for (int i = 0; i < vec->len; i++) {
-		if (i % 5 == 0 && i > 0) {
-			strcat(result, "\n  ");
+	const double *src;
+	int len;
+	if (lua_type(L, 1) == LUA_TSTRING) {
+		size_t nbytes;
+		src = (const double *) lua_tolstring(L, 1, &nbytes);
+		luaL_argcheck(L, nbytes % sizeof(double) == 0, 1, "Invalid buffer size");
+		len = (int) (nbytes / sizeof(double));
+		if (!lua_isnoneornil(L, 2)) {
+			int n = (int) luaL_checkinteger(L, 2);
+			luaL_argcheck(L, n >= 0 && n <= len, 2, "Invalid size");
+			len = n;
 		}
-		sprintf(buf, "%12.5g ", vec->data[i+1]); strcat(result, buf);
+	} else if (lua_islightuserdata(L, 1)) {
+		src = (const double *) lua_touserdata(L, 1);
+		len = (int) luaL_checkinteger(L, 2);
+		luaL_argcheck(L, len >= 0, 2, "Invalid size");
+	} else {
+		return luaL_error(L, "Input argument must be either string or light userdata");
 	}
-	strcat(result, "\n");
-	lua_pushstring(L, result);
-	free(result);
+	RealVector *vec = c_realvector_create(L, len);
+	memcpy(vec->data + 1, src, len * sizeof(double));
+	c_realvector_setdefault(L, vec);
 	return 1;
 }
 
-static int realvector_getvalue(lua_State *L)
-{	/* Get data and check array index */
-	IndexRange *inds_ptr;
-	RealVector *vec = (RealVector *) luaL_checkudata(L, -2, "MLSMat::RealVector");
-	if (lua_isinteger(L, -1)) {
-		/* Variant 1: integer index */
-		int ind = luaL_checkinteger(L, -1);
-		luaL_argcheck(L, 1 <= ind && ind <= vec->len, 2, "Index is out of boundaries");
-		/* Return value */	
-		lua_pushnumber(L, vec->data[ind]);
-	} else if (lua_isstring(L, -1)) {
-		/* Variant 2: string index, return method from metatable */
-		luaL_getmetatable(L, "MLSMat::RealVector");
+/*
+ * vec:tobuffer([ptr]) returns the content of the vector as a Lua string
+ * of doubles (native byte order) or copies it to the memory pointed by
+ * light userdata ptr (it must have space for #vec doubles). Single
+ * precision vectors are converted to doubles.
+ */
+static int realvector_tobuffer(lua_State *L)
+{
+	RealVector *vec = (RealVector *) luaL_checkudata(L, 1, "MLSMat::RealVector");
+	double *dst;
+	if (lua_isnoneornil(L, 2)) {
+		if (!vec->single) {
+			lua_pushlstring(L, (const char *) (vec->data + 1), vec->len * sizeof(double));
+			return 1;
+		}
+		luaL_Buffer b;
+		dst = (double *) luaL_buffinitsize(L, &b, vec->len * sizeof(double));
+		for (int i = 0; i < vec->len; i++) {
+			dst[i] = vec->sdata[i + 1];
+		}
+		luaL_pushresultsize(&b, vec->len * sizeof(double));
+		return 1;
+	}
+	luaL_checktype(L, 2, LUA_TLIGHTUSERDATA);
+	dst = (double *) lua_touserdata(L, 2);
+	if (!vec->single) {
+		memcpy(dst, vec->data + 1, vec->len * sizeof(double));
+	} else {
+		for (int i = 0; i < vec->len; i++) {
+			dst[i] = vec->sdata[i + 1];
+		}
+	}
+	return 0;
+}
+
+/*
+ * vec:dataptr() returns light userdata with the address of the element
+ * with index 0 (elements 1..#vec follow it, so 1-based indices may be used),
+ * flags single and readonly. It is used by FFI views (see view in mlslib.lua).
+ */
+static int realvector_dataptr(lua_State *L)
+{
+	RealVector *vec = (RealVector *) luaL_checkudata(L, 1, "MLSMat::RealVector");
+	lua_pushlightuserdata(L, vec->single ? (void *) vec->sdata : (void *) vec->data);
+	lua_pushboolean(L, vec->single);
+	lua_pushboolean(L, vec->readonly);
+	return 3;
+}
+
+static int realvector_tostring(lua_State *L)
+{
+	char buf[64];
+	RealVector *vec = (RealVector *) luaL_checkudata(L, -1, "MLSMat::RealVector");
+	char *result = (char *) calloc(32 + vec->len * 20, sizeof(char));
+	
+	result[0] = 0;
+	sprintf(buf, "RealVector: %d elements%s\n  ", vec->len,
+		vec->single ? " (single precision)" : ""); strcat(result, buf);
+	for (int i = 0; i < vec->len; i++) {
+		if (i % 5 == 0 && i > 0) {
+			strcat(result, "\n  ");
+		}
+		sprintf(buf, "%12.5g ", REALVECTOR_GET(vec, i + 1)); strcat(result, buf);
+	}
+	strcat(result, "\n");
+	lua_pushstring(L, result);
+	free(result);
+	return 1;
+}
+
+static int realvector_getvalue(lua_State *L)
+{	/* Get data and check array index */
+	IndexRange *inds_ptr;
+	RealVector *vec = (RealVector *) luaL_checkudata(L, -2, "MLSMat::RealVector");
+	if (lua_isinteger(L, -1)) {
+		/* Variant 1: integer index */
+		int ind = luaL_checkinteger(L, -1);
+		luaL_argcheck(L, 1 <= ind && ind <= vec->len, 2, "Index is out of boundaries");
+		/* Return value */	
+		lua_pushnumber(L, REALVECTOR_GET(vec, ind));
+	} else if (lua_isstring(L, -1)) {
+		/* Variant 2: string index, return method from metatable */
+		luaL_getmetatable(L, "MLSMat::RealVector");
 		lua_pushvalue(L, -2);
 		lua_gettable(L, -2);
 	} else if ((inds_ptr = (IndexRange *) luaL_testudata(L, -1, "MLSMat::IndexRange")) != NULL) {
@@ -454,10 +1223,10 @@ static int realvector_getvalue(lua_State *L)
 				reslen++;
 			}
 		}
-		RealVector *resvec = (RealVector *) c_realvector_create(L, reslen);
-		double *in = vec->data, *out = resvec->data + 1;
-		for (int i = inds.a; ibegin <= i && i <= iend; i += inds.step) {
-			*out++ = in[i];
+		RealVector *resvec = (RealVector *) c_realvector_create_prec(L, reslen, vec->single);
+		int k = 1;
+		for (int i = inds.a; ibegin <= i && i <= iend; i += inds.step, k++) {
+			REALVECTOR_SET(resvec, k, REALVECTOR_GET(vec, i));
 		}
 	} else {
 		luaL_error(L, "bad argument #1 to '__index' (number, string or IndexRange expected)");
@@ -470,9 +1239,12 @@ static int realvector_setvalue(lua_State *L)
 	RealVector *vec = (RealVector *) luaL_checkudata(L, -3, "MLSMat::RealVector");
 	int ind = luaL_checkinteger(L, -2);
 	luaL_argcheck(L, 1 <= ind && ind <= vec->len, 2, "Index is out of boundaries");
+	if (vec->readonly) {
+		luaL_error(L, "Vector is read-only");
+	}
 	double value = luaL_checknumber(L, -1);
 	/* Set value */
-	vec->data[ind] = value;
+	REALVECTOR_SET(vec, ind, value);
 	return 0;
 }
 
@@ -487,26 +1259,307 @@ static int realvector_concat(lua_State *L)
 {
 	RealVector *vec1 = (RealVector *) luaL_checkudata(L, 1, "MLSMat::RealVector");
 	RealVector *vec2 = (RealVector *) luaL_checkudata(L, 2, "MLSMat::RealVector");
-	RealVector *resvec = (RealVector *) c_realvector_create(L, vec1->len + vec2->len);
+	RealVector *resvec = (RealVector *) c_realvector_create_prec(L, vec1->len + vec2->len,
+		vec1->single || vec2->single);
 
-	double *out = resvec->data + 1, *in1 = vec1->data + 1, *in2 = vec2->data + 1;
 	for (int i = 1; i <= vec1->len; i++) {
-		*out++ = *in1++;
+		REALVECTOR_SET(resvec, i, REALVECTOR_GET(vec1, i));
 	}
 	for (int i = 1; i <= vec2->len; i++) {
-		*out++ = *in2++;
+		REALVECTOR_SET(resvec, vec1->len + i, REALVECTOR_GET(vec2, i));
 	}
 	return 1;
 }
 
 static int realvector_copy(lua_State *L)
+{
+	RealVector *vec = (RealVector *) luaL_checkudata(L, 1, "MLSMat::RealVector");
+	RealVector *resvec = (RealVector *) c_realvector_create_prec(L, vec->len, vec->single);
+	if (vec->single) {
+		memcpy(resvec->sdata + 1, vec->sdata + 1, vec->len * sizeof(float));
+	} else {
+		memcpy(resvec->data + 1, vec->data + 1, vec->len * sizeof(double));
+	}
+	return 1;
+}
+
+/*
+ * vec:single() and vec:double() return copies of the vector with single
+ * and double precision storage. Rules of precision mixing:
+ *   1) arithmetic is always done in double precision, results are rounded
+ *      to float when stored into single precision vectors;
+ *   2) numbers and 1-element vectors take precision of the other argument;
+ *   3) operations with vectors of different precisions give single
+ *      precision result (i.e. precision is never increased implicitly);
+ *   4) reductions (min, max etc.) are accumulated in double precision;
+ *   5) unary operations and indexing keep precision of the argument.
+ */
+static int realvector_single(lua_State *L)
+{
+	RealVector *vec = (RealVector *) luaL_checkudata(L, 1, "MLSMat::RealVector");
+	RealVector *resvec = (RealVector *) c_realvector_create_prec(L, vec->len, 1);
+	for (int i = 1; i <= vec->len; i++) {
+		resvec->sdata[i] = (float) REALVECTOR_GET(vec, i);
+	}
+	return 1;
+}
+
+static int realvector_double(lua_State *L)
 {
 	RealVector *vec = (RealVector *) luaL_checkudata(L, 1, "MLSMat::RealVector");
 	RealVector *resvec = (RealVector *) c_realvector_create(L, vec->len);
-	memcpy(resvec->data + 1, vec->data + 1, vec->len * sizeof(double));
+	for (int i = 1; i <= vec->len; i++) {
+		resvec->data[i] = REALVECTOR_GET(vec, i);
+	}
+	return 1;
+}
+
+static int realvector_issingle(lua_State *L)
+{
+	RealVector *vec = (RealVector *) luaL_checkudata(L, 1, "MLSMat::RealVector");
+	lua_pushboolean(L, vec->single);
+	return 1;
+}
+
+/*
+ * RealVector.setprecision("single" or "double") sets precision of vectors
+ * created by constructors (new, rand, randn, linspace, frombuffer, loadtxt)
+ * in this Lua state. RealVector.getprecision() returns the current one.
+ */
+static int realvector_setprecision(lua_State *L)
+{
+	static const char *const modes[] = {"double", "single", NULL};
+	int single = luaL_checkoption(L, 1, NULL, modes);
+	lua_pushboolean(L, single);
+	lua_setfield(L, LUA_REGISTRYINDEX, "MLSMat::single");
+	return 0;
+}
+
+static int realvector_getprecision(lua_State *L)
+{
+	lua_pushstring(L, c_default_single(L) ? "single" : "double");
+	return 1;
+}
+
+/*========== RealVector reductions ==========*/
+/*
+ * Sums are computed by pairwise summation: blocks of REDUCE_BLOCK elements
+ * are summed by 4 independent accumulators (SSE2 for double precision
+ * vectors), the results of blocks are added pairwise (error grows as
+ * O(log n) instead of O(n)). Long vectors are divided into chunks of
+ * REDUCE_CHUNK elements that are processed in parallel if OpenMP is
+ * enabled (-fopenmp); partial sums are combined in fixed order, so
+ * results don't depend on the number of threads. Single precision data
+ * is accumulated in double precision.
+ */
+#define REDUCE_BLOCK 128
+#define REDUCE_CHUNK 65536
+
+/* Kinds of reductions for c_reduce */
+enum {REDUCE_SUM, REDUCE_SUMSQ, REDUCE_SUMSQDEV, REDUCE_DOT};
+
+#define REDUCE_PAIRWISE(name, T1, T2, EXPR) \
+static double name(const T1 *x, const T2 *y, double c, int n) \
+{ \
+	if (n > REDUCE_BLOCK) { \
+		int h = (n / 2) & ~3; \
+		return name(x, y, c, h) + name(x + h, y + h, c, n - h); \
+	} \
+	double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0; \
+	int i; \
+	for (i = 0; i + 4 <= n; i += 4) { \
+		s0 += EXPR(i); s1 += EXPR(i + 1); s2 += EXPR(i + 2); s3 += EXPR(i + 3); \
+	} \
+	for (; i < n; i++) { \
+		s0 += EXPR(i); \
+	} \
+	return (s0 + s2) + (s1 + s3); \
+}
+
+#define REDUCE_X(i) ((double) x[i])
+#define REDUCE_X2(i) ((double) x[i] * (double) x[i])
+#define REDUCE_XDEV2(i) (((double) x[i] - c) * ((double) x[i] - c))
+#define REDUCE_XY(i) ((double) x[i] * (double) y[i])
+
+REDUCE_PAIRWISE(c_sum_s, float, float, REDUCE_X)
+REDUCE_PAIRWISE(c_sumsq_s, float, float, REDUCE_X2)
+REDUCE_PAIRWISE(c_sumsqdev_d, double, double, REDUCE_XDEV2)
+REDUCE_PAIRWISE(c_sumsqdev_s, float, float, REDUCE_XDEV2)
+REDUCE_PAIRWISE(c_dot_sd, float, double, REDUCE_XY)
+REDUCE_PAIRWISE(c_dot_ss, float, float, REDUCE_XY)
+
+#if defined(__SSE2__)
+/* SSE2 versions for double precision: the same order of summation
+   as in REDUCE_PAIRWISE (lanes of acc0 are s0, s1; lanes of acc1 are s2, s3) */
+#define REDUCE_PAIRWISE_SSE2(name, LOADEXPR, EXPR) \
+static double name(const double *x, const double *y, double c, int n) \
+{ \
+	if (n > REDUCE_BLOCK) { \
+		int h = (n / 2) & ~3; \
+		return name(x, y, c, h) + name(x + h, y + h, c, n - h); \
+	} \
+	__m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd(); \
+	double s[2]; \
+	int i; \
+	for (i = 0; i + 4 <= n; i += 4) { \
+		acc0 = _mm_add_pd(acc0, LOADEXPR(i)); \
+		acc1 = _mm_add_pd(acc1, LOADEXPR(i + 2)); \
+	} \
+	_mm_storeu_pd(s, acc0); \
+	for (; i < n; i++) { \
+		s[0] += EXPR(i); \
+	} \
+	acc0 = _mm_loadu_pd(s); \
+	_mm_storeu_pd(s, _mm_add_pd(acc0, acc1)); \
+	return s[0] + s[1]; \
+}
+#define REDUCE_X_SSE2(i) _mm_loadu_pd(x + (i))
+#define REDUCE_X2_SSE2(i) _mm_mul_pd(_mm_loadu_pd(x + (i)), _mm_loadu_pd(x + (i)))
+#define REDUCE_XY_SSE2(i) _mm_mul_pd(_mm_loadu_pd(x + (i)), _mm_loadu_pd(y + (i)))
+REDUCE_PAIRWISE_SSE2(c_sum_d, REDUCE_X_SSE2, REDUCE_X)
+REDUCE_PAIRWISE_SSE2(c_sumsq_d, REDUCE_X2_SSE2, REDUCE_X2)
+REDUCE_PAIRWISE_SSE2(c_dot_dd, REDUCE_XY_SSE2, REDUCE_XY)
+#else
+REDUCE_PAIRWISE(c_sum_d, double, double, REDUCE_X)
+REDUCE_PAIRWISE(c_sumsq_d, double, double, REDUCE_X2)
+REDUCE_PAIRWISE(c_dot_dd, double, double, REDUCE_XY)
+#endif
+
+/* Reduction of elements [i0; i0 + n) of x (and y for REDUCE_DOT), c is shift for REDUCE_SUMSQDEV */
+static double c_reduce_block(int kind, const RealVector *x, const RealVector *y, double c, int i0, int n)
+{
+	const double *xd = x->single ? NULL : x->data + 1 + i0;
+	const float *xs = x->single ? x->sdata + 1 + i0 : NULL;
+	switch (kind) {
+	case REDUCE_SUM:
+		return xd ? c_sum_d(xd, xd, c, n) : c_sum_s(xs, xs, c, n);
+	case REDUCE_SUMSQ:
+		return xd ? c_sumsq_d(xd, xd, c, n) : c_sumsq_s(xs, xs, c, n);
+	case REDUCE_SUMSQDEV:
+		return xd ? c_sumsqdev_d(xd, xd, c, n) : c_sumsqdev_s(xs, xs, c, n);
+	default:
+		if (!y->single) {
+			const double *yd = y->data + 1 + i0;
+			return xd ? c_dot_dd(xd, yd, c, n) : c_dot_sd(xs, yd, c, n);
+		} else {
+			const float *ys = y->sdata + 1 + i0;
+			return xd ? c_dot_sd(ys, xd, c, n) : c_dot_ss(xs, ys, c, n);
+		}
+	}
+}
+
+/* Reduction of the whole vector (see c_reduce_block) */
+static double c_reduce(int kind, const RealVector *x, const RealVector *y, double c)
+{
+	int n = x->len, nchunks = (n + REDUCE_CHUNK - 1) / REDUCE_CHUNK;
+	if (nchunks <= 1) {
+		return c_reduce_block(kind, x, y, c, 0, n);
+	}
+	double *part = (double *) malloc(nchunks * sizeof(double));
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(static) if (nchunks >= 4)
+#endif
+	for (int k = 0; k < nchunks; k++) {
+		int len = (k == nchunks - 1) ? n - k * REDUCE_CHUNK : REDUCE_CHUNK;
+		part[k] = c_reduce_block(kind, x, y, c, k * REDUCE_CHUNK, len);
+	}
+	double s = c_sum_d(part, part, 0.0, nchunks);
+	free(part);
+	return s;
+}
+
+static int realvector_sum(lua_State *L)
+{
+	RealVector *vec = (RealVector *) luaL_checkudata(L, 1, "MLSMat::RealVector");
+	lua_pushnumber(L, c_reduce(REDUCE_SUM, vec, NULL, 0.0));
+	return 1;
+}
+
+static int realvector_sumsq(lua_State *L)
+{
+	RealVector *vec = (RealVector *) luaL_checkudata(L, 1, "MLSMat::RealVector");
+	lua_pushnumber(L, c_reduce(REDUCE_SUMSQ, vec, NULL, 0.0));
+	return 1;
+}
+
+static int realvector_norm2(lua_State *L)
+{
+	RealVector *vec = (RealVector *) luaL_checkudata(L, 1, "MLSMat::RealVector");
+	lua_pushnumber(L, sqrt(c_reduce(REDUCE_SUMSQ, vec, NULL, 0.0)));
+	return 1;
+}
+
+static int realvector_dot(lua_State *L)
+{
+	RealVector *vec1 = (RealVector *) luaL_checkudata(L, 1, "MLSMat::RealVector");
+	RealVector *vec2 = (RealVector *) luaL_checkudata(L, 2, "MLSMat::RealVector");
+	if (vec1->len != vec2->len) {
+		luaL_error(L, "RealVector sizes are mismatching");
+	}
+	lua_pushnumber(L, c_reduce(REDUCE_DOT, vec1, vec2, 0.0));
+	return 1;
+}
+
+static int realvector_mean(lua_State *L)
+{
+	RealVector *vec = (RealVector *) luaL_checkudata(L, 1, "MLSMat::RealVector");
+	if (vec->len == 0) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_pushnumber(L, c_reduce(REDUCE_SUM, vec, NULL, 0.0) / vec->len);
+	return 1;
+}
+
+/*
+ * vec:var([ddof]) -- variance with ddof degrees of freedom subtracted
+ * (default 1, i.e. unbiased estimate), two-pass algorithm
+ */
+static int realvector_var(lua_State *L)
+{
+	RealVector *vec = (RealVector *) luaL_checkudata(L, 1, "MLSMat::RealVector");
+	int ddof = (int) luaL_optinteger(L, 2, 1);
+	if (vec->len <= ddof) {
+		lua_pushnil(L);
+		return 1;
+	}
+	double mean = c_reduce(REDUCE_SUM, vec, NULL, 0.0) / vec->len;
+	lua_pushnumber(L, c_reduce(REDUCE_SUMSQDEV, vec, NULL, mean) / (vec->len - ddof));
 	return 1;
 }
 
+/* Returns index and value of minimal (sign = -1) or maximal (sign = 1) element */
+static int c_argext(lua_State *L, double sign)
+{
+	RealVector *vec = (RealVector *) luaL_checkudata(L, 1, "MLSMat::RealVector");
+	if (vec->len == 0) {
+		lua_pushnil(L);
+		return 1;
+	}
+	int ind = 1;
+	double extval = sign * REALVECTOR_GET(vec, 1);
+	for (int i = 2; i <= vec->len; i++) {
+		double val = sign * REALVECTOR_GET(vec, i);
+		if (val > extval) {
+			extval = val;
+			ind = i;
+		}
+	}
+	lua_pushinteger(L, ind);
+	lua_pushnumber(L, sign * extval);
+	return 2;
+}
+
+static int realvector_argmax(lua_State *L)
+{
+	return c_argext(L, 1.0);
+}
+
+static int realvector_argmin(lua_State *L)
+{
+	return c_argext(L, -1.0);
+}
+
 static int realvector_max(lua_State *L)
 {
 	RealVector *vec = (RealVector *) luaL_checkudata(L, 1, "MLSMat::RealVector");
@@ -514,10 +1567,11 @@ static int realvector_max(lua_State *L)
 		lua_pushnil(L);
 		return 1;
 	}
-	double maxval = vec->data[1];
+	double maxval = REALVECTOR_GET(vec, 1);
 	for (int i = 2; i <= vec->len; i++) {
-		if (vec->data[i] > maxval) {
-			maxval = vec->data[i];
+		double val = REALVECTOR_GET(vec, i);
+		if (val > maxval) {
+			maxval = val;
 		}
 	}
 	lua_pushnumber(L, maxval);
@@ -531,10 +1585,11 @@ static int realvector_min(lua_State *L)
 		lua_pushnil(L);
 		return 1;
 	}
-	double minval = vec->data[1];
+	double minval = REALVECTOR_GET(vec, 1);
 	for (int i = 2; i <= vec->len; i++) {
-		if (vec->data[i] < minval) {
-			minval = vec->data[i];
+		double val = REALVECTOR_GET(vec, i);
+		if (val < minval) {
+			minval = val;
 		}
 	}
 	lua_pushnumber(L, minval);
@@ -561,69 +1616,1950 @@ static int realvector_linspace(lua_State *L)
 	for (int i = 1; i <= n; i++) {
 		vec->data[i] = a + (i - 1) * (b - a) / (n - 1);
 	}
+	c_realvector_setdefault(L, vec);
 	return 1;
 }
 
-static const struct luaL_Reg realvector_funcs[] = {
-	{"new", realvector_new},
-	{"rand", realvector_rand},
-	{"randn", realvector_randn},
-	{"__add", realvector_add},
-	{"__sub", realvector_sub},
-	{"__mul", realvector_mul},
-	{"__div", realvector_div},
-	{"__pow", realvector_pow},
-	{"__unm", realvector_unm},
-	{"__len", realvector_length},
-	{"__concat", realvector_concat},
-	{"abs", realvector_abs},
-	{"exp", realvector_exp},
-	{"log", realvector_log},
-	{"sqrt", realvector_sqrt},
-	{"totable", realvector_totable},
-	{"copy", realvector_copy},
-	{"max", realvector_max},
-	{"min", realvector_min},
-	{"linspace", realvector_linspace},
-	{"__tostring", realvector_tostring},
-	{"__index", realvector_getvalue},
-	{"__newindex", realvector_setvalue},
-	{"__gc", realvector_gc},
-	{NULL, NULL}
-};
+/*========== RealVector cumulative and windowed operations ==========*/
+/*
+ * cumsum, cumprod, diff, movsum, movmean and conv are computed in double
+ * precision; the result has single precision if any argument has single
+ * precision. All of them except cumprod are linear, so DualNVector applies
+ * them to real and imaginary parts separately (cumprod has the fused
+ * kernel dcumprod).
+ */
+#define CONV_FFTCOST 24 /* Cost of FFT conv per point and stage relatively to direct one */
 
-int __declspec(dllexport) luaopen_mlsmat(lua_State* L)
+/* vec:cumsum() -- cumulative sums (compensated summation, Neumaier algorithm) */
+static int realvector_cumsum(lua_State *L)
 {
-	static int initialized = 0;
-	if (!initialized) {
-		initialized = 1;
-	} else {
-		return 0;
+	RealVector *vec = (RealVector *) luaL_checkudata(L, 1, "MLSMat::RealVector");
+	RealVector *rv = c_realvector_create(L, vec->len);
+	double s = 0.0, c = 0.0;
+	for (int i = 1; i <= vec->len; i++) {
+		double x = REALVECTOR_GET(vec, i), t = s + x;
+		c += (fabs(s) >= fabs(x)) ? (s - t) + x : (x - t) + s;
+		s = t;
+		rv->data[i] = isfinite(s) ? s + c : s;
+	}
+	if (vec->single) {
+		c_realvector_tosingle(rv);
 	}
+	return 1;
+}
 
-	srand(time(NULL));
-	lua_newtable(L);
+/* vec:cumprod() -- cumulative products */
+static int realvector_cumprod(lua_State *L)
+{
+	RealVector *vec = (RealVector *) luaL_checkudata(L, 1, "MLSMat::RealVector");
+	RealVector *rv = c_realvector_create(L, vec->len);
+	double p = 1.0;
+	for (int i = 1; i <= vec->len; i++) {
+		p *= REALVECTOR_GET(vec, i);
+		rv->data[i] = p;
+	}
+	if (vec->single) {
+		c_realvector_tosingle(rv);
+	}
+	return 1;
+}
 
-	lua_pushstring(L, "RealVector");
-	luaL_newmetatable(L, "MLSMat::RealVector");
-	luaL_setfuncs(L, realvector_funcs, 0);
-	lua_settable(L, -3);
+/*
+ * p, dp = RealVector.dcumprod(x, dx) is a fused kernel for derivatives
+ * of cumulative products (used by DualNVector.cumprod):
+ *   dp[k][i] = dp[k][i-1]*x[i] + p[i-1]*dx[k][i]
+ * dx is a table of imaginary parts (RealVectors). Unlike p*cumsum(dx/x)
+ * this recurrence is valid for zero elements of x.
+ */
+static int realvector_dcumprod(lua_State *L)
+{
+	RealVector *x = (RealVector *) luaL_checkudata(L, 1, "MLSMat::RealVector");
+	int len = x->len, nvars = -1;
+	const RealVector **dx = c_dpow_imag(L, 2, &nvars, len);
+	if (dx == NULL) {
+		nvars = 0;
+	}
+	/* Real part (products before i-th element are kept for derivatives) */
+	double *p = (double *) malloc((len + 1) * sizeof(double));
+	p[0] = 1.0;
+	for (int i = 1; i <= len; i++) {
+		p[i] = p[i - 1] * REALVECTOR_GET(x, i);
+	}
+	RealVector *rv = c_realvector_create_prec(L, len, x->single);
+	lua_insert(L, -3); /* Remove service values created by c_realvector_wrap */
+	lua_pop(L, 2);
+	for (int i = 1; i <= len; i++) {
+		REALVECTOR_SET(rv, i, p[i]);
+	}
+	/* Imaginary parts */
+	lua_createtable(L, nvars, 0);
+	for (int k = 0; k < nvars; k++) {
+		RealVector *iv = c_realvector_create_prec(L, len, x->single || dx[k]->single);
+		double d = 0.0;
+		for (int i = 1; i <= len; i++) {
+			d = d * REALVECTOR_GET(x, i) + p[i - 1] * POW_VECGET(dx[k], i);
+			REALVECTOR_SET(iv, i, d);
+		}
+		lua_rawseti(L, -4, k + 1);
+		lua_pop(L, 2);
+	}
+	free(p);
+	return 2;
+}
 
-	lua_pushstring(L, "IndexRange");
-	luaL_newmetatable(L, "MLSMat::IndexRange");
-	luaL_setfuncs(L, indexrange_funcs, 0);
-	lua_settable(L, -3);
+/* vec:diff([k]) -- k-th order differences (k = 1 by default), #vec - k elements */
+static int realvector_diff(lua_State *L)
+{
+	RealVector *vec = (RealVector *) luaL_checkudata(L, 1, "MLSMat::RealVector");
+	int k = (int) luaL_optinteger(L, 2, 1);
+	if (k < 0) {
+		luaL_error(L, "Invalid order of differences");
+	}
+	int len = (vec->len > k) ? vec->len - k : 0;
+	RealVector *rv = c_realvector_create(L, len);
+	if (len > 0) {
+		double *tmp;
+		const double *x = c_realvector_doubledata(vec, &tmp);
+		double *buf = (double *) malloc(vec->len * sizeof(double));
+		memcpy(buf, x, vec->len * sizeof(double));
+		for (int p = 1; p <= k; p++) {
+			for (int i = 0; i < vec->len - p; i++) {
+				buf[i] = buf[i + 1] - buf[i];
+			}
+		}
+		memcpy(rv->data + 1, buf, len * sizeof(double));
+		free(buf);
+		free(tmp);
+	}
+	if (vec->single) {
+		c_realvector_tosingle(rv);
+	}
+	return 1;
+}
 
-	lua_pushstring(L, "DualNVector");
-	luaL_newmetatable(L, "MLSMat::DualNVector");
-	lua_settable(L, -3);
-	/* Short aliases for constructors */
-	lua_pushstring(L, "Vec");
-	lua_pushcfunction(L, realvector_new);
-	lua_settable(L, -3);
+/* s = a + b exactly (TwoSum algorithm) */
+static void c_twosum(double a, double b, double *s, double *e)
+{
+	double t = a + b, bb = t - a;
+	*s = t;
+	*e = (a - (t - bb)) + (b - bb);
+}
 
-	lua_pushstring(L, "Rng");
-	lua_pushcfunction(L, indexrange_new);
+/*
+ * Sums (mean = 0) or means (mean = 1) of windows x[i - kb .. i + kf] truncated
+ * at the ends of x. Window sums are differences of prefix sums kept in
+ * double-double arithmetics, so the cost doesn't depend on the window width.
+ * Windows with non-finite elements are summed directly (they don't spoil
+ * other windows).
+ */
+static void c_movsum(const double *x, int n, int kb, int kf, int mean, double *out)
+{
+	double *hi = (double *) malloc(2 * (n + 1) * sizeof(double)), *lo = hi + n + 1;
+	int *nbad = (int *) malloc((n + 1) * sizeof(int));
+	hi[0] = 0.0; lo[0] = 0.0; nbad[0] = 0;
+	for (int i = 0; i < n; i++) {
+		double e;
+		int bad = !isfinite(x[i]);
+		c_twosum(hi[i], bad ? 0.0 : x[i], &hi[i + 1], &e);
+		lo[i + 1] = lo[i] + e;
+		nbad[i + 1] = nbad[i] + bad;
+	}
+	for (int i = 0; i < n; i++) {
+		int a = (i > kb) ? i - kb : 0;
+		int b = (kf < n - i) ? i + kf + 1 : n;
+		double s, e;
+		if (nbad[b] != nbad[a]) {
+			s = 0.0;
+			for (int j = a; j < b; j++) {
+				s += x[j];
+			}
+		} else {
+			c_twosum(hi[b], -hi[a], &s, &e);
+			s += e + (lo[b] - lo[a]);
+		}
+		out[i] = mean ? s / (b - a) : s;
+	}
+	free(hi);
+	free(nbad);
+}
+
+/*
+ * vec:movsum(k), vec:movmean(k) -- moving sums and means over centered
+ * windows of k elements (k/2 elements before and (k - 1)/2 elements after
+ * the current one, i.e. MATLAB convention for even k).
+ * vec:movsum(kb, kf), vec:movmean(kb, kf) -- windows of kb elements before
+ * and kf elements after the current one.
+ * Windows are truncated at the ends of the vector (means are computed
+ * over the elements that are present).
+ */
+static int c_movsum_lua(lua_State *L, int mean)
+{
+	RealVector *vec = (RealVector *) luaL_checkudata(L, 1, "MLSMat::RealVector");
+	int kb, kf;
+	if (lua_isnoneornil(L, 3)) {
+		int k = (int) luaL_checkinteger(L, 2);
+		if (k < 1) {
+			luaL_error(L, "Window length must be positive");
+		}
+		kb = k / 2;
+		kf = (k - 1) / 2;
+	} else {
+		kb = (int) luaL_checkinteger(L, 2);
+		kf = (int) luaL_checkinteger(L, 3);
+		if (kb < 0 || kf < 0) {
+			luaL_error(L, "Window bounds must be non-negative");
+		}
+	}
+	double *tmp;
+	const double *x = c_realvector_doubledata(vec, &tmp);
+	RealVector *rv = c_realvector_create(L, vec->len);
+	c_movsum(x, vec->len, kb, kf, mean, rv->data + 1);
+	free(tmp);
+	if (vec->single) {
+		c_realvector_tosingle(rv);
+	}
+	return 1;
+}
+
+static int realvector_movsum(lua_State *L)
+{
+	return c_movsum_lua(L, 0);
+}
+
+static int realvector_movmean(lua_State *L)
+{
+	return c_movsum_lua(L, 1);
+}
+
+/* y[0..n-1] += a*x[0..n-1] */
+static void c_axpy(int n, double a, const double *x, double *y)
+{
+	int i = 0;
+#if defined(__SSE2__)
+	__m128d av = _mm_set1_pd(a);
+	for (; i + 4 <= n; i += 4) {
+		_mm_storeu_pd(y + i, _mm_add_pd(_mm_loadu_pd(y + i), _mm_mul_pd(av, _mm_loadu_pd(x + i))));
+		_mm_storeu_pd(y + i + 2, _mm_add_pd(_mm_loadu_pd(y + i + 2), _mm_mul_pd(av, _mm_loadu_pd(x + i + 2))));
+	}
+#endif
+	for (; i < n; i++) {
+		y[i] += a * x[i];
+	}
+}
+
+/*
+ * In-place radix-2 FFT of n complex points (n is a power of 2, interleaved
+ * real and imaginary parts), w contains exp(-2*pi*i*k/n) for k < n/2.
+ * The inverse transform (inverse != 0) is not scaled.
+ */
+static void c_fft(double *z, int n, const double *w, int inverse)
+{
+	/* Bit reversal permutation */
+	for (int i = 1, j = 0; i < n; i++) {
+		int bit = n >> 1;
+		for (; j & bit; bit >>= 1) {
+			j ^= bit;
+		}
+		j ^= bit;
+		if (i < j) {
+			double tr = z[2*i], ti = z[2*i + 1];
+			z[2*i] = z[2*j]; z[2*i + 1] = z[2*j + 1];
+			z[2*j] = tr; z[2*j + 1] = ti;
+		}
+	}
+	/* Butterflies */
+	double sign = inverse ? -1.0 : 1.0;
+	for (int len = 2; len <= n; len <<= 1) {
+		int half = len / 2, step = n / len;
+		for (int i = 0; i < n; i += len) {
+			for (int k = 0; k < half; k++) {
+				double wr = w[2*k*step], wi = sign * w[2*k*step + 1];
+				double *a = z + 2*(i + k), *b = a + 2*half;
+				double tr = wr * b[0] - wi * b[1], ti = wr * b[1] + wi * b[0];
+				b[0] = a[0] - tr; b[1] = a[1] - ti;
+				a[0] += tr; a[1] += ti;
+			}
+		}
+	}
+}
+
+/*
+ * Full convolutions y[s] = x[s] * h (n + m - 1 elements, y[s] must be
+ * zero-filled) of nx vectors x[s] of n elements with vector h of m elements.
+ * FFT method transforms x[s] + i*x[s + 1] by one complex FFT (h is real).
+ */
+static void c_conv_full(const double **x, int nx, int n, const double *h, int m, double **y, int fft)
+{
+	if (!fft) {
+		for (int s = 0; s < nx; s++) {
+			if (m <= n) {
+				for (int j = 0; j < m; j++) {
+					c_axpy(n, h[j], x[s], y[s] + j);
+				}
+			} else {
+				for (int i = 0; i < n; i++) {
+					c_axpy(m, x[s][i], h, y[s] + i);
+				}
+			}
+		}
+		return;
+	}
+	int nfull = n + m - 1, nfft = 1;
+	while (nfft < nfull) {
+		nfft <<= 1;
+	}
+	double *w = (double *) malloc(nfft * sizeof(double));
+	double *hf = (double *) calloc(2 * nfft, sizeof(double));
+	double *z = (double *) malloc(2 * nfft * sizeof(double));
+	for (int k = 0; k < nfft / 2; k++) {
+		w[2*k] = cos(2.0 * M_PI * k / nfft);
+		w[2*k + 1] = -sin(2.0 * M_PI * k / nfft);
+	}
+	for (int j = 0; j < m; j++) {
+		hf[2*j] = h[j];
+	}
+	c_fft(hf, nfft, w, 0);
+	for (int s = 0; s < nx; s += 2) {
+		const double *x1 = (s + 1 < nx) ? x[s + 1] : NULL;
+		memset(z, 0, 2 * nfft * sizeof(double));
+		for (int i = 0; i < n; i++) {
+			z[2*i] = x[s][i];
+			z[2*i + 1] = x1 ? x1[i] : 0.0;
+		}
+		c_fft(z, nfft, w, 0);
+		for (int k = 0; k < nfft; k++) {
+			double zr = z[2*k], zi = z[2*k + 1];
+			z[2*k] = zr * hf[2*k] - zi * hf[2*k + 1];
+			z[2*k + 1] = zr * hf[2*k + 1] + zi * hf[2*k];
+		}
+		c_fft(z, nfft, w, 1);
+		for (int i = 0; i < nfull; i++) {
+			y[s][i] = z[2*i] / nfft;
+			if (x1) {
+				y[s + 1][i] = z[2*i + 1] / nfft;
+			}
+		}
+	}
+	free(w);
+	free(hf);
+	free(z);
+}
+
+/*
+ * Reads argument of conv: RealVector or non-empty table of RealVectors
+ * of equal length (*islist = 1). Returns the number of vectors.
+ */
+static int c_conv_arg(lua_State *L, int narg, const RealVector ***vecs, int *len, int *islist)
+{
+	const RealVector *vec = (const RealVector *) luaL_testudata(L, narg, "MLSMat::RealVector");
+	if (vec != NULL) {
+		*vecs = (const RealVector **) lua_newuserdata(L, sizeof(RealVector *));
+		(*vecs)[0] = vec;
+		*len = vec->len;
+		*islist = 0;
+		return 1;
+	}
+	luaL_checktype(L, narg, LUA_TTABLE);
+	int n = (int) lua_rawlen(L, narg);
+	if (n == 0) {
+		luaL_error(L, "bad argument #%d to 'conv' (empty table)", narg);
+	}
+	*vecs = (const RealVector **) lua_newuserdata(L, n * sizeof(RealVector *));
+	for (int k = 0; k < n; k++) {
+		lua_rawgeti(L, narg, k + 1);
+		(*vecs)[k] = (const RealVector *) luaL_testudata(L, -1, "MLSMat::RealVector");
+		lua_pop(L, 1);
+		if ((*vecs)[k] == NULL || (*vecs)[k]->len != (*vecs)[0]->len) {
+			luaL_error(L, "bad argument #%d to 'conv' (RealVectors of equal length expected)", narg);
+		}
+	}
+	*len = (*vecs)[0]->len;
+	*islist = 1;
+	return n;
+}
+
+/*
+ * y = RealVector.conv(x, h [, shape [, method]]) -- convolution of vectors,
+ * y[k] = sum x[j]*h[k - j + 1]
+ *   shape -- "full" (default, #x + #h - 1 elements), "same" (central part
+ *     of full convolution with #x elements, MATLAB convention) or "valid"
+ *     (#x - #h + 1 elements that don't depend on zero padding)
+ *   method -- "auto" (default), "direct" or "fft". "auto" chooses
+ *     the cheaper one: direct summation (O(#x*#h)) or zero-padded
+ *     radix-2 FFT (O(N*log(N))). FFT gives absolute errors of order
+ *     eps*max|y| rather than relative ones.
+ * Either x or h may be a table of RealVectors of equal length: the table
+ * of convolutions is returned then (the other argument is transformed only
+ * once). Tables with metatables (e.g. DualNVector) are readdressed to their
+ * conv method.
+ */
+static int realvector_conv(lua_State *L)
+{
+	static const char *const shapes[] = {"full", "same", "valid", NULL};
+	static const char *const methods[] = {"auto", "direct", "fft", NULL};
+	for (int narg = 1; narg <= 2; narg++) {
+		if (lua_type(L, narg) == LUA_TTABLE && luaL_getmetafield(L, narg, "conv") != LUA_TNIL) {
+			lua_insert(L, 1);
+			lua_call(L, lua_gettop(L) - 1, 1);
+			return 1;
+		}
+	}
+	int shape = luaL_checkoption(L, 3, "full", shapes);
+	int method = luaL_checkoption(L, 4, "auto", methods);
+	const RealVector **xv, **hv;
+	int n, m, xlist, hlist;
+	int nx = c_conv_arg(L, 1, &xv, &n, &xlist);
+	int nh = c_conv_arg(L, 2, &hv, &m, &hlist);
+	if (xlist && hlist) {
+		luaL_error(L, "Only one argument of conv may be a table");
+	}
+	/* Full convolution is symmetric: vectors from the table are convolved with the other argument */
+	const RealVector **sv = hlist ? hv : xv, *kv = hlist ? xv[0] : hv[0];
+	int ns = hlist ? nh : nx;
+	/* Part of full convolution to be returned */
+	int nfull = (n > 0 && m > 0) ? n + m - 1 : 0, off = 0, len = nfull;
+	if (shape == 1) {
+		off = m / 2;
+		len = n;
+	} else if (shape == 2) {
+		off = m - 1;
+		len = (n >= m) ? n - m + 1 : 0;
+	}
+	int nfft = 1, nstages = 0;
+	while (nfft < nfull) {
+		nfft <<= 1;
+		nstages++;
+	}
+	int fft = (method == 2) || (method == 0 && (double) n * m > CONV_FFTCOST * (double) nfft * nstages);
+	/* Convert data to double precision and compute full convolutions */
+	int single = kv->single;
+	double **tmp = (double **) calloc(ns + 1, sizeof(double *));
+	const double **sd = (const double **) malloc(ns * sizeof(double *));
+	double **yd = (double **) malloc(ns * sizeof(double *));
+	double *ybuf = (double *) calloc((size_t) ns * nfull + 1, sizeof(double));
+	for (int s = 0; s < ns; s++) {
+		sd[s] = c_realvector_doubledata(sv[s], &tmp[s]);
+		yd[s] = ybuf + (size_t) s * nfull;
+		single = single || sv[s]->single;
+	}
+	const double *kd = c_realvector_doubledata(kv, &tmp[ns]);
+	if (nfull > 0) {
+		c_conv_full(sd, ns, sv[0]->len, kd, kv->len, yd, fft);
+	}
+	/* Output vectors */
+	if (xlist || hlist) {
+		lua_createtable(L, ns, 0);
+	}
+	for (int s = 0; s < ns; s++) {
+		RealVector *rv = c_realvector_create(L, len);
+		for (int i = 0; i < len; i++) {
+			rv->data[i + 1] = (off + i < nfull) ? yd[s][off + i] : 0.0;
+		}
+		if (single) {
+			c_realvector_tosingle(rv);
+		}
+		if (xlist || hlist) {
+			lua_rawseti(L, -4, s + 1);
+			lua_pop(L, 2);
+		}
+	}
+	for (int s = 0; s <= ns; s++) {
+		free(tmp[s]);
+	}
+	free(tmp);
+	free(sd);
+	free(yd);
+	free(ybuf);
+	return 1;
+}
+
+/*========== RealVector file input ==========*/
+#define LOADTXT_MAXCOLS 256 /* Maximal number of columns in text file */
+
+/* Exact powers of 10 (for Clinger's fast path) */
+static const double c_pow10[23] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+	1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19,
+	1e20, 1e21, 1e22};
+
+/*
+ * Parses floating point number from the string. Numbers with not more
+ * than 19 significant digits that fit into 2^53 and with decimal exponent
+ * from [-22; 22] are converted exactly by one multiplication or division
+ * (Clinger's fast path), other ones (and inf, nan etc.) are passed to strtod.
+ * Returns pointer to the first character after the number or NULL.
+ */
+static const char *c_parse_double(const char *s, double *val)
+{
+	const char *p = s, *digits;
+	unsigned long long mant = 0;
+	int neg = 0, ndig = 0, exp10 = 0, inexact = 0;
+	if (*p == '-' || *p == '+') {
+		neg = (*p++ == '-');
+	}
+	digits = p;
+	for (; *p >= '0' && *p <= '9'; p++) {
+		if (ndig < 19) {
+			mant = mant * 10 + (*p - '0');
+			ndig += (mant != 0);
+		} else {
+			inexact = 1;
+		}
+	}
+	if (*p == '.') {
+		for (p++; *p >= '0' && *p <= '9'; p++) {
+			if (ndig < 19) {
+				mant = mant * 10 + (*p - '0');
+				ndig += (mant != 0);
+				exp10--;
+			} else {
+				inexact = 1;
+			}
+		}
+	}
+	if (p == digits || (p == digits + 1 && *digits == '.')) {
+		inexact = 1; /* No digits: inf, nan or invalid input */
+	} else if (*p == 'e' || *p == 'E') {
+		const char *e = p + 1;
+		int eneg = 0, eval = 0;
+		if (*e == '-' || *e == '+') {
+			eneg = (*e++ == '-');
+		}
+		if (*e >= '0' && *e <= '9') {
+			for (; *e >= '0' && *e <= '9'; e++) {
+				if (eval < 10000) {
+					eval = eval * 10 + (*e - '0');
+				}
+			}
+			exp10 += eneg ? -eval : eval;
+			p = e;
+		}
+	}
+	if (!inexact && mant <= (1ULL << 53) && exp10 >= -22 && exp10 <= 22) {
+		double x = (double) mant;
+		x = (exp10 < 0) ? x / c_pow10[-exp10] : x * c_pow10[exp10];
+		*val = neg ? -x : x;
+		return p;
+	} else {
+		char *end;
+		*val = strtod(s, &end);
+		return (end == s) ? NULL : end;
+	}
+}
+
+/* Separators of columns in text files */
+static int c_isdelim(char c)
+{
+	return c == ' ' || c == '\t' || c == ',' || c == ';';
+}
+
+/* End of line (comments starting from # are ignored) */
+static int c_iseol(char c)
+{
+	return c == '\n' || c == '\r' || c == '\0' || c == '#';
+}
+
+/*
+ * Reads the whole file into memory (with terminating zero).
+ * Returns NULL in the case of error.
+ */
+static char *c_readfile(const char *path, size_t *size)
+{
+	FILE *fp = fopen(path, "rb");
+	char *buf = NULL;
+	if (fp == NULL) {
+		return NULL;
+	}
+	if (fseek(fp, 0, SEEK_END) == 0) {
+		long len = ftell(fp);
+		if (len >= 0 && fseek(fp, 0, SEEK_SET) == 0 &&
+			(buf = malloc(len + 1)) != NULL) {
+			*size = fread(buf, 1, len, fp);
+			buf[*size] = '\0';
+		}
+	}
+	fclose(fp);
+	return buf;
+}
+
+/*
+ * v1, v2, ... = RealVector.loadtxt(path [, opts])
+ * Loads columns of numbers from the text file. Columns may be separated
+ * by spaces, tabs, commas or semicolons; empty lines and comments
+ * (from # to the end of line) are skipped. Options:
+ *   opts.columns -- column number or table of column numbers (1-based)
+ *     to be loaded (default: all columns of the first data line)
+ *   opts.skiprows -- number of lines to skip at the beginning of file
+ * Returns one RealVector per column.
+ */
+static int realvector_loadtxt(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	int colmap[LOADTXT_MAXCOLS + 1]; /* Output index for each column or -1 */
+	int ncols = 0, maxcol = 0, skiprows = 0;
+	for (int i = 0; i <= LOADTXT_MAXCOLS; i++) {
+		colmap[i] = -1;
+	}
+	/* Process options */
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		lua_getfield(L, 2, "skiprows");
+		skiprows = (int) luaL_optinteger(L, -1, 0);
+		lua_getfield(L, 2, "columns");
+		if (lua_isinteger(L, -1)) {
+			lua_createtable(L, 1, 0);
+			lua_insert(L, -2);
+			lua_rawseti(L, -2, 1);
+		}
+		if (lua_istable(L, -1)) {
+			ncols = (int) lua_rawlen(L, -1);
+			for (int i = 0; i < ncols; i++) {
+				lua_rawgeti(L, -1, i + 1);
+				int col = (int) luaL_checkinteger(L, -1);
+				lua_pop(L, 1);
+				if (col < 1 || col > LOADTXT_MAXCOLS || colmap[col] != -1) {
+					luaL_error(L, "Invalid or duplicate column number %d", col);
+				}
+				colmap[col] = i;
+				if (col > maxcol) {
+					maxcol = col;
+				}
+			}
+			if (ncols == 0) {
+				luaL_error(L, "Columns list is empty");
+			}
+		} else if (!lua_isnil(L, -1)) {
+			luaL_error(L, "columns must be either integer or table");
+		}
+	}
+	/* Load file */
+	size_t size = 0;
+	char *buf = c_readfile(path, &size);
+	if (buf == NULL) {
+		luaL_error(L, "Cannot read file %s", path);
+	}
+	/* Parse all lines */
+	double *cols[LOADTXT_MAXCOLS];
+	int len = 0, cap = 1024, line = 0, err = 0;
+	const char *p = buf;
+	for (int i = 0; i < LOADTXT_MAXCOLS; i++) {
+		cols[i] = NULL;
+	}
+	while (*p != '\0' && err == 0) {
+		line++;
+		while (*p == ' ' || *p == '\t') {
+			p++;
+		}
+		if (line > skiprows && !c_iseol(*p)) {
+			/* Number of columns is defined by the first data line */
+			if (maxcol == 0) {
+				for (const char *q = p; !c_iseol(*q); ) {
+					if (ncols == LOADTXT_MAXCOLS) {
+						err = 1;
+						break;
+					}
+					colmap[ncols + 1] = ncols;
+					ncols++;
+					while (!c_iseol(*q) && !c_isdelim(*q)) {
+						q++;
+					}
+					while (c_isdelim(*q)) {
+						q++;
+					}
+				}
+				maxcol = ncols;
+			}
+			if (len == 0 || len == cap) {
+				int newcap = (len == 0) ? cap : 2 * cap;
+				for (int i = 0; i < ncols && err == 0; i++) {
+					double *col = realloc(cols[i], (newcap + 1) * sizeof(double));
+					if (col == NULL) {
+						err = 4;
+					} else {
+						cols[i] = col;
+					}
+				}
+				if (err != 0) {
+					break;
+				}
+				cap = newcap;
+			}
+			len++;
+			/* Parse numbers from the line */
+			int col = 1;
+			for (; col <= maxcol && !c_iseol(*p) && err == 0; col++) {
+				if (colmap[col] >= 0) {
+					const char *q = c_parse_double(p, &cols[colmap[col]][len]);
+					if (q == NULL || !(c_isdelim(*q) || c_iseol(*q))) {
+						err = 2;
+					} else {
+						p = q;
+					}
+				} else {
+					while (!c_iseol(*p) && !c_isdelim(*p)) {
+						p++;
+					}
+				}
+				while (c_isdelim(*p)) {
+					p++;
+				}
+			}
+			if (col <= maxcol && err == 0) {
+				err = 3;
+			}
+		}
+		/* Go to the next line */
+		while (*p != '\n' && *p != '\0') {
+			p++;
+		}
+		if (*p == '\n') {
+			p++;
+		}
+	}
+	free(buf);
+	if (err != 0 || len == 0) {
+		for (int i = 0; i < ncols; i++) {
+			free(cols[i]);
+		}
+	}
+	switch (err) {
+	case 1: return luaL_error(L, "%s: too many columns (maximum is %d)", path, LOADTXT_MAXCOLS);
+	case 2: return luaL_error(L, "%s: invalid number at line %d", path, line);
+	case 3: return luaL_error(L, "%s: not enough columns at line %d", path, line);
+	case 4: return luaL_error(L, "%s: not enough memory", path);
+	}
+	if (len == 0) {
+		return luaL_error(L, "%s: no data", path);
+	}
+	/* Return vectors (they take ownership of buffers) */
+	luaL_checkstack(L, 3 * ncols, "Too many columns");
+	for (int i = 0; i < ncols; i++) {
+		double *col = realloc(cols[i], (len + 1) * sizeof(double));
+		RealVector *vec = c_realvector_wrap(L, len, (col != NULL) ? col : cols[i]); /* Shrinking may fail */
+		lua_insert(L, -3); /* Remove service values created by c_realvector_wrap */
+		lua_pop(L, 2);
+		c_realvector_setdefault(L, vec);
+	}
+	return ncols;
+}
+
+/*
+ * RealVector.mmap(path [, offset [, count]])
+ * Maps the binary file of little-endian doubles as read-only vector
+ * without copying. offset is in bytes (must be a multiple of 8),
+ * count is number of elements (default: up to the end of file)
+ */
+static int realvector_mmap(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	lua_Integer offset = luaL_optinteger(L, 2, 0);
+	lua_Integer count = luaL_optinteger(L, 3, -1);
+	const union {unsigned short s; unsigned char c[2];} endian = {1};
+	long long fsize, pgsize;
+	if (endian.c[0] != 1) {
+		luaL_error(L, "mmap requires little-endian platform");
+	}
+	luaL_argcheck(L, offset >= 0 && offset % sizeof(double) == 0, 2, "Invalid offset");
+	/* Open file and find its size */
+#ifdef _WIN32
+	SYSTEM_INFO si;
+	LARGE_INTEGER li;
+	HANDLE fh = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (fh == INVALID_HANDLE_VALUE) {
+		luaL_error(L, "Cannot open file %s", path);
+	}
+	if (!GetFileSizeEx(fh, &li)) {
+		CloseHandle(fh);
+		luaL_error(L, "Cannot get size of file %s", path);
+	}
+	fsize = li.QuadPart;
+	GetSystemInfo(&si);
+	pgsize = si.dwAllocationGranularity;
+#else
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		luaL_error(L, "Cannot open file %s", path);
+	}
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		luaL_error(L, "Cannot get size of file %s", path);
+	}
+	fsize = st.st_size;
+	pgsize = sysconf(_SC_PAGESIZE);
+#endif
+	if (count < 0) {
+		count = (offset < fsize) ? (fsize - offset) / sizeof(double) : 0;
+	}
+	if (offset + count * (long long) sizeof(double) > fsize || count > 0x7FFFFFFF) {
+#ifdef _WIN32
+		CloseHandle(fh);
+#else
+		close(fd);
+#endif
+		luaL_error(L, "%s: requested range is out of file", path);
+	}
+	/* Map view of file (its offset must be aligned to page size) */
+	long long pgoff = offset % pgsize;
+	size_t mapsize = (size_t) (pgoff + count * sizeof(double));
+	void *base = NULL;
+	if (count > 0) {
+#ifdef _WIN32
+		HANDLE mh = CreateFileMappingA(fh, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mh != NULL) {
+			long long pos = offset - pgoff;
+			base = MapViewOfFile(mh, FILE_MAP_READ, (DWORD) (pos >> 32),
+				(DWORD) (pos & 0xFFFFFFFF), mapsize);
+			CloseHandle(mh);
+		}
+#else
+		base = mmap(NULL, mapsize, PROT_READ, MAP_PRIVATE, fd, offset - pgoff);
+		if (base == MAP_FAILED) {
+			base = NULL;
+		}
+#endif
+	}
+#ifdef _WIN32
+	CloseHandle(fh);
+#else
+	close(fd);
+#endif
+	if (count > 0 && base == NULL) {
+		luaL_error(L, "Cannot map file %s", path);
+	}
+	/* Create read-only vector (data[0] is not used so data points
+	   to the element before the first one) */
+	RealVector *vec;
+	if (count == 0) {
+		vec = c_realvector_create(L, 0);
+	} else {
+		vec = c_realvector_wrap(L, (int) count, (double *) ((char *) base + pgoff) - 1);
+		vec->mapbase = base;
+		vec->mapsize = mapsize;
+	}
+	vec->readonly = 1;
+	return 1;
+}
+
+static const struct luaL_Reg realvector_funcs[] = {
+	{"new", realvector_new},
+	{"rand", realvector_rand},
+	{"randn", realvector_randn},
+	{"seed", realvector_seed},
+	{"__add", realvector_add},
+	{"__sub", realvector_sub},
+	{"__mul", realvector_mul},
+	{"__div", realvector_div},
+	{"__pow", realvector_pow},
+	{"dpow", realvector_dpow},
+	{"__unm", realvector_unm},
+	{"__len", realvector_length},
+	{"__concat", realvector_concat},
+	{"abs", realvector_abs},
+	{"exp", realvector_exp},
+	{"log", realvector_log},
+	{"sqrt", realvector_sqrt},
+	{"totable", realvector_totable},
+	{"frombuffer", realvector_frombuffer},
+	{"tobuffer", realvector_tobuffer},
+	{"dataptr", realvector_dataptr},
+	{"copy", realvector_copy},
+	{"single", realvector_single},
+	{"double", realvector_double},
+	{"issingle", realvector_issingle},
+	{"setprecision", realvector_setprecision},
+	{"getprecision", realvector_getprecision},
+	{"max", realvector_max},
+	{"min", realvector_min},
+	{"argmax", realvector_argmax},
+	{"argmin", realvector_argmin},
+	{"sum", realvector_sum},
+	{"sumsq", realvector_sumsq},
+	{"norm2", realvector_norm2},
+	{"dot", realvector_dot},
+	{"mean", realvector_mean},
+	{"var", realvector_var},
+	{"cumsum", realvector_cumsum},
+	{"cumprod", realvector_cumprod},
+	{"dcumprod", realvector_dcumprod},
+	{"diff", realvector_diff},
+	{"movsum", realvector_movsum},
+	{"movmean", realvector_movmean},
+	{"conv", realvector_conv},
+	{"linspace", realvector_linspace},
+	{"loadtxt", realvector_loadtxt},
+	{"mmap", realvector_mmap},
+	{"__tostring", realvector_tostring},
+	{"__index", realvector_getvalue},
+	{"__newindex", realvector_setvalue},
+	{"__gc", realvector_gc},
+	{NULL, NULL}
+};
+
+/*========== RealMatrix class ==========*/
+/*
+ * Dense matrix of doubles with column-major storage (the same layout as in
+ * BLAS/LAPACK): columns are contiguous and may be used as RealVector views.
+ * Products are computed by cache-blocked kernels that update 4 columns at
+ * once (SSE2 if available). If OpenMP is enabled the blocks of the result
+ * are processed in parallel; every element is always summed in the same
+ * order, so results don't depend on the number of threads.
+ */
+#define MATRIX_MB 64 /* Rows in a block of A for GEMM */
+#define MATRIX_KB 256 /* Columns in a block of A for GEMM */
+#define MATRIX_NB 32 /* Columns in a block of C for GEMM */
+#define MATRIX_GEMV_MB 512 /* Rows in a block of y for GEMV */
+#define MATRIX_TB 32 /* Size of a block for transposition */
+
+static RealMatrix *c_realmatrix_create(lua_State *L, int nrows, int ncols)
+{
+	RealMatrix *mat = (RealMatrix *) lua_newuserdata(L, sizeof(RealMatrix));
+	mat->nrows = nrows;
+	mat->ncols = ncols;
+	mat->ld = (nrows > 0) ? nrows : 1;
+	mat->data = calloc((size_t) mat->ld * ncols + 1, sizeof(double));
+	mat->isview = 0;
+	luaL_getmetatable(L, "MLSMat::RealMatrix");
+	lua_setmetatable(L, -2);
+	return mat;
+}
+
+/* y[0..n-1] += a0*x[0] + a1*x[1] + a2*x[2] + a3*x[3] (a0..a3 are columns) */
+static void c_axpy4(int n, const double *a0, const double *a1, const double *a2,
+	const double *a3, const double *x, double *y)
+{
+	int i = 0;
+#if defined(__SSE2__)
+	__m128d x0 = _mm_set1_pd(x[0]), x1 = _mm_set1_pd(x[1]);
+	__m128d x2 = _mm_set1_pd(x[2]), x3 = _mm_set1_pd(x[3]);
+	for (; i + 2 <= n; i += 2) {
+		__m128d t = _mm_mul_pd(_mm_loadu_pd(a0 + i), x0);
+		t = _mm_add_pd(t, _mm_mul_pd(_mm_loadu_pd(a1 + i), x1));
+		t = _mm_add_pd(t, _mm_mul_pd(_mm_loadu_pd(a2 + i), x2));
+		t = _mm_add_pd(t, _mm_mul_pd(_mm_loadu_pd(a3 + i), x3));
+		_mm_storeu_pd(y + i, _mm_add_pd(_mm_loadu_pd(y + i), t));
+	}
+#endif
+	for (; i < n; i++) {
+		y[i] += ((a0[i] * x[0] + a1[i] * x[1]) + a2[i] * x[2]) + a3[i] * x[3];
+	}
+}
+
+/* y += A*x for m x n block of matrix with leading dimension lda */
+static void c_gemv_block(int m, int n, const double *a, int lda, const double *x, double *y)
+{
+	int j = 0;
+	for (; j + 4 <= n; j += 4) {
+		const double *aj = a + (size_t) j * lda;
+		c_axpy4(m, aj, aj + lda, aj + 2 * (size_t) lda, aj + 3 * (size_t) lda, x + j, y);
+	}
+	for (; j < n; j++) {
+		const double *aj = a + (size_t) j * lda;
+		for (int i = 0; i < m; i++) {
+			y[i] += aj[i] * x[j];
+		}
+	}
+}
+
+/* y = A*x: the block of y stays in L1 cache while columns of A are streamed */
+static void c_gemv(const RealMatrix *a, const double *x, double *y)
+{
+	int m = a->nrows, nblocks = (m + MATRIX_GEMV_MB - 1) / MATRIX_GEMV_MB;
+	memset(y, 0, m * sizeof(double));
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(static) if (nblocks >= 4)
+#endif
+	for (int b = 0; b < nblocks; b++) {
+		int i0 = b * MATRIX_GEMV_MB;
+		int mb = (m - i0 < MATRIX_GEMV_MB) ? m - i0 : MATRIX_GEMV_MB;
+		c_gemv_block(mb, a->ncols, a->data + i0, a->ld, x, y + i0);
+	}
+}
+
+/* y = A'*x (columns of A are multiplied by x) */
+static void c_gemv_t(const RealMatrix *a, const double *x, double *y)
+{
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(static) if ((double) a->nrows * a->ncols > 1e6)
+#endif
+	for (int j = 0; j < a->ncols; j++) {
+		const double *aj = a->data + (size_t) j * a->ld;
+		y[j] = c_dot_dd(aj, x, 0.0, a->nrows);
+	}
+}
+
+/*
+ * C = A*B: blocks of A (MATRIX_MB x MATRIX_KB) are kept in L2 cache and
+ * multiplied by all columns from the current block of C
+ */
+static void c_gemm(const RealMatrix *a, const RealMatrix *b, RealMatrix *c)
+{
+	int m = a->nrows, k = a->ncols, n = b->ncols;
+	int nblocks = (n + MATRIX_NB - 1) / MATRIX_NB;
+	for (int j = 0; j < n; j++) {
+		memset(c->data + (size_t) j * c->ld, 0, m * sizeof(double));
+	}
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic) if (nblocks >= 2 && (double) m * n * k > 1e6)
+#endif
+	for (int jb = 0; jb < nblocks; jb++) {
+		int j0 = jb * MATRIX_NB, j1 = (j0 + MATRIX_NB < n) ? j0 + MATRIX_NB : n;
+		for (int k0 = 0; k0 < k; k0 += MATRIX_KB) {
+			int kb = (k - k0 < MATRIX_KB) ? k - k0 : MATRIX_KB;
+			for (int i0 = 0; i0 < m; i0 += MATRIX_MB) {
+				int mb = (m - i0 < MATRIX_MB) ? m - i0 : MATRIX_MB;
+				const double *ablk = a->data + (size_t) k0 * a->ld + i0;
+				for (int j = j0; j < j1; j++) {
+					c_gemv_block(mb, kb, ablk, a->ld, b->data + (size_t) j * b->ld + k0,
+						c->data + (size_t) j * c->ld + i0);
+				}
+			}
+		}
+	}
+}
+
+/* T = A' (by square blocks to avoid cache misses on both sides) */
+static void c_transpose(const RealMatrix *a, RealMatrix *t)
+{
+	for (int j0 = 0; j0 < a->ncols; j0 += MATRIX_TB) {
+		int j1 = (j0 + MATRIX_TB < a->ncols) ? j0 + MATRIX_TB : a->ncols;
+		for (int i0 = 0; i0 < a->nrows; i0 += MATRIX_TB) {
+			int i1 = (i0 + MATRIX_TB < a->nrows) ? i0 + MATRIX_TB : a->nrows;
+			for (int j = j0; j < j1; j++) {
+				for (int i = i0; i < i1; i++) {
+					t->data[(size_t) i * t->ld + j] = a->data[(size_t) j * a->ld + i];
+				}
+			}
+		}
+	}
+}
+
+/*
+ * RealMatrix.new(nrows, ncols) creates zero matrix
+ * RealMatrix.new({{a11, a12, ...}, {a21, a22, ...}, ...}) creates matrix
+ * from the table of rows
+ */
+static int realmatrix_new(lua_State *L)
+{
+	if (lua_type(L, 1) == LUA_TTABLE) {
+		int nrows = (int) lua_rawlen(L, 1), ncols = 0;
+		if (nrows > 0) {
+			lua_rawgeti(L, 1, 1);
+			luaL_argcheck(L, lua_type(L, -1) == LUA_TTABLE, 1, "table of rows expected");
+			ncols = (int) lua_rawlen(L, -1);
+			lua_pop(L, 1);
+		}
+		RealMatrix *mat = c_realmatrix_create(L, nrows, ncols);
+		for (int i = 1; i <= nrows; i++) {
+			lua_rawgeti(L, 1, i);
+			if (lua_type(L, -1) != LUA_TTABLE || (int) lua_rawlen(L, -1) != ncols) {
+				luaL_error(L, "Row %d must be a table with %d elements", i, ncols);
+			}
+			for (int j = 1; j <= ncols; j++) {
+				int isnum;
+				lua_rawgeti(L, -1, j);
+				REALMATRIX_ELEM(mat, i, j) = lua_tonumberx(L, -1, &isnum);
+				if (!isnum) {
+					luaL_error(L, "Element (%d, %d) is not a number", i, j);
+				}
+				lua_pop(L, 1);
+			}
+			lua_pop(L, 1);
+		}
+		return 1;
+	}
+	int nrows = (int) luaL_checkinteger(L, 1);
+	int ncols = (int) luaL_checkinteger(L, 2);
+	luaL_argcheck(L, nrows >= 0, 1, "Invalid number of rows");
+	luaL_argcheck(L, ncols >= 0, 2, "Invalid number of columns");
+	c_realmatrix_create(L, nrows, ncols);
+	return 1;
+}
+
+/*
+ * RealMatrix.fromcols(v1, v2, ...) or RealMatrix.fromcols({v1, v2, ...})
+ * creates matrix from RealVector columns (e.g. design matrix from basis
+ * functions values)
+ */
+static int realmatrix_fromcols(lua_State *L)
+{
+	int istable = lua_type(L, 1) == LUA_TTABLE;
+	int ncols = istable ? (int) lua_rawlen(L, 1) : lua_gettop(L), nrows = 0;
+	for (int j = 1; j <= ncols; j++) {
+		RealVector *vec;
+		if (istable) {
+			lua_rawgeti(L, 1, j);
+			vec = (RealVector *) luaL_testudata(L, -1, "MLSMat::RealVector");
+			lua_pop(L, 1);
+		} else {
+			vec = (RealVector *) luaL_testudata(L, j, "MLSMat::RealVector");
+		}
+		if (vec == NULL) {
+			luaL_error(L, "Column %d must be a RealVector", j);
+		}
+		if (j == 1) {
+			nrows = vec->len;
+		} else if (vec->len != nrows) {
+			luaL_error(L, "Column %d size is not consistent", j);
+		}
+	}
+	RealMatrix *mat = c_realmatrix_create(L, nrows, ncols);
+	for (int j = 1; j <= ncols; j++) {
+		if (istable) {
+			lua_rawgeti(L, 1, j);
+		} else {
+			lua_pushvalue(L, j);
+		}
+		RealVector *vec = (RealVector *) lua_touserdata(L, -1);
+		for (int i = 1; i <= nrows; i++) {
+			REALMATRIX_ELEM(mat, i, j) = REALVECTOR_GET(vec, i);
+		}
+		lua_pop(L, 1);
+	}
+	return 1;
+}
+
+/* RealMatrix.eye(n) creates n x n identity matrix */
+static int realmatrix_eye(lua_State *L)
+{
+	int n = (int) luaL_checkinteger(L, 1);
+	luaL_argcheck(L, n >= 0, 1, "Invalid size");
+	RealMatrix *mat = c_realmatrix_create(L, n, n);
+	for (int i = 1; i <= n; i++) {
+		REALMATRIX_ELEM(mat, i, i) = 1.0;
+	}
+	return 1;
+}
+
+static int realmatrix_gc(lua_State *L)
+{
+	RealMatrix *mat = (RealMatrix *) luaL_checkudata(L, 1, "MLSMat::RealMatrix");
+	if (!mat->isview) {
+		free(mat->data);
+	}
+	return 0;
+}
+
+/* nrows, ncols = mat:size() */
+static int realmatrix_size(lua_State *L)
+{
+	RealMatrix *mat = (RealMatrix *) luaL_checkudata(L, 1, "MLSMat::RealMatrix");
+	lua_pushinteger(L, mat->nrows);
+	lua_pushinteger(L, mat->ncols);
+	return 2;
+}
+
+/* Checks matrix (1st argument) and indices (arguments i and i + 1) */
+static RealMatrix *c_realmatrix_checkij(lua_State *L, int narg, int *i, int *j)
+{
+	RealMatrix *mat = (RealMatrix *) luaL_checkudata(L, 1, "MLSMat::RealMatrix");
+	*i = (int) luaL_checkinteger(L, narg);
+	*j = (int) luaL_checkinteger(L, narg + 1);
+	luaL_argcheck(L, 1 <= *i && *i <= mat->nrows, narg, "Row index is out of boundaries");
+	luaL_argcheck(L, 1 <= *j && *j <= mat->ncols, narg + 1, "Column index is out of boundaries");
+	return mat;
+}
+
+/* x = mat:get(i, j) */
+static int realmatrix_get(lua_State *L)
+{
+	int i, j;
+	RealMatrix *mat = c_realmatrix_checkij(L, 2, &i, &j);
+	lua_pushnumber(L, REALMATRIX_ELEM(mat, i, j));
+	return 1;
+}
+
+/* mat:set(i, j, x) */
+static int realmatrix_set(lua_State *L)
+{
+	int i, j;
+	RealMatrix *mat = c_realmatrix_checkij(L, 2, &i, &j);
+	REALMATRIX_ELEM(mat, i, j) = luaL_checknumber(L, 4);
+	return 0;
+}
+
+/*
+ * mat:col(j) returns j-th column as RealVector that shares memory with
+ * the matrix (changes of its elements change the matrix)
+ */
+static int realmatrix_col(lua_State *L)
+{
+	RealMatrix *mat = (RealMatrix *) luaL_checkudata(L, 1, "MLSMat::RealMatrix");
+	int j = (int) luaL_checkinteger(L, 2);
+	luaL_argcheck(L, 1 <= j && j <= mat->ncols, 2, "Column index is out of boundaries");
+	RealVector *vec = c_realvector_wrap(L, mat->nrows, mat->data + (size_t) (j - 1) * mat->ld - 1);
+	vec->external = 1;
+	lua_pushvalue(L, 1); /* The matrix must live as long as the view */
+	lua_setuservalue(L, -2);
+	return 1;
+}
+
+/* mat:row(i) returns a copy of i-th row as RealVector (rows are not contiguous) */
+static int realmatrix_row(lua_State *L)
+{
+	RealMatrix *mat = (RealMatrix *) luaL_checkudata(L, 1, "MLSMat::RealMatrix");
+	int i = (int) luaL_checkinteger(L, 2);
+	luaL_argcheck(L, 1 <= i && i <= mat->nrows, 2, "Row index is out of boundaries");
+	RealVector *vec = c_realvector_create(L, mat->ncols);
+	for (int j = 1; j <= mat->ncols; j++) {
+		vec->data[j] = REALMATRIX_ELEM(mat, i, j);
+	}
+	return 1;
+}
+
+/*
+ * mat:view(i1, i2, j1, j2) returns submatrix (rows i1..i2, columns j1..j2)
+ * that shares memory with the matrix
+ */
+static int realmatrix_view(lua_State *L)
+{
+	RealMatrix *mat = (RealMatrix *) luaL_checkudata(L, 1, "MLSMat::RealMatrix");
+	int i1 = (int) luaL_checkinteger(L, 2), i2 = (int) luaL_checkinteger(L, 3);
+	int j1 = (int) luaL_checkinteger(L, 4), j2 = (int) luaL_checkinteger(L, 5);
+	if (i1 < 1 || i2 > mat->nrows || i1 > i2 + 1 || j1 < 1 || j2 > mat->ncols || j1 > j2 + 1) {
+		luaL_error(L, "Invalid view boundaries");
+	}
+	RealMatrix *view = (RealMatrix *) lua_newuserdata(L, sizeof(RealMatrix));
+	view->nrows = i2 - i1 + 1;
+	view->ncols = j2 - j1 + 1;
+	view->ld = mat->ld;
+	view->data = mat->data + (size_t) (j1 - 1) * mat->ld + (i1 - 1);
+	view->isview = 1;
+	luaL_getmetatable(L, "MLSMat::RealMatrix");
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, 1);
+	lua_setuservalue(L, -2);
+	return 1;
+}
+
+/* Creates contiguous copy of the matrix (pushes it to the stack) */
+static RealMatrix *c_realmatrix_copy(lua_State *L, const RealMatrix *mat)
+{
+	RealMatrix *res = c_realmatrix_create(L, mat->nrows, mat->ncols);
+	for (int j = 0; j < mat->ncols; j++) {
+		memcpy(res->data + (size_t) j * res->ld, mat->data + (size_t) j * mat->ld,
+			mat->nrows * sizeof(double));
+	}
+	return res;
+}
+
+static int realmatrix_copy(lua_State *L)
+{
+	RealMatrix *mat = (RealMatrix *) luaL_checkudata(L, 1, "MLSMat::RealMatrix");
+	c_realmatrix_copy(L, mat);
+	return 1;
+}
+
+/* mat:t() returns transposed matrix */
+static int realmatrix_t(lua_State *L)
+{
+	RealMatrix *mat = (RealMatrix *) luaL_checkudata(L, 1, "MLSMat::RealMatrix");
+	RealMatrix *res = c_realmatrix_create(L, mat->ncols, mat->nrows);
+	c_transpose(mat, res);
+	return 1;
+}
+
+/* Pushes y = A*x (trans = 0) or y = A'*x (trans = 1) to the stack */
+static void c_realmatrix_mulvec(lua_State *L, const RealMatrix *mat, const RealVector *vec, int trans)
+{
+	double *tmp;
+	if (vec->len != (trans ? mat->nrows : mat->ncols)) {
+		luaL_error(L, "RealMatrix and RealVector sizes are mismatching");
+	}
+	const double *x = c_realvector_doubledata(vec, &tmp);
+	RealVector *res = c_realvector_create(L, trans ? mat->ncols : mat->nrows);
+	if (trans) {
+		c_gemv_t(mat, x, res->data + 1);
+	} else {
+		c_gemv(mat, x, res->data + 1);
+	}
+	free(tmp);
+	if (vec->single) {
+		c_realvector_tosingle(res);
+	}
+}
+
+/* mat:tmul(vec) returns mat' * vec (without transposition of mat) */
+static int realmatrix_tmul(lua_State *L)
+{
+	RealMatrix *mat = (RealMatrix *) luaL_checkudata(L, 1, "MLSMat::RealMatrix");
+	RealVector *vec = (RealVector *) luaL_checkudata(L, 2, "MLSMat::RealVector");
+	c_realmatrix_mulvec(L, mat, vec, 1);
+	return 1;
+}
+
+/* Pushes c * mat to the stack */
+static void c_realmatrix_scale(lua_State *L, const RealMatrix *mat, double c)
+{
+	RealMatrix *res = c_realmatrix_create(L, mat->nrows, mat->ncols);
+	for (int j = 1; j <= mat->ncols; j++) {
+		for (int i = 1; i <= mat->nrows; i++) {
+			REALMATRIX_ELEM(res, i, j) = c * REALMATRIX_ELEM(mat, i, j);
+		}
+	}
+}
+
+/*
+ * __mul metamethod: matrix by number, RealVector (GEMV) or RealMatrix (GEMM).
+ * Multiplication by classes (e.g. DualNVector) is readdressed to their
+ * __mul metamethod.
+ */
+static int realmatrix_mul(lua_State *L)
+{
+	RealMatrix *a = (RealMatrix *) luaL_testudata(L, 1, "MLSMat::RealMatrix"), *b;
+	RealVector *vec;
+	if (a == NULL) { /* number * matrix */
+		double c = luaL_checknumber(L, 1);
+		c_realmatrix_scale(L, (RealMatrix *) luaL_checkudata(L, 2, "MLSMat::RealMatrix"), c);
+	} else if (lua_type(L, 2) == LUA_TNUMBER) {
+		c_realmatrix_scale(L, a, lua_tonumber(L, 2));
+	} else if ((vec = (RealVector *) luaL_testudata(L, 2, "MLSMat::RealVector")) != NULL) {
+		c_realmatrix_mulvec(L, a, vec, 0);
+	} else if ((b = (RealMatrix *) luaL_testudata(L, 2, "MLSMat::RealMatrix")) != NULL) {
+		if (a->ncols != b->nrows) {
+			luaL_error(L, "RealMatrix sizes are mismatching");
+		}
+		c_gemm(a, b, c_realmatrix_create(L, a->nrows, b->ncols));
+	} else if (lua_type(L, 2) == LUA_TTABLE && luaL_getmetafield(L, 2, "__mul") != LUA_TNIL) {
+		lua_pushvalue(L, 1);
+		lua_pushvalue(L, 2);
+		lua_call(L, 2, 1);
+	} else {
+		luaL_error(L, "bad argument #2 to '__mul' (number, RealVector or RealMatrix expected)");
+	}
+	return 1;
+}
+
+/* Pushes a + sign * b to the stack */
+static int c_realmatrix_addsub(lua_State *L, double sign)
+{
+	RealMatrix *a = (RealMatrix *) luaL_checkudata(L, 1, "MLSMat::RealMatrix");
+	RealMatrix *b = (RealMatrix *) luaL_checkudata(L, 2, "MLSMat::RealMatrix");
+	if (a->nrows != b->nrows || a->ncols != b->ncols) {
+		luaL_error(L, "RealMatrix sizes are mismatching");
+	}
+	RealMatrix *res = c_realmatrix_create(L, a->nrows, a->ncols);
+	for (int j = 1; j <= a->ncols; j++) {
+		for (int i = 1; i <= a->nrows; i++) {
+			REALMATRIX_ELEM(res, i, j) = REALMATRIX_ELEM(a, i, j) + sign * REALMATRIX_ELEM(b, i, j);
+		}
+	}
+	return 1;
+}
+
+static int realmatrix_add(lua_State *L)
+{
+	return c_realmatrix_addsub(L, 1.0);
+}
+
+static int realmatrix_sub(lua_State *L)
+{
+	return c_realmatrix_addsub(L, -1.0);
+}
+
+static int realmatrix_unm(lua_State *L)
+{
+	c_realmatrix_scale(L, (RealMatrix *) luaL_checkudata(L, 1, "MLSMat::RealMatrix"), -1.0);
+	return 1;
+}
+
+/* Returns the table of rows (see RealMatrix.new) */
+static int realmatrix_totable(lua_State *L)
+{
+	RealMatrix *mat = (RealMatrix *) luaL_checkudata(L, 1, "MLSMat::RealMatrix");
+	lua_createtable(L, mat->nrows, 0);
+	for (int i = 1; i <= mat->nrows; i++) {
+		lua_createtable(L, mat->ncols, 0);
+		for (int j = 1; j <= mat->ncols; j++) {
+			lua_pushnumber(L, REALMATRIX_ELEM(mat, i, j));
+			lua_rawseti(L, -2, j);
+		}
+		lua_rawseti(L, -2, i);
+	}
+	return 1;
+}
+
+static int realmatrix_tostring(lua_State *L)
+{
+	char buf[64];
+	RealMatrix *mat = (RealMatrix *) luaL_checkudata(L, 1, "MLSMat::RealMatrix");
+	char *result = (char *) calloc(64 + (size_t) mat->nrows * (mat->ncols * 14 + 4), sizeof(char));
+
+	result[0] = 0;
+	sprintf(buf, "RealMatrix: %d x %d%s\n", mat->nrows, mat->ncols,
+		mat->isview ? " (view)" : ""); strcat(result, buf);
+	for (int i = 1; i <= mat->nrows; i++) {
+		strcat(result, "  ");
+		for (int j = 1; j <= mat->ncols; j++) {
+			sprintf(buf, "%12.5g ", REALMATRIX_ELEM(mat, i, j)); strcat(result, buf);
+		}
+		strcat(result, "\n");
+	}
+	lua_pushstring(L, result);
+	free(result);
+	return 1;
+}
+
+static const struct luaL_Reg realmatrix_funcs[] = {
+	{"new", realmatrix_new},
+	{"fromcols", realmatrix_fromcols},
+	{"eye", realmatrix_eye},
+	{"size", realmatrix_size},
+	{"get", realmatrix_get},
+	{"set", realmatrix_set},
+	{"col", realmatrix_col},
+	{"row", realmatrix_row},
+	{"view", realmatrix_view},
+	{"copy", realmatrix_copy},
+	{"t", realmatrix_t},
+	{"tmul", realmatrix_tmul},
+	{"totable", realmatrix_totable},
+	{"__mul", realmatrix_mul},
+	{"__add", realmatrix_add},
+	{"__sub", realmatrix_sub},
+	{"__unm", realmatrix_unm},
+	{"__tostring", realmatrix_tostring},
+	{"__gc", realmatrix_gc},
+	{NULL, NULL}
+};
+
+/*========== Interp1 class ==========*/
+/*
+ * One-dimensional interpolation tables: piecewise linear or natural cubic
+ * spline. Intervals are found by the table of buckets of equal width
+ * (each bucket contains index of the interval for its left boundary),
+ * so the search takes O(1) operations for smooth grids.
+ */
+enum {INTERP1_LINEAR, INTERP1_SPLINE};
+
+/* Returns index of interval [x[i]; x[i+1]] for t (end intervals for outside points) */
+static int c_interp1_find(const Interp1 *ip, double t)
+{
+	const double *x = ip->x;
+	int n = ip->n;
+	if (!(t >= x[0])) { /* Also for NaN */
+		return 0;
+	} else if (t >= x[n - 1]) {
+		return n - 2;
+	}
+	int k = (int) ((t - x[0]) * ip->invh);
+	if (k >= ip->nbuckets) {
+		k = ip->nbuckets - 1;
+	}
+	int i = ip->bucket[k];
+	while (i > 0 && x[i] > t) {
+		i--;
+	}
+	while (i < n - 2 && x[i + 1] <= t) {
+		i++;
+	}
+	return i;
+}
+
+/* Value and derivatives (up to order) of interpolant in point t */
+static void c_interp1_eval(const Interp1 *ip, double t, int order, double *f)
+{
+	int i = c_interp1_find(ip, t);
+	const double *x = ip->x, *y = ip->y;
+	double h = x[i + 1] - x[i];
+	if (!ip->extrap && (t < x[0] || t > x[ip->n - 1])) {
+		f[0] = f[1] = f[2] = NAN;
+		return;
+	}
+	if (ip->method == INTERP1_LINEAR) {
+		double s = (y[i + 1] - y[i]) / h;
+		f[0] = y[i] + s * (t - x[i]);
+		f[1] = s;
+		f[2] = 0.0;
+		return;
+	}
+	double a = (x[i + 1] - t) / h, b = (t - x[i]) / h;
+	double mi = ip->m[i], mi1 = ip->m[i + 1];
+	f[0] = a * y[i] + b * y[i + 1] + ((a * a * a - a) * mi + (b * b * b - b) * mi1) * (h * h / 6.0);
+	if (order > 0) {
+		f[1] = (y[i + 1] - y[i]) / h + ((1.0 - 3.0 * a * a) * mi + (3.0 * b * b - 1.0) * mi1) * (h / 6.0);
+		f[2] = a * mi + b * mi1;
+	}
+}
+
+/* Second derivatives of natural cubic spline (tridiagonal system, Thomas algorithm) */
+static void c_interp1_spline(Interp1 *ip)
+{
+	int n = ip->n;
+	const double *x = ip->x, *y = ip->y;
+	double *m = ip->m, *c = (double *) calloc(n, sizeof(double));
+	m[0] = m[n - 1] = 0.0;
+	for (int i = 1; i < n - 1; i++) {
+		double h0 = x[i] - x[i - 1], h1 = x[i + 1] - x[i];
+		double rhs = 6.0 * ((y[i + 1] - y[i]) / h1 - (y[i] - y[i - 1]) / h0);
+		double diag = 2.0 * (h0 + h1) - h0 * c[i - 1];
+		c[i] = h1 / diag;
+		m[i] = (rhs - h0 * m[i - 1]) / diag;
+	}
+	for (int i = n - 2; i >= 1; i--) {
+		m[i] -= c[i] * m[i + 1];
+	}
+	free(c);
+}
+
+/*
+ * Interp1.new(x, y [, opts]) creates interpolation table from RealVectors
+ * (x must be strictly increasing). Options (table):
+ *   method -- "linear" (default) or "spline" (natural cubic spline)
+ *   extrapolate -- false gives NaN outside [x1; xn], by default
+ *     the end intervals are extrapolated
+ */
+static int interp1_new(lua_State *L)
+{
+	static const char *methods[] = {"linear", "spline", NULL};
+	RealVector *xv = (RealVector *) luaL_checkudata(L, 1, "MLSMat::RealVector");
+	RealVector *yv = (RealVector *) luaL_checkudata(L, 2, "MLSMat::RealVector");
+	int method = INTERP1_LINEAR, extrap = 1;
+	if (xv->len != yv->len) {
+		luaL_error(L, "RealVector sizes are mismatching");
+	} else if (xv->len < 2) {
+		luaL_error(L, "At least 2 points are required");
+	}
+	if (!lua_isnoneornil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		lua_getfield(L, 3, "method");
+		method = luaL_checkoption(L, -1, "linear", methods);
+		lua_getfield(L, 3, "extrapolate");
+		extrap = lua_isnil(L, -1) || lua_toboolean(L, -1);
+		lua_pop(L, 2);
+	}
+	for (int i = 1; i < xv->len; i++) {
+		if (!(REALVECTOR_GET(xv, i + 1) > REALVECTOR_GET(xv, i))) {
+			luaL_error(L, "x must be strictly increasing");
+		}
+	}
+	/* Copy data */
+	int n = xv->len;
+	Interp1 *ip = (Interp1 *) lua_newuserdata(L, sizeof(Interp1));
+	ip->n = n;
+	ip->method = method;
+	ip->extrap = extrap;
+	ip->x = (double *) calloc(3 * n, sizeof(double));
+	ip->y = ip->x + n;
+	ip->m = (method == INTERP1_SPLINE) ? ip->y + n : NULL;
+	for (int i = 0; i < n; i++) {
+		ip->x[i] = REALVECTOR_GET(xv, i + 1);
+		ip->y[i] = REALVECTOR_GET(yv, i + 1);
+	}
+	/* Table of buckets */
+	ip->nbuckets = n;
+	ip->bucket = (int *) calloc(n, sizeof(int));
+	ip->invh = ip->nbuckets / (ip->x[n - 1] - ip->x[0]);
+	for (int k = 0, i = 0; k < ip->nbuckets; k++) {
+		double xb = ip->x[0] + k / ip->invh;
+		while (i < n - 2 && ip->x[i + 1] <= xb) {
+			i++;
+		}
+		ip->bucket[k] = i;
+	}
+	if (method == INTERP1_SPLINE) {
+		c_interp1_spline(ip);
+	}
+	luaL_getmetatable(L, "MLSMat::Interp1");
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+static int interp1_gc(lua_State *L)
+{
+	Interp1 *ip = (Interp1 *) luaL_checkudata(L, 1, "MLSMat::Interp1");
+	free(ip->x);
+	free(ip->bucket);
+	return 0;
+}
+
+/*
+ * f [, df [, d2f]] = ip:eval(t [, order]) evaluates interpolant and its
+ * derivatives up to order (0, 1 or 2) in points t (number or RealVector)
+ */
+static int interp1_eval(lua_State *L)
+{
+	Interp1 *ip = (Interp1 *) luaL_checkudata(L, 1, "MLSMat::Interp1");
+	int order = (int) luaL_optinteger(L, 3, 0);
+	double f[3];
+	luaL_argcheck(L, 0 <= order && order <= 2, 3, "order must be 0, 1 or 2");
+	if (lua_type(L, 2) == LUA_TNUMBER) {
+		c_interp1_eval(ip, lua_tonumber(L, 2), order, f);
+		for (int k = 0; k <= order; k++) {
+			lua_pushnumber(L, f[k]);
+		}
+		return order + 1;
+	}
+	RealVector *tv = (RealVector *) luaL_checkudata(L, 2, "MLSMat::RealVector");
+	RealVector *res[3];
+	for (int k = 0; k <= order; k++) {
+		res[k] = c_realvector_create_prec(L, tv->len, tv->single);
+		lua_insert(L, -3); /* Remove service values created by c_realvector_wrap */
+		lua_pop(L, 2);
+	}
+	for (int i = 1; i <= tv->len; i++) {
+		c_interp1_eval(ip, REALVECTOR_GET(tv, i), order, f);
+		for (int k = 0; k <= order; k++) {
+			REALVECTOR_SET(res[k], i, f[k]);
+		}
+	}
+	return order + 1;
+}
+
+/* ip(t) is the same as ip:eval(t) (DualNVector arguments are handled by mlslib) */
+static int interp1_call(lua_State *L)
+{
+	lua_settop(L, 2);
+	return interp1_eval(L);
+}
+
+static int interp1_tostring(lua_State *L)
+{
+	Interp1 *ip = (Interp1 *) luaL_checkudata(L, 1, "MLSMat::Interp1");
+	lua_pushfstring(L, "Interp1: %d points in [%f; %f], %s%s", ip->n, ip->x[0], ip->x[ip->n - 1],
+		(ip->method == INTERP1_SPLINE) ? "cubic spline" : "linear",
+		ip->extrap ? "" : ", no extrapolation");
+	return 1;
+}
+
+static const struct luaL_Reg interp1_funcs[] = {
+	{"new", interp1_new},
+	{"eval", interp1_eval},
+	{"__call", interp1_call},
+	{"__tostring", interp1_tostring},
+	{"__gc", interp1_gc},
+	{NULL, NULL}
+};
+
+/*========== ODE solver ==========*/
+/*
+ * Explicit Runge-Kutta method of Dormand and Prince (order 5 with
+ * embedded order 4 error estimate, FSAL) with adaptive or fixed step.
+ * State is a set of blocks (RealVectors) of the same length: elements
+ * of blocks are independent lanes (e.g. different initial conditions)
+ * integrated with the common step. Forward sensitivities are handled
+ * by the Lua wrapper (mlslib.lua): imaginary parts of dual numbers are
+ * additional blocks, so the sensitivity equations are integrated by the
+ * same steps (internal differentiation).
+ */
+static const double dp_c[7] = {0.0, 1.0/5, 3.0/10, 4.0/5, 8.0/9, 1.0, 1.0};
+static const double dp_a[7][6] = {
+	{0.0},
+	{1.0/5},
+	{3.0/40, 9.0/40},
+	{44.0/45, -56.0/15, 32.0/9},
+	{19372.0/6561, -25360.0/2187, 64448.0/6561, -212.0/729},
+	{9017.0/3168, -355.0/33, 46732.0/5247, 49.0/176, -5103.0/18656},
+	{35.0/384, 0.0, 500.0/1113, 125.0/192, -2187.0/6784, 11.0/84}
+};
+/* Differences between weights of 5th and 4th order solutions */
+static const double dp_e[7] = {71.0/57600, 0.0, -71.0/16695, 71.0/1920,
+	-17253.0/339200, 22.0/525, -1.0/40};
+
+typedef struct {
+	lua_State *L;
+	int nb; /* Number of blocks */
+	int len; /* Number of lanes (length of each block) */
+	int fidx; /* Stack index of right-hand side function */
+	int argidx; /* Stack index of table with argument vectors */
+	double *arg; /* Data of argument vectors */
+	int nfev; /* Number of function evaluations */
+} OdeProblem;
+
+/* dy = f(t, y): y is copied to (read-only) argument vectors of f */
+static void c_ode_rhs(OdeProblem *p, double t, const double *y, double *dy)
+{
+	lua_State *L = p->L;
+	int n = p->len;
+	memcpy(p->arg, y, (size_t) p->nb * n * sizeof(double));
+	lua_pushvalue(L, p->fidx);
+	lua_pushnumber(L, t);
+	lua_pushvalue(L, p->argidx);
+	lua_call(L, 2, 1);
+	if (lua_type(L, -1) != LUA_TTABLE) {
+		luaL_error(L, "ode45: right-hand side must return a table");
+	}
+	for (int b = 0; b < p->nb; b++) {
+		double *out = dy + (size_t) b * n;
+		lua_rawgeti(L, -1, b + 1);
+		RealVector *vec = (RealVector *) luaL_testudata(L, -1, "MLSMat::RealVector");
+		if (lua_type(L, -1) == LUA_TNUMBER || (vec != NULL && vec->len == 1)) {
+			double val = (vec != NULL) ? REALVECTOR_GET(vec, 1) : lua_tonumber(L, -1);
+			for (int i = 0; i < n; i++) {
+				out[i] = val;
+			}
+		} else if (vec != NULL && vec->len == n) {
+			for (int i = 0; i < n; i++) {
+				out[i] = REALVECTOR_GET(vec, i + 1);
+			}
+		} else {
+			luaL_error(L, "ode45: element %d of right-hand side must be a number or RealVector with %d elements",
+				b + 1, n);
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	p->nfev++;
+}
+
+/* Reads optional numeric field of the table (or returns default value) */
+static double c_optfield(lua_State *L, int idx, const char *name, double def)
+{
+	if (lua_isnoneornil(L, idx)) {
+		return def;
+	}
+	lua_getfield(L, idx, name);
+	double val = lua_isnil(L, -1) ? def : luaL_checknumber(L, -1);
+	lua_pop(L, 1);
+	return val;
+}
+
+/*
+ * Y, stats = ode45(f, tout, y0 [, opts]) integrates dy/dt = f(t, y)
+ * Inputs:
+ *   f(t, y) -- right-hand side: y is a table of RealVectors (blocks, they
+ *     are reused between calls and cannot be changed), must return a table
+ *     of RealVectors or numbers (constants for all lanes)
+ *   tout -- RealVector of output times (increasing), tout[1] is initial time
+ *   y0 -- initial state (table of RealVectors of the same length or numbers)
+ *   opts -- table with options:
+ *     rtol, atol -- relative and absolute tolerances (1e-6, 1e-9)
+ *     h -- initial step (fixed step if fixed = true)
+ *     hmax -- maximal step; maxsteps -- maximal number of steps (100000)
+ *     errstride -- only blocks 1, 1 + errstride, ... are used for error
+ *       control (e.g. real parts of dual numbers), default is 1
+ * Outputs:
+ *   Y -- table of RealVectors: values of blocks in output times,
+ *     Y[b][(lane - 1) * #tout + k] is value of lane in tout[k]
+ *   stats -- table with nsteps, nreject and nfev fields
+ */
+static int ode45(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+	RealVector *tout = (RealVector *) luaL_checkudata(L, 2, "MLSMat::RealVector");
+	luaL_checktype(L, 3, LUA_TTABLE);
+	if (!lua_isnoneornil(L, 4)) {
+		luaL_checktype(L, 4, LUA_TTABLE);
+	}
+	double rtol = c_optfield(L, 4, "rtol", 1e-6), atol = c_optfield(L, 4, "atol", 1e-9);
+	double hmax = c_optfield(L, 4, "hmax", HUGE_VAL), h = c_optfield(L, 4, "h", 0.0);
+	int maxsteps = (int) c_optfield(L, 4, "maxsteps", 100000);
+	int errstride = (int) c_optfield(L, 4, "errstride", 1), fixed = 0;
+	if (!lua_isnoneornil(L, 4)) {
+		lua_getfield(L, 4, "fixed");
+		fixed = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+	lua_settop(L, 4);
+	int nt = tout->len, nb = (int) lua_rawlen(L, 3), len = 1;
+	luaL_argcheck(L, nt >= 1, 2, "at least one output time is required");
+	luaL_argcheck(L, nb >= 1, 3, "empty initial state");
+	luaL_argcheck(L, errstride >= 1, 4, "invalid errstride");
+	luaL_argcheck(L, !fixed || h > 0, 4, "positive h is required for fixed step");
+	for (int k = 1; k < nt; k++) {
+		if (!(REALVECTOR_GET(tout, k + 1) > REALVECTOR_GET(tout, k))) {
+			luaL_error(L, "ode45: output times must be increasing");
+		}
+	}
+	/* Number of lanes */
+	for (int b = 1; b <= nb; b++) {
+		lua_rawgeti(L, 3, b);
+		RealVector *vec = (RealVector *) luaL_testudata(L, -1, "MLSMat::RealVector");
+		if (vec != NULL && vec->len != 1) {
+			if (len != 1 && vec->len != len) {
+				luaL_error(L, "ode45: sizes of initial state blocks are mismatching");
+			}
+			len = vec->len;
+		} else if (vec == NULL && lua_type(L, -1) != LUA_TNUMBER) {
+			luaL_error(L, "ode45: element %d of initial state must be a number or RealVector", b);
+		}
+		lua_pop(L, 1);
+	}
+	/* Work memory is kept in userdata (freed by GC even after errors in f):
+	   y, ynew, err, k1..k7; argument vectors data is a separate userdata */
+	size_t n = (size_t) nb * len;
+	double *y = (double *) lua_newuserdata(L, 10 * n * sizeof(double)); /* 5 */
+	double *ynew = y + n, *err = ynew + n, *k[7];
+	for (int s = 0; s < 7; s++) {
+		k[s] = err + (s + 1) * n;
+	}
+	OdeProblem p = {L, nb, len, 1, 7, NULL, 0};
+	p.arg = (double *) lua_newuserdata(L, n * sizeof(double)); /* 6 */
+	lua_createtable(L, nb, 0); /* 7: argument vectors */
+	for (int b = 0; b < nb; b++) {
+		RealVector *vec = c_realvector_wrap(L, len, p.arg + (size_t) b * len - 1);
+		vec->external = 1;
+		vec->readonly = 1;
+		lua_pushvalue(L, 6); /* Data must live as long as the vector */
+		lua_setuservalue(L, -2);
+		lua_rawseti(L, 7, b + 1);
+		lua_pop(L, 2);
+	}
+	lua_createtable(L, nb, 0); /* 8: output vectors */
+	RealVector **out = (RealVector **) lua_newuserdata(L, nb * sizeof(RealVector *)); /* 9 */
+	for (int b = 0; b < nb; b++) {
+		out[b] = c_realvector_create(L, len * nt);
+		lua_rawseti(L, 8, b + 1);
+		lua_pop(L, 2);
+	}
+	/* Initial state */
+	for (int b = 0; b < nb; b++) {
+		lua_rawgeti(L, 3, b + 1);
+		RealVector *vec = (RealVector *) luaL_testudata(L, -1, "MLSMat::RealVector");
+		for (int i = 0; i < len; i++) {
+			y[(size_t) b * len + i] = (vec == NULL) ? lua_tonumber(L, -1) :
+				REALVECTOR_GET(vec, (vec->len == 1) ? 1 : i + 1);
+		}
+		lua_pop(L, 1);
+	}
+	/* Integration */
+	double t = REALVECTOR_GET(tout, 1), tend = REALVECTOR_GET(tout, nt);
+	int nsteps = 0, nreject = 0;
+	if (h <= 0) {
+		h = (nt > 1) ? (tend - t) * 1e-3 : 1.0;
+	}
+	if (h > hmax) {
+		h = hmax;
+	}
+	if (nt > 1) {
+		c_ode_rhs(&p, t, y, k[0]);
+	}
+	for (int kt = 1; kt <= nt; kt++) {
+		double tk = REALVECTOR_GET(tout, kt);
+		while (t < tk) {
+			if (nsteps + nreject >= maxsteps) {
+				luaL_error(L, "ode45: too many steps (t = %f)", t);
+			}
+			/* Step size: the last step before the output time hits it exactly */
+			int hit = (t + 1.01 * h >= tk);
+			double hs = hit ? tk - t : h;
+			for (int s = 1; s < 7; s++) {
+				for (size_t i = 0; i < n; i++) {
+					double sum = 0.0;
+					for (int j = 0; j < s; j++) {
+						sum += dp_a[s][j] * k[j][i];
+					}
+					ynew[i] = y[i] + hs * sum;
+				}
+				c_ode_rhs(&p, t + dp_c[s] * hs, ynew, k[s]);
+			}
+			/* ynew is the 5th order solution (the last stage), error estimate */
+			double errnorm = 0.0;
+			if (!fixed) {
+				int ncontrol = 0;
+				for (int b = 0; b < nb; b += errstride) {
+					for (int l = 0; l < len; l++) {
+						size_t i = (size_t) b * len + l;
+						double e = 0.0;
+						for (int s = 0; s < 7; s++) {
+							e += dp_e[s] * k[s][i];
+						}
+						double sc = atol + rtol * fmax(fabs(y[i]), fabs(ynew[i]));
+						e = hs * e / sc;
+						errnorm += e * e;
+						ncontrol++;
+					}
+				}
+				errnorm = sqrt(errnorm / ncontrol);
+			}
+			if (errnorm <= 1.0) {
+				/* Accept step (FSAL: the last stage is the first stage of the next step) */
+				t = hit ? tk : t + hs;
+				memcpy(y, ynew, n * sizeof(double));
+				memcpy(k[0], k[6], n * sizeof(double));
+				nsteps++;
+			} else {
+				nreject++;
+			}
+			if (!fixed) {
+				double fac = 0.9 * pow(errnorm, -0.2);
+				if (!(fac >= 0.2)) {
+					fac = 0.2; /* Also for NaN */
+				} else if (fac > 5.0) {
+					fac = 5.0;
+				}
+				double hnew = fmin(hs * fac, hmax);
+				h = (hit && errnorm <= 1.0) ? fmax(h, hnew) : hnew;
+				if (h <= 1e-14 * fabs(t)) {
+					luaL_error(L, "ode45: step size is too small (t = %f)", t);
+				}
+			}
+		}
+		for (int b = 0; b < nb; b++) {
+			for (int l = 0; l < len; l++) {
+				out[b]->data[(size_t) l * nt + kt] = y[(size_t) b * len + l];
+			}
+		}
+	}
+	/* Return results */
+	lua_pushvalue(L, 8);
+	lua_createtable(L, 0, 3);
+	lua_pushinteger(L, nsteps);
+	lua_setfield(L, -2, "nsteps");
+	lua_pushinteger(L, nreject);
+	lua_setfield(L, -2, "nreject");
+	lua_pushinteger(L, p.nfev);
+	lua_setfield(L, -2, "nfev");
+	return 2;
+}
+
+int __declspec(dllexport) luaopen_mlsmat(lua_State* L)
+{
+	lua_newtable(L);
+
+	lua_pushstring(L, "RealVector");
+	luaL_newmetatable(L, "MLSMat::RealVector");
+	luaL_setfuncs(L, realvector_funcs, 0);
+	lua_settable(L, -3);
+
+	lua_pushstring(L, "IndexRange");
+	luaL_newmetatable(L, "MLSMat::IndexRange");
+	luaL_setfuncs(L, indexrange_funcs, 0);
+	lua_settable(L, -3);
+
+	lua_pushstring(L, "RealMatrix");
+	luaL_newmetatable(L, "MLSMat::RealMatrix");
+	luaL_setfuncs(L, realmatrix_funcs, 0);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	lua_settable(L, -3);
+
+	lua_pushstring(L, "Interp1");
+	luaL_newmetatable(L, "MLSMat::Interp1");
+	luaL_setfuncs(L, interp1_funcs, 0);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	lua_settable(L, -3);
+
+	lua_pushstring(L, "RandomStream");
+	luaL_newmetatable(L, "MLSMat::RandomStream");
+	luaL_setfuncs(L, randomstream_funcs, 0);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	lua_settable(L, -3);
+
+	lua_pushstring(L, "DualNVector");
+	luaL_newmetatable(L, "MLSMat::DualNVector");
+	lua_settable(L, -3);
+
+	lua_pushstring(L, "HyperDualNVector");
+	luaL_newmetatable(L, "MLSMat::HyperDualNVector");
+	lua_settable(L, -3);
+	/* Short aliases for constructors */
+	lua_pushstring(L, "Vec");
+	lua_pushcfunction(L, realvector_new);
+	lua_settable(L, -3);
+
+	lua_pushstring(L, "Mat");
+	lua_pushcfunction(L, realmatrix_new);
+	lua_settable(L, -3);
+
+	lua_pushstring(L, "Rng");
+	lua_pushcfunction(L, indexrange_new);
+	lua_settable(L, -3);
+	/* ODE solver */
+	lua_pushstring(L, "ode45");
+	lua_pushcfunction(L, ode45);
 	lua_settable(L, -3);
 
 	return 1;
@@ -9,9 +9,51 @@ typedef struct {
 
 typedef struct {
 	int len;
-	double *data;
+	double *data; /* Double precision storage (NULL if single != 0) */
+	float *sdata; /* Single precision storage (NULL if single == 0) */
+	int single; /* 1 if the vector is stored in single precision */
+	int readonly; /* 1 if data cannot be changed (e.g. mapped file) */
+	int external; /* 1 if data is owned by the host application (not freed) */
+	void *mapbase; /* Base address of mapped file view (or NULL) */
+	size_t mapsize; /* Size of mapped file view */
 } RealVector;
 
+typedef struct {
+	int nrows;
+	int ncols;
+	int ld; /* Leading dimension (distance between columns in data) */
+	double *data; /* Column-major storage: element (i, j) is data[(j-1)*ld + i-1] */
+	int isview; /* 1 if data belongs to other matrix (referenced by uservalue) */
+} RealMatrix;
+
+typedef struct {
+	int n; /* Number of points */
+	int method; /* INTERP1_LINEAR or INTERP1_SPLINE */
+	int extrap; /* 1 if end intervals are extrapolated, 0 for NaN outside [x1; xn] */
+	double *x; /* Abscissas (strictly increasing) */
+	double *y; /* Ordinates */
+	double *m; /* Second derivatives in points (spline only) */
+	int nbuckets; /* Number of buckets in the search table */
+	int *bucket; /* Index of interval for the left boundary of each bucket */
+	double invh; /* Reciprocal width of a bucket */
+} Interp1;
+
+typedef struct {
+	unsigned long long s[4][4]; /* States of 4 xoshiro256+ lanes: s[word][lane] */
+	double buf[4]; /* Unused uniform numbers from the last block */
+	int nbuf; /* Number of unused numbers in buf */
+	double spare; /* Unused normal number from the last Box-Muller pair */
+	int hasspare; /* 1 if spare contains a number */
+} RandomStream;
+
+/* Access to i-th element (1-based) of vector with any storage precision */
+#define REALVECTOR_GET(v, i) ((v)->single ? (double) (v)->sdata[i] : (v)->data[i])
+#define REALVECTOR_SET(v, i, x) ((v)->single ? (void) ((v)->sdata[i] = (float) (x)) : \
+	(void) ((v)->data[i] = (x)))
+
+/* Element (i, j) of matrix (1-based indices) */
+#define REALMATRIX_ELEM(m, i, j) ((m)->data[(size_t) ((j) - 1) * (m)->ld + (i) - 1])
+
 int __declspec(dllexport) luaopen_mlsmat(lua_State* L);
 
 #endif
\ No newline at end of file
@@ -58,3 +58,78 @@ print(#a)
 --m.exp(a)
 
 --]]
+
+-- Construction from tables and binary buffers
+print(t.Vec{1.5, 2.5, 3.5})
+print(t.Vec{[1] = 1, [3] = 3})
+c = t.Vec{1, 2, 3, 4}
+s = c:tobuffer()
+print(#s)
+print(t.RealVector.frombuffer(s))
+print(t.RealVector.frombuffer(s, 2))
+
+-- Loading of data files
+T, Cp = t.RealVector.loadtxt('ScF3.dat', {columns = {1, 2}})
+print(#T, T:min(), T:max(), Cp:min(), Cp:max())
+f = io.open('test.bin', 'wb'); f:write(Cp:tobuffer()); f:close()
+m = t.RealVector.mmap('test.bin', 8, 3)
+print(m, pcall(function() m[1] = 0 end))
+print(select(3, m:dataptr()), m[1] == Cp[2])
+t.RealVector.setprecision('single') -- Precision conversions mustn't touch read-only data
+print((m + t.RealVector.new(3)):issingle(), m:issingle(), pcall(function() m[2] = 0 end))
+t.RealVector.setprecision('double')
+m = nil; collectgarbage(); os.remove('test.bin')
+
+-- Single precision storage
+s = t.Vec{1, 2, 3, 4}:single()
+print(s, s:issingle(), (s * t.Vec{1, 1, 1, 1}):issingle(), (s * 2):issingle())
+print(s:double(), s:max(), s:sqrt()[4])
+
+-- Pseudorandom numbers streams (reproducible)
+rs = t.RandomStream.new(42)
+print(rs, rs:rand(4))
+print(t.RandomStream.new(42):rand(2) .. t.RandomStream.new(42, 1):rand(2))
+print(rs:randn(3), rs:uniform(2, 10, 20), rs:exp(2, 0.5))
+t.RealVector.seed(1)
+print(t.RealVector.rand(2))
+
+-- Reductions (pairwise summation)
+c = t.Vec{3, 1, 4, 1, 5, 9, 2, 6}
+print(c:sum(), c:sumsq(), c:dot(c), c:norm2(), c:mean(), c:var(), c:var(0))
+print(c:argmin())
+print(c:argmax())
+print(c:single():sum())
+c = t.RealVector.linspace(0, 1, 1000001)
+print(c:sum(), c:mean(), c:var())
+
+-- Dense matrices (column-major)
+A = t.RealMatrix.new{{1, 2, 3}, {4, 5, 6}}
+print(A, A:size())
+print(A * t.Vec{1, 0, -1}, A:tmul(t.Vec{1, 1}))
+print(A * A:t(), A:view(1, 2, 2, 3) - A:view(1, 2, 1, 2))
+c = A:col(3); c[2] = 60
+print(A:get(2, 3), A:row(2), t.RealMatrix.fromcols(c, c) * 0.5)
+
+-- Power with special exponents (multiplication chains, sqrt)
+c = t.Vec{-2, -0.5, 0, 0.5, 2}
+print(c ^ 2, c ^ 3, c ^ -1, c:abs() ^ 0.5, c:abs() ^ 2.5, c ^ t.Vec{2})
+f, df = t.RealVector.dpow(c, 2, {t.Vec{1, 1, 1, 1, 1}}, nil)
+print(f, df[1])
+
+-- Interpolation tables
+x = t.RealVector.linspace(0, 3, 31)
+ip = t.Interp1.new(x, x:exp(), {method = "spline"})
+print(ip, ip:eval(1.5, 2))
+print(t.Interp1.new(x, x ^ 2, {extrapolate = false})(t.Vec{-1, 0.25, 1.05, 4}))
+
+-- ODE solver (harmonic oscillator, two lanes)
+y, st = t.ode45(function(tm, y) return {y[2], -y[1]} end,
+	t.Vec{0, math.pi / 2, math.pi}, {t.Vec{1, 2}, 0}, {rtol = 1e-10})
+print(y[1], y[2], st.nsteps > 0)
+
+-- Cumulative and windowed operations, convolution (direct and FFT)
+c = t.Vec{1, 2, 3, 4, 5}
+print(c:cumsum(), c:cumprod(), c:diff(), c:diff(2))
+print(c:movsum(3), c:movmean(2), c:movsum(1, 0))
+h = t.Vec{1, 1, 1}
+print(c:conv(h), c:conv(h, "same"), c:conv(h, "valid"), c:conv(h, "full", "fft"))
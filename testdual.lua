@@ -18,7 +18,7 @@ local function create_x23grid()
 		end
 		x2i = x2i + 1 / 64
 	end
-	x2, x3 = d.vec(x2), d.vec(x3)
+	x2, x3 = d.Vec(x2), d.Vec(x3)
 	local x1 = 1 - x2 - x3
 
 	for i = 1, #x2 do
@@ -136,7 +136,7 @@ local function test_power()
 	local fd = ad ^ n
 
 	local numOfEq = 0;
-	for i = 1, #fd do
+	for i = 1, #fd.real do
 		if fd.real[i] == f[i] then
 			numOfEq = numOfEq + 1;
 		end
@@ -152,6 +152,255 @@ local function test_power()
 	else
 		print('  Test: OK');
 	end
+
+	print('Test 5: integer and half-integer exponents, constant base');
+	x = d.RealVector.linspace(-2, 2, 100)
+	local xd = d.DVar(x, 1, 2)
+	local err = 0
+	for _, e in ipairs{2, 3, -1, -2, 7} do
+		fd = xd ^ e
+		err = math.max(err, ((fd.real - x:abs() ^ e * (x/x:abs()) ^ e) / fd.real):abs():max())
+		err = math.max(err, ((fd.imag[1] - e * x ^ (e - 1)) / fd.real):abs():max())
+	end
+	fd = (xd ^ 2 + 1) ^ 2.5
+	err = math.max(err, ((fd.imag[1] - 5 * x * (x^2 + 1)^1.5) / fd.real):abs():max())
+	fd = 2 ^ yd
+	err = math.max(err, ((fd.imag[2] - 2 ^ y * math.log(2)) / fd.real):abs():max())
+	print(string.format('  d(F)/F:  %g', err))
+	print('')
+end
+
+local function test_hyperdual()
+	print('===== hyper-dual numbers (second derivatives) test')
+	local x = 0.5 + 2*d.RealVector.rand(1000)
+	local y = 0.5 + 2*d.RealVector.rand(1000)
+	local xd = d.HDVar(x, 1, 2)
+	local yd = d.HDVar(y, 2, 2)
+	local h = d.HyperDualNVector.hessindex
+
+	print('Test 1: x^2.5*sqrt(y) + log(x*y)/y')
+	local fd = xd ^ 2.5 * yd:sqrt() + (xd*yd):log() / yd
+	local f = x ^ 2.5 * y:sqrt() + (x*y):log() / y
+	local dfdx = 2.5 * x^1.5 * y:sqrt() + 1 / (x*y)
+	local dfdy = 0.5 * x^2.5 / y:sqrt() + (1 - (x*y):log()) / y^2
+	local dfdxx = 3.75 * (x*y):sqrt() - 1 / (x^2 * y)
+	local dfdxy = 1.25 * x^1.5 / y:sqrt() - 1 / (x * y^2)
+	local dfdyy = -0.25 * x^2.5 / y^1.5 - (3 - 2*(x*y):log()) / y^3
+	print(string.format('  dF:        %g', (f - fd.real):abs():max()))
+	print(string.format('  d(dFdX):   %g', (dfdx - fd.imag[1]):abs():max()))
+	print(string.format('  d(dFdY):   %g', (dfdy - fd.imag[2]):abs():max()))
+	print(string.format('  d(d2FdX2): %g', (dfdxx - fd.hess[h(1, 1)]):abs():max()))
+	print(string.format('  d(d2FdXY): %g', (dfdxy - fd.hess[h(1, 2)]):abs():max()))
+	print(string.format('  d(d2FdY2): %g', (dfdyy - fd.hess[h(2, 2)]):abs():max()))
+
+	print('Test 2: exp(x*y) - 2^y / x')
+	fd = (xd*yd):exp() - 2 ^ yd / xd
+	local e, p = (x*y):exp(), 2 ^ y
+	local ln2 = math.log(2)
+	print(string.format('  d(dFdX):   %g', (y*e + p / x^2 - fd.imag[1]):abs():max()))
+	print(string.format('  d(dFdY):   %g', (x*e - p*ln2 / x - fd.imag[2]):abs():max()))
+	print(string.format('  d(d2FdX2): %g', (y^2*e - 2*p / x^3 - fd.hess[h(1, 1)]):abs():max()))
+	print(string.format('  d(d2FdXY): %g', ((1 + x*y)*e + p*ln2 / x^2 - fd.hess[h(1, 2)]):abs():max()))
+	print(string.format('  d(d2FdY2): %g', (x^2*e - p*ln2^2 / x - fd.hess[h(2, 2)]):abs():max()))
+
+	print('Test 3: x^y')
+	fd = xd ^ yd
+	f = x ^ y
+	print(string.format('  d(d2FdX2): %g', (y*(y-1)*x^(y-2) - fd.hess[h(1, 1)]):abs():max()))
+	print(string.format('  d(d2FdXY): %g', (x^(y-1)*(1 + y*x:log()) - fd.hess[h(1, 2)]):abs():max()))
+	print(string.format('  d(d2FdY2): %g', (f*x:log()^2 - fd.hess[h(2, 2)]):abs():max()))
+
+	print('Test 4: x^1 and x^0 at x = 0')
+	local z = d.HDVar(d.RealVector.linspace(0, 1, 3), 1, 1)
+	local f1, f0 = z ^ 1, z ^ 0
+	print(string.format('  d2(x^1)/dx2 at 0: %g (0 expected)', f1.hess[1][1]))
+	print(string.format('  d(x^0)/dx, d2(x^0)/dx2 at 0: %g %g (0 0 expected)', f0.imag[1][1], f0.hess[1][1]))
+	print('')
+end
+
+local function test_single()
+	print('===== single precision storage test')
+	local x = 1 + d.RealVector.rand(1000)
+	local y = 1 + d.RealVector.rand(1000)
+	local xd = d.DualNVector.var(x, 1, 2)
+	local yd = d.DualNVector.var(y, 2, 2)
+	local fd = (xd * yd:log()):exp()
+	local fs = (xd:single() * yd:single():log()):exp()
+	local fm = xd:single(true) * yd:single(true)
+	print('single:', fs.real:issingle(), fs.imag[1]:issingle())
+	print('mixed:', fm.real:issingle(), fm.imag[1]:issingle())
+	print(string.format('d(F)/F:     %g', ((fs.real - fd.real) / fd.real):abs():max()))
+	print(string.format('d(dFdX)/F:  %g', ((fs.imag[1] - fd.imag[1]) / fd.real):abs():max()))
+	print(string.format('d(dFdY)/F:  %g', ((fs.imag[2] - fd.imag[2]) / fd.real):abs():max()))
+	print('')
+end
+
+local function test_reductions()
+	print('===== reductions test')
+	local x = 1 + d.RealVector.rand(1000)
+	local y = 1 + d.RealVector.rand(1000)
+	local xd = d.DualNVector.var(x, 1, 2) * d.DualNVector.var(y, 2, 2)
+	local yd = d.DualNVector.var(y, 2, 2):log()
+	local function check(name, fd, f)
+		local h = 1e-6
+		local dx = (f(x + h, y) - f(x - h, y)) / (2 * h)
+		local dy = (f(x, y + h) - f(x, y - h)) / (2 * h)
+		print(string.format('  %-6s d(F): %g  d(dFdX): %g  d(dFdY): %g', name,
+			math.abs(fd.real[1] - f(x, y)), math.abs(fd.imag[1][1] - dx) / math.abs(dx),
+			math.abs(fd.imag[2][1] - dy) / math.abs(dy)))
+	end
+	check('sum', xd:sum(), function(x, y) return (x * y):sum() end)
+	check('sumsq', xd:sumsq(), function(x, y) return (x * y):sumsq() end)
+	check('dot', xd:dot(yd), function(x, y) return (x * y):dot(y:log()) end)
+	check('norm2', xd:norm2(), function(x, y) return (x * y):norm2() end)
+	check('mean', xd:mean(), function(x, y) return (x * y):mean() end)
+	check('var', xd:variance(), function(x, y) return (x * y):var() end)
+	local ind, val = xd:argmax()
+	print('  argmax:', ind == (x * y):argmax(), val.real[1] == (x * y):max(), #val.imag)
+	print('')
+end
+
+local function test_matrix()
+	print('===== RealMatrix by DualNVector test')
+	local x = 1 + d.RealVector.rand(50)
+	local cols = {}
+	for j = 1, #x do cols[j] = d.RealVector.rand(100) end
+	local A = d.RealMatrix.fromcols(cols)
+	local xd = d.DualNVector.var(x, 1, 2) ^ 2
+	local fd = A * xd
+	local dfdx = A * (2 * x)
+	print(string.format('  d(F):    %g', (fd.real - A * x^2):abs():max()))
+	print(string.format('  d(dFdX): %g', (fd.imag[1] - dfdx):abs():max()))
+	print(string.format('  d(dFdY): %g', fd.imag[2]:abs():max()))
+	local hd = A * (d.HyperDualNVector.var(x, 1, 1) ^ 2)
+	print(string.format('  d(d2FdX2): %g', (hd.hess[1] - A * (0 * x + 2)):abs():max()))
+	print('')
+end
+
+local function test_interp1()
+	print('===== Interp1 (interpolation tables) test')
+	local xt = d.RealVector.linspace(0, 3, 31)
+	local ip = d.Interp1.new(xt, xt:exp(), {method = "spline"})
+	local x = d.RealVector.linspace(0.05, 2.95, 100)
+	local f, df, d2f = ip:eval(x, 2)
+	local h = 1e-5
+	print(string.format('  d(dFdX) (finite differences): %g',
+		(df - (ip(x + h) - ip(x - h)) / (2 * h)):abs():max()))
+	local fd = ip(d.DualNVector.var(x, 1, 2))
+	print(string.format('  d(F):     %g', (fd.real - f):abs():max()))
+	print(string.format('  d(dFdX):  %g', (fd.imag[1] - df):abs():max()))
+	print(string.format('  d(dFdY):  %g', fd.imag[2]:abs():max()))
+	local hd = ip(d.HyperDualNVector.var(x, 1, 1) * 2)
+	local _, _, d2f2 = ip:eval(2 * x, 2)
+	print(string.format('  d(d2FdX2): %g', (hd.hess[1] - 4 * d2f2):abs():max()))
+	print('')
+end
+
+local function test_ode45()
+	print('===== ODE solver (forward sensitivities) test')
+	local k = d.DualNVector.var(0.7, 1, 2)
+	local a = d.DualNVector.var(2.0, 2, 2)
+	local tout = d.RealVector.linspace(0, 5, 11)
+	local y = d.ode45(function(t, y) return {-k * y[1]} end, tout, {a},
+		{rtol = 1e-10, atol = 1e-12})
+	local e = (-0.7 * tout):exp()
+	print(string.format('  d(F):    %g', (y[1].real - 2 * e):abs():max()))
+	print(string.format('  d(dFdK): %g', (y[1].imag[1] + 2 * tout * e):abs():max()))
+	print(string.format('  d(dFdA): %g', (y[1].imag[2] - e):abs():max()))
+	-- stats.nfev must count all calls of f (real y0, dual parameter)
+	local ncalls, st = 0, nil
+	y, st = d.ode45(function(t, y) ncalls = ncalls + 1; return {-k * y[1]} end, tout, {2.0})
+	print(string.format('  d(dFdK), real y0: %g', (y[1].imag[1] + 2 * tout * e):abs():max()))
+	print(string.format('  nfev: %d, calls of f: %d', st.nfev, ncalls))
+	assert(st.nfev == ncalls)
+	print('')
+end
+
+local function test_cumconv()
+	print('===== Cumulative and windowed operations test')
+	local x = d.DualNVector.var(d.RealVector.linspace(0.5, 2, 50), 1, 2)
+	local a = d.DualNVector.var(0.3, 2, 2)
+	local h = (-a * d.RealVector.linspace(-2, 2, 41) ^ 2):exp()
+	local y = (x * a):cumsum():movmean(5):diff()
+	print(string.format('  d(dFdA) (cumsum etc.): %g',
+		(y.imag[2] - x.real:cumsum():movmean(5):diff()):abs():max()))
+	local p = (x * a):cumprod()
+	print(string.format('  d(dFdX) (cumprod):     %g',
+		(p.imag[1] / (p.real * (1 / x.real):cumsum()) - 1):abs():max()))
+	print(string.format('  d(dFdA) (cumprod):     %g',
+		(p.imag[2] / (p.real * d.RealVector.linspace(1, 50, 50) / 0.3) - 1):abs():max()))
+	-- Convolution of two dual numbers: direct and FFT methods
+	local function conva(av)
+		local hv = (-av * d.RealVector.linspace(-2, 2, 41) ^ 2):exp()
+		return (x.real * av):conv(hv, "same", "direct")
+	end
+	local da = 1e-6
+	local fd = (conva(0.3 + da) - conva(0.3 - da)) / (2 * da)
+	for _, method in ipairs({"direct", "fft"}) do
+		local c = (x * a):conv(h, "same", method)
+		print(string.format('  d(dFdA) (conv, %s): %g', method, (c.imag[2] - fd):abs():max()))
+	end
+	print('')
+end
+
+local function test_invariant()
+	print('===== Cache of parameter-independent subexpressions test')
+	local X, ncalls = d.RealVector.linspace(0, 1, 5), {0}
+	local function resfunc(b)
+		local F = b[1] + b[4] * d.invariant(function() ncalls[1] = ncalls[1] + 1; return X:exp() end)
+		for k = 1, 2 do -- Closures differ only by upvalues: keys are required
+			F = F + b[k + 1] * d.invariant('X^' .. k, function() ncalls[1] = ncalls[1] + 1; return X^k end)
+		end
+		return F
+	end
+	local b = d.DualNVector.var(d.Vec{1, 2, 3, 4}, 1, 4)
+	local F1, F2 = resfunc(b), resfunc(b)
+	print(string.format('  evaluations: %d (3 expected)', ncalls[1]))
+	print(string.format('  d(F): %g', (F2.real - (1 + 2 * X + 3 * X^2 + 4 * X:exp())):abs():max()))
+	d.invalidate('X^2')
+	resfunc(b)
+	print(string.format('  evaluations after invalidate(key): %d (4 expected)', ncalls[1]))
+	d.invalidate()
+	resfunc(b)
+	print(string.format('  evaluations after invalidate: %d (7 expected)', ncalls[1]))
+	ncalls[1] = 0
+	for i = 1, 3000 do -- The cache is bounded: old values are dropped
+		d.invariant(i, function() ncalls[1] = ncalls[1] + 1; return i end)
+	end
+	d.invariant(1, function() ncalls[1] = ncalls[1] + 1; return 1 end)
+	print(string.format('  evaluations of 3000 keys and the first one again: %d (3001 expected)', ncalls[1]))
+	d.invalidate()
+	print('')
+end
+
+local function test_dataset()
+	print('===== Named data sets test')
+	local nloads = 0
+	local function loader() nloads = nloads + 1; return d.Vec{1, 2, 3}, d.Vec{4, 5, 6} end
+	local X1, Y1 = d.dataset('test', loader)
+	local X2, Y2 = d.dataset('test', loader)
+	print(string.format('  loads: %d (1 expected), same vectors: %s', nloads,
+		tostring(rawequal(X1, X2) and rawequal(Y1, Y2))))
+	print('  non-RealVector data:', pcall(d.dataset, 'bad', function() return {1} end))
+	print('')
+end
+
+local function test_view()
+	print('===== Fast element access (views) test')
+	local x = d.RealVector.linspace(1, 5, 5)
+	local p = d.view(x)
+	p[2] = 20 -- Writes change the vector
+	local s = 0
+	for i = 1, #x do s = s + p[i] end
+	print(string.format('  x[2]: %g (20 expected), sum: %g (33 expected)', x[2], s))
+	local xs = d.RealVector.linspace(1, 5, 5):single()
+	print(string.format('  single precision: %g (3 expected)', d.view(xs)[3]))
+	print('  FFI pointer (LuaJIT):', type(p) == 'cdata')
+	local f = io.open('testview.bin', 'wb'); f:write(x:tobuffer()); f:close()
+	local ro = d.RealVector.mmap('testview.bin', 0, 5)
+	local ok = pcall(function() d.view(ro)[1] = 0 end)
+	print(string.format('  write to read-only vector: %s (false expected), ro[1]: %g (1 expected)', tostring(ok), ro[1]))
+	ro = nil; collectgarbage(); os.remove('testview.bin')
 	print('')
 end
 
@@ -160,3 +409,13 @@ test_basic()
 test_exp()
 test_div()
 test_power()
+test_hyperdual()
+test_single()
+test_reductions()
+test_matrix()
+test_interp1()
+test_ode45()
+test_cumconv()
+test_invariant()
+test_dataset()
+test_view()